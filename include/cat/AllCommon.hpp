@@ -48,6 +48,7 @@
 #include <cat/threads/Atomic.hpp>
 #include <cat/threads/Mutex.hpp>
 #include <cat/threads/RWLock.hpp>
+#include <cat/threads/EpochGate.hpp>
 #include <cat/threads/Thread.hpp>
 #include <cat/threads/WaitableFlag.hpp>
 #include <cat/threads/WorkerThreads.hpp>
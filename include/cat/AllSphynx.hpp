@@ -42,13 +42,16 @@
 #include <cat/net/DNSClient.hpp>
 
 #include <cat/sphynx/Common.hpp>
+#include <cat/sphynx/CompressionDictionary.hpp>
 #include <cat/sphynx/Connexion.hpp>
 #include <cat/sphynx/ConnexionMap.hpp>
 #include <cat/sphynx/Collexion.hpp>
 #include <cat/sphynx/Client.hpp>
 #include <cat/sphynx/FlowControl.hpp>
+#include <cat/sphynx/HandshakePipeline.hpp>
 #include <cat/sphynx/Server.hpp>
 #include <cat/sphynx/Transport.hpp>
+#include <cat/sphynx/TransportStats.hpp>
 #include <cat/sphynx/FileTransfer.hpp>
 
 #if defined(CAT_COMPILER_MSVC) && defined(CAT_BUILD_DLL)
@@ -90,6 +90,9 @@ namespace cat {
 // Enable Re-use UDP Send Allocator
 #define CAT_UDP_SEND_ALLOCATOR
 
+// Use the io_uring completion backend on Linux instead of the epoll reactor (requires liburing)
+//#define CAT_IO_URING
+
 // When not in debug mode, enable/disable levels of logging
 #define CAT_RELEASE_DISABLE_INANE
 //#define CAT_RELEASE_DISABLE_INFO
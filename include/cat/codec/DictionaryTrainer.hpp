@@ -0,0 +1,95 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_DICTIONARY_TRAINER_HPP
+#define CAT_DICTIONARY_TRAINER_HPP
+
+#include <cat/Platform.hpp>
+#include <ostream>
+#include <vector>
+
+namespace cat {
+
+
+/*
+	DictionaryTrainer
+
+	Builds a compression dictionary for small messages from a sample of
+	captured traffic.  The resulting dictionary is loaded at runtime by
+	sphynx::CompressionDictionary and shared with each client, so that
+	datagrams of a few dozen bytes can still find LZ4 matches.
+
+	Training follows the COVER approach of Liao, Petri, Moffat and Wirth
+	("Effective Construction of Relative Lempel-Ziv Dictionaries", WWW 2016).
+	Every KMER_BYTES substring is scored by the number of different messages
+	it appears in.  The sample is split into one epoch per dictionary segment,
+	and from each epoch the SEGMENT_BYTES window with the highest total score
+	is kept.  Substrings that were already kept score zero afterwards, so the
+	dictionary does not fill up with copies of the most common field.
+
+	The best segments are placed at the end of the dictionary, where they are
+	closest to the data being compressed and survive truncation.
+
+	Like TextStatsCollector, this is meant to run offline on a large sample.
+*/
+class CAT_EXPORT DictionaryTrainer
+{
+	static const u32 KMER_BYTES = 6;
+	static const u32 SEGMENT_BYTES = 48;
+	static const u32 TABLE_BITS = 20;
+
+	std::vector<u8> _corpus;
+	std::vector<u32> _sample_ends;
+
+	static CAT_INLINE u32 HashKmer(const u8 *data);
+
+public:
+	// Record one captured message
+	void AddSample(const void *data, u32 bytes);
+
+	CAT_INLINE u32 GetSampleCount() { return (u32)_sample_ends.size(); }
+	CAT_INLINE u32 GetSampleBytes() { return (u32)_corpus.size(); }
+	CAT_INLINE const u8 *GetSample(u32 index, u32 &bytes)
+	{
+		u32 begin = index ? _sample_ends[index - 1] : 0;
+		bytes = _sample_ends[index] - begin;
+		return &_corpus[begin];
+	}
+
+	// Build a dictionary of at most max_bytes
+	// Returns false if the samples have nothing in common
+	bool Train(u32 max_bytes, std::vector<u8> &dictionary);
+
+	// Write a dictionary of at most max_bytes, in the file format CompressionDictionary::Load() reads
+	bool GenerateDictionary(u32 max_bytes, std::ostream &osout);
+};
+
+
+} // namespace cat
+
+#endif // CAT_DICTIONARY_TRAINER_HPP
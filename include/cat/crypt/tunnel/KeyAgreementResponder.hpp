@@ -63,6 +63,13 @@ class CAT_EXPORT KeyAgreementResponder : public KeyAgreementCommon
     bool AllocateMemory();
     void FreeMemory();
 
+	// Fill in Y,r and compute the projective shared point for one challenge
+	bool ComputeSharedPoint(TunnelTLS *tls, const u8 *initiator_challenge,
+							u8 *responder_answer, Skein *key_hash, Leg *shared_point);
+
+	// Derive the session key from the affine shared X and append the proof of key
+	bool FinishAnswer(const u8 *shared_x, u8 *responder_answer, Skein *key_hash);
+
 public:
     KeyAgreementResponder();
     ~KeyAgreementResponder();
@@ -74,6 +81,17 @@ public:
 						  const u8 *initiator_challenge, int challenge_bytes,
                           u8 *responder_answer, int answer_bytes, Skein *key_hash);
 
+	static const int MAX_CHALLENGE_BATCH = 16;
+
+	// Process up to MAX_CHALLENGE_BATCH challenges at once, sharing the
+	// field inversion that converts each shared point to affine form.
+	// results[ii] is set to the outcome of each challenge as ProcessChallenge() would return it.
+	// Returns the number of successful challenges
+	int ProcessChallengeBatch(TunnelTLS *tls, int count,
+							  const u8 * const *initiator_challenges, int challenge_bytes,
+							  u8 * const *responder_answers, int answer_bytes,
+							  Skein *key_hashes, bool *results);
+
 	inline bool KeyEncryption(Skein *key_hash, AuthenticatedEncryption *auth_enc, const char *key_name)
 	{
 		return auth_enc->SetKey(KeyBytes, key_hash, false, key_name);
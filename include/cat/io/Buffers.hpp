@@ -36,10 +36,13 @@
 # include <cat/iocp/IOThreadPools.hpp>
 # include <cat/iocp/AsyncFile.hpp>
 # include <cat/iocp/UDPEndpoint.hpp>
+#elif defined(CAT_IO_URING)
+# include <cat/uring/IOThreadPools.hpp>
+# include <cat/uring/AsyncFile.hpp>
+# include <cat/uring/UDPEndpoint.hpp>
 #else
-# include <cat/io/AsyncFile.hpp>
-# include <cat/io/IOThreadPools.hpp>
-# include <cat/io/UDPEndpoint.hpp>
+# include <cat/net/IOThreads.hpp>
+# include <cat/net/UDPEndpoint.hpp>
 #endif
 
 namespace cat {
@@ -86,7 +86,7 @@ struct IOCPOverlappedWriteFile : IOCPOverlapped
 typedef IOCPOverlappedReadFile IOLayerReadOverhead;
 typedef IOCPOverlappedWriteFile IOLayerWriteOverhead;
 
-static const u32 IOTHREADS_BUFFER_READ_BYTES = 1450;
+static const u32 IOTHREADS_BUFFER_READ_BYTES = 1472; // Largest UDP payload in a 1500 byte IPv4 frame
 static const u32 IOTHREADS_BUFFER_COUNT = 10000;
 
 // Manually imported functions from the Windows API, which are not
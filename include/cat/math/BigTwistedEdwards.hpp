@@ -127,6 +127,10 @@ public:
     // out(x) = X/Z
     void SaveAffineX(const Leg *in, void *out_x);
 
+    // out_x[ii] = X_ii/Z_ii for a batch of points, sharing a single inversion
+    // scratch must have room for count registers
+    void SaveAffineXBatch(const Leg * const *in, int count, Leg *scratch, void * const *out_x);
+
     // out(x,y) = (X/Z,Y/Z)
     void SaveAffineXY(const Leg *in, void *out_x, void *out_y);
 
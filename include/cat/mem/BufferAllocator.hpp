@@ -29,8 +29,7 @@
 #ifndef CAT_BUFFER_ALLOCATOR_HPP
 #define CAT_BUFFER_ALLOCATOR_HPP
 
-#include <cat/mem/IAllocator.hpp>
-#include <cat/threads/Mutex.hpp>
+#include <cat/mem/MagazineCache.hpp>
 
 namespace cat {
 
@@ -42,11 +41,10 @@ namespace cat {
 	It preallocates a number of buffers and tries to allocate from this
 	set.  If it runs out of space, it will return zero.
 
-	Allocation and deallocation are thread-safe.  It is optimized to
-	be used for allocating in one thread and deallocating in another,
-	since it uses two locks and only causes contention if the allocator
-	runs out of space and needs to lazily move all the freed buffers
-	into the acquire list.  In any case, the lock time is minimized. 
+	Allocation and deallocation are thread-safe and take no locks.  Free
+	buffers live in a MagazineCache, so a thread that releases buffers
+	usually gets the same ones back on its next acquire, and buffers only
+	move between threads a magazine at a time through the lock-free depot.
 */
 
 // Aligned buffer array heap allocator
@@ -55,11 +53,7 @@ class CAT_EXPORT BufferAllocator : public IAllocator
 	u32 _buffer_bytes, _buffer_count;
 	u8 *_buffers;
 
-	Mutex _acquire_lock;
-	BatchHead * volatile _acquire_head;
-
-	Mutex _release_lock;
-	BatchHead * volatile _release_head;
+	MagazineCache _cache;
 
 	// This interface really doesn't make sense for this allocator
 	void *Acquire(u32 bytes) { return 0; }
@@ -81,6 +75,8 @@ public:
 
 	// Release a number of buffers simultaneously
 	void ReleaseBatch(const BatchSet &set);
+
+	CAT_INLINE void GetStats(MagazineCacheStats &stats) { _cache.GetStats(stats); }
 };
 
 
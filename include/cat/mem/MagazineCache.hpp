@@ -0,0 +1,149 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_MAGAZINE_CACHE_HPP
+#define CAT_MAGAZINE_CACHE_HPP
+
+#include <cat/mem/IAllocator.hpp>
+#include <cat/threads/Atomic.hpp>
+#include <cat/threads/Mutex.hpp>
+
+/*
+	Magazine Cache
+
+	Front end shared by BufferAllocator and ReuseAllocator that keeps
+	released buffers near the thread that released them.
+
+	Each thread is assigned one of MAX_SLOTS cache slots the first time it
+	touches any cache.  A slot holds up to two magazines of free buffers
+	behind a spin flag.  The flag is only contended when more threads than
+	slots share a slot, so the usual acquire and release touch nothing but
+	the slot's own cache line.
+
+	When a slot overflows, one magazine is pushed onto the depot, which is
+	a Treiber stack with a generation tag updated by Atomic::CAS2.  When a
+	slot runs dry, a magazine is popped off the depot, and if the depot is
+	empty the other slots are raided so no buffer is stranded.  Platforms
+	without CAS2 put a mutex around the depot instead.
+
+	Magazines are threaded through the free buffers themselves, so every
+	buffer must be at least sizeof(MagazineHead) bytes and must stay mapped
+	for the lifetime of the cache.
+*/
+
+namespace cat {
+
+
+// Counters for judging contention on a buffer pool
+struct MagazineCacheStats
+{
+	u64 slot_collisions;	// Spins waiting on a slot shared with another thread
+	u64 depot_retries;		// Failed CAS2 attempts on the depot
+	u64 depot_pushes, depot_pops;
+	u64 depot_misses;		// Depot found empty when a slot ran dry
+	u64 steals;				// Buffers taken from other slots
+};
+
+class CAT_EXPORT MagazineCache
+{
+public:
+	static const u32 MAX_SLOTS = 64;
+	static const u32 MAGAZINE_SIZE = 32; // Buffers moved per depot operation
+
+	// Overlays the first free buffer of a magazine on the depot
+	struct MagazineHead : BatchHead
+	{
+		MagazineHead *next_magazine;
+		u32 count;
+	};
+
+private:
+#if defined(CAT_WORD_64)
+	typedef u64 DepotTag;
+#else
+	typedef u32 DepotTag;
+#endif
+
+	// Aligned to the CAS2 operand size
+	struct Depot
+	{
+		MagazineHead *top;
+		DepotTag tag;
+	};
+
+	struct Slot
+	{
+		volatile u32 busy;
+		u32 count;
+		BatchHead *head;
+
+		// Protected by the busy flag
+		MagazineCacheStats stats;
+	};
+
+	u8 *_memory;
+	Depot *_depot;
+	u8 *_slots;
+	u32 _slot_stride;
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+	Mutex _depot_lock;
+#endif
+
+	CAT_INLINE Slot *GetSlot(u32 index) { return reinterpret_cast<Slot*>( _slots + index * _slot_stride ); }
+
+	Slot *LockSlot();
+	CAT_INLINE void UnlockSlot(Slot *slot) { Atomic::Set(&slot->busy, 0); }
+
+	void PushDepot(Slot *slot, MagazineHead *magazine);
+	MagazineHead *PopDepot(Slot *slot);
+	void Steal(Slot *slot);
+
+public:
+	MagazineCache();
+	~MagazineCache();
+
+	CAT_INLINE bool Valid() { return _memory != 0; }
+
+	// Returns the number of buffers it was able to take, up to count
+	u32 Acquire(BatchSet &set, u32 count);
+
+	// Return buffers to the calling thread's slot
+	void Release(const BatchSet &set);
+
+	// Remove every cached buffer, for teardown
+	BatchHead *Drain();
+
+	// Sum of the per-slot counters; values may be slightly stale
+	void GetStats(MagazineCacheStats &stats);
+};
+
+
+} // namespace cat
+
+#endif // CAT_MAGAZINE_CACHE_HPP
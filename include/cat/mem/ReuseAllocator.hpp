@@ -29,8 +29,7 @@
 #ifndef CAT_REUSE_ALLOCATOR_HPP
 #define CAT_REUSE_ALLOCATOR_HPP
 
-#include <cat/mem/IAllocator.hpp>
-#include <cat/threads/Mutex.hpp>
+#include <cat/mem/MagazineCache.hpp>
 
 namespace cat {
 
@@ -41,24 +40,18 @@ namespace cat {
 
 	These buffers are not aligned and are allocated off the CRT heap.
 
-	All buffers are the same size.
+	All buffers are the same size, and at least sizeof(MagazineHead).
 
-	Allocation and deallocation are thread-safe.  It is optimized to
-	be used for allocating in one thread and deallocating in another,
-	since it uses two locks and only causes contention if the allocator
-	runs out of space and needs to lazily move all the freed buffers
-	into the acquire list.  In any case, the lock time is minimized. 
+	Allocation and deallocation are thread-safe and take no locks.  Released
+	buffers are kept in a MagazineCache, and the heap is only touched when
+	no thread has a spare buffer of this size.
 */
 
 class CAT_EXPORT ReuseAllocator : public IAllocator
 {
 	u32 _buffer_bytes;
 
-	Mutex _acquire_lock;
-	BatchHead * volatile _acquire_head;
-
-	Mutex _release_lock;
-	BatchHead * volatile _release_head;
+	MagazineCache _cache;
 
 	// This interface really doesn't make sense for this allocator
 	CAT_INLINE void *Resize(void *ptr, u32 bytes) { return 0; }
@@ -69,13 +62,15 @@ public:
 	ReuseAllocator(u32 buffer_bytes);
 	virtual ~ReuseAllocator();
 
-	CAT_INLINE bool Valid() { return true; }
+	CAT_INLINE bool Valid() { return _cache.Valid(); }
 
 	// NOTE: Bytes parameter is ignored
 	void *Acquire(u32 bytes = 0);
 
 	// Release a number of buffers simultaneously
 	void ReleaseBatch(const BatchSet &set);
+
+	CAT_INLINE void GetStats(MagazineCacheStats &stats) { _cache.GetStats(stats); }
 };
 
 
@@ -31,18 +31,33 @@
 
 #include <cat/threads/Thread.hpp>
 #include <cat/net/Sockets.hpp>
-#include <cat/threads/RefObject.hpp>
-#include <cat/mem/BufferAllocator.hpp>
+#include <cat/lang/RefSingleton.hpp>
+
+/*
+	IOThreads
+
+	A fixed pool of threads waiting on one epoll set, mirroring the
+	completion port design of IOThreadPools on Windows.
+
+	Each associated handle is registered with EPOLLONESHOT, so exactly one
+	IO thread owns a readiness event at a time.  The owner drains the
+	handle and then re-arms it with Rearm(), or removes it with Dissociate()
+	if the object is shutting down.  Only the owner may call those two.
+
+	The pool size is read from the "IO.IOThreads.WorkerCount" setting,
+	defaulting to the number of processors.
+*/
 
 namespace cat {
 
 
-struct NetOverlapped;
-struct IOTLS;
 class IOThread;
 class IOThreads;
 class UDPEndpoint;
 
+
+//// Buffer overhead
+
 struct NetOverlapped
 {
 	int addr_len;
@@ -57,57 +72,73 @@ struct NetOverlappedSendTo : NetOverlapped
 {
 };
 
+struct FileOverlapped
+{
+	u64 offset;
+};
+
 typedef NetOverlappedRecvFrom IOLayerRecvOverhead;
 typedef NetOverlappedSendTo IOLayerSendOverhead;
+typedef FileOverlapped IOLayerReadOverhead;
+typedef FileOverlapped IOLayerWriteOverhead;
 
-static const u32 IOTHREADS_BUFFER_READ_BYTES = 1450;
+static const u32 IOTHREADS_BUFFER_READ_BYTES = 1472; // Largest UDP payload in a 1500 byte IPv4 frame
 static const u32 IOTHREADS_BUFFER_COUNT = 10000;
 
 
-class UDPReadThread : public Thread
+// An associator object
+class CAT_EXPORT IOThreadsAssociator
 {
-	bool ThreadFunction(void *vmaster);
-};
+public:
+	CAT_INLINE virtual ~IOThreadsAssociator() {}
 
-class UDPWriteThread : public Thread
-{
-	bool ThreadFunction(void *vmaster);
+	virtual SocketHandle GetHandle() = 0;
+
+	// Called from an IO thread that owns the readiness event
+	virtual void OnReadiness(u32 events, u32 event_msec) = 0;
 };
 
 
-// IO thread
-class CAT_EXPORT UDPThreads : public Thread
+// epoll thread
+class CAT_EXPORT IOThread : public Thread
 {
-	UDPReadThread _reader;
-	UDPWriteThread _writer;
-	UDPEndpoint *_endpoint;
+	virtual bool Entrypoint(void *vmaster);
 
 public:
-	CAT_INLINE UDPEndpoint *GetEndpoint() { return _endpoint; }
-
-	bool Associate(UDPEndpoint *endpoint);
-	void Shutdown();
+	CAT_INLINE virtual ~IOThread() {}
 };
 
 
-// IO threads
-class CAT_EXPORT IOThreads
+// Pool of epoll threads shared by all endpoints
+class CAT_EXPORT IOThreads : public RefSingleton<IOThreads>
 {
 	friend class IOThread;
 
-	std::vector<UDPThread*> _udp_workers;
+	bool OnInitialize();
+	void OnFinalize();
 
-	BufferAllocator *_recv_allocator;
+	static const u32 MAX_IO_GATHER = 32;
 
-public:
-	IOThreads();
-	virtual ~IOThreads();
+	int _epoll_fd;
+	int _wake_fd;
 
-	CAT_INLINE BufferAllocator *GetRecvAllocator() { return _recv_allocator; }
+	u32 _worker_count;
+	IOThread *_workers;
 
 	bool Startup();
-	bool Shutdown();
-	bool Associate(UDPEndpoint *udp_endpoint);
+	void Shutdown();
+
+public:
+	CAT_INLINE u32 GetWorkerCount() { return _worker_count; }
+
+	// Start watching a handle for the given EPOLLIN/EPOLLOUT events
+	bool Associate(IOThreadsAssociator *associator, u32 events);
+
+	// Hand the readiness event back to the pool
+	bool Rearm(IOThreadsAssociator *associator, u32 events);
+
+	// Stop watching a handle
+	bool Dissociate(IOThreadsAssociator *associator);
 };
 
 
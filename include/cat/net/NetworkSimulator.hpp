@@ -0,0 +1,202 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_NET_NETWORK_SIMULATOR_HPP
+#define CAT_NET_NETWORK_SIMULATOR_HPP
+
+#include <cat/threads/Thread.hpp>
+#include <cat/threads/Mutex.hpp>
+#include <cat/threads/WaitableFlag.hpp>
+#include <cat/rand/AbyssinianPRNG.hpp>
+#include <cat/net/Sockets.hpp>
+#include <cat/mem/IAllocator.hpp>
+#include <cat/lang/RefSingleton.hpp>
+
+/*
+	Network Simulator
+
+	When "IO.Simulator.Enable" is set, every UDPEndpoint in the process
+	registers its port with the simulator after binding.  Datagrams written
+	to the port of another registered endpoint never reach the kernel: they
+	are copied into RecvBuffers, pushed through a virtual link and handed to
+	the receiver's OnRecvRouting() by the simulator thread at the scheduled
+	time.  Everything above the endpoint (Transport, FlowControl, FileTransfer)
+	runs unmodified, so Clients and a Server can be benchmarked in one process.
+	Datagrams to any other port still go out on the real socket.
+
+	Links are one-way and created on first use for each (source port,
+	destination port) pair from the default parameters, which are read from
+	the "IO.Simulator.*" settings and can be replaced with SetDefaultLink().
+	SetLink() overrides a single direction.  Each link has a bottleneck
+	queue drained at RateBytesPerSec, a fixed latency plus uniform jitter
+	(which also reorders), Gilbert-Elliott loss for bursts and random
+	duplication.
+
+	Every link draws from its own generator seeded from "IO.Simulator.Seed"
+	and its port pair, so for the same sequence of writes the same datagrams
+	are lost, duplicated and delayed on every run.
+
+	By default a simulator thread delivers datagrams by the wall clock, to
+	about a millisecond.  When "IO.Simulator.VirtualClock" is set there is
+	no thread: the Clock is switched to virtual time and only moves when the
+	harness calls Advance(), which delivers each datagram on the calling
+	thread at exactly its scheduled time.  With the harness also driving
+	the transports from that thread, a run is fully reproducible.
+
+	If all MAX_LINKS links are in use, datagrams for a new port pair are
+	dropped and counted by GetUnlinkedDrops().
+*/
+
+namespace cat {
+
+
+class UDPEndpoint;
+struct RecvBuffer;
+
+
+// Parameters for one direction of a virtual link
+struct SimulatedLinkParams
+{
+	u32 latency_usec;		// Fixed one-way delay
+	u32 jitter_usec;		// Uniform extra delay in [0, jitter_usec]
+	u32 loss_ppm;			// Loss rate while in the good state, parts per million
+	u32 burst_enter_ppm;	// Chance per datagram of entering the bursty state
+	u32 burst_exit_ppm;		// Chance per datagram of leaving the bursty state
+	u32 burst_loss_ppm;		// Loss rate while in the bursty state
+	u32 duplicate_ppm;		// Chance a delivered datagram arrives twice
+	u32 rate_bytes;			// Bottleneck rate in bytes per second, 0 = unlimited
+	u32 queue_bytes;		// Bottleneck queue depth before tail drop
+};
+
+// Counters for one direction of a virtual link
+struct SimulatedLinkStats
+{
+	u64 sent, delivered;
+	u64 lost, overflowed, duplicated;
+	u64 bytes_delivered;
+};
+
+
+// In-process virtual network for UDPEndpoints
+class CAT_EXPORT NetworkSimulator : public RefSingleton<NetworkSimulator>, public Thread
+{
+	friend class UDPEndpoint;
+
+	bool OnInitialize();
+	void OnFinalize();
+
+	static const u32 MAX_ENDPOINTS = 64;
+	static const u32 MAX_LINKS = 256;
+	static const u32 DEFAULT_MAX_QUEUED = 65536;
+
+	struct Link
+	{
+		Port src, dst;
+		SimulatedLinkParams params;
+		SimulatedLinkStats stats;
+		Abyssinian prng;
+		bool bursty;
+		double idle_usec; // Time at which the bottleneck queue empties
+	};
+
+	struct Pending
+	{
+		double deliver_usec;
+		u32 seq;
+		Port src, dst;
+		RecvBuffer *buffer;
+	};
+
+	bool _enabled;
+	bool _virtual;
+	u32 _seed;
+
+	// Protected by the endpoint lock
+	Mutex _endpoint_lock;
+	UDPEndpoint *_endpoints[MAX_ENDPOINTS];
+	u32 _endpoint_count;
+
+	// Protected by the queue lock
+	Mutex _queue_lock;
+	SimulatedLinkParams _default_params;
+	Link _links[MAX_LINKS];
+	u32 _link_count;
+	Pending *_queue; // Binary min-heap on delivery time
+	u32 _queue_size, _queue_limit;
+	u32 _next_seq;
+	u64 _unlinked_drops;
+
+	WaitableFlag _wakeup;
+	volatile bool _die;
+
+	bool IsRegistered(Port port);
+	UDPEndpoint *AcquireEndpoint(Port port);
+	Link *FindLink(Port src, Port dst, bool create);
+	bool DecideLoss(Link *link);
+	bool Enqueue(const Pending &pending);
+	void PopQueue();
+
+	// Called by UDPEndpoint
+	bool Register(UDPEndpoint *endpoint);
+	void Unregister(UDPEndpoint *endpoint);
+
+	// Returns false if the destination is not simulated and the datagrams should hit the wire
+	bool Send(UDPEndpoint *sender, const BatchSet &buffers, const NetAddr &addr);
+
+	void Deliver(const BatchSet &buffers, Port dst);
+
+	// Deliver everything due by now_usec and return how long until the next is due, or -1
+	int DeliverDue(double now_usec, u32 now_msec);
+
+	bool Entrypoint(void *param);
+
+public:
+	CAT_INLINE bool IsEnabled() { return _enabled; }
+	CAT_INLINE bool IsVirtual() { return _virtual; }
+
+	// Virtual clock only: Move time forward, delivering datagrams as they come due
+	void Advance(u32 usec);
+
+	// Applies to links created after the call
+	void SetDefaultLink(const SimulatedLinkParams &params);
+
+	// Set parameters for datagrams flowing from src port to dst port,
+	// resetting its generator, bottleneck queue and counters
+	bool SetLink(Port src, Port dst, const SimulatedLinkParams &params);
+
+	// Returns false if no datagram has crossed the link yet
+	bool GetLinkStats(Port src, Port dst, SimulatedLinkStats &stats);
+
+	// Datagrams dropped because the link table was full
+	u64 GetUnlinkedDrops();
+};
+
+
+} // namespace cat
+
+#endif // CAT_NET_NETWORK_SIMULATOR_HPP
@@ -242,6 +242,10 @@ public:
 	bool SetSendBufferSize(int bytes);
 	bool SetRecvBufferSize(int bytes);
 
+	// Disabled by default; allow several sockets to bind the same port and
+	// let the kernel distribute incoming datagrams between them
+	bool SetReusePort(bool reuse = true);
+
 	bool Bind(Port port);
 
 	// Call these after binding:
@@ -275,7 +279,12 @@ public:
 	// Call these after binding:
 
 	// Disabled by default; useful for MTU discovery
+	// On Linux this also enables the error queue so path MTU reports arrive
 	bool DontFragment(bool df = true);
+
+	// Disabled by default; queue ICMP errors and local EMSGSIZE failures
+	// on the socket error queue (Linux IP_RECVERR)
+	bool ReportErrors(bool report = true);
 };
 
 
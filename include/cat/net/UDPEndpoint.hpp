@@ -32,14 +32,61 @@
 #include <cat/net/Sockets.hpp>
 #include <cat/lang/RefObject.hpp>
 #include <cat/mem/IAllocator.hpp>
+#include <cat/net/IOThreads.hpp>
+#include <cat/net/NetworkSimulator.hpp>
 
 /*
-	To get maximum performance from the UDP sockets, be sure to adjust your
-	registry settings:
+	Batched UDP I/O
 
-	HKLM\System\CurrentControlSet\Services\Afd\Parameters
-	ADD REG_DWORD KEY FastSendDatagramThreshold
-	Set it to 1500
+	The endpoint is driven by the shared IOThreads epoll pool.  When the
+	socket becomes readable, the IO thread that owns the event pulls up to
+	a batch of datagrams out of the kernel with each recvmmsg() call.
+
+	Write() sends straight from the calling thread with sendmmsg() in
+	batches of the same depth.  One thread flushes at a time, and it sends
+	with the write lock released; writes queued meanwhile are picked up by
+	that same flush.  If the kernel send buffer is full, the rest stay
+	queued and a duplicate of the socket handle is armed for EPOLLOUT, so
+	the queue drains even if the endpoint never reads another datagram.
+
+	The batch depth is read from the "IO.UDPEndpoint.BatchDepth" setting.
+	Other POSIX platforms fall back to one recvfrom()/sendto() per datagram.
+*/
+
+/*
+	Segmentation Offload (Linux)
+
+	When "IO.UDPEndpoint.GSO" is set (default on), runs of queued writes
+	to the same address with the same size are handed to the kernel as one
+	message with a UDP_SEGMENT control message.  The kernel (or the NIC)
+	splits it back into datagrams, so a Transport flush of many full-size
+	datagrams walks the network stack once.  If the kernel or device
+	rejects a segmented send, the endpoint quietly stops using GSO.
+
+	When "IO.UDPEndpoint.GRO" is set (default off), UDP_GRO is enabled and
+	reads go into a few 64 KB scratch areas.  Each coalesced read is split
+	back into ordinary RecvBuffers before OnRecvRouting() sees it.
+*/
+
+/*
+	Kernel Receive Timestamps (Linux)
+
+	When "IO.UDPEndpoint.KernelTimestamps" is set (default on), SO_TIMESTAMPNS
+	is enabled and each RecvBuffer is stamped with the time the datagram
+	reached the socket rather than the time the IO thread woke up.  Since
+	Clock::msec() and the kernel stamp share the wall clock on POSIX, the
+	stamp drops straight into event_msec, so RTT, flow control and time
+	synchronization no longer include socket and IO thread queueing delay.
+	Send times are kept in milliseconds, so the stamp is truncated to match.
+*/
+
+/*
+	Error Queue (Linux)
+
+	When IP_RECVERR is on, ICMP errors and local EMSGSIZE failures are
+	queued on the socket and raise EPOLLERR.  The queue is drained on the
+	IO thread; "fragmentation needed" and "packet too big" reports are
+	passed to OnPathMTU() and the rest are dropped.
 */
 
 /*
@@ -55,74 +102,129 @@
 namespace cat {
 
 
-class IOLayer;
 struct RecvBuffer;
 struct SendBuffer;
 
 
-// Number of IO outstanding on a UDP endpoint
-static const u32 SIMULTANEOUS_READS = 128;
+// Number of datagrams moved per recvmmsg()/sendmmsg() call
+static const u32 UDP_DEFAULT_BATCH_DEPTH = 32;
+static const u32 UDP_MAX_BATCH_DEPTH = 64;
 
 
-// Object that represents a UDP endpoint bound to a single port
-class CAT_EXPORT UDPEndpoint : public WatchedRefObject
+// Counters for judging how well the syscalls are being batched
+struct UDPEndpointStats
 {
-	friend class UDPReadThread;
-	friend class UDPWriteThread;
+	u64 recv_syscalls, recv_datagrams;
+	u64 send_syscalls, send_datagrams;
+};
 
-	IOLayer *_iolayer;
-	Socket _socket;
-	Port _port;
-	bool _ipv6;
 
+// Object that represents a UDP endpoint bound to a single port
+class CAT_EXPORT UDPEndpoint : public RefObject, public IOThreadsAssociator, public UDPSocket
+{
+	friend class NetworkSimulator;
+
+	// Maximum number of batches read per readiness event, for fairness
+	static const u32 MAX_READS_PER_EVENT = 4;
+
+	// Largest run of datagrams passed to the kernel as one segmented send
+	static const u32 UDP_GSO_MAX_BYTES = 60000;
+
+	// Number of coalesced reads per recvmmsg() call when GRO is on
+	static const u32 UDP_GRO_BATCH_DEPTH = 8;
+	static const u32 UDP_GRO_READ_BYTES = 65535;
+
+	struct CoalescedRead
+	{
+		u64 control[8];
+		NetAddr::SockAddr addr;
+		u8 data[UDP_GRO_READ_BYTES];
+	};
+
+	u32 _batch_depth;
+
+	// Only touched by the IO thread that owns the readiness event
+	BatchSet _spare_buffers;
+	u32 _spare_count;
+	u64 _recv_syscalls, _recv_datagrams;
+	CoalescedRead *_gro_reads;
+	bool _kernel_timestamps;
+	bool _simulated;
+
+	// Watches a duplicate of the socket for EPOLLOUT while writes are queued
+	class WriteWatcher : public IOThreadsAssociator
+	{
+	public:
+		UDPEndpoint *endpoint;
+		int fd;
+
+		CAT_INLINE SocketHandle GetHandle() { return fd; }
+		void OnReadiness(u32 events, u32 event_msec);
+	};
+
+	// Protected by the write lock
 	Mutex _write_lock;
 	BatchSet _write_buffers;
-	WaitableFlag _write_flag;
+	bool _write_flushing; // A thread is sending outside the lock
+	bool _write_watched; // The watcher is armed and holds a reference
 
-	void ProcessReads();
-	void ProcessWrites();
+	// Only touched by the thread that is flushing
+	u64 _send_syscalls, _send_datagrams;
+	bool _gso_enabled;
 
-public:
-    UDPEndpoint();
-    virtual ~UDPEndpoint();
+	WriteWatcher _write_watcher;
 
-	CAT_INLINE bool Valid() { return _socket != SOCKET_ERROR; }
-	CAT_INLINE Socket GetSocket() { return _socket; }
-    Port GetPort();
-	CAT_INLINE Port GetCachedPort() { return _port; }
+	void OnReadiness(u32 events, u32 event_msec);
+	void OnWritable();
 
-	// Is6() result is only valid AFTER Bind()
-	CAT_INLINE bool Is6() { return _ipv6; }
+	void ProcessReads(u32 event_msec);
+	void ProcessErrors();
+	void FlushWrites();
+	void WatchWrites();
+	BatchHead *SendQueued(const BatchSet &queued, BatchSet &done);
 
-    // For servers: Bind() with ignoreUnreachable = true ((default))
-    // For clients: Bind() with ignoreUnreachable = false and call this
-    //              after the first packet from the server is received.
-    bool IgnoreUnreachable();
+	void AcquireSpareBuffers();
+	void EnableOffload();
 
-	// Disabled by default; useful for MTU discovery
-	bool DontFragment(bool df = true);
+	u32 RecvBatch(BatchSet &buffers, u32 count, u32 event_msec);
+	u32 RecvCoalesced(BatchSet &delivery, u32 event_msec);
+	u32 SendBatch(BatchHead *node, u32 count, bool &would_block);
 
-	bool Bind(IOLayer *iolayer, bool onlySupportIPv4, Port port = 0, bool ignoreUnreachable = true, int kernelReceiveBufferBytes = 0);
+public:
+    UDPEndpoint();
+    virtual ~UDPEndpoint();
+
+	CAT_INLINE const char *GetRefObjectName() { return "UDPEndpoint"; }
+	CAT_INLINE SocketHandle GetHandle() { return GetSocket(); }
 
-	// If Is6() == true, the address must be promoted to IPv6
+	bool Initialize(Port port = 0, bool ignoreUnreachable = true, bool RequestIPv6 = true, bool RequireIPv4 = true, int kernelReceiveBufferBytes = 0, bool reusePort = false);
+
+	// If SupportsIPv6() == true, the address must be promoted to IPv6
 	// before calling using addr.PromoteTo6()
-	// This function takes approximately 1 ms per ~20 buffers
 	bool Write(const BatchSet &buffers, u32 count, const NetAddr &addr);
 
-	CAT_INLINE bool Write(u8 *data, u32 data_bytes, const NetAddr &addr);
+	bool Write(u8 *data, u32 data_bytes, const NetAddr &addr);
 
 	// When done with read buffers, call this function to add them back to the available pool
 	void ReleaseRecvBuffers(BatchSet buffers, u32 count);
 
+	CAT_INLINE u32 GetBatchDepth() { return _batch_depth; }
+
+	// Snapshot of the syscall counters; values may be slightly stale
+	void GetStats(UDPEndpointStats &stats);
+
 protected:
-	CAT_INLINE IOLayer *GetIOLayer() { return _iolayer; }
+	void SetRemoteAddress(RecvBuffer *buffer);
 
-	CAT_INLINE void SetRemoteAddress(RecvBuffer *buffer);
+	virtual void OnRecvRouting(const BatchSet &buffers) = 0;
 
-	virtual void OnShutdownRequest();
-	virtual bool OnZeroReferences();
+	// Called from an IO thread when the error queue reports the path MTU toward
+	// a destination, only after ReportErrors() or DontFragment() on Linux
+	virtual void OnPathMTU(const NetAddr &dest, u32 mtu) {}
 
-	virtual void OnReadRouting(const BatchSet &buffers) = 0;
+	virtual bool OnInitialize();
+	virtual void OnDestroy();
+	virtual bool OnFinalize();
 };
 
 
@@ -66,6 +66,12 @@ public:
 	{
 		_allocator->ReleaseBatch(set);
 	}
+
+	// Contention counters for the buffer pool
+	CAT_INLINE void GetStats(MagazineCacheStats &stats)
+	{
+		_allocator->GetStats(stats);
+	}
 };
 
 
@@ -79,6 +79,9 @@ public:
 
 	// Release a number of buffers simultaneously
 	void ReleaseBatch(const BatchSet &set);
+
+	// Contention counters summed over all bins
+	void GetStats(MagazineCacheStats &stats);
 };
 
 
@@ -56,7 +56,7 @@ class CAT_EXPORT Client : public UDPEndpoint, public Transport
 	WaitableFlag _kill_flag;
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	u16 _my_id;
+	u32 _my_id;
 #endif
 
 	u32 _last_send_msec;
@@ -72,8 +72,11 @@ class CAT_EXPORT Client : public UDPEndpoint, public Transport
 	u32 _last_hello_post;
 	s32 _hello_post_interval;
 
+	// Path MTU search: _mtu_low is known to work, _mtu_high is the largest size still possible
 	u32 _mtu_discovery_time;
 	int _mtu_discovery_attempts;
+	u32 _mtu_low, _mtu_high, _mtu_probe; // _mtu_probe = 0 when not searching
+	volatile u32 _mtu_reported; // Set by the IO thread from the socket error queue
 	u32 _next_sync_time;
 	u32 _sync_attempts;
 
@@ -86,15 +89,27 @@ class CAT_EXPORT Client : public UDPEndpoint, public Transport
 
 	u32 _ts_delta; // Milliseconds clock difference between server and client: server_time = client_time + _ts_delta
 
+	// Compression dictionary being received from the server in pieces
+	u8 *_dict_buffer;
+	u32 _dict_id, _dict_bytes, _dict_received;
+
+	void OnDictionaryPiece(BufferStream data, u32 bytes);
+
 	void UpdateTimeSynch(u32 rtt, s32 delta);
 
 	bool WriteHello();
 	bool WriteTimePing();
 
+	void StartMTUSearch(u32 now);
+	void UpdateMTUSearch(u32 now);
+	void NextMTUSearchStep(u32 now);
+	void PostMTUSearchProbe(u32 now, u32 mtu);
+
 	// Return false to remove resolve from cache
 	bool OnDNSResolve(const char *hostname, const NetAddr *array, int array_length);
 
 	virtual s32 WriteDatagrams(const BatchSet &buffers, u32 count);
+	virtual bool SchedulePacingWakeup(u32 when);
 	virtual void OnInternal(u32 recv_time, BufferStream msg, u32 bytes);
 	virtual void OnDisconnectComplete();
 
@@ -106,10 +121,12 @@ class CAT_EXPORT Client : public UDPEndpoint, public Transport
 	virtual void OnRecvRouting(const BatchSet &buffers);
 	virtual void OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers);
 	virtual void OnTick(ThreadLocalStorage &tls, u32 now);
+	void OnPaceTimer(ThreadLocalStorage &tls, u32 now);
+	virtual void OnPathMTU(const NetAddr &dest, u32 mtu);
 
 public:
 	Client();
-	CAT_INLINE virtual ~Client() {}
+	virtual ~Client();
 
 	CAT_INLINE const char *GetRefObjectName() { return "Client"; }
 
@@ -119,7 +136,7 @@ public:
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 	// After connection, will return the user id of the client
-	CAT_INLINE u16 getMyId() { return _my_id; }
+	CAT_INLINE u32 getMyId() { return _my_id; }
 #endif
 
 	// Current local time
@@ -42,7 +42,7 @@
 // TODO: fix a bug that eats all the buffers when none are available
 // TODO: fix a bug that drops data on the floor when it arrives out of order
 
-#define CAT_SPHYNX_ROAMING_IP /* Add extra 2 byte header to each c2s packet to support roaming ip */
+#define CAT_SPHYNX_ROAMING_IP /* Add extra 3 byte header to each c2s packet to support roaming ip */
 
 #define CAT_TRANSPORT_RANDOMIZE_LENGTH /* Add extra no-op bytes to the end of each datagram to mask true length */
 
@@ -77,8 +77,10 @@ static const int PRIVATE_KEY_BYTES = 32;
 static const int CHALLENGE_BYTES = PUBLIC_KEY_BYTES;
 static const int ANSWER_BYTES = PUBLIC_KEY_BYTES*2;
 #if defined(CAT_SPHYNX_ROAMING_IP)
+static const int ROAMING_ID_BYTES = 3; // Little-endian connexion id at the end of c2s packets
+static const u32 ROAMING_ID_LIMIT = (u32)1 << (ROAMING_ID_BYTES * 8);
 static const int SPHYNX_S2C_OVERHEAD = AuthenticatedEncryption::OVERHEAD_BYTES;
-static const int SPHYNX_C2S_OVERHEAD = AuthenticatedEncryption::OVERHEAD_BYTES + 2;
+static const int SPHYNX_C2S_OVERHEAD = AuthenticatedEncryption::OVERHEAD_BYTES + ROAMING_ID_BYTES;
 static const int SPHYNX_OVERHEAD = SPHYNX_C2S_OVERHEAD; // Use larger one for shared Transport layer
 #else
 static const int SPHYNX_OVERHEAD = AuthenticatedEncryption::OVERHEAD_BYTES;
@@ -86,12 +88,23 @@ static const int SPHYNX_S2C_OVERHEAD = SPHYNX_OVERHEAD;
 static const int SPHYNX_C2S_OVERHEAD = SPHYNX_OVERHEAD;
 #endif
 
+// Flag byte following the payload of each datagram
+enum DatagramCompression
+{
+	DGRAM_RAW = 0,			// Not compressed
+	DGRAM_LZ4 = 1,			// Compressed with LZ4
+	DGRAM_LZ4_DICT = 2		// Compressed with LZ4 against the shared CompressionDictionary
+};
+
 // Client constants
 static const int SESSION_KEY_BYTES = 32;
 static const int HANDSHAKE_TICK_RATE = 100; // milliseconds
 static const int INITIAL_HELLO_POST_INTERVAL = 200; // milliseconds
 static const int CONNECT_TIMEOUT = 6000; // milliseconds
 static const u32 MTU_PROBE_INTERVAL = 8000; // seconds
+static const u32 MTU_PROBE_TIMEOUT = 1500; // Time to wait for a probe to be acknowledged, milliseconds
+static const int MTU_PROBE_RETRIES = 2; // Lost probes of one size before the size is considered too large
+static const u32 MTU_SEARCH_PRECISION = 16; // Stop searching once the range is narrower than this, bytes
 static const int CLIENT_THREAD_KILL_TIMEOUT = 10000; // seconds
 static const int SILENCE_LIMIT = 4357; // Time silent before sending a keep-alive (0-length unordered reliable message), milliseconds
 
@@ -117,13 +130,31 @@ enum HandshakeType
 static const u32 C2S_HELLO_LEN = 1 + PUBLIC_KEY_BYTES + sizeof(PROTOCOL_MAGIC);
 static const u32 S2C_COOKIE_LEN = 1 + 4;
 #if defined(CAT_SPHYNX_ROAMING_IP)
-static const u32 S2C_ANSWER_LEN = 1 + ANSWER_BYTES + 2;
+static const u32 S2C_ANSWER_LEN = 1 + ANSWER_BYTES + ROAMING_ID_BYTES;
 #else
 static const u32 S2C_ANSWER_LEN = 1 + ANSWER_BYTES;
 #endif
 static const u32 C2S_CHALLENGE_LEN = S2C_ANSWER_LEN; // 8 + 1 + 4 + CHALLENGE_BYTES + Padded to avoid amplification attacks
 static const u32 S2C_ERROR_LEN = 1 + 1;
 
+#if defined(CAT_SPHYNX_ROAMING_IP)
+
+// Read the roaming connexion id from its ROAMING_ID_BYTES wire format
+static CAT_INLINE u32 ReadRoamingID(const u8 *data)
+{
+	return data[0] | ((u32)data[1] << 8) | ((u32)data[2] << 16);
+}
+
+// Write the roaming connexion id in its ROAMING_ID_BYTES wire format
+static CAT_INLINE void WriteRoamingID(u8 *data, u32 id)
+{
+	data[0] = (u8)id;
+	data[1] = (u8)(id >> 8);
+	data[2] = (u8)(id >> 16);
+}
+
+#endif // CAT_SPHYNX_ROAMING_IP
+
 // Handshake errors
 enum SphynxError
 {
@@ -178,7 +209,9 @@ enum SuperOpcode
 	SOP_INTERNAL,	// 0=Internal (reliable or unreliable)
 	SOP_DATA,		// 1=Data (reliable or unreliable)
 	SOP_FRAG,		// 2=Fragment (reliable)
-	SOP_ACK			// 3=ACK (unreliable)
+	SOP_ACK,		// 3=ACK (unreliable)
+
+	SOP_LATEST = SOP_FRAG	// 2=Latest-only sequenced data (unreliable)
 };
 
 // Internal opcodes
@@ -192,7 +225,13 @@ enum InternalOpcode
 
 	IOP_HUGE = 2,			// a2a 02 (data[MTU]) Huge data
 
-	IOP_DISCO = 3			// a2a 03 (reason[1]) Disconnection notification
+	IOP_DISCO = 3,			// a2a 03 (reason[1]) Disconnection notification
+
+	// Extended opcodes share the low bits of opcode 0, which never uses the high bits
+	IOP_C2S_DICTIONARY_ACK = 4,	// c2s 04 (dictionary id[4]) Compression dictionary installed
+	IOP_S2C_DICTIONARY = 4,		// s2c 04 (dictionary id[4]) (total bytes[2]) (offset[2]) (data[N]) Compression dictionary piece
+
+	IOP_ACK_FREQUENCY = 8		// a2a 08 (ack every[1]) (max delay msec[2]) Requested acknowledgment frequency
 };
 
 // Internal opcode lengths
@@ -202,6 +241,10 @@ static const u32 IOP_C2S_TIME_PING_LEN = 1 + 4;
 static const u32 IOP_S2C_TIME_PONG_LEN = 1 + 4 + 4 + 4;
 static const u32 IOP_HUGE_MINLEN = 1 + 1;
 static const u32 IOP_DISCO_LEN = 1 + 1;
+static const u32 IOP_C2S_DICTIONARY_ACK_LEN = 1 + 4;
+static const u32 IOP_S2C_DICTIONARY_MINLEN = 1 + 4 + 2 + 2 + 1;
+static const u32 IOP_S2C_DICTIONARY_PIECE_BYTES = 256; // Keeps each piece in one datagram at the minimum MTU
+static const u32 IOP_ACK_FREQUENCY_LEN = 1 + 1 + 2;
 
 // MTU discovery guesses
 static const u32 MINIMUM_MTU = 576; // Dial-up
@@ -214,6 +257,7 @@ static const u32 MAXIMUM_MTU = 1500; // Highspeed
 static const u32 MAX_MESSAGE_SIZE = 65535;	// Past this size the messages must go through the WriteHuge() interface
 static const int TIMEOUT_DISCONNECT = 15000; // milliseconds; NOTE: If this changes, the timestamp compression will stop working
 static const u32 NUM_STREAMS = 4; // Number of reliable streams
+static const u32 MAX_LATEST_CHANNELS = 32; // Number of latest-only unreliable channels
 
 // (multiplier-1) divisible by all prime factors of table size
 // (multiplier-1) is a multiple of 4 if table size is a multiple of 4
@@ -251,8 +295,8 @@ public:
 // Receive state: Fragmentation
 struct RecvFrag
 {
-	u8 *buffer; // Buffer for accumulating fragment
-	u16 length; // Number of bytes in fragment buffer
+	u8 *buffer; // Buffer for accumulating fragment, or 0 if the message is being discarded
+	u16 length; // Number of bytes in fragment buffer, or 0 if no message is in progress
 	u16 offset; // Current write offset in buffer
 	u16 decomp_length;	// Number of bytes after decompression
 };
@@ -260,8 +304,6 @@ struct RecvFrag
 // Receive state: Receive queue
 struct RecvQueue
 {
-	RecvQueue *next;	// Next message in list
-	RecvQueue *eos;		// End of current sequence (forward)
 	u32 id;				// Acknowledgment id
 	u16 bytes;			// Data Bytes
 	u8 sop;				// Super Opcode
@@ -292,12 +334,17 @@ struct OutgoingMessage : ResizableBuffer<OutgoingMessage>
 			u32 id;					// Acknowledgment id
 			u32 ts_firstsend;		// Millisecond-resolution timestamp when it was first sent
 			u32 ts_lastsend;		// Millisecond-resolution timestamp when it was last sent
+			u32 ts_expire;			// Millisecond-resolution timestamp when it is due for retransmission
+			OutgoingMessage *wheel_next;	// Next in retransmit wheel slot
+			OutgoingMessage **wheel_pprev;	// Link to this node in the retransmit wheel, 0=Not scheduled
 		};
 	};
 
 	// Shared members:
 	u8 sop;		// Super opcode of message
 	u8 loss_on;	// 1=Represents a packet loss on retransmit, 0=Not representative, other values invalid
+	u8 shared;	// 1=Node is a SendShared and its data lives in a SharedMessage, 0=Data is trailing
+	u8 stream;	// Stream the node was sent on (only in sent list)
 
 	/*
 		loss_on : Converting messageloss to packetloss 1:1
@@ -343,11 +390,39 @@ struct SendFrag : OutgoingMessage
 	u16 offset;					// Fragment data offset
 };
 
+/*
+	SharedMessage
+
+		An immutable message payload built once by BroadcastReliable() and
+	referenced by every recipient.  Each recipient gets a small SendShared
+	descriptor in place of its own copy of the data, and the payload is
+	freed when the last descriptor is acknowledged or discarded.
+
+		Messages long enough to always fragment are compressed once when
+	the payload is built.  The compressed bytes follow the message bytes
+	and are used in place of them when the descriptor starts fragmenting.
+*/
+struct SharedMessage
+{
+	volatile u32 references;	// Number of SendShared descriptors still pointing here
+	u32 bytes;					// Number of message bytes, including the opcode
+	u32 comp_bytes;				// Number of compressed bytes after the message, 0=Not compressed
+
+	// Followed by message bytes, then compressed bytes
+};
+
+struct SendShared : OutgoingMessage
+{
+	SharedMessage *payload;		// Object containing message data
+};
+
 struct SendCluster
 {
 	static const u32 WORKSPACE_BYTES = MAXIMUM_MTU; // Static number of bytes for cluster workspace
 
-	u8 workspace[WORKSPACE_BYTES];
+	// Acquired on the first write and released when the cluster is flushed,
+	// so an idle connexion does not hold an MTU of workspace
+	u8 *workspace;
 	u32 ack_id;	// Next ACK-ID: Used to compress ACK-ID by setting I=0 after the first reliable message
 	u32 bytes;	// Number of bytes written to the send cluster so far
 	u8 stream;	// Active stream
@@ -362,10 +437,15 @@ struct SendCluster
 
 	CAT_INLINE u8 *Next(u32 add_bytes)
 	{
+		if (!workspace) AcquireWorkspace();
+
 		u8 *pkt = workspace + bytes;
 		bytes += add_bytes;
 		return pkt;
 	}
+
+	void AcquireWorkspace();
+	void ReleaseWorkspace();
 };
 
 #if defined(CAT_PACK_TRANSPORT_STATE_STRUCTURES)
@@ -0,0 +1,143 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_SPHYNX_COMPRESSION_DICTIONARY_HPP
+#define CAT_SPHYNX_COMPRESSION_DICTIONARY_HPP
+
+#include <cat/sphynx/Common.hpp>
+
+namespace cat {
+
+
+namespace sphynx {
+
+
+/*
+	Compression Dictionary
+
+	Game messages of 20-200 bytes rarely shrink under LZ4 on their own,
+	because a single small datagram has no earlier data to match against.
+	A dictionary trained offline from captured traffic (see DictionaryTrainer)
+	gives every datagram the same shared history: the dictionary is treated
+	as if it came immediately before the datagram, so LZ4 matches may reach
+	back into it.
+
+	The Server loads the file named by the "Sphynx.Server.Dictionary" setting
+	and sends it to each client in IOP_S2C_DICTIONARY pieces once the
+	connexion is established.  The client installs it and replies with
+	IOP_C2S_DICTIONARY_ACK, after which both sides compress datagrams against
+	it and mark them with DGRAM_LZ4_DICT.
+
+	Dictionaries are immutable once created and reference counted, so one
+	instance is shared by every connexion of a server.
+
+	The bundled LZ4 only matches within the buffer it is given, so the
+	dictionary variant of its block format lives in CompressionDictionary.cpp.
+	Each worker keeps a DictionaryWorkspace in TransportTLS that holds the
+	dictionary with room for a datagram after it, and a working copy of the
+	primed hash table.  The hash slots a datagram touches are put back after
+	it is compressed, so each datagram copies only its own bytes.
+*/
+class CompressionDictionary;
+
+// Scratch space for compressing or decompressing against one dictionary
+struct CAT_EXPORT DictionaryWorkspace
+{
+	CompressionDictionary *dict; // Holds a reference, or 0 if none is laid out
+	u8 *buffer; // Dictionary followed by room for one datagram
+	u16 *table; // Working copy of the primed hash table, or 0 if not copied yet
+
+	CAT_INLINE void Clear()
+	{
+		dict = 0;
+		buffer = 0;
+		table = 0;
+	}
+
+	// Release the dictionary reference and free the buffers
+	void FreeMemory();
+};
+
+class CAT_EXPORT CompressionDictionary
+{
+	volatile u32 _references;
+
+	u8 *_data;
+	u32 _bytes;
+	u32 _id;
+
+	// Hash table primed with the dictionary, copied into each workspace once
+	u16 *_table;
+
+	CompressionDictionary();
+	~CompressionDictionary();
+
+	// Lay the dictionary out in the workspace if it holds another one
+	// Returns false if out of memory
+	bool Install(DictionaryWorkspace &ws);
+
+public:
+	// Largest dictionary accepted
+	static const u32 MAX_BYTES = 8192;
+
+	// Hash table size for matching against the dictionary
+	static const u32 HASH_BITS = 13;
+	static const u32 HASH_SIZE = (u32)1 << HASH_BITS;
+
+	// Returns 0 on failure.  The new dictionary has one reference
+	static CompressionDictionary *Create(const void *data, u32 bytes);
+
+	// Load a dictionary file written by DictionaryTrainer, or 0 on failure
+	static CompressionDictionary *Load(const char *path);
+
+	// Hash of the dictionary data, exchanged to confirm both sides match
+	static u32 CalculateID(const void *data, u32 bytes);
+
+	CAT_INLINE u32 GetID() { return _id; }
+	CAT_INLINE const u8 *GetData() { return _data; }
+	CAT_INLINE u32 GetBytes() { return _bytes; }
+
+	void AddRef();
+	void ReleaseRef();
+
+	// Returns the number of bytes written to out, or 0 if the data did not shrink
+	// out must have room for LZ4_compressBound(bytes).  The workspace must not be shared between threads
+	u32 Compress(DictionaryWorkspace &ws, const u8 *data, u32 bytes, u8 *out);
+
+	// Returns the number of bytes written to out, or <= 0 if the data is invalid
+	// The workspace must not be shared between threads
+	s32 Decompress(DictionaryWorkspace &ws, const u8 *data, u32 bytes, u8 *out, u32 out_limit);
+};
+
+
+} // namespace sphynx
+
+
+} // namespace cat
+
+#endif // CAT_SPHYNX_COMPRESSION_DICTIONARY_HPP
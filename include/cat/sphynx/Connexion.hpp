@@ -39,50 +39,146 @@ namespace cat {
 namespace sphynx {
 
 
+/*
+	Worker Migration
+
+		Each Connexion is owned by one worker thread, which receives its
+	datagrams, ticks it and fires its pacing wakeups.  The Server's load
+	balancer (see Server.hpp) may ask a Connexion to move to another
+	worker with RequestMigration().  The move is carried out by the owning
+	worker so that no datagram is dropped, reordered or processed on two
+	threads at once:
+
+	(1) On its next tick, the source worker registers the timer on the
+		destination and switches the worker id that routing reads.  New
+		datagrams now go to the destination, which parks them.
+
+	(2) A marker is queued behind the datagrams already delivered to the
+		source.  If the ConnexionMap epoch does not yet show that every
+		router holding the old worker id is gone, the source keeps the
+		marker and checks again on each tick.  Then the marker goes around
+		the source queue once more to drain anything those routers delivered.
+
+	(3) When the source processes the marker, it moves the Transport onto
+		the destination's TransportTLS and send cluster lock, drops its
+		own timer and queues the marker to the destination.
+
+	(4) The destination processes the parked datagrams in arrival order
+		when the marker reaches it, and the Connexion is back to normal.
+
+		Ticks that land on a worker that does not own the Connexion during
+	the move are skipped.  Pacing wakeups are scheduled on the worker that
+	is running the Connexion, which is the source until the handoff, and
+	any that land elsewhere are forwarded there.
+*/
+
+
 // Base class for a connexion with a remote Sphynx client
 class CAT_EXPORT Connexion : public Transport, public RefObject
 {
 	friend class Server;
 	friend class ConnexionMap;
 
-	Server *_parent; // Server object that owns this one
-
-	NetAddr _client_addr;
-	u16 _flood_key; // Flood key based on IP address, not necessarily unique
-	u16 _my_id; // Unique connexion id number
-	u32 _worker_id; // Worker thread index
+	// Hot state first, see Memory Layout in Transport.hpp
 
-#if !defined(CAT_SPHYNX_ROAMING_IP)
-	u64 _first_challenge_hash;	// First challenge seen from this client address
-	u8 _cached_answer[128]; // Cached answer to this first challenge, to avoid eating server CPU time
+	Server *_parent; // Server object that owns this one
 
-	void RetransmitAnswer(RecvBuffer *buffer);
-#endif // CAT_SPHYNX_ROAMING_IP
+	u32 _my_id; // Unique connexion id number
+	volatile u32 _worker_id; // Worker thread index, read by routing without a lock
+	volatile u32 _migrate_state; // MigrateState, see below
 
 	// Last time a packet was received from this user -- for disconnect timeouts
 	u32 _last_recv_tsc;
 
+	// Processing cost in microseconds, written by the owning worker and wraps at 2^32
+	volatile u32 _cost_usec;
+
 	// Flag indicating if a valid encrypted message has been seen yet
 	bool _seen_encrypted;
+
+	NetAddr _client_addr;
 	AuthenticatedEncryption _auth_enc;
 
+	u32 _flood_key; // Flood key based on IP address, not necessarily unique
+
+	// Worker migration state, see above
+	enum MigrateState
+	{
+		MIGRATE_IDLE,		// Owned by _worker_id
+		MIGRATE_PARKING,	// Source still processing, destination parks datagrams
+		MIGRATE_HANDOFF		// Marker on its way to the destination, which parks datagrams
+	};
+
+	volatile u32 _migrate_to;		// Requested destination, or INVALID_WORKER_ID
+	u32 _migrate_from;				// Source worker while migrating
+	u32 _migrate_epoch;				// ConnexionMap epoch when routing was switched
+	bool _migrate_grace;			// Routers that saw the old worker id are gone
+	volatile u32 _migrate_waiting;	// Source holds the marker until the grace period passes
+	BatchSet _parked;				// Datagrams held by the destination, only touched there
+	WorkerBuffer _migrate_marker;
+
+	u32 _balance_cost_last;			// Only touched by the load balancer
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	// Kept to replay a lost answer, and freed once the client is heard from over the tunnel
+	struct HandshakeCache
+	{
+		u64 first_challenge_hash;	// First challenge seen from this client address
+		u8 answer[128];				// Cached answer to this first challenge, to avoid eating server CPU time
+	};
+
+	HandshakeCache *_handshake;
+
+	void RetransmitAnswer(RecvBuffer *buffer);
+#endif // CAT_SPHYNX_ROAMING_IP
+
 	virtual s32 WriteDatagrams(const BatchSet &buffers, u32 count);
+	virtual bool SchedulePacingWakeup(u32 when);
 	virtual void OnInternal(u32 recv_time, BufferStream msg, u32 bytes);
 	virtual void OnDisconnectComplete();
 
 	void OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers);
 	void OnTick(ThreadLocalStorage &tls, u32 now);
+	void OnPaceTimer(ThreadLocalStorage &tls, u32 now);
+
+	// Decrypt and deliver a batch of datagrams, releasing the buffers
+	void ProcessDatagrams(const BatchSet &buffers);
+
+	// Returns true if the calling worker may process this Connexion right now
+	bool IsRunnableOn(ThreadLocalStorage &tls);
+
+	void BeginMigration();
+	void OnMigrateMarker(ThreadLocalStorage &tls);
+	void OnMigrateRecv(ThreadLocalStorage &tls, const BatchSet &buffers);
+	void PostMigrateMarker(u32 worker_id);
+
+	// Called only by the load balancer: Processing cost since the previous call
+	u32 TakeCostSample();
+
+	// Send the server compression dictionary to the client in pieces
+	bool PostDictionary(CompressionDictionary *dict);
 
 public:
 	Connexion();
-	CAT_INLINE virtual ~Connexion() {}
+	virtual ~Connexion();
 
 	CAT_INLINE const char *GetRefObjectName() { return "Connexion"; }
 
+	// Memory held by each connexion, not counting derived classes
+	static void GetFootprint(ConnexionFootprint &footprint);
+
 	CAT_INLINE const NetAddr &GetAddress() { return _client_addr; }
-	CAT_INLINE u16 GetMyID() { return _my_id; }
-	CAT_INLINE u16 GetFloodKey() { return _flood_key; }
+	CAT_INLINE u32 GetMyID() { return _my_id; }
+	CAT_INLINE u32 GetFloodKey() { return _flood_key; }
 	CAT_INLINE u32 GetWorkerID() { return _worker_id; }
+	// Worker that processes the Connexion right now: The source until the handoff
+	CAT_INLINE u32 GetRunningWorkerID() { return _migrate_state == MIGRATE_PARKING ? _migrate_from : _worker_id; }
+
+	CAT_INLINE bool IsMigrating() { return _migrate_state != MIGRATE_IDLE || _migrate_to != INVALID_WORKER_ID; }
+
+	// Ask the owning worker to move this Connexion to another worker on its next tick
+	// Returns false if a move is already under way
+	bool RequestMigration(u32 worker_id);
 
 	// Current local time
 	u32 getLocalTime();
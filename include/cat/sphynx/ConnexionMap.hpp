@@ -31,12 +31,14 @@
 
 #include <cat/net/Sockets.hpp>
 #include <cat/sphynx/Connexion.hpp>
-#include <cat/threads/RWLock.hpp>
+#include <cat/threads/Mutex.hpp>
+#include <cat/threads/EpochGate.hpp>
+#include <vector>
 
 /*
 	Roaming IP
 
-		Roaming IP is implemented by adding two bytes to the front
+		Roaming IP is implemented by adding three bytes to the front
 	of each c2s packet.  The extra field is used to uniquely identify
 	the clients rather than using the IP:port.  This is advantageous
 	because even if there is a change-over, any late-arriving packets
@@ -50,6 +52,38 @@
 	turned off for desktop-dedicated applications.
 */
 
+/*
+	Lock-free Lookups
+
+		Every incoming datagram is routed through a lookup, so readers
+	never take a lock.  Insert() and Remove() are serialized by a mutex
+	and publish slot changes with a store barrier, while readers walk the
+	table inside an EpochGate.  When a Connexion is removed, the table's
+	reference to it is not released right away: it is filed under the
+	current epoch and dropped once the epoch has advanced twice, so a
+	pointer read by a lookup stays valid long enough to AddRef() it.
+	The epoch is advanced by Insert(), Remove() and ReclaimRetired(),
+	which the server calls from its tick so that references do not wait
+	for the next connexion to come or go.
+*/
+
+/*
+	Growth
+
+		The population limit is set at Initialize() time from the server's
+	"Sphynx.Server.MaxConnexions" setting, DEFAULT_MAX_POPULATION by
+	default.  With Roaming IP the connexion id is 24 bits wide, and slots
+	live in CHUNK_SIZE chunks reached through a fixed directory.  The map
+	starts empty and grows one chunk at a time as connexions arrive, so
+	growth never copies or rehashes existing slots and readers never see
+	a table move.
+
+		The IP-based version keeps its open-addressed table, sized once to
+	twice the population limit.  In both versions the flood table is sized
+	to the population limit so that unrelated addresses rarely share a
+	flood counter.
+*/
+
 namespace cat {
 
 
@@ -60,54 +94,89 @@ namespace sphynx {
 class CAT_EXPORT ConnexionMap
 {
 public:
-	static const u16 INVALID_KEY = ~(u16)0;
-	static const int HASH_TABLE_SIZE = 32768; // Power-of-2
-	static const int HASH_TABLE_MASK = HASH_TABLE_SIZE - 1;
-	static const int MAX_POPULATION = HASH_TABLE_SIZE / 2;
+	static const u32 INVALID_KEY = ~(u32)0;
+	static const u32 DEFAULT_MAX_POPULATION = 262144;
+	static const u32 MAX_POPULATION_LIMIT = (u32)1 << 24; // Fits the roaming id
+	static const u32 MIN_FLOOD_TABLE_SIZE = 32768; // Power-of-2
 	static const int CONNECTION_FLOOD_THRESHOLD = 10;
 
+#if defined(CAT_SPHYNX_ROAMING_IP)
+	static const u32 CHUNK_BITS = 12;
+	static const u32 CHUNK_SIZE = (u32)1 << CHUNK_BITS; // Slots added per growth step
+	static const u32 CHUNK_MASK = CHUNK_SIZE - 1;
+	static const u32 MAX_CHUNKS = ROAMING_ID_LIMIT >> CHUNK_BITS;
+#endif
+
 private:
 	volatile bool _is_shutdown;
+	u32 _max_population;
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	static const int MAP_PREALLOC = 64;
+	struct Slot
+	{
+		Connexion * volatile conn;
+		u32 next_free; // Only touched with the table lock held
+	};
+
 	u32 _flood_salt, _first_free;
 
-	Connexion **_conn_table;
-	u16 *_free_table;
-	u32 _map_alloc;
+	// Chunks are published before the allocated slot count covers them
+	Slot * volatile _chunks[MAX_CHUNKS];
+	volatile u32 _map_alloc;
+
+	CAT_INLINE Slot *GetSlot(u32 key) { return _chunks[key >> CHUNK_BITS] + (key & CHUNK_MASK); }
+
+	// Append one chunk of free slots; returns false if out of memory
+	bool Grow();
 
 #else // IP-based version:
 	u32 _flood_salt, _ip_salt, _port_salt;
 
 	struct Slot
 	{
-		Connexion *conn;
-		u8 collision;
+		Connexion * volatile conn;
+		volatile u8 collision;
 	};
 
-	Slot _map_table[HASH_TABLE_SIZE];
+	Slot *_map_table;
+	u32 _map_mask;
 #endif // CAT_SPHYNX_ROAMING_IP
 
-	RWLock _table_lock;
-	u8 _flood_table[HASH_TABLE_SIZE];
+	Mutex _table_lock;
+	EpochGate _epoch;
+
+	// Table references waiting for readers to leave, by epoch parity
+	std::vector<Connexion*> _retired[2];
+
+	u8 *_flood_table;
+	u32 _flood_mask;
 
 	volatile u32 _count;
 
+	// Called with the table lock held: Advances the epoch and moves
+	// references no reader can still see onto the released list
+	void CollectRetired(std::vector<Connexion*> &released);
+
+	// Release references gathered by CollectRetired() after unlocking
+	static void ReleaseRetired(std::vector<Connexion*> &released);
+
 public:
 	ConnexionMap();
 	virtual ~ConnexionMap();
 
 	CAT_INLINE bool IsShutdown() { return _is_shutdown; }
 	CAT_INLINE u32 GetCount() { return _count; }
+	CAT_INLINE u32 GetMaxPopulation() { return _max_population; }
+	CAT_INLINE bool IsFull() { return _count >= _max_population; }
 
-	// Initialize the hash salt
-	void Initialize(FortunaOutput *csprng);
+	// Initialize the hash salt and allocate tables for the population limit
+	// Returns false if out of memory
+	bool Initialize(FortunaOutput *csprng, u32 max_population = DEFAULT_MAX_POPULATION);
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 	// Lookup client by id
 	// Returns true if flood guard triggered by address
-	bool LookupCheckFlood(Connexion * &connexion, const NetAddr &addr, u16 id);
+	bool LookupCheckFlood(Connexion * &connexion, const NetAddr &addr, u32 id);
 #else
 	// Lookup client by address
 	// Returns true if flood guard triggered
@@ -118,11 +187,27 @@ public:
 	Connexion *Lookup(u32 key);
 
 	// Returns ERR_NO_PROBLEMO if insertion succeeds, else an error code
-	SphynxError Insert(Connexion *conn);
+	// With Roaming IP the assigned key will satisfy (key % shard_count) == shard,
+	// which lets a socket steering program pick the owning worker from the key
+	SphynxError Insert(Connexion *conn, u32 shard_count = 1, u32 shard = 0);
 
 	// Remove Connexion object from the lookup table
 	void Remove(Connexion *conn);
 
+	// Routing code stays inside this gate from lookup until the datagrams are delivered,
+	// so a Connexion changing workers can wait out routers that saw its old worker id
+	CAT_INLINE EpochGate &GetRoutingGate() { return _epoch; }
+	CAT_INLINE u32 GetEpoch() { return _epoch.GetEpoch(); }
+
+	// Returns true once every reader that entered at or before the given epoch has left
+	bool PassedGrace(u32 epoch);
+
+	// Release table references that no reader can still see
+	void ReclaimRetired();
+
+	// Append a reference to each Connexion object; caller must ReleaseRef() each one
+	void AcquireAll(std::vector<Connexion*> &connexions);
+
 	// Invoke ->RequestShutdown() on all Connexion objects
 	void ShutdownAll();
 };
@@ -38,6 +38,89 @@ namespace cat {
 namespace sphynx {
 
 
+/*
+	FlowControl
+
+		Congestion controller interface used by the Sphynx transport layer.
+	Each Transport owns one controller, selected per Server or Client by the
+	"Sphynx.Server.FlowControl" and "Sphynx.Client.FlowControl" settings:
+
+		"Tampon" (default) : Loss-driven AIMD, described below
+		"Bottleneck" : Delivery rate and minimum RTT model, described below
+
+	The transport asks GetRemainingBytes() how much it may send each time it
+	flushes, reports what it sent with OnPacketSend(), reports round trip
+	samples with OnACK() and acknowledged bytes and losses with OnACKDone(),
+	and calls OnTick() once per worker tick.  Controllers are called from the
+	owning worker thread and also from other threads that write OOB data, so
+	they must lock their own state.
+*/
+
+enum FlowControlMode
+{
+	FLOW_CONTROL_TAMPON,
+	FLOW_CONTROL_BOTTLENECK
+};
+
+class CAT_EXPORT FlowControl
+{
+protected:
+	static const u32 RTT_FUZZ = 10;	// Fuzz mainly for worker tick rate
+	static const u32 INITIAL_RTT = 3000; // Milliseconds
+
+	// BPS low and high limits
+	s32 _bandwidth_low_limit, _bandwidth_high_limit;
+
+	// Milliseconds receiving negative acknowledgment before a message will be considered lost
+	u32 _rtt;
+
+	// Smooth a new round trip time sample into the RTT estimate
+	CAT_INLINE void UpdateRTT(u32 rtt) { _rtt = (_rtt * 9 + rtt) / 10; }
+
+public:
+	FlowControl();
+	CAT_INLINE virtual ~FlowControl() {}
+
+	// Returns 0 if out of memory
+	static FlowControl *Create(FlowControlMode mode);
+
+	// Returns FLOW_CONTROL_TAMPON for unrecognized names
+	static FlowControlMode GetModeFromName(const char *name);
+
+	CAT_INLINE u32 GetBandwidthLowLimit() { return _bandwidth_low_limit; }
+	CAT_INLINE void SetBandwidthLowLimit(u32 limit) { _bandwidth_low_limit = limit; }
+	CAT_INLINE u32 GetBandwidthHighLimit() { return _bandwidth_high_limit; }
+	CAT_INLINE void SetBandwidthHighLimit(u32 limit) { _bandwidth_high_limit = limit; }
+
+	// Number of bytes remaining in available bandwidth at this instant
+	virtual s32 GetRemainingBytes(u32 now) = 0;
+
+	// Report number of bytes for each successfully sent packet, including overhead bytes
+	virtual void OnPacketSend(u32 bytes_with_overhead) = 0;
+
+	// Target sending rate in bytes per second, used to space datagrams apart
+	virtual u32 GetPacingRate() = 0;
+
+	// Smoothed round trip time estimate in milliseconds
+	CAT_INLINE u32 GetRTT() { return _rtt; }
+
+	// Get timeout for reliable message with negative acknowledgment
+	CAT_INLINE u32 GetNACKTimeout(u32 stream) { return (_rtt + RTT_FUZZ) * 3 / 2; }
+
+	// Get timeout for reliable message with no negative acknowledgment
+	CAT_INLINE u32 GetHeadTimeout(u32 stream) { return (_rtt + RTT_FUZZ) * 2; }
+
+	// Called when a transport layer tick occurs
+	virtual void OnTick(u32 now, u32 timeout_loss_count) = 0;
+
+	// Called when an acknowledgment is received
+	virtual void OnACK(u32 recv_time, OutgoingMessage *node) = 0;
+	virtual void OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes) = 0;
+};
+
+
+
+
 /*
     Approach inspired by TCP Adaptive Westwood from
     Marcondes-Sanadidi-Gerla-Shimonishi paper "TCP Adaptive Westwood" (ICC 2008)
@@ -85,54 +168,134 @@ namespace sphynx {
 			- Cuts channel capacity estimation down to a perceived safe level
 */
 
-class CAT_EXPORT FlowControl
+class CAT_EXPORT TamponFlowControl : public FlowControl
 {
 	Mutex _lock;
 
-	static const u32 RTT_FUZZ = 10;	// Fuzz mainly for worker tick rate
-
-	// BPS low and high limits
-	s32 _bandwidth_low_limit, _bandwidth_high_limit;
-
 	// Current BPS limit
 	s32 _bps;
 
 	s32 _available_bw;
 	u32 _last_bw_update;
 
-	// Milliseconds receiving negative acknowledgment before a message will be considered lost
-	u32 _rtt;
-
 	// Statistics
 	u32 _last_stats_update;
 	u32 _stats_rtt_acc, _stats_rtt_count, _stats_loss_count, _stats_goodput;
 
 public:
-	FlowControl();
-
-	CAT_INLINE u32 GetBandwidthLowLimit() { return _bandwidth_low_limit; }
-	CAT_INLINE void SetBandwidthLowLimit(u32 limit) { _bandwidth_low_limit = limit; }
-	CAT_INLINE u32 GetBandwidthHighLimit() { return _bandwidth_high_limit; }
-	CAT_INLINE void SetBandwidthHighLimit(u32 limit) { _bandwidth_high_limit = limit; }
+	TamponFlowControl();
+
+	virtual s32 GetRemainingBytes(u32 now);
+	virtual void OnPacketSend(u32 bytes_with_overhead);
+	virtual u32 GetPacingRate();
+	virtual void OnTick(u32 now, u32 timeout_loss_count);
+	virtual void OnACK(u32 recv_time, OutgoingMessage *node);
+	virtual void OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes);
+};
 
-	// Number of bytes remaining in available bandwidth at this instant
-	s32 GetRemainingBytes(u32 now);
 
-	// Report number of bytes for each successfully sent packet, including overhead bytes
-	void OnPacketSend(u32 bytes_with_overhead);
+/*
+	"Bottleneck" Flow Control algorithm:
+
+	Bottleneck models the path as a pipe with a bottleneck bandwidth and a
+	minimum round trip time, after the BBR approach of Cardwell et al.
+	("BBR: Congestion-Based Congestion Control", ACM Queue 2016).  It paces
+	transmission at a gain times the estimated bottleneck bandwidth rather
+	than reacting to packetloss, so a long fat pipe with a little random
+	loss is not throttled the way a loss-driven estimator throttles it.
+
+	Rounds last one minimum RTT (at least MIN_ROUND_MSEC).  At the end of
+	each round the delivery rate is the acknowledged bytes over the round
+	duration.  The bottleneck bandwidth is the maximum delivery rate over
+	the last BW_WINDOW_ROUNDS rounds.  Rounds where the sender did not use
+	most of its pacing budget are application-limited, and their samples
+	can raise the estimate but never lower it.
+
+	Bottleneck has four phases:
+		+ Startup
+			- Pacing gain of 2.89 until the delivery rate stops growing by
+			  25% for three rounds in a row
+		+ Drain
+			- Pacing gain of 1/2.89 for one round to empty the queue that
+			  Startup built up
+		+ Probe Bandwidth
+			- Cycles pacing gain through 1.25, 0.75 and then six rounds of
+			  1.0, to find more bandwidth and then drain what it queued
+		+ Probe RTT
+			- When the minimum RTT has not been refreshed for ten seconds,
+			  halves the pacing rate for at least 200 ms so queues drain
+			  and the true propagation delay can be measured again
+
+	The transport has no in-flight byte accounting, so unlike BBR there is
+	no congestion window.  Pacing alone bounds the sending rate.
+*/
 
-	// Get timeout for reliable message with negative acknowledgment
-	CAT_INLINE u32 GetNACKTimeout(u32 stream) { return (_rtt + RTT_FUZZ) * 3 / 2; }
+class CAT_EXPORT BottleneckFlowControl : public FlowControl
+{
+	Mutex _lock;
 
-	// Get timeout for reliable message with no negative acknowledgment
-	CAT_INLINE u32 GetHeadTimeout(u32 stream) { return (_rtt + RTT_FUZZ) * 2; }
+	static const u32 GAIN_UNIT = 256; // Gains are fixed point with this as 1.0
+	static const u32 HIGH_GAIN = 739; // 2/ln(2) = 2.89
+	static const u32 DRAIN_GAIN = 88; // 1/2.89
+	static const u32 PROBE_RTT_GAIN = 128; // 0.5
+	static const u32 CYCLE_LENGTH = 8;
+	static const u32 BW_WINDOW_ROUNDS = 10;
+	static const u32 MIN_ROUND_MSEC = 40;
+	static const u32 MIN_RTT_WINDOW_MSEC = 10000;
+	static const u32 PROBE_RTT_MSEC = 200;
+	static const u32 FULL_BW_ROUNDS = 3;
+
+	enum Mode
+	{
+		MODE_STARTUP,
+		MODE_DRAIN,
+		MODE_PROBE_BW,
+		MODE_PROBE_RTT
+	};
+
+	Mode _mode;
+	u32 _pacing_gain;
+
+	// Bottleneck bandwidth estimate in bytes per second, and its windowed samples
+	u32 _btl_bw;
+	u32 _bw_samples[BW_WINDOW_ROUNDS];
+	u32 _round_count;
+
+	// Minimum RTT estimate and when it was last refreshed
+	u32 _min_rtt, _min_rtt_stamp;
+
+	// Current round
+	u32 _round_start;
+	u32 _round_delivered, _round_sent;
+	bool _round_started;
+
+	// Startup exit detection
+	u32 _full_bw, _full_bw_count;
+	bool _filled_pipe;
+
+	// Probe Bandwidth gain cycle
+	u32 _cycle_index;
+
+	// Probe RTT end time
+	u32 _probe_rtt_done;
+
+	// Pacing
+	s32 _available_bw;
+	u32 _last_bw_update;
 
-	// Called when a transport layer tick occurs
-	void OnTick(u32 now, u32 timeout_loss_count);
+	CAT_INLINE u32 CalculatePacingRate();
+	void EndRound(u32 now);
+	void EnterProbeBandwidth();
 
-	// Called when an acknowledgment is received
-	void OnACK(u32 recv_time, OutgoingMessage *node);
-	void OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes);
+public:
+	BottleneckFlowControl();
+
+	virtual s32 GetRemainingBytes(u32 now);
+	virtual void OnPacketSend(u32 bytes_with_overhead);
+	virtual u32 GetPacingRate();
+	virtual void OnTick(u32 now, u32 timeout_loss_count);
+	virtual void OnACK(u32 recv_time, OutgoingMessage *node);
+	virtual void OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes);
 };
 
 
@@ -0,0 +1,172 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_SPHYNX_HANDSHAKE_PIPELINE_HPP
+#define CAT_SPHYNX_HANDSHAKE_PIPELINE_HPP
+
+#include <cat/sphynx/Common.hpp>
+#include <cat/sphynx/TransportStats.hpp>
+#include <cat/crypt/tunnel/KeyAgreementResponder.hpp>
+#include <cat/threads/Thread.hpp>
+#include <cat/threads/WaitableFlag.hpp>
+#include <cat/threads/Mutex.hpp>
+#include <cat/time/Clock.hpp>
+
+/*
+	Handshake Pipeline
+
+		Answering a C2S_CHALLENGE costs a scalar multiplication on the curve,
+	which is far more work than anything else the server does for a datagram.
+	Instead of doing it inline on whichever worker received the challenge,
+	the Server makes only the cheap checks there (cookie, shutdown, address
+	filter, population) and queues the challenge here.  A small pool of
+	handshake threads drains the queue, so a login storm cannot stall the
+	workers that are moving data for established connexions.
+
+		The queue holds at most "Sphynx.Server.HandshakeQueueDepth" challenges
+	(default 256).  When it is full the worker answers with ERR_SERVER_FULL
+	right away rather than letting the challenge wait in line until the
+	client has given up on it.
+
+		Each handshake thread takes up to MAX_BATCH challenges at a time and
+	answers them together, so the field inversion that converts each shared
+	point to affine coordinates is paid once per batch.  Batches only form
+	when challenges arrive faster than they are answered, so a lone challenge
+	is never held back waiting for company.
+
+		"Sphynx.Server.HandshakeThreads" sets the size of the pool (default 1,
+	up to MAX_THREADS).  Setting it to 0 answers challenges inline on the
+	receiving worker as before.  Counters and the queue latency histogram
+	are reported in each StatsSnapshot.
+*/
+
+namespace cat {
+
+
+namespace sphynx {
+
+
+class Server;
+class HandshakePipeline;
+
+
+// A challenge waiting for key agreement
+struct HandshakeJob
+{
+	HandshakeJob *next;
+	NetAddr addr;
+	u32 recv_msec;					// Local time when the challenge arrived
+	double queue_usec;				// Local time when the challenge was queued
+	u8 challenge[CHALLENGE_BYTES];
+};
+
+
+// One thread of the handshake pool
+class CAT_EXPORT HandshakeThread : public Thread
+{
+	friend class HandshakePipeline;
+
+	static const int IDLE_WAIT_MSEC = 1000;
+
+	HandshakePipeline *_pipeline;
+	WaitableFlag _wake_flag;
+
+	virtual bool Entrypoint(void *param);
+
+public:
+	HandshakeThread();
+	CAT_INLINE virtual ~HandshakeThread() {}
+};
+
+
+class CAT_EXPORT HandshakePipeline
+{
+	friend class HandshakeThread;
+
+public:
+	static const u32 DEFAULT_THREADS = 1;
+	static const u32 MAX_THREADS = 16;
+	static const u32 DEFAULT_QUEUE_DEPTH = 256;
+	static const u32 MIN_QUEUE_DEPTH = 16;
+	static const u32 MAX_QUEUE_DEPTH = 65536;
+	static const u32 MAX_BATCH = KeyAgreementResponder::MAX_CHALLENGE_BATCH;
+
+private:
+	Server *_server;
+	Clock *_clock;
+
+	HandshakeThread _threads[MAX_THREADS];
+	u32 _thread_count;
+	volatile u32 _next_wake;
+	volatile bool _kill_flag;
+
+	// Jobs are allocated up front so that the queue depth also bounds memory
+	HandshakeJob *_jobs;
+
+	Mutex _lock;
+	HandshakeJob *_free_head;					// Protected by _lock
+	HandshakeJob *_queue_head, *_queue_tail;	// Protected by _lock
+	u32 _queue_depth;							// Protected by _lock
+	HandshakeSample _sample;					// Protected by _lock
+
+	void WakeOne();
+
+	// Take up to max_count jobs from the head of the queue.  more is set if any are left
+	u32 Dequeue(HandshakeJob **jobs, u32 max_count, bool &more);
+
+	// Return jobs to the free list and count the outcome
+	void Complete(HandshakeJob **jobs, u32 count, u32 answered);
+
+	void FreeJobs();
+
+public:
+	HandshakePipeline();
+	~HandshakePipeline();
+
+	CAT_INLINE bool IsRunning() { return _thread_count > 0; }
+
+	bool Start(Server *server, Clock *clock, u32 thread_count, u32 queue_depth);
+	void Stop();
+
+	// Returns false if the queue is full or stopped, in which case the challenge is shed
+	bool Enqueue(const NetAddr &addr, const u8 *challenge, u32 recv_msec);
+
+	// Count challenges that were answered inline without the pipeline
+	void Record(u32 answered, u32 rejected);
+
+	// Copy the counters accumulated since the previous sample and reset them
+	void TakeSample(HandshakeSample &sample);
+};
+
+
+} // namespace sphynx
+
+
+} // namespace cat
+
+#endif // CAT_SPHYNX_HANDSHAKE_PIPELINE_HPP
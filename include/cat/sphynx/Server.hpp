@@ -32,6 +32,49 @@
 #include <cat/crypt/cookie/CookieJar.hpp>
 #include <cat/crypt/tunnel/KeyAgreementResponder.hpp>
 #include <cat/sphynx/ConnexionMap.hpp>
+#include <cat/sphynx/HandshakePipeline.hpp>
+
+#if defined(CAT_OS_LINUX) && defined(CAT_SPHYNX_ROAMING_IP)
+# define CAT_SPHYNX_SHARDED_SERVER /* Allow one SO_REUSEPORT socket per worker thread */
+#endif
+
+/*
+	Sharded Sockets
+
+		When the "Sphynx.Server.ShardedSockets" setting is enabled, the
+	server binds one extra socket per worker thread to the same port with
+	SO_REUSEPORT.  A small classic BPF program is attached to the port group
+	that reads the Roaming IP id from the end of each datagram and picks the
+	socket as 1 + (id % worker count).  Connexion ids are handed out by the
+	ConnexionMap so that (id % worker count) is the worker that owns the
+	Connexion, so the datagrams for a Connexion arrive on a socket that only
+	ever feeds that one worker and no per-packet re-binning is needed.
+
+		Datagrams that are too short to carry an id are steered to the
+	original socket, which performs the usual routing and handles the
+	handshake.  Any datagram that lands on the wrong shard (handshakes,
+	stale ids, old kernels without the steering program) is handed back to
+	the Server routing code, so steering is purely an optimization.
+*/
+
+/*
+	Load Balancing
+
+		New connexions go to the worker with the fewest timers, but one
+	busy client can leave a worker saturated while the others idle.  Every
+	"Sphynx.Server.BalanceInterval" milliseconds (default 0, off; try 1000)
+	the Server compares the busy time of each worker thread.  If the
+	busiest worker spent more than "Sphynx.Server.BalanceThreshold" percent
+	of the interval (default 20) longer than the idlest one, the costliest
+	Connexion on the busiest worker that would not overshoot the gap is
+	moved to the idlest worker.  At most one Connexion moves per interval.
+
+		Busy time is the wall time a worker spends outside of its wait,
+	and Connexion cost is the time spent in its receive and tick handlers.
+	See Connexion.hpp for how a move is carried out.  With sharded sockets
+	a moved Connexion keeps its id, so its datagrams land on the shard of
+	its first worker and take the Server routing path.
+*/
 
 namespace cat {
 
@@ -39,9 +82,38 @@ namespace cat {
 namespace sphynx {
 
 
+class Server;
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+
+// Receive socket that feeds a single worker thread
+class CAT_EXPORT ServerShard : public UDPEndpoint
+{
+	friend class Server;
+
+	Server *_server;
+	u32 _worker_id;
+
+public:
+	ServerShard();
+	virtual ~ServerShard();
+
+	CAT_INLINE const char *GetRefObjectName() { return "ServerShard"; }
+
+protected:
+	virtual bool OnFinalize();
+
+	virtual void OnRecvRouting(const BatchSet &buffers);
+};
+
+#endif // CAT_SPHYNX_SHARDED_SERVER
+
+
 class CAT_EXPORT Server : public UDPEndpoint
 {
 	friend class Connexion;
+	friend class ServerShard;
+	friend class HandshakeThread;
 
 	static const int MIN_KERNEL_RECV_BUFFER = 1000000;
 	static const int DEFAULT_KERNEL_RECV_BUFFER = 8000000;
@@ -55,6 +127,45 @@ class CAT_EXPORT Server : public UDPEndpoint
 	KeyAgreementResponder _key_agreement_responder;
 	TunnelPublicKey _public_key;
 	u32 _connect_worker;
+	FlowControlMode _flow_control_mode;
+	u32 _ack_every, _ack_max_delay; // Acknowledgment frequency for new connexions
+	CompressionDictionary *_dictionary; // Shipped to each client, or 0 for none
+	HandshakePipeline _handshakes;
+
+	// Answer a batch of challenges, returns the number of clients connected
+	u32 OnChallenges(ThreadLocalStorage &tls, HandshakeJob **jobs, u32 count);
+
+	// Create the Connexion for a challenge that passed key agreement and post the answer in pkt
+	bool AcceptChallenge(HandshakeJob *job, u8 *pkt, Skein *key_hash);
+
+	// Statistics snapshots, see TransportStats.hpp
+	u32 _stats_interval, _stats_last;
+	std::string _stats_path;
+	Mutex _stats_lock;
+	StatsSnapshot _stats_snapshot; // Protected by _stats_lock
+	bool _stats_valid;
+	StatsWriter _stats_writer;
+	bool _stats_writing; // The writer thread is running
+
+	void TakeStatsSnapshot(u32 now);
+
+	// Load balancing between worker threads, see above
+	static const u32 DEFAULT_BALANCE_INTERVAL = 0; // milliseconds, 0 = off
+	static const u32 DEFAULT_BALANCE_THRESHOLD = 20; // percent of the interval
+
+	u32 _balance_interval, _balance_last, _balance_threshold;
+	u32 _balance_busy[MAX_WORKER_THREADS]; // Worker busy time at the last pass
+
+	void Rebalance(u32 now);
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+	ServerShard *_shards[MAX_WORKER_THREADS];
+	u32 _shard_count;
+
+	bool StartShards(Port port, bool request_ip6, bool require_ip4, int kernelReceiveBufferBytes);
+	bool AttachShardSteering(u32 shard_count);
+	void StopShards();
+#endif
 
 	bool PostConnectionCookie(const NetAddr &dest);
 	bool PostConnectionError(const NetAddr &dest, SphynxError err);
@@ -69,6 +180,9 @@ public:
 
 	bool StartServer(Port port, TunnelKeyPair &key_pair, const char *session_key, ThreadLocalStorage *tls = 0);
 
+	// Copy the latest statistics snapshot.  Returns false if none has been taken yet
+	bool GetStatsSnapshot(StatsSnapshot &snapshot);
+
 protected:
 	// Must return a new instance of your Connexion derivation
 	virtual Connexion *NewConnexion() = 0;
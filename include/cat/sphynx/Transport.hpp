@@ -31,11 +31,14 @@
 
 #include <cat/threads/Thread.hpp>
 #include <cat/threads/Mutex.hpp>
+#include <cat/threads/Atomic.hpp>
 #include <cat/crypt/tunnel/AuthenticatedEncryption.hpp>
 #include <cat/parse/BufferStream.hpp>
 #include <cat/time/Clock.hpp>
 #include <cat/math/BitMath.hpp>
 #include <cat/sphynx/FlowControl.hpp>
+#include <cat/sphynx/CompressionDictionary.hpp>
+#include <cat/sphynx/TransportStats.hpp>
 #include <cat/sphynx/Collexion.hpp>
 
 namespace cat {
@@ -79,7 +82,7 @@ namespace sphynx {
 		SOP: Super opcodes:
 				0=Internal (any)
 				1=Data (reliable or unreliable)
-				2=Fragment (reliable)
+				2=Fragment (reliable) or Latest-only (unreliable)
 				3=ACK (unreliable)
 		C: 1=BHI byte is sent. 0=BHI byte is not sent and is assumed to be 0.
 
@@ -238,12 +241,86 @@ namespace sphynx {
 
 	WriteOOB, WriteUnreliable, WriteReliable, FlushImmediately
 
+	WriteReliable and WriteUnreliable do not take any locks.  They push the
+	message onto a per-connexion SendInbox (the ZeroCopy variants push the
+	caller's OutgoingMessage buffer as-is), and the worker thread moves the
+	inbox contents into the send cluster the next time it flushes.  WriteOOB
+	bypasses the send cluster entirely.
+
 	Locks should always be held for a minimal amount of time, never to include
 	invocations of the IO layer functions that actually transmit data.  Ideally
 	locks should also be held for a constant amount of time that does not grow
 	with the number of items to be processed.
 */
 
+/*
+	Pacing
+
+	Flow control decides how many bytes may leave each time the transport
+	flushes, but most flushes happen on the 10 ms worker tick.  Without pacing
+	a whole tick of bandwidth would go out in one burst and overflow shallow
+	router queues.
+
+	FlushWrites() appends finished datagrams to a pacing queue, and
+	ReleasePacedDatagrams() writes only those due to depart within
+	PACING_QUANTUM_USEC of the present.  Departure times are spaced in
+	microseconds by datagram size over FlowControl::GetPacingRate(), plus some
+	headroom so the pacer smooths the flow control budget without limiting it.
+	The remainder waits for a one-shot worker wakeup at the next departure
+	time, via SchedulePacingWakeup().
+
+	OOB messages, huge data and MTU probes bypass the pacer.
+*/
+
+/*
+	Acknowledgment Frequency
+
+	Acknowledging every reliable datagram as it arrives would double the
+	datagram rate of a receive-heavy connexion, so acknowledgments are
+	decimated.  An ACK is written when any of these happen:
+
+		+ ACK-every-N datagrams carrying reliable messages have arrived
+		+ The first unacknowledged one has waited the maximum ACK delay
+		  (checked on each tick)
+		+ A hole opens or closes in a stream, or a duplicate arrives,
+		  since the sender needs to hear about those right away
+
+	While holes remain, the ranges are repeated once per maximum ACK delay.
+
+	The policy starts from the "Sphynx.Server.AckEvery" and
+	"Sphynx.Server.AckMaxDelay" settings (or the Client equivalents) and may
+	be changed by the remote host: RequestACKFrequency() sends an
+	IOP_ACK_FREQUENCY message, and the receiver adopts the requested values
+	after clamping them to its limits.  A sender that needs faster feedback
+	can ask for it, and one that tolerates slower feedback can spare the
+	receiver some ACK traffic.  Older peers ignore the request.
+
+	TransportStats counts ACKs sent and datagrams carrying reliable
+	messages received, so the ACK-to-data ratio shows up in snapshots.
+*/
+
+/*
+	Latest-only Channels
+
+	State updates such as positions only matter until the next one arrives.
+	Sending them reliably wastes bandwidth on retransmitting stale data, and
+	sending them as plain unreliable messages lets a late datagram overwrite
+	newer state.
+
+	WriteLatest() posts an unreliable message on one of MAX_LATEST_CHANNELS
+	channels.  It is sent with R=0 and SOP_LATEST, and its data part starts
+	with a three byte header:
+
+		CHANNEL(1) || SEQUENCE(2, little-endian) || MESSAGE
+
+	The sender assigns sequence numbers per channel as the worker writes the
+	messages into the send cluster, and if several messages on one channel
+	are waiting in the unreliable inbox only the newest is written.  The
+	receiver delivers a message only if its sequence number is newer than
+	the last one delivered on that channel, so stale and duplicate datagrams
+	are dropped.  Older peers ignore unreliable SOP_LATEST messages.
+*/
+
 /*
 	Graceful Disconnection
 
@@ -267,6 +344,29 @@ namespace sphynx {
 	OnDisconnectReason() callback is invoked.
 */
 
+/*
+	Memory Layout
+
+	A server holds one Transport per connexion, so its size decides how
+	many connexions fit in memory and how many cache lines a tick touches.
+
+	The fields read on every datagram and tick are declared first so they
+	share the first cache lines of the object: the ACK-ID counters,
+	acknowledgment state, disconnect state and pacing state.  The send
+	inboxes that other threads write to come next, away from the hot
+	fields, followed by state used only while sending or retransmitting.
+
+	Per-stream reassembly, out of order, send and sent list state lives in
+	a StreamState allocated the first time a stream stores something, so a
+	connexion pays only for the streams it uses.  The send cluster
+	workspace is held only between the first write and the next flush.
+	Handshake data kept by the Connexion is freed once the client is heard
+	from over the tunnel.
+
+	The fixed and lazily allocated sizes are reported in each statistics
+	snapshot (see TransportStats.hpp) and logged when the server starts.
+*/
+
 
 // A queue of messages to transmit
 struct SendQueue
@@ -280,6 +380,113 @@ struct SendQueue
 };
 
 
+/*
+	SendInbox
+
+		A lock-free multi-producer single-consumer stack of outgoing
+	messages.  Any thread may Push() a message, and the worker thread that
+	owns the connexion takes the whole stack with PopAll(), which hands it
+	back oldest first.
+
+		Since the consumer only ever takes the entire stack, there is no
+	ABA hazard on pop.  The generation tag exists only because Atomic::CAS2
+	is the pointer-sized compare-and-swap available on every platform.
+	Where CAS2 is not available the inbox falls back to a shared mutex.
+*/
+
+#if defined(CAT_WORD_64)
+# define CAT_SEND_INBOX_ALIGNMENT 16
+#else
+# define CAT_SEND_INBOX_ALIGNMENT 8
+#endif
+
+struct CAT_ALIGNED(CAT_SEND_INBOX_ALIGNMENT) SendInbox
+{
+#if defined(CAT_WORD_64)
+	typedef u64 Tag;
+#else
+	typedef u32 Tag;
+#endif
+
+	OutgoingMessage * volatile head;
+	Tag tag;
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+	Mutex *lock; // Shared per-worker lock
+#endif
+
+	CAT_INLINE void Push(OutgoingMessage *node)
+	{
+#if defined(CAT_NO_ATOMIC_CAS2)
+		lock->Enter();
+		node->next = head;
+		head = node;
+		lock->Leave();
+#else
+		SendInbox expected, replacement;
+
+		CAT_FOREVER
+		{
+			expected.tag = tag;
+			expected.head = head;
+
+			node->next = expected.head;
+
+			replacement.head = node;
+			replacement.tag = expected.tag + 1;
+
+			if (Atomic::CAS2(this, &expected, &replacement))
+				break;
+		}
+#endif
+	}
+
+	// Returns the oldest message or 0 if empty, and sets tail to the newest
+	CAT_INLINE OutgoingMessage *PopAll(OutgoingMessage *&tail)
+	{
+		OutgoingMessage *node;
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+		lock->Enter();
+		node = head;
+		head = 0;
+		lock->Leave();
+#else
+		SendInbox expected, replacement;
+
+		CAT_FOREVER
+		{
+			expected.tag = tag;
+			expected.head = head;
+
+			node = expected.head;
+			if (!node) break;
+
+			replacement.head = 0;
+			replacement.tag = expected.tag + 1;
+
+			if (Atomic::CAS2(this, &expected, &replacement))
+				break;
+		}
+#endif
+
+		// Reverse the stack into arrival order
+		OutgoingMessage *prev = 0;
+		tail = node;
+
+		while (node)
+		{
+			OutgoingMessage *next = node->next;
+			node->next = prev;
+			prev = node;
+			node = next;
+		}
+
+		return prev;
+	}
+};
+
+
 // A doubly-linked version of the above queue for the sent list
 struct SentList : SendQueue
 {
@@ -294,27 +501,167 @@ struct SentList : SendQueue
 struct OutOfOrderQueue
 {
 	/*
-		An alternative to a skip list is a huge preallocated
-		circular buffer.  The memory space required for this
-		is really prohibitive.  It would be 1 GB for 1k users
-		for a window of 32k packets.  With this skip list
-		approach I can achieve good average case efficiency
-		with just 48 bytes overhead.
-
-		If the circular buffer grows with demand, then it
-		requires a lot of additional overhead for allocation.
-		And the advantage over a skip list becomes less clear.
-
-		In the worst case it may take longer to walk the list
-		on insert and an attacker may be able to slow down the
-		server by sending a lot of swiss cheese.  So I limit
-		the number of loops allowed through the wait list to
-		bound the processing time.
+		A circular window indexed by ACK-ID modulo its capacity,
+		with a bitmap marking which slots hold an arrival.  It
+		starts empty and doubles on demand up to the out of order
+		limit, so an idle stream costs 16 bytes and a stream that
+		sees heavy loss pays only for the span it is waiting on.
+
+		Every stored id lies within capacity of the next expected
+		id, so each id maps to a unique slot.  Insertion, removal
+		and duplicate detection are O(1), and the ACK writer finds
+		runs of arrivals by scanning bitmap words with BSF.
 	*/
-	RecvQueue *head;	// Head of skip list
+	static const u32 MIN_CAPACITY = 64; // Must be a power of two and at least 64
+
+	RecvQueue **slots;	// Ring of stored messages
+	u32 *arrived;		// One bit per slot, set when the slot holds a message
+	u32 capacity;		// Number of slots, a power of two or zero
 	u32 size;			// Number of elements
 
 	CAT_INLINE void FreeMemory();
+
+	// Make room for ids up to expected_id + span - 1
+	bool Grow(u32 expected_id, u32 span);
+
+	// Bytes allocated for the window
+	CAT_INLINE u32 GetBytes() { return capacity * (u32)sizeof(RecvQueue*) + capacity / 8; }
+
+	CAT_INLINE bool Contains(u32 id)
+	{
+		u32 bit = id & (capacity - 1);
+		return capacity && (arrived[bit >> 5] & ((u32)1 << (bit & 31)));
+	}
+
+	CAT_INLINE void Insert(RecvQueue *node);
+	CAT_INLINE RecvQueue *Remove(u32 id);
+
+	// Returns the first id in [id, end) whose arrival bit equals the flag, or end
+	u32 Scan(u32 id, u32 end, bool arrival);
+};
+
+// Send state: Retransmission deadlines for the sent lists
+struct RetransmitWheel
+{
+	/*
+		A hierarchical timer wheel holding every message in the sent
+		lists, keyed on the time it is due for retransmission.  Three
+		levels of 16 slots cover 8 ms, 128 ms and 2 second spans, for a
+		horizon of about 32 seconds.  Later deadlines are parked at the
+		horizon and filed again when they cascade down.
+
+		Scheduling and removal are O(1) since each message links itself
+		into its slot.  Advancing only touches the slots that have come
+		due, so a tick costs the same however many messages are in
+		flight.
+
+		Deadlines are rounded up to the next slot so a message never
+		fires early.  If the flow control timeout has grown by the time
+		a message fires, it is simply scheduled again.
+	*/
+	static const u32 RESOLUTION_SHIFT = 3; // 8 ms per level 0 slot
+	static const u32 SLOT_BITS = 4;
+	static const u32 SLOTS = 1 << SLOT_BITS;
+	static const u32 SLOT_MASK = SLOTS - 1;
+	static const u32 LEVELS = 3;
+	static const u32 HORIZON = 1 << (SLOT_BITS * LEVELS); // In level 0 slots
+
+	OutgoingMessage *slots[LEVELS][SLOTS];
+	u32 current;	// Last level 0 slot time processed
+	u32 count;		// Number of scheduled messages
+
+	CAT_INLINE void Clear()
+	{
+		CAT_OBJCLR(slots);
+		current = 0;
+		count = 0;
+	}
+
+	// Schedule a message that is not already scheduled
+	void Schedule(OutgoingMessage *node, u32 now, u32 expire);
+
+	// Remove a message if it is scheduled
+	CAT_INLINE void Remove(OutgoingMessage *node)
+	{
+		OutgoingMessage **pprev = node->wheel_pprev;
+
+		if (pprev)
+		{
+			OutgoingMessage *next = node->wheel_next;
+
+			*pprev = next;
+			if (next) next->wheel_pprev = pprev;
+
+			node->wheel_pprev = 0;
+			--count;
+		}
+	}
+
+	// Returns messages that have come due, linked through wheel_next and no longer scheduled
+	OutgoingMessage *Advance(u32 now);
+
+private:
+	void Place(OutgoingMessage *node, u32 t);
+};
+
+// Per-stream state that only the owning worker touches, allocated on first use
+struct StreamState
+{
+	RecvFrag fragment;			// Receive state: Fragment being reassembled
+	OutOfOrderQueue recv_wait;	// Receive state: Messages waiting for an earlier ACK-ID
+	SendQueue sending_queue;	// Send state: Messages that are being sent
+	SentList sent_list;			// Send state: Messages waiting to be acknowledged
+
+	CAT_INLINE void Clear() { CAT_OBJCLR(*this); }
+};
+
+// Receive state: Pooled buffers for fragment reassembly
+struct ReassemblyPool
+{
+	/*
+		Fragmented messages are reassembled in place in buffers drawn
+		from size-classed free lists, kept per worker in TransportTLS,
+		so clients sending 2-60 KB messages do not churn the general
+		heap from every worker.  Size classes are powers of two from
+		1 KB to 64 KB.  Released buffers are kept until a class holds
+		MAX_FREE_PER_CLASS of them or the pool holds MAX_POOLED_BYTES,
+		and beyond that they go back to the heap.
+
+		Only the owning worker thread touches the pool.  Buffers are
+		allocated with new[], so a Transport destroyed on another thread
+		can return its partial buffers straight to the heap.
+	*/
+	static const u32 MIN_CLASS_BITS = 10; // 1 KB
+	static const u32 MAX_CLASS_BITS = 16; // 64 KB, enough for MAX_MESSAGE_SIZE
+	static const u32 CLASS_COUNT = MAX_CLASS_BITS - MIN_CLASS_BITS + 1;
+	static const u32 MAX_FREE_PER_CLASS = 16;
+	static const u32 MAX_POOLED_BYTES = 1024 * 1024;
+
+	u8 *free_buffers[CLASS_COUNT][MAX_FREE_PER_CLASS];
+	u32 free_count[CLASS_COUNT];
+	u32 pooled_bytes;
+
+	static CAT_INLINE u32 GetClass(u32 bytes)
+	{
+		if (bytes <= ((u32)1 << MIN_CLASS_BITS)) return 0;
+		return BSR32(bytes - 1) + 1 - MIN_CLASS_BITS;
+	}
+
+	static CAT_INLINE u32 GetClassBytes(u32 size_class) { return (u32)1 << (size_class + MIN_CLASS_BITS); }
+
+	CAT_INLINE void Clear()
+	{
+		CAT_OBJCLR(free_count);
+		pooled_bytes = 0;
+	}
+
+	void FreeMemory();
+
+	// Returns a buffer with room for at least the given number of bytes, or 0 if out of memory
+	u8 *Acquire(u32 bytes);
+
+	// Bytes must be the number passed to Acquire()
+	void Release(u8 *buffer, u32 bytes);
 };
 
 /*
@@ -348,13 +695,29 @@ struct TransportTLS : ITLS
 
 	sphynx::IncomingMessage delivery_queue[DELIVERY_QUEUE_DEPTH];
 	u32 delivery_queue_depth;
-	u8 *free_list[DELIVERY_QUEUE_DEPTH*2]; // Twice as many to handle compressed fragments
+	struct FragFree
+	{
+		u8 *buffer;
+		u32 bytes; // Size requested from the pool
+	};
+
+	FragFree free_list[DELIVERY_QUEUE_DEPTH*2]; // Twice as many to handle compressed fragments
 	u32 free_list_count;
 
+	// Fragment reassembly buffers
+	ReassemblyPool frag_pool;
+
+	// Dictionary compression: The send side is guarded by the send cluster
+	// lock, and the receive side is only touched by the owning worker
+	DictionaryWorkspace send_dict_workspace;
+	DictionaryWorkspace recv_dict_workspace;
+
 	struct TransportLocks
 	{
 		Mutex send_cluster_lock;
-		Mutex send_queue_lock;
+#if defined(CAT_NO_ATOMIC_CAS2)
+		Mutex send_inbox_lock;
+#endif
 	};
 
 	TransportLocks locks;
@@ -399,74 +762,138 @@ class CAT_EXPORT Transport
 	static const u32 FRAG_THRESHOLD = 32; // Minimum fragment size; used elsewhere as a kind of "fuzz factor" for edges of packets
 	static const u32 FRAG_HEADER_BYTES = 2 + 2;
 
+	// Broadcast messages longer than the smallest possible payload are compressed once up front
+	static const u32 SHARED_COMPRESS_THRESHOLD = MINIMUM_MTU - IPV6_HEADER_BYTES - UDP_HEADER_BYTES - SPHYNX_OVERHEAD;
+
+	// Datagrams due to depart within this window of the present are written together
+	static const u32 PACING_QUANTUM_USEC = 1000;
+
+	// Pace 1/4 faster than flow control allows so the pacer only spreads its budget out
+	static const u32 PACING_HEADROOM_SHIFT = 2;
+
+	// Latest-only channel message header: CHANNEL(1) || SEQUENCE(2)
+	static const u32 LATEST_HEADER_BYTES = 1 + 2;
+
+	// Most bytes a connexion may hold in partially reassembled messages, two of the largest
+	static const u32 MAX_REASSEMBLY_BYTES = 2 * 65536;
+
 	// This is 4 times larger than the encryption out of order limit to match max expectations
-	static const u32 OUT_OF_ORDER_LIMIT = 4096; // Stop acknowledging out of order packets after caching this many
-	static const u32 OUT_OF_ORDER_LOOPS = 32; // Max number of loops looking for the insertion point for out of order arrivals
+	static const u32 OUT_OF_ORDER_LIMIT = 4096; // Stop acknowledging out of order packets this far ahead of the next expected id
+
+	//// Hot state: Touched on every datagram and tick, see Memory Layout above
 
 	// Transport thread local storage object pointer
 	TransportTLS *_ttls;
 
 	// These are initialized by SetTLS()
-	Mutex *_send_cluster_lock;
-	Mutex *_send_queue_lock;
+	Mutex * volatile _send_cluster_lock;
+
+	// Enter the send cluster lock, even if MigrateTLS() is swapping it.  Returns the lock held
+	Mutex *LockSendCluster();
+
+	// Per-stream state, allocated by GetStream() on first use
+	StreamState *_streams[NUM_STREAMS];
 
 	// Receive state: Next expected ack id to receive
 	u32 _next_recv_expected_id[NUM_STREAMS];
 
+	// Send state: Next ack id to use
+	u32 _next_send_id[NUM_STREAMS];
+
+	// Send state: Last rollup ack id from remote receiver
+	u32 _send_next_remote_expected[NUM_STREAMS];
+
 	// Receive state: Synchronization objects
 	bool _got_reliable[NUM_STREAMS];
 
-	// Receive state: Fragmentation
-	RecvFrag _fragments[NUM_STREAMS]; // Fragments for each stream
+	// Receive state: Acknowledgment decimation
+	bool _ack_immediate;	// Set when a hole or duplicate needs acknowledging right away
+	u32 _ack_pending;		// Datagrams carrying reliable messages since the last acknowledgment
+	u32 _ack_due;			// Time by which the next acknowledgment must be written
 
-	// Receive state: Out of order packets waiting for an earlier ACK_ID to be processed
-	OutOfOrderQueue _recv_wait[NUM_STREAMS];
+	// Receive state: Acknowledgment policy
+	u32 _ack_every;		// Acknowledge after this many datagrams carrying reliable messages
+	u32 _ack_max_delay;	// Milliseconds an acknowledgment may be held back
 
-	// Send state: Next ack id to use
-	u32 _next_send_id[NUM_STREAMS];
+	// true = no longer connected
+	u8 _disconnect_countdown; // When it hits zero, will called RequestShutdown() and close the socket
+	u8 _disconnect_reason; // DISCO_CONNECTED = still connected
 
 	// Send state: Flush after processing incoming data
 	volatile bool _send_flush_after_processing;
 
-	// Send state: Last rollup ack id from remote receiver
-	u32 _send_next_remote_expected[NUM_STREAMS];
+	// Send state: Set while a pacing wakeup is scheduled with the worker
+	volatile u32 _pace_wakeup_pending;
+	u64 _pace_next_usec; // Departure time of the next paced datagram
 
-	// Send state: Writes combined into a send cluster
-	// Protected by _send_cluster_lock
-	SendCluster _send_cluster;
+	// Receive state: Bytes held in reassembly buffers, up to MAX_REASSEMBLY_BYTES
+	u32 _frag_bytes;
 
-	// Send state: Queue of messages that are waiting to be sent
-	// Protected by _send_queue_lock
-	SendQueue _send_queue[NUM_STREAMS];
+	// Send state: Retransmission deadlines for every message in the sent lists
+	RetransmitWheel _retransmit_wheel;
 
-	// Send state: Queue of messages that are being sent
-	SendQueue _sending_queue[NUM_STREAMS];
+	// Returns the state of a stream, allocating it if needed, or 0 if out of memory
+	StreamState *GetStream(u32 stream);
 
-	// Send state: List of messages that are waiting to be acknowledged
-	SentList _sent_list[NUM_STREAMS];
+	// Returns the state of a stream, or an empty one that must not be modified
+	CAT_INLINE StreamState *PeekStream(u32 stream) { return _streams[stream] ? _streams[stream] : &_idle_stream; }
 
-	CAT_INLINE void RetransmitNegative(u32 recv_time, u32 stream, u32 last_ack_id, u32 &loss_count);
-	static void FreeSentNode(OutgoingMessage *node);
+	// Stands in for streams that have not stored anything yet
+	static StreamState _idle_stream;
+
+	//// Shared state: Written by other threads
+
+	// Send state: Reliable messages posted from any thread, waiting to be sent
+	SendInbox _send_inbox[NUM_STREAMS];
+
+	// Send state: Unreliable messages posted from any thread, waiting for a flush
+	SendInbox _unreliable_inbox;
+
+	// Statistics for monitoring, see TransportStats.hpp
+	TransportStats _stats;
+
+	//// Send state: Protected by _send_cluster_lock
+
+	// Writes combined into a send cluster
+	SendCluster _send_cluster;
 
 	// Queue of outgoing datagrams for batched output
-	// Protected by _send_cluster_lock
 	BatchSet _outgoing_datagrams;
 	u32 _outgoing_datagrams_count;
 
+	// Datagrams waiting for their departure time at the pacing rate
+	BatchSet _paced_datagrams;
+
+	//// Cold state
+
+	// Send state: Sequence number of the last message written on each latest-only channel
+	u16 _latest_send_seq[MAX_LATEST_CHANNELS];
+
+	// Receive state: Sequence number of the last message delivered on each latest-only channel
+	u16 _latest_recv_seq[MAX_LATEST_CHANNELS];
+
+	// Returns the time at which a sent message should be retransmitted if not acknowledged
+	CAT_INLINE u32 GetRetransmitTime(u32 stream, OutgoingMessage *node);
+
+	CAT_INLINE void RetransmitNegative(u32 recv_time, u32 stream, u32 last_ack_id, u32 &loss_count);
+	static void FreeSentNode(OutgoingMessage *node);
+
+	// Write paced datagrams that are due and schedule a wakeup for the rest
+	void ReleasePacedDatagrams();
+
 #if defined(CAT_TRANSPORT_RANDOMIZE_LENGTH)
 	void RandPadDatagram(u8 *data, u32 &data_bytes);
 #endif // CAT_TRANSPORT_RANDOMIZE_LENGTH
 
 	void QueueWriteDatagram(SendCluster &cluster);
 
-	// true = no longer connected
-	u8 _disconnect_countdown; // When it hits zero, will called RequestShutdown() and close the socket
-	u8 _disconnect_reason; // DISCO_CONNECTED = still connected
+	u32 RetransmitLost(u32 now); // Returns estimated number of lost packets, touching only expired messages
 
-	u32 RetransmitLost(u32 now); // Returns estimated number of lost packets
+	// Queue a reassembly buffer for release after delivery
+	CAT_INLINE void QueueFragFree(u8 *data, u32 bytes);
 
-	// Queue a fragment for freeing
-	CAT_INLINE void QueueFragFree(u8 *data);
+	// Release reassembly buffers after delivery
+	CAT_INLINE void ReleaseQueuedFrags();
 
 	// Queue received data for user processing
 	void QueueDelivery(u32 stream, u8 *data, u32 data_bytes);
@@ -491,10 +918,17 @@ class CAT_EXPORT Transport
 	// Returns true if send cluster is still locked
 	bool WriteQueuedReliable();
 
+	// Write unreliable messages from the inbox into the send cluster
+	void WriteQueuedUnreliable();
+
 	void Retransmit(u32 stream, OutgoingMessage *node, u32 now); // Does not hold the send lock!
 	void WriteACK();
+
+	// Write an acknowledgment if any reliable messages need one, and reset decimation
+	void SendACK(u32 now);
 	void OnACK(u32 recv_time, u8 *data, u32 data_bytes);
 	void OnFragment(u32 recv_time, u8 *data, u32 bytes, u32 stream);
+	void OnLatest(u8 *data, u32 bytes);
 
 public:
 	Transport();
@@ -504,12 +938,21 @@ public:
 	bool InitializeTransportSecurity(bool is_initiator, AuthenticatedEncryption &auth_enc);
 	void InitializeTLS(TransportTLS *tls);
 
+	// Switch to the TransportTLS of another worker.  Only call from the old
+	// owning worker between datagram batches, when the delivery queue is empty
+	void MigrateTLS(TransportTLS *tls);
+	bool InitializeFlowControl(FlowControlMode mode);
+
 	// Copy data directly to the send buffer, no need to acquire an OutgoingMessage
 	bool WriteOOB(u8 msg_opcode, const void *msg_data = 0, u32 msg_bytes = 0, SuperOpcode super_opcode = SOP_DATA);
 	bool WriteUnreliable(u8 msg_opcode, const void *msg_data = 0, u32 msg_bytes = 0, SuperOpcode super_opcode = SOP_DATA);
+
+	// Unreliable, but stale messages are dropped and unflushed ones are replaced by newer ones on the same channel
+	// 0 <= channel < MAX_LATEST_CHANNELS
+	bool WriteLatest(u32 channel, u8 msg_opcode, const void *msg_data = 0, u32 msg_bytes = 0);
 	bool WriteReliable(StreamMode stream, u8 msg_opcode, const void *msg_data = 0, u32 msg_bytes = 0, SuperOpcode super_opcode = SOP_DATA);
 
-	// Broadcast version
+	// Broadcast version: Payload is built once and shared by all recipients
 	static bool BroadcastReliable(BinnedConnexionSubset &subset, StreamMode stream, u8 msg_opcode, const void *msg_data = 0, u32 msg_bytes = 0, SuperOpcode super_opcode = SOP_DATA);
 
 	// Helper connexion-criterion version
@@ -541,6 +984,12 @@ public:
 	// msg_bytes: Includes message opcode byte at offset 0
 	bool WriteReliableZeroCopy(StreamMode stream, u8 *msg, u32 msg_bytes, SuperOpcode super_opcode = SOP_DATA);
 
+	// Queue up an unreliable message for delivery without copy overhead
+	// msg: Allocate with OutgoingMessage::Acquire(msg_bytes)
+	// msg_bytes: Includes message opcode byte at offset 0
+	// super_opcode: Any but SOP_LATEST, which is reserved for WriteLatest()
+	bool WriteUnreliableZeroCopy(u8 *msg, u32 msg_bytes, SuperOpcode super_opcode = SOP_DATA);
+
 	// Queue up a huge message for delivery without copy overhead
 	// msg: Allocate with SendBuffer::Acquire(msg_bytes)
 	// 1 <= msg_bytes <= _max_payload_bytes
@@ -550,6 +999,12 @@ public:
 	// Flush send buffer after processing the current message from the remote host
 	CAT_INLINE void FlushAfter() { _send_flush_after_processing = true; }
 
+	// Set how often this side acknowledges reliable messages, clamped to the limits
+	void SetACKFrequency(u32 ack_every, u32 max_delay);
+
+	// Ask the remote host to acknowledge our reliable messages this often
+	bool RequestACKFrequency(u32 ack_every, u32 max_delay);
+
 	// Flush send buffer immediately, don't try to blob.
 	// Try to use FlushAfter() unless you really see benefit from this!
 	void FlushWrites();
@@ -563,9 +1018,21 @@ public:
 
 	CAT_INLINE u32 GetMaxPayloadBytes() { return _max_payload_bytes; }
 
+	// Lock-free statistics, readable from any thread
+	CAT_INLINE TransportStats &GetStats() { return _stats; }
+
+	// Fill in the Transport part of the memory footprint
+	static void GetFootprint(ConnexionFootprint &footprint);
+
 	// Write this to the first byte of a huge zero copy
 	static const u8 HUGE_HEADER_BYTE = (u8)((SOP_INTERNAL << SOP_SHIFT) | I_MASK | (1 & BLO_MASK));
 
+	// Acknowledgment frequency defaults and limits
+	static const u32 DEFAULT_ACK_EVERY = 16; // Datagrams
+	static const u32 MAX_ACK_EVERY = 255;
+	static const u32 DEFAULT_ACK_MAX_DELAY = 20; // Milliseconds
+	static const u32 MAX_ACK_MAX_DELAY = 200;
+
 protected:
 	// Maximum transfer unit (MTU) in UDP payload bytes, excluding _udpip_bytes
 	u32 _max_payload_bytes;
@@ -573,12 +1040,26 @@ protected:
 	// Overhead bytes: UDP/IP headers
 	u32 _udpip_bytes;
 
-	// Send state: Flow control
-	FlowControl _send_flow;
+	// Send state: Flow control, created by InitializeFlowControl()
+	FlowControl *_send_flow;
 
 	// Huge endpoint of upstream/downstream data
 	IHugeEndpoint *_huge_endpoint;
 
+	// Compression dictionary for incoming datagrams, or 0 if none
+	CompressionDictionary *_recv_dictionary;
+
+	// Compression dictionary for outgoing datagrams, set once the remote host holds it
+	CompressionDictionary * volatile _send_dictionary;
+
+	// Each may be set only once; the transport keeps its own reference
+	bool SetRecvDictionary(CompressionDictionary *dict);
+	bool SetSendDictionary(CompressionDictionary *dict);
+
+	// Decompress a DGRAM_LZ4_DICT datagram from the owning worker
+	// Returns the number of bytes written to out, or <= 0 if invalid or no dictionary is set
+	s32 DecompressDictionary(const u8 *data, u32 bytes, u8 *out, u32 out_limit);
+
 	CAT_INLINE u8 GetDisconnectReason() { return _disconnect_reason; }
 
 	virtual void OnDisconnectComplete() = 0;
@@ -586,6 +1067,12 @@ protected:
 	// Return the number of bytes written across all datagrams or 0 for error
 	virtual s32 WriteDatagrams(const BatchSet &buffers, u32 count) = 0;
 
+	// Arrange for OnPacingWakeup() to be called at the given time, or return false
+	virtual bool SchedulePacingWakeup(u32 when) = 0;
+
+	// Called by the derived class when a pacing wakeup fires
+	void OnPacingWakeup();
+
 	virtual void OnMessages(IncomingMessage msgs[], u32 count) = 0;
 	virtual void OnInternal(u32 recv_time, BufferStream msg, u32 bytes) = 0; // precondition: bytes > 0
 	virtual void OnDisconnectReason(u8 reason) = 0; // Called to help explain why a disconnect is happening
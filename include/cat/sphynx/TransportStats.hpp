@@ -0,0 +1,264 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_SPHYNX_TRANSPORT_STATS_HPP
+#define CAT_SPHYNX_TRANSPORT_STATS_HPP
+
+#include <cat/sphynx/Common.hpp>
+#include <cat/net/Sockets.hpp>
+#include <cat/threads/Thread.hpp>
+#include <cat/threads/WaitableFlag.hpp>
+#include <cat/threads/Mutex.hpp>
+#include <ostream>
+#include <string>
+
+namespace cat {
+
+
+namespace sphynx {
+
+
+/*
+	Transport Statistics
+
+	Each Transport keeps a TransportStats block of volatile 32-bit words,
+	so readers on other threads never take a lock.  Fields written only on
+	the receive path and by the tick are plain stores from the worker
+	thread.  Everything the send path touches is updated with Atomic::Add,
+	because FlushWrites() is public and may run on an application thread
+	at the same time as the worker, as may the Write*() calls.  Readers may
+	see a block that is a tick old, and a set of fields read together is
+	not a consistent cut, which is fine for monitoring.
+
+	Counters are totals since connect that wrap at 2^32, so readers should
+	take differences between two samples.  Most gauges are sampled by the
+	worker once per tick; in_flight_bytes is instead kept current by every
+	send and acknowledgment.
+
+	The Server aggregates the blocks of all of its connexions into a
+	StatsSnapshot every "Sphynx.Server.StatsInterval" milliseconds (0 to
+	disable, the default).  The latest snapshot is available from
+	Server::GetStatsSnapshot(), and when "Sphynx.Server.StatsFile" is set
+	each snapshot is also appended to that file as text by a StatsWriter
+	thread, so a slow disk never holds up the worker taking snapshots.  If
+	the writer falls behind, only the newest unwritten snapshot is kept.
+*/
+
+// Counters that the aggregator differences between snapshots
+struct TransportCounters
+{
+	u32 datagrams_sent, bytes_sent;		// Including OOB, excluding UDP/IP headers
+	u32 datagrams_recv, bytes_recv;		// After decryption and decompression
+	u32 reliable_sent;					// Reliable messages or fragments written for the first time
+	u32 retransmits;					// Reliable messages or fragments written again
+	u32 losses;							// Loss events reported to flow control
+	u32 reliable_recv;					// Datagrams received carrying reliable messages
+	u32 acks_sent;						// Acknowledgments written
+	u32 compress_in, compress_out;		// Datagram bytes before and after compression
+};
+
+struct TransportStats
+{
+	// Counters: Written by the worker thread, or with Atomic::Add where noted
+	volatile u32 datagrams_sent, bytes_sent; // Atomic
+	volatile u32 datagrams_recv, bytes_recv;
+	volatile u32 reliable_posted; // Atomic
+	volatile u32 reliable_dequeued; // Atomic
+	volatile u32 reliable_sent; // Atomic
+	volatile u32 retransmits; // Atomic
+	volatile u32 losses; // Atomic
+	volatile u32 reliable_recv;
+	volatile u32 acks_sent;
+	volatile u32 compress_in, compress_out; // Atomic
+
+	// Gauge: Kept current with Atomic::Add on each send and acknowledgment
+	volatile u32 in_flight_bytes;	// Reliable bytes waiting for acknowledgment
+
+	// Gauges: Sampled by the worker thread on each tick
+	volatile u32 rtt;				// Smoothed round trip time in milliseconds
+	volatile u32 pacing_rate;		// Flow control rate in bytes per second
+	volatile u32 out_of_order;		// Reliable messages waiting for an earlier ACK-ID
+	volatile u32 heap_bytes;		// Lazily allocated transport memory, see ConnexionFootprint
+
+	// Written only by the aggregator
+	TransportCounters last_sample;
+
+	CAT_INLINE void Clear() { CAT_OBJCLR(*this); }
+
+	// Messages posted but not yet written to the wire
+	CAT_INLINE u32 GetSendQueueDepth() { return reliable_posted - reliable_dequeued; }
+
+	// Called only by the aggregator: Counter changes since the previous call
+	void TakeSample(TransportCounters &delta);
+};
+
+
+// Histogram with power-of-two buckets
+struct StatsHistogram
+{
+	// Bucket 0 counts zeroes and bucket n counts values in [2^(n-1), 2^n)
+	static const u32 BUCKETS = 33;
+
+	u32 counts[BUCKETS];
+	u32 total;
+
+	CAT_INLINE void Clear() { CAT_OBJCLR(*this); }
+
+	void Add(u32 value);
+
+	// Returns the upper bound of the bucket holding the given percentile
+	u32 GetPercentile(u32 percent) const;
+
+	void Write(std::ostream &out, const char *name) const;
+};
+
+
+// Handshake stage activity over a snapshot interval, see HandshakePipeline.hpp
+struct HandshakeSample
+{
+	u32 answered;				// Challenges that produced a connexion
+	u32 rejected;				// Challenges that were invalid or could not be completed
+	u32 shed;					// Challenges turned away because the queue was full
+	u32 batches;				// Batches handed to the key agreement responder
+	u32 queue_depth;			// Challenges waiting when the sample was taken
+	StatsHistogram queue_usec;	// Microseconds from queueing to the start of key agreement
+
+	CAT_INLINE void Clear() { CAT_OBJCLR(*this); }
+};
+
+
+// Memory held by each connexion
+struct ConnexionFootprint
+{
+	u32 connexion_bytes;	// Connexion base object, including the Transport
+	u32 transport_bytes;	// Transport part of it
+	u32 encryption_bytes;	// AuthenticatedEncryption part of it
+	u32 stream_bytes;		// Allocated for each stream the first time it stores something
+	u32 workspace_bytes;	// Send cluster workspace, held from the first write until the flush
+	u32 handshake_bytes;	// Handshake data, held until the client is heard from over the tunnel
+
+	CAT_INLINE void Clear() { CAT_OBJCLR(*this); }
+
+	void Write(std::ostream &out) const;
+};
+
+
+// Statistics of one connexion over a snapshot interval
+struct ConnexionSample
+{
+	u32 id;
+	NetAddr addr;
+	u32 worker_id;
+
+	u32 rtt, pacing_rate;
+	u32 send_queue, out_of_order, in_flight_bytes;
+	u32 heap_bytes;
+
+	TransportCounters delta;
+
+	// Loss events per thousand reliable messages or fragments sent
+	u32 GetLossPermille() const;
+};
+
+
+// Server-wide statistics aggregated over a snapshot interval
+struct StatsSnapshot
+{
+	// Number of worst connexions kept in each snapshot
+	static const u32 PROBLEM_CLIENTS = 8;
+
+	u32 time;			// Local time in milliseconds when taken
+	u32 interval;		// Milliseconds covered by the deltas
+	u32 connexions;
+
+	TransportCounters total;
+
+	StatsHistogram rtt;
+	StatsHistogram loss_permille;
+	StatsHistogram retransmits;
+	StatsHistogram send_queue;
+	StatsHistogram out_of_order;
+	StatsHistogram in_flight_bytes;
+	StatsHistogram pacing_rate;
+	StatsHistogram heap_bytes;
+
+	// Fixed sizes, set before adding connexions, and memory held by all of them
+	ConnexionFootprint footprint;
+	u64 memory_bytes;
+
+	HandshakeSample handshakes;
+
+	// Connexions with the highest loss, then the highest RTT
+	ConnexionSample problems[PROBLEM_CLIENTS];
+	u32 problem_count;
+
+	void Clear();
+
+	// Accumulate one connexion into the snapshot
+	void Add(const ConnexionSample &sample);
+
+	// Human-readable "name value" lines
+	void Write(std::ostream &out) const;
+};
+
+
+// Appends snapshots to a file from its own thread
+class CAT_EXPORT StatsWriter : public Thread
+{
+	std::string _path;
+	WaitableFlag _wake_flag;
+	volatile bool _kill_flag;
+
+	Mutex _lock;
+	StatsSnapshot _pending; // Protected by _lock
+	bool _has_pending;
+	u32 _replaced;
+
+	virtual bool Entrypoint(void *param);
+
+public:
+	StatsWriter();
+	CAT_INLINE virtual ~StatsWriter() {}
+
+	// Returns false if the thread could not be started
+	bool Start(const char *path);
+
+	// Write any snapshot still pending and stop the thread
+	void Stop();
+
+	// Queue a snapshot to be appended, replacing one that is still unwritten
+	void Post(const StatsSnapshot &snapshot);
+};
+
+
+} // namespace sphynx
+
+
+} // namespace cat
+
+#endif // CAT_SPHYNX_TRANSPORT_STATS_HPP
@@ -70,6 +70,10 @@ public:
 	{
 		return _client->WriteUnreliable(msg_opcode, msg_data, msg_bytes);
 	}
+	inline bool WriteLatest(unsigned int channel, unsigned char msg_opcode, const unsigned char *msg_data, unsigned int msg_bytes)
+	{
+		return _client->WriteLatest(channel, msg_opcode, msg_data, msg_bytes);
+	}
 	inline bool WriteReliable(unsigned int stream, unsigned char msg_opcode, const unsigned char *msg_data, unsigned int msg_bytes)
 	{
 		return _client->WriteReliable((cat::sphynx::StreamMode)stream, msg_opcode, msg_data, msg_bytes);
@@ -0,0 +1,120 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_EPOCH_GATE_HPP
+#define CAT_EPOCH_GATE_HPP
+
+#include <cat/Platform.hpp>
+
+namespace cat {
+
+
+/*
+	class EpochGate
+
+	Lets many reader threads walk a shared structure without taking a lock,
+	while writers (serialized by their own lock) unlink objects and defer
+	freeing them until no reader can still be looking at them.
+
+	Readers bracket each walk with Enter() and Leave().  Each thread is
+	assigned one of MAX_SLOTS cache-line sized slots the first time it
+	enters, so a reader only touches its own cache line and the read-mostly
+	epoch counter.  A slot holds reader counts for the even and odd epochs.
+
+	A writer that unlinks an object files it under the parity of the
+	current epoch, then calls TryAdvance().  The epoch can only advance
+	once no reader is left in the previous epoch, so after a successful
+	advance to epoch N, everything filed under the parity of N (two epochs
+	ago) is unreachable and may be freed.  Readers are short so two advances
+	usually succeed back to back.
+*/
+class CAT_EXPORT EpochGate
+{
+public:
+	static const u32 MAX_SLOTS = 64;
+
+private:
+	struct Slot
+	{
+		volatile u32 readers[2];
+		u8 padding[CAT_DEFAULT_CACHE_LINE_SIZE - sizeof(u32) * 2];
+	};
+
+	volatile u32 _epoch;
+	u8 _padding[CAT_DEFAULT_CACHE_LINE_SIZE - sizeof(u32)];
+
+	Slot _slots[MAX_SLOTS];
+
+public:
+	EpochGate();
+
+	CAT_INLINE u32 GetEpoch() { return _epoch; }
+
+	// Returns a ticket to pass to Leave()
+	u32 Enter();
+	void Leave(u32 ticket);
+
+	// Writers must serialize calls to this function
+	// Returns true if the epoch advanced
+	bool TryAdvance();
+};
+
+
+//// AutoEpoch
+
+class AutoEpoch
+{
+	EpochGate *_gate;
+	u32 _ticket;
+
+public:
+	CAT_INLINE AutoEpoch(EpochGate &gate)
+	{
+		_gate = &gate;
+		_ticket = gate.Enter();
+	}
+
+	CAT_INLINE ~AutoEpoch()
+	{
+		Release();
+	}
+
+	CAT_INLINE void Release()
+	{
+		if (_gate)
+		{
+			_gate->Leave(_ticket);
+			_gate = 0;
+		}
+	}
+};
+
+
+} // namespace cat
+
+#endif // CAT_EPOCH_GATE_HPP
@@ -61,6 +61,14 @@ struct WorkerTimer
 	WorkerTimerDelegate callback;
 };
 
+// A one-shot wakeup that fires between worker ticks
+struct WorkerWakeup
+{
+	RefObject *object;
+	WorkerTimerDelegate callback;
+	u32 when;
+};
+
 
 enum WorkQueuePriorities
 {
@@ -85,6 +93,9 @@ class CAT_EXPORT WorkerThread : public Thread
 	WaitableFlag _event_flag;
 	volatile bool _kill_flag;
 
+	// Microseconds spent processing rather than waiting, wraps at 2^32
+	volatile u32 _busy_usec;
+
 	WorkerThreadQueue _workqueues[WQPRIO_COUNT];
 
 	// Thread-safe array of new timers to add to the running array
@@ -98,16 +109,36 @@ class CAT_EXPORT WorkerThread : public Thread
 
 	void TickTimers(u32 now); // locks if needed
 
+	// Thread-safe array of pending one-shot wakeups
+	Mutex _wakeups_lock;
+	WorkerWakeup *_wakeups;
+	u32 _wakeups_count, _wakeups_allocated;
+	volatile u32 _next_wakeup; // Earliest wakeup time, valid while _wakeups_count > 0
+
+	// Wakeups being fired, only touched by the worker thread
+	WorkerWakeup *_firing;
+	u32 _firing_allocated;
+
+	void FireWakeups(u32 now, u32 retry_delay); // locks
+
 public:
 	WorkerThread();
-	CAT_INLINE virtual ~WorkerThread() {}
+	virtual ~WorkerThread();
 
 	CAT_INLINE u32 GetTimerCount() { return _timers_count + _new_timers_count; }
+	CAT_INLINE u32 GetBusyTime() { return _busy_usec; }
 	CAT_INLINE void FlagEvent() { _event_flag.Set(); }
 	CAT_INLINE void SetKillFlag() { _kill_flag = true; }
 
 	void DeliverBuffers(u32 priority, const BatchSet &buffers);
 	bool Associate(RefObject *object, WorkerTimerDelegate callback);
+
+	// Remove the timer of an object and release its reference
+	// Must be called from this worker's thread, outside of a timer callback
+	bool Dissociate(RefObject *object);
+
+	// Run callback once at the given millisecond time, even between ticks
+	bool ScheduleWakeup(RefObject *object, WorkerTimerDelegate callback, u32 when);
 };
 
 
@@ -135,6 +166,9 @@ public:
 
 	u32 FindLeastPopulatedWorker();
 
+	// Microseconds the worker has spent processing, wraps at 2^32.  Take differences between samples
+	CAT_INLINE u32 GetBusyTime(u32 worker_id) { return _workers[worker_id].GetBusyTime(); }
+
 	template<class T>
 	bool InitializeTLS()
 	{
@@ -181,6 +215,17 @@ public:
 	{
 		return _workers[worker_id].Associate(object, timer);
 	}
+
+	// Must be called from the thread of the given worker, outside of a timer callback
+	CAT_INLINE bool RemoveTimer(u32 worker_id, RefObject *object)
+	{
+		return _workers[worker_id].Dissociate(object);
+	}
+
+	CAT_INLINE bool ScheduleWakeup(u32 worker_id, RefObject *object, WorkerTimerDelegate callback, u32 when)
+	{
+		return _workers[worker_id].ScheduleWakeup(object, callback, when);
+	}
 };
 
 
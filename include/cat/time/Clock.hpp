@@ -40,6 +40,10 @@ class CAT_EXPORT Clock : public RefSingleton<Clock>
 	bool OnInitialize();
 	void OnFinalize();
 
+	// Simulated time in microseconds, used instead of the system clock when virtual
+	volatile bool _virtual;
+	double _virtual_usec;
+
 #ifdef CAT_OS_WINDOWS
 	// Windows version requires some initialization
 	static const int LOWEST_ACCEPTABLE_PERIOD = 10;
@@ -55,6 +59,12 @@ public:
 	double usec();				// Timestamp in microseconds
 	static u32 cycles();		// Timestamp in cycles
 
+	// From now on msec() and usec() report the given simulated time instead
+	// of the system clock, and only move when this is called again.  Used by
+	// the NetworkSimulator to make a simulated run repeatable
+	void SetVirtualTime(double usec);
+	CAT_INLINE bool IsVirtual() { return _virtual; }
+
     static std::string format(const char *format_string);
 
     static void sleep(u32 milliseconds);
@@ -0,0 +1,196 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_URING_IO_THREADS_HPP
+#define CAT_URING_IO_THREADS_HPP
+
+#include <cat/threads/Thread.hpp>
+#include <cat/threads/Mutex.hpp>
+#include <cat/net/Sockets.hpp>
+#include <cat/mem/BufferAllocator.hpp>
+#include <cat/lang/LinkedLists.hpp>
+#include <cat/lang/RefSingleton.hpp>
+#include <liburing.h>
+
+/*
+	io_uring completion backend
+
+	Enabled on Linux by defining CAT_IO_URING.  This is a drop-in for the
+	Windows IOCP layer in cat/iocp/ and follows the same contract: requests
+	carry an IOType tag in their iointernal overhead, and completions are
+	gathered in batches by an IOThread and dispatched per object.
+
+	Each IOThreadPool owns one ring and one completion thread, since the
+	completion queue of a ring has a single consumer.  Submissions may come
+	from any thread and are serialized by the pool.
+
+	The completion batch size is read from "IO.IOThreadPool.MaxIOGather"
+	and the ring size from "IO.IOThreadPool.RingEntries".
+*/
+
+namespace cat {
+
+
+class IOThread;
+class IOThreadPool;
+class IOThreadPools;
+class UDPEndpoint;
+class AsyncFile;
+
+enum IOType
+{
+	IOTYPE_UDP_SEND,
+	IOTYPE_UDP_RECV,
+	IOTYPE_FILE_WRITE,
+	IOTYPE_FILE_READ
+};
+
+
+// An associator object
+class CAT_EXPORT IOThreadsAssociator
+{
+public:
+	CAT_INLINE virtual ~IOThreadsAssociator() {}
+
+	virtual int GetHandle() = 0;
+};
+
+
+struct UringOverlapped
+{
+	// A value from enum IOType
+	u32 io_type;
+
+	// Object that submitted the request
+	IOThreadsAssociator *associator;
+};
+
+// Filled in from the multishot receive header after completion
+struct UringOverlappedRecvFrom
+{
+	int addr_len;
+	sockaddr_in6 addr;
+};
+
+struct UringOverlappedSendTo : UringOverlapped
+{
+	// Must stay pinned until the send completes
+	msghdr msg;
+	iovec iov;
+
+	int addr_len;
+	sockaddr_in6 addr;
+};
+
+typedef UringOverlappedRecvFrom IOLayerRecvOverhead;
+typedef UringOverlappedSendTo IOLayerSendOverhead;
+
+struct UringOverlappedFile : UringOverlapped
+{
+	u64 offset;
+};
+
+typedef UringOverlappedFile IOLayerReadOverhead;
+typedef UringOverlappedFile IOLayerWriteOverhead;
+
+static const u32 IOTHREADS_BUFFER_READ_BYTES = 1472; // Largest UDP payload in a 1500 byte IPv4 frame
+static const u32 IOTHREADS_BUFFER_COUNT = 10000;
+
+
+// io_uring completion thread
+class CAT_EXPORT IOThread : public Thread
+{
+	CAT_INLINE bool HandleCompletion(io_uring_cqe *cqe, u32 event_msec,
+		BatchSet &sendq, UDPEndpoint *&prev_send_endpoint, u32 &send_count,
+		BatchSet &recvq, UDPEndpoint *&prev_recv_endpoint, u32 &recv_count, u32 &recv_releases);
+
+	CAT_INLINE void FlushRecvQueue(BatchSet &recvq, UDPEndpoint *&prev_recv_endpoint, u32 &recv_count, u32 &recv_releases);
+
+	virtual bool Entrypoint(void *vmaster);
+
+public:
+	CAT_INLINE virtual ~IOThread() {}
+};
+
+
+// One ring and its completion thread
+class CAT_EXPORT IOThreadPool : public DListItem
+{
+	friend class IOThread;
+
+	static const u32 DEFAULT_RING_ENTRIES = 1024;
+	static const u32 MIN_RING_ENTRIES = 64;
+	static const u32 MAX_RING_ENTRIES = 32768;
+
+	io_uring _ring;
+	bool _ring_valid;
+
+	Mutex _submit_lock;
+
+	IOThread _worker;
+
+public:
+	IOThreadPool();
+
+	CAT_INLINE io_uring *GetRing() { return &_ring; }
+
+	bool Startup();
+	bool Shutdown();
+
+	// Grab a submission entry.  Must hold the submit lock.
+	// Flushes the submission queue if it is full.  Returns 0 on failure
+	io_uring_sqe *GetSQE();
+
+	CAT_INLINE void EnterSubmit() { _submit_lock.Enter(); }
+	CAT_INLINE void LeaveSubmit() { io_uring_submit(&_ring); _submit_lock.Leave(); }
+};
+
+
+// A collection of IOThreadPools
+class CAT_EXPORT IOThreadPools : public RefSingleton<IOThreadPools>
+{
+	bool OnInitialize();
+	void OnFinalize();
+
+	Mutex _lock;
+	DListForward _private_pools;
+	typedef DListForward::Iterator<IOThreadPool> pools_iter;
+
+	IOThreadPool _shared_pool;
+
+public:
+	IOThreadPool *AssociatePrivate(IOThreadsAssociator *associator);
+	bool DissociatePrivate(IOThreadPool *pool);
+
+	CAT_INLINE IOThreadPool *GetSharedPool() { return &_shared_pool; }
+};
+
+
+} // namespace cat
+
+#endif // CAT_URING_IO_THREADS_HPP
@@ -0,0 +1,121 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CAT_URING_UDP_ENDPOINT_HPP
+#define CAT_URING_UDP_ENDPOINT_HPP
+
+#include <cat/net/Sockets.hpp>
+#include <cat/lang/RefObject.hpp>
+#include <cat/mem/IAllocator.hpp>
+#include <cat/uring/IOThreadPools.hpp>
+
+/*
+	Receives use a single multishot recvmsg() request that stays armed,
+	drawing from a ring of provided buffers carved out of UDPRecvAllocator.
+	Each completion names the buffer it filled, which is swapped out of
+	the ring for a fresh one and handed up to OnRecvRouting.
+
+	The kernel writes an io_uring_recvmsg_out header and the source
+	address ahead of the payload, so the provided region starts inside
+	the RecvBuffer header and the payload is moved down to the usual
+	trailing bytes position once the address has been copied out.
+
+	The number of provided buffers is read from the
+	"IO.UDPEndpoint.ProvidedBuffers" setting.
+*/
+
+namespace cat {
+
+
+class IOLayer;
+struct RecvBuffer;
+struct SendBuffer;
+
+
+// Number of receive buffers kept in the provided buffer ring
+static const u32 UDP_PROVIDED_BUFFERS = 256;
+static const u32 UDP_MAX_PROVIDED_BUFFERS = 4096;
+
+
+// Object that represents a UDP endpoint bound to a single port
+class CAT_EXPORT UDPEndpoint : public RefObject, public IOThreadsAssociator, public UDPSocket
+{
+	friend class IOThread;
+
+	IOThreadPool *_pool;
+
+	// Multishot receive state, only touched by the completion thread
+	UringOverlapped _recv_ov;
+	msghdr _recv_msg;
+	io_uring_buf_ring *_buf_ring;
+	RecvBuffer **_provided;
+	u32 _provided_count;
+	u32 _provided_missing;
+	bool _recv_armed;
+
+	bool SetupBufferRing();
+	void FreeBufferRing();
+	void ReplenishBuffers();
+	bool PostMultishotRecv();
+
+	// Sets terminated when the multishot request ended; the caller then owes one ReleaseRef()
+	RecvBuffer *OnRecvCompletion(s32 result, u32 flags, u32 event_msec, bool &terminated);
+	void OnRecvBatch(const BatchSet &buffers, u32 count);
+
+public:
+    UDPEndpoint();
+    virtual ~UDPEndpoint();
+
+	CAT_INLINE const char *GetRefObjectName() { return "UDPEndpoint"; }
+	CAT_INLINE int GetHandle() { return GetSocket(); }
+
+	bool Initialize(Port port = 0, bool ignoreUnreachable = true, bool RequestIPv6 = true, bool RequireIPv4 = true, int kernelReceiveBufferBytes = 0, bool reusePort = false);
+
+	// If SupportsIPv6() == true, the address must be promoted to IPv6
+	// before calling using addr.PromoteTo6()
+	bool Write(const BatchSet &buffers, u32 count, const NetAddr &addr);
+
+	bool Write(u8 *data, u32 data_bytes, const NetAddr &addr);
+
+	// When done with read buffers, call this function to add them back to the available pool
+	void ReleaseRecvBuffers(BatchSet buffers, u32 count);
+
+protected:
+	void SetRemoteAddress(RecvBuffer *buffer);
+
+	virtual void OnRecvRouting(const BatchSet &buffers) = 0;
+
+	virtual bool OnInitialize();
+	virtual void OnDestroy();
+	virtual bool OnFinalize();
+};
+
+
+} // namespace cat
+
+#endif // CAT_URING_UDP_ENDPOINT_HPP
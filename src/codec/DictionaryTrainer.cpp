@@ -0,0 +1,194 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/codec/DictionaryTrainer.hpp>
+#include <algorithm>
+using namespace cat;
+using namespace std;
+
+static const u32 INVALID_KMER = ~(u32)0;
+
+struct TrainedSegment
+{
+	u32 offset;
+	u64 score;
+
+	CAT_INLINE bool operator<(const TrainedSegment &rhs) const { return score < rhs.score; }
+};
+
+
+//// DictionaryTrainer
+
+u32 DictionaryTrainer::HashKmer(const u8 *data)
+{
+	u64 x = 0;
+
+	for (u32 ii = 0; ii < KMER_BYTES; ++ii)
+		x = (x << 8) | data[ii];
+
+	return (u32)((x * 0x9E3779B97F4A7C15ULL) >> (64 - TABLE_BITS));
+}
+
+void DictionaryTrainer::AddSample(const void *data, u32 bytes)
+{
+	if (bytes == 0) return;
+
+	const u8 *sample = reinterpret_cast<const u8*>( data );
+
+	_corpus.insert(_corpus.end(), sample, sample + bytes);
+	_sample_ends.push_back((u32)_corpus.size());
+}
+
+bool DictionaryTrainer::Train(u32 max_bytes, vector<u8> &dictionary)
+{
+	dictionary.clear();
+
+	u32 sample_count = (u32)_sample_ends.size();
+	u32 corpus_bytes = (u32)_corpus.size();
+
+	if (sample_count < 2 || corpus_bytes < SEGMENT_BYTES || max_bytes < SEGMENT_BYTES)
+		return false;
+
+	// Hash each k-mer that lies entirely inside one sample
+	vector<u32> kmers(corpus_bytes, INVALID_KMER);
+	vector<u32> frequency((size_t)1 << TABLE_BITS, 0);
+	vector<u32> last_sample((size_t)1 << TABLE_BITS, INVALID_KMER);
+
+	for (u32 sample = 0, begin = 0; sample < sample_count; ++sample)
+	{
+		u32 end = _sample_ends[sample];
+
+		for (u32 pos = begin; pos + KMER_BYTES <= end; ++pos)
+		{
+			u32 h = HashKmer(&_corpus[pos]);
+			kmers[pos] = h;
+
+			// Count each k-mer once per sample
+			if (last_sample[h] != sample)
+			{
+				last_sample[h] = sample;
+				++frequency[h];
+			}
+		}
+
+		begin = end;
+	}
+
+	// K-mers seen in only one message do not help compress any other
+	for (u32 ii = 0, count = (u32)frequency.size(); ii < count; ++ii)
+		if (frequency[ii] < 2)
+			frequency[ii] = 0;
+
+	u32 epochs = max_bytes / SEGMENT_BYTES;
+	u32 epoch_bytes = corpus_bytes / epochs;
+	if (epoch_bytes < SEGMENT_BYTES)
+	{
+		epoch_bytes = SEGMENT_BYTES;
+		epochs = corpus_bytes / SEGMENT_BYTES;
+	}
+
+	const u32 window_kmers = SEGMENT_BYTES - KMER_BYTES + 1;
+
+	vector<TrainedSegment> segments;
+
+	// For each epoch,
+	for (u32 epoch = 0; epoch < epochs; ++epoch)
+	{
+		u32 begin = epoch * epoch_bytes;
+		u32 end = (epoch + 1 == epochs) ? corpus_bytes : begin + epoch_bytes;
+
+		TrainedSegment best;
+		best.offset = begin;
+		best.score = 0;
+
+		u64 score = 0;
+
+		// Slide a segment-sized window across the epoch, summing k-mer scores
+		for (u32 pos = begin; pos + KMER_BYTES <= end; ++pos)
+		{
+			if (kmers[pos] != INVALID_KMER)
+				score += frequency[kmers[pos]];
+
+			// If window has filled,
+			if (pos >= begin + window_kmers)
+			{
+				u32 old = pos - window_kmers;
+				if (kmers[old] != INVALID_KMER)
+					score -= frequency[kmers[old]];
+			}
+
+			u32 start = pos + 1 >= window_kmers ? pos + 1 - window_kmers : 0;
+			if (start < begin) continue;
+
+			if (score > best.score && start + SEGMENT_BYTES <= corpus_bytes)
+			{
+				best.score = score;
+				best.offset = start;
+			}
+		}
+
+		if (best.score == 0)
+			continue;
+
+		// Kept k-mers score nothing in later epochs
+		for (u32 pos = best.offset; pos < best.offset + window_kmers; ++pos)
+			if (kmers[pos] != INVALID_KMER)
+				frequency[kmers[pos]] = 0;
+
+		segments.push_back(best);
+	}
+
+	if (segments.empty())
+		return false;
+
+	// Best segments go last, closest to the data
+	stable_sort(segments.begin(), segments.end());
+
+	u32 total = (u32)segments.size() * SEGMENT_BYTES;
+	u32 skip = total > max_bytes ? (total - max_bytes + SEGMENT_BYTES - 1) / SEGMENT_BYTES : 0;
+
+	for (u32 ii = skip; ii < (u32)segments.size(); ++ii)
+	{
+		const u8 *segment = &_corpus[segments[ii].offset];
+		dictionary.insert(dictionary.end(), segment, segment + SEGMENT_BYTES);
+	}
+
+	return true;
+}
+
+bool DictionaryTrainer::GenerateDictionary(u32 max_bytes, std::ostream &osout)
+{
+	vector<u8> dictionary;
+
+	if (!Train(max_bytes, dictionary))
+		return false;
+
+	osout.write(reinterpret_cast<const char*>( &dictionary[0] ), dictionary.size());
+
+	return !osout.fail();
+}
@@ -167,12 +167,9 @@ bool KeyAgreementResponder::Initialize(TunnelTLS *tls, TunnelKeyPair &key_pair)
     return true;
 }
 
-bool KeyAgreementResponder::ProcessChallenge(TunnelTLS *tls,
-											 const u8 *initiator_challenge, int challenge_bytes,
-                                             u8 *responder_answer, int answer_bytes, Skein *key_hash)
+bool KeyAgreementResponder::ComputeSharedPoint(TunnelTLS *tls, const u8 *initiator_challenge,
+											   u8 *responder_answer, Skein *key_hash, Leg *shared_point)
 {
-	CAT_DEBUG_ENFORCE(tls && tls->Valid() && challenge_bytes == KeyBytes*2 && answer_bytes == KeyBytes*4);
-
 	BigTwistedEdwards *math = tls->Math();
 	FortunaOutput *csprng = tls->CSPRNG();
 
@@ -245,14 +242,18 @@ bool KeyAgreementResponder::ProcessChallenge(TunnelTLS *tls,
 	while (!math->Less(T, math->GetCurveQ()))
 		math->Subtract(T, math->GetCurveQ(), T);
 
-	// T = AffineX(T * hA)
-	math->PtMultiply(hA, T, 0, S);
-    math->SaveAffineX(S, T);
+	// shared_point = T * hA
+	math->PtMultiply(hA, T, 0, shared_point);
 
+	return true;
+}
+
+bool KeyAgreementResponder::FinishAnswer(const u8 *shared_x, u8 *responder_answer, Skein *key_hash)
+{
 	// k = H(d,T)
 	if (!key_hash->BeginKDF())
 		return false;
-	key_hash->Crunch(T, KeyBytes);
+	key_hash->Crunch(shared_x, KeyBytes);
 	key_hash->End();
 
 	// Generate responder proof of key
@@ -267,6 +268,79 @@ bool KeyAgreementResponder::ProcessChallenge(TunnelTLS *tls,
 	return true;
 }
 
+bool KeyAgreementResponder::ProcessChallenge(TunnelTLS *tls,
+											 const u8 *initiator_challenge, int challenge_bytes,
+                                             u8 *responder_answer, int answer_bytes, Skein *key_hash)
+{
+	CAT_DEBUG_ENFORCE(tls && tls->Valid() && challenge_bytes == KeyBytes*2 && answer_bytes == KeyBytes*4);
+
+	BigTwistedEdwards *math = tls->Math();
+
+    Leg *S = math->Get(8);
+    Leg *T = math->Get(12);
+
+	if (!ComputeSharedPoint(tls, initiator_challenge, responder_answer, key_hash, S))
+		return false;
+
+	// T = AffineX(S)
+    math->SaveAffineX(S, T);
+
+	return FinishAnswer((const u8*)T, responder_answer, key_hash);
+}
+
+int KeyAgreementResponder::ProcessChallengeBatch(TunnelTLS *tls, int count,
+												 const u8 * const *initiator_challenges, int challenge_bytes,
+												 u8 * const *responder_answers, int answer_bytes,
+												 Skein *key_hashes, bool *results)
+{
+	CAT_DEBUG_ENFORCE(tls && tls->Valid() && count <= MAX_CHALLENGE_BATCH && challenge_bytes == KeyBytes*2 && answer_bytes == KeyBytes*4);
+
+	BigTwistedEdwards *math = tls->Math();
+	const int point_legs = math->PtLegs();
+
+	CAT_DEBUG_ENFORCE(point_legs <= MAX_LEGS * 4);
+
+	// Projective (X,Y,T,Z) shared points, and their affine X coordinates
+	Leg points[MAX_CHALLENGE_BATCH * MAX_LEGS * 4];
+	Leg shared_x[MAX_CHALLENGE_BATCH * MAX_LEGS];
+	Leg scratch[MAX_CHALLENGE_BATCH * MAX_LEGS];
+	const Leg *valid_points[MAX_CHALLENGE_BATCH];
+	void *valid_x[MAX_CHALLENGE_BATCH];
+	int valid_count = 0;
+
+	// The scalar multiplication cannot be shared, so do it for each challenge
+	for (int ii = 0; ii < count; ++ii)
+	{
+		Leg *point = points + valid_count * point_legs;
+
+		results[ii] = ComputeSharedPoint(tls, initiator_challenges[ii], responder_answers[ii], &key_hashes[ii], point);
+
+		if (results[ii])
+		{
+			valid_points[valid_count] = point;
+			valid_x[valid_count] = shared_x + ii * MAX_LEGS;
+			++valid_count;
+		}
+	}
+
+	// T_ii = AffineX(point_ii) for one field inversion instead of one per challenge
+	math->SaveAffineXBatch(valid_points, valid_count, scratch, valid_x);
+
+	int success_count = 0;
+
+	for (int ii = 0; ii < count; ++ii)
+	{
+		if (results[ii])
+		{
+			results[ii] = FinishAnswer((const u8*)(shared_x + ii * MAX_LEGS), responder_answers[ii], &key_hashes[ii]);
+
+			if (results[ii]) ++success_count;
+		}
+	}
+
+	return success_count;
+}
+
 bool KeyAgreementResponder::VerifyInitiatorIdentity(TunnelTLS *tls,
 													const u8 *responder_answer, int answer_bytes,
 													const u8 *proof, int proof_bytes,
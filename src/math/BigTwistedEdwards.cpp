@@ -122,6 +122,7 @@ bool BigTwistedEdwards::LoadVerifyAffineXY(const void *in_x, const void *in_y, L
 #include "edward/io/PtSolveAffineY.inc"
 #include "edward/io/PtValidAffine.inc"
 #include "edward/io/SaveAffineX.inc"
+#include "edward/io/SaveAffineXBatch.inc"
 #include "edward/io/SaveAffineXY.inc"
 #include "edward/addsub/PtAdd.inc"
 #include "edward/addsub/PtNegate.inc"
@@ -45,7 +45,11 @@ BufferAllocator::BufferAllocator(u32 buffer_min_size, u32 buffer_count)
 
 	u32 cacheline_bytes = SystemInfo::ref()->GetCacheLineBytes();
 
+	// Free buffers carry the magazine links
 	const u32 overhead_bytes = sizeof(BatchHead);
+	if (overhead_bytes + buffer_min_size < sizeof(MagazineCache::MagazineHead))
+		buffer_min_size = sizeof(MagazineCache::MagazineHead) - overhead_bytes;
+
 	u32 buffer_bytes = CAT_CEIL(overhead_bytes + buffer_min_size, cacheline_bytes);
 	u32 total_bytes = buffer_count * buffer_bytes;
 	u8 *buffers = (u8*)m_large_allocator->Acquire(total_bytes);
@@ -54,17 +58,17 @@ BufferAllocator::BufferAllocator(u32 buffer_min_size, u32 buffer_count)
 	_buffer_count = buffer_count;
 	_buffers = buffers;
 
-	if (!buffers)
+	if (!buffers || !_cache.Valid())
 	{
 		CAT_FATAL("BufferAllocator") << "Unable to allocate " << buffer_count << " buffers of " << buffer_min_size;
+		if (buffers) m_large_allocator->Release(buffers);
+		_buffers = 0;
 		return;
 	}
 
 	// Construct linked list of free nodes
-	BatchHead *tail = reinterpret_cast<BatchHead*>( buffers );
-
-	_acquire_head = tail;
-	_release_head = 0;
+	BatchHead *head = reinterpret_cast<BatchHead*>( buffers );
+	BatchHead *tail = head;
 
 	for (u32 ii = 1; ii < buffer_count; ++ii)
 	{
@@ -77,6 +81,9 @@ BufferAllocator::BufferAllocator(u32 buffer_min_size, u32 buffer_count)
 
 	tail->batch_next = 0;
 
+	// Fill the depot
+	_cache.Release(BatchSet(head, tail));
+
 	CAT_INFO("BufferAllocator") << "Allocated and marked " << buffer_count << " buffers of " << buffer_min_size;
 }
 
@@ -84,99 +91,12 @@ BufferAllocator::~BufferAllocator()
 {
 	CAT_INFO("BufferAllocator") << "Releasing buffers";
 
-	m_large_allocator->Release(_buffers);
+	if (_buffers) m_large_allocator->Release(_buffers);
 }
 
 u32 BufferAllocator::AcquireBatch(BatchSet &set, u32 count, u32 bytes)
 {
-	u32 ii = 0;
-
-	_acquire_lock.Enter();
-
-	// Select up to count items from the list
-	BatchHead *last = _acquire_head;
-
-	set.head = last;
-
-	if (last)
-	{
-		CAT_FOREVER
-		{
-			BatchHead *next = last->batch_next;
-
-			// If we are done,
-			if (++ii >= count)
-			{
-				_acquire_head = next;
-				_acquire_lock.Leave();
-
-				set.tail = last;
-				last->batch_next = 0;
-				return ii;
-			}
-
-			// If the list ran out,
-			if (!next) break;
-
-			last = next;
-		}
-	}
-
-	// End up here if the acquire list was empty or is empty now
-
-	// If it looks like the release list has more,
-	if (_release_head)
-	{
-		// Escalate lock and steal from release list
-		_release_lock.Enter();
-		BatchHead *next = _release_head;
-		_release_head = 0;
-		_release_lock.Leave();
-
-		if (next)
-		{
-			// Link acquire list to release list
-			// Handle the case where the acquire list was empty
-			if (last) last->batch_next = next;
-			else set.head = next;
-
-			last = next;
-
-			CAT_FOREVER
-			{
-				next = last->batch_next;
-
-				// If we are done,
-				if (++ii >= count)
-				{
-					_acquire_head = next;
-					_acquire_lock.Leave();
-
-					set.tail = last;
-					last->batch_next = 0;
-					return ii;
-				}
-
-				// If the list ran out,
-				if (!next) break;
-
-				last = next;
-			}
-		}
-	}
-
-	_acquire_head = 0;
-	_acquire_lock.Leave();
-
-	set.tail = last;
-
-	if (last)
-	{
-		//last->batch_next = 0;
-		CAT_DEBUG_ENFORCE(!last->batch_next);
-	}
-
-	return ii;
+	return _cache.Acquire(set, count);
 }
 
 void BufferAllocator::ReleaseBatch(const BatchSet &set)
@@ -193,8 +113,5 @@ void BufferAllocator::ReleaseBatch(const BatchSet &set)
 	}
 #endif // CAT_DEBUG
 
-	_release_lock.Enter();
-	set.tail->batch_next = _release_head;
-	_release_head = set.head;
-	_release_lock.Leave();
+	_cache.Release(set);
 }
@@ -0,0 +1,357 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/mem/MagazineCache.hpp>
+#include <cat/port/SystemInfo.hpp>
+#include <cat/io/Log.hpp>
+using namespace cat;
+
+// One plus the slot index assigned to this thread, or zero before first use
+static CAT_TLS u32 m_thread_slot = 0;
+static volatile u32 m_next_slot = 0;
+
+
+//// MagazineCache
+
+MagazineCache::MagazineCache()
+{
+	u32 cacheline_bytes = SystemInfo::ref()->GetCacheLineBytes();
+	if (cacheline_bytes < sizeof(Depot)) cacheline_bytes = sizeof(Depot);
+
+	// Depot gets its own cache line, then each slot gets its own
+	_slot_stride = CAT_CEIL(sizeof(Slot), cacheline_bytes);
+	u32 total_bytes = cacheline_bytes * 2 + _slot_stride * MAX_SLOTS;
+
+	_memory = new (std::nothrow) u8[total_bytes];
+	if (!_memory)
+	{
+		CAT_FATAL("MagazineCache") << "Out of memory";
+		return;
+	}
+
+	u8 *aligned = _memory + cacheline_bytes - ((size_t)_memory % cacheline_bytes);
+
+	_depot = reinterpret_cast<Depot*>( aligned );
+	_depot->top = 0;
+	_depot->tag = 0;
+
+	_slots = aligned + cacheline_bytes;
+
+	for (u32 ii = 0; ii < MAX_SLOTS; ++ii)
+	{
+		Slot *slot = GetSlot(ii);
+
+		slot->busy = 0;
+		slot->count = 0;
+		slot->head = 0;
+		CAT_OBJCLR(slot->stats);
+	}
+}
+
+MagazineCache::~MagazineCache()
+{
+	if (_memory) delete []_memory;
+}
+
+MagazineCache::Slot *MagazineCache::LockSlot()
+{
+	u32 index = m_thread_slot;
+
+	// If this thread has not been assigned a slot yet,
+	if (!index)
+	{
+		index = Atomic::Add(&m_next_slot, 1) % MAX_SLOTS + 1;
+		m_thread_slot = index;
+	}
+
+	Slot *slot = GetSlot(index - 1);
+
+	// Only another thread hashed to the same slot can be holding it
+	u32 spins = 0;
+	while (Atomic::Set(&slot->busy, 1))
+	{
+		do ++spins;
+		while (slot->busy);
+	}
+
+	slot->stats.slot_collisions += spins;
+
+	return slot;
+}
+
+void MagazineCache::PushDepot(Slot *slot, MagazineHead *magazine)
+{
+#if defined(CAT_NO_ATOMIC_CAS2)
+
+	_depot_lock.Enter();
+	magazine->next_magazine = _depot->top;
+	_depot->top = magazine;
+	_depot_lock.Leave();
+
+#else
+
+	Depot expected, replacement;
+
+	CAT_FOREVER
+	{
+		expected.tag = _depot->tag;
+		expected.top = _depot->top;
+
+		magazine->next_magazine = expected.top;
+
+		replacement.top = magazine;
+		replacement.tag = expected.tag + 1;
+
+		if (Atomic::CAS2(_depot, &expected, &replacement))
+			break;
+
+		++slot->stats.depot_retries;
+	}
+
+#endif
+
+	++slot->stats.depot_pushes;
+}
+
+MagazineCache::MagazineHead *MagazineCache::PopDepot(Slot *slot)
+{
+	MagazineHead *magazine;
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+
+	_depot_lock.Enter();
+	magazine = _depot->top;
+	if (magazine) _depot->top = magazine->next_magazine;
+	_depot_lock.Leave();
+
+#else
+
+	Depot expected, replacement;
+
+	CAT_FOREVER
+	{
+		expected.tag = _depot->tag;
+		expected.top = _depot->top;
+
+		magazine = expected.top;
+		if (!magazine) break;
+
+		// May read a buffer that was just popped by another thread, but the tag will not match
+		replacement.top = magazine->next_magazine;
+		replacement.tag = expected.tag + 1;
+
+		if (Atomic::CAS2(_depot, &expected, &replacement))
+			break;
+
+		++slot->stats.depot_retries;
+	}
+
+#endif
+
+	if (magazine)
+		++slot->stats.depot_pops;
+	else
+		++slot->stats.depot_misses;
+
+	return magazine;
+}
+
+void MagazineCache::Steal(Slot *slot)
+{
+	// For each other slot,
+	for (u32 ii = 0; ii < MAX_SLOTS; ++ii)
+	{
+		Slot *other = GetSlot(ii);
+		if (other == slot || !other->head) continue;
+
+		// Never wait on another slot while holding ours
+		if (Atomic::Set(&other->busy, 1))
+			continue;
+
+		BatchHead *head = other->head;
+		u32 count = other->count;
+
+		other->head = 0;
+		other->count = 0;
+
+		UnlockSlot(other);
+
+		// If the slot was emptied before we got to it,
+		if (!head) continue;
+
+		slot->head = head;
+		slot->count = count;
+		slot->stats.steals += count;
+		return;
+	}
+}
+
+u32 MagazineCache::Acquire(BatchSet &set, u32 count)
+{
+	BatchHead *head = 0, *tail = 0;
+	u32 taken = 0;
+
+	Slot *slot = LockSlot();
+
+	while (taken < count)
+	{
+		// If the slot ran dry,
+		if (!slot->head)
+		{
+			MagazineHead *magazine = PopDepot(slot);
+
+			if (magazine)
+			{
+				slot->head = magazine;
+				slot->count = magazine->count;
+			}
+			else
+			{
+				Steal(slot);
+				if (!slot->head) break;
+			}
+		}
+
+		u32 take = count - taken;
+		if (take > slot->count) take = slot->count;
+
+		// Unlink the first take buffers
+		BatchHead *first = slot->head, *last = first;
+		for (u32 ii = 1; ii < take; ++ii)
+			last = last->batch_next;
+
+		slot->head = last->batch_next;
+		slot->count -= take;
+
+		if (tail) tail->batch_next = first;
+		else head = first;
+		tail = last;
+
+		taken += take;
+	}
+
+	UnlockSlot(slot);
+
+	if (tail) tail->batch_next = 0;
+
+	set.head = head;
+	set.tail = tail;
+	return taken;
+}
+
+void MagazineCache::Release(const BatchSet &set)
+{
+	if (!set.head) return;
+
+	Slot *slot = LockSlot();
+
+	// For each buffer,
+	for (BatchHead *next, *node = set.head; node; node = next)
+	{
+		next = (node == set.tail) ? 0 : node->batch_next;
+
+		// Most recently released buffers are handed out first, while still warm
+		node->batch_next = slot->head;
+		slot->head = node;
+
+		// If the slot holds two magazines,
+		if (++slot->count >= 2 * MAGAZINE_SIZE)
+		{
+			// Keep the warm half and send the cold half to the depot
+			BatchHead *keep = slot->head;
+			for (u32 ii = 1; ii < MAGAZINE_SIZE; ++ii)
+				keep = keep->batch_next;
+
+			MagazineHead *magazine = static_cast<MagazineHead*>( keep->batch_next );
+			keep->batch_next = 0;
+
+			magazine->count = slot->count - MAGAZINE_SIZE;
+			slot->count = MAGAZINE_SIZE;
+
+			PushDepot(slot, magazine);
+		}
+	}
+
+	UnlockSlot(slot);
+}
+
+BatchHead *MagazineCache::Drain()
+{
+	BatchSet all;
+	all.Clear();
+
+	if (!_memory) return 0;
+
+	// For each slot,
+	for (u32 ii = 0; ii < MAX_SLOTS; ++ii)
+	{
+		Slot *slot = GetSlot(ii);
+
+		for (BatchHead *next, *node = slot->head; node; node = next)
+		{
+			next = node->batch_next;
+			all.PushBack(node);
+		}
+
+		slot->head = 0;
+		slot->count = 0;
+	}
+
+	// For each magazine,
+	for (MagazineHead *magazine = _depot->top; magazine; magazine = magazine->next_magazine)
+	{
+		for (BatchHead *next, *node = magazine; node; node = next)
+		{
+			next = node->batch_next;
+			all.PushBack(node);
+		}
+	}
+
+	_depot->top = 0;
+
+	return all.head;
+}
+
+void MagazineCache::GetStats(MagazineCacheStats &stats)
+{
+	CAT_OBJCLR(stats);
+
+	if (!_memory) return;
+
+	for (u32 ii = 0; ii < MAX_SLOTS; ++ii)
+	{
+		const MagazineCacheStats &s = GetSlot(ii)->stats;
+
+		stats.slot_collisions += s.slot_collisions;
+		stats.depot_retries += s.depot_retries;
+		stats.depot_pushes += s.depot_pushes;
+		stats.depot_pops += s.depot_pops;
+		stats.depot_misses += s.depot_misses;
+		stats.steals += s.steals;
+	}
+}
@@ -35,25 +35,17 @@ using namespace cat;
 
 ReuseAllocator::ReuseAllocator(u32 buffer_bytes)
 {
+	// Free buffers carry the magazine links
+	if (buffer_bytes < sizeof(MagazineCache::MagazineHead))
+		buffer_bytes = sizeof(MagazineCache::MagazineHead);
+
 	_buffer_bytes = buffer_bytes;
-	_acquire_head = 0;
-	_release_head = 0;
 }
 
 ReuseAllocator::~ReuseAllocator()
 {
 	// For each ready buffer,
-	for (BatchHead *next, *buffer = _acquire_head; buffer; buffer = next)
-	{
-		next = buffer->batch_next;
-
-		// Deallocate
-		u8 *pkt = reinterpret_cast<u8*>( buffer );
-		delete []pkt;
-	}
-
-	// For each free buffer,
-	for (BatchHead *next, *buffer = _release_head; buffer; buffer = next)
+	for (BatchHead *next, *buffer = _cache.Drain(); buffer; buffer = next)
 	{
 		next = buffer->batch_next;
 
@@ -65,66 +57,14 @@ ReuseAllocator::~ReuseAllocator()
 
 void *ReuseAllocator::Acquire(u32 /*bytes*/)
 {
-	bool acquire_lock_held = false;
-
-	// If it looks like the acquire list has more,
-	if (_acquire_head)
-	{
-		acquire_lock_held = true;
-
-		_acquire_lock.Enter();
-
-		BatchHead *last = _acquire_head;
-
-		// If found,
-		if (last)
-		{
-			// Update list
-			BatchHead *next = last->batch_next;
-			_acquire_head = next;
-
-			_acquire_lock.Leave();
-
-			//CAT_WARN("ReuseAllocator") << "Reused an acquire-list buffer of size " << _buffer_bytes;
-
-			return last;
-		}
-	}
-
-	// End up here if the acquire list was empty
-
-	// If it looks like the release list has more,
-	if (_release_head)
-	{
-		// Escalate lock and steal from release list
-		_release_lock.Enter();
-		BatchHead *last = _release_head;
-		_release_head = 0;
-		_release_lock.Leave();
-
-		// If found,
-		if (last)
-		{
-			if (!acquire_lock_held)
-				_acquire_lock.Enter();
-
-			BatchHead *next = last->batch_next;
-			_acquire_head = next;
-
-			_acquire_lock.Leave();
-
-			//CAT_WARN("ReuseAllocator") << "Reused a release-list buffer of size " << _buffer_bytes;
-
-			return last;
-		}
-	}
+	BatchSet set;
 
-	// If need to release lock,
-	if (acquire_lock_held)
-		_acquire_lock.Leave();
+	// If a released buffer is available,
+	if (_cache.Acquire(set, 1))
+		return set.head;
 
-	// Allocate without lock held
-	BatchHead *buffer = reinterpret_cast<BatchHead*>( new u8[_buffer_bytes] );
+	// Otherwise fall back to the heap
+	BatchHead *buffer = reinterpret_cast<BatchHead*>( new (std::nothrow) u8[_buffer_bytes] );
 
 	//CAT_WARN("ReuseAllocator") << "Had to allocate a new buffer of size " << _buffer_bytes;
 
@@ -145,8 +85,5 @@ void ReuseAllocator::ReleaseBatch(const BatchSet &set)
 	}
 #endif // CAT_DEBUG
 
-	_release_lock.Enter();
-	set.tail->batch_next = _release_head;
-	_release_head = set.head;
-	_release_lock.Leave();
+	_cache.Release(set);
 }
@@ -998,7 +998,11 @@ bool DNSClient::OnInitialize()
 	CAT_ENFORCE(_lock.Valid());
 
 	Use(m_worker_threads, m_settings, m_udp_send_allocator);
+#if defined(CAT_OS_WINDOWS) || defined(CAT_IO_URING)
 	Use<IOThreadPools>();
+#else
+	Use<IOThreads>();
+#endif
 
 	// Attempt to get a CSPRNG
 	m_csprng = Use<FortunaFactory>()->Create();
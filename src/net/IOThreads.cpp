@@ -26,263 +26,189 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 
-#include <cat/iocp/IOThreadPools.hpp>
-#include <cat/io/IOLayer.hpp>
-#include <cat/net/Buffers.hpp>
+#include <cat/net/IOThreads.hpp>
+#include <cat/io/Buffers.hpp>
 #include <cat/time/Clock.hpp>
 #include <cat/port/SystemInfo.hpp>
-#include <cat/io/Logging.hpp>
+#include <cat/io/Log.hpp>
 #include <cat/io/Settings.hpp>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
 using namespace cat;
 
-CAT_INLINE bool IOThread::HandleCompletion(IOThreads *master, OVERLAPPED_ENTRY entries[], u32 count, u32 event_msec)
+static IOThreads *m_io_threads = 0;
+static Settings *m_settings = 0;
+static Clock *m_clock = 0;
+static SystemInfo *m_system_info = 0;
+
+
+//// IOThread
+
+bool IOThread::Entrypoint(void *vmaster)
 {
-	bool exit_flag = false;
+	IOThreads *master = reinterpret_cast<IOThreads*>( vmaster );
+	int epoll_fd = master->_epoll_fd;
 
-	BatchSet sendq, recvq;
-	sendq.Clear();
-	recvq.Clear();
+	epoll_event events[IOThreads::MAX_IO_GATHER];
 
-	UDPEndpoint *prev_recv_endpoint = 0;
-	u32 recv_count = 0;
+	u32 max_io_gather = m_settings->getInt("IO.IOThreads.MaxIOGather", IOThreads::MAX_IO_GATHER, 1, IOThreads::MAX_IO_GATHER);
 
-	// For each entry,
-	for (u32 ii = 0; ii < count; ++ii)
+	CAT_FOREVER
 	{
-		UDPEndpoint *udp_endpoint = reinterpret_cast<UDPEndpoint*>( entries[ii].lpCompletionKey );
-		IOCPOverlapped *ov_iocp = reinterpret_cast<IOCPOverlapped*>( entries[ii].lpOverlapped );
-		u32 bytes = entries[ii].dwNumberOfBytesTransferred;
+		int count = epoll_wait(epoll_fd, events, max_io_gather, -1);
 
-		// Terminate thread on zero completion
-		if (!ov_iocp)
+		// If wait failed,
+		if (count < 0)
 		{
-			exit_flag = true;
-			continue;
-		}
-
-		// Based on type of IO,
-		switch (ov_iocp->io_type)
-		{
-		case IOTYPE_UDP_SEND:
-			{
-				SendBuffer *buffer = reinterpret_cast<SendBuffer*>( (u8*)ov_iocp - offsetof(SendBuffer, iointernal.ov) );
+			if (errno == EINTR)
+				continue;
 
-				// Link to sendq
-				if (sendq.tail) sendq.tail->batch_next = buffer;
-				else sendq.head = buffer;
+			CAT_FATAL("IOThreads") << "epoll_wait error " << errno;
+			break;
+		}
 
-				sendq.tail = buffer;
-				buffer->batch_next = 0;
+		u32 event_msec = m_clock->msec();
+		bool exit_flag = false;
 
-				udp_endpoint->ReleaseRef();
-			}
-			break;
+		// For each event,
+		for (int ii = 0; ii < count; ++ii)
+		{
+			IOThreadsAssociator *associator = reinterpret_cast<IOThreadsAssociator*>( events[ii].data.ptr );
 
-		case IOTYPE_UDP_RECV:
+			// Terminate thread on wake event
+			if (!associator)
 			{
-				RecvBuffer *buffer = reinterpret_cast<RecvBuffer*>( (u8*)ov_iocp - offsetof(RecvBuffer, iointernal.ov) );
-
-				// Write event completion results to buffer
-				buffer->data_bytes = bytes;
-				buffer->event_msec = event_msec;
-
-				// If the same UDP endpoint got the last request too,
-				if (prev_recv_endpoint == udp_endpoint)
-				{
-					// Append to recvq
-					recvq.tail->batch_next = buffer;
-					recvq.tail = buffer;
-					++recv_count;
-				}
-				else
-				{
-					// If recvq is not empty,
-					if (recvq.head)
-					{
-						// Finalize the recvq and post it
-						recvq.tail->batch_next = 0;
-						prev_recv_endpoint->OnReadCompletion(recvq, recv_count);
-					}
-
-					// Reset recvq
-					recvq.head = recvq.tail = buffer;
-					recv_count = 1;
-					prev_recv_endpoint = udp_endpoint;
-				}
+				exit_flag = true;
+				continue;
 			}
-			break;
-		}
-	}
 
-	// If recvq is not empty,
-	if (recvq.head)
-	{
-		// Finalize the recvq and post it
-		recvq.tail->batch_next = 0;
-		prev_recv_endpoint->OnReadCompletion(recvq, recv_count);
-	}
+			associator->OnReadiness(events[ii].events, event_msec);
+		}
 
-	// If sendq is not empty,
-	if (sendq.head)
-	{
-		sendq.tail->batch_next = 0;
-		StdAllocator::ii->ReleaseBatch(sendq);
+		if (exit_flag)
+			break;
 	}
 
-	return exit_flag;
+	return true;
 }
 
-void IOThread::UseVistaAPI(IOThreads *master)
-{
-	PGetQueuedCompletionStatusEx pGetQueuedCompletionStatusEx = master->_GetQueuedCompletionStatusEx;
-	HANDLE port = master->_io_port;
 
-	static const u32 MAX_IO_GATHER = 32;
-	OVERLAPPED_ENTRY entries[MAX_IO_GATHER];
-	unsigned long ulEntriesRemoved;
+//// IOThreads
 
-	while (pGetQueuedCompletionStatusEx(port, entries, MAX_IO_GATHER, &ulEntriesRemoved, INFINITE, FALSE))
-	{
-		u32 event_time = Clock::msec();
+CAT_REF_SINGLETON(IOThreads);
 
-		// Quit if we received the quit signal
-		if (HandleCompletion(master, entries, ulEntriesRemoved, event_time))
-			break;
-	}
-}
-
-void IOThread::UsePreVistaAPI(IOThreads *master)
+bool IOThreads::OnInitialize()
 {
-	HANDLE port = master->_io_port;
-
-	DWORD bytes;
-	ULONG_PTR key;
-	LPOVERLAPPED ov;
-
-	static const u32 MAX_IO_GATHER = 4;
-	OVERLAPPED_ENTRY entries[MAX_IO_GATHER];
-	u32 count = 0;
-
-	for (;;)
-	{
-		BOOL bResult = GetQueuedCompletionStatus(port, &bytes, &key, &ov, INFINITE);
-
-		u32 event_time = Clock::msec();
-
-		// Attempt to pull off a number of events at a time
-		do 
-		{
-			entries[count].lpOverlapped = ov;
-			entries[count].lpCompletionKey = key;
-			entries[count].dwNumberOfBytesTransferred = bytes;
-			if (++count >= MAX_IO_GATHER) break;
-
-			bResult = GetQueuedCompletionStatus((HANDLE)port, &bytes, &key, &ov, 0);
-		} while (bResult || ov);
-
-		// Quit if we received the quit signal
-		if (HandleCompletion(master, entries, count, event_time))
-			break;
+	m_io_threads = this;
 
-		count = 0;
-	}
-}
+	_epoll_fd = -1;
+	_wake_fd = -1;
+	_worker_count = 0;
+	_workers = 0;
 
-bool UDPReadThread::ThreadFunction(void *vmaster)
-{
-	UDPThreads *master = reinterpret_cast<UDPThreads*>( vmaster );
+	Use(m_settings, m_clock, m_system_info);
 
-	
+	return IsInitialized() && Startup();
 }
 
-bool UDPWriteThread::ThreadFunction(void *vmaster)
+void IOThreads::OnFinalize()
 {
-	UDPThreads *master = reinterpret_cast<UDPThreads*>( vmaster );
-
-	UDPEndpoint *endpoint = master->GetEndpoint();
-
-	endpoint->DoWrites();
+	Shutdown();
 }
 
-bool UDPThreads::Associate(UDPEndpoint *endpoint)
+bool IOThreads::Startup()
 {
-	_endpoint = endpoint;
-	if (!_writer.StartThread(this)) return false;
-	if (!_reader.StartThread(this)) return false;
-	return true;
-}
+	_epoll_fd = epoll_create(MAX_IO_GATHER);
+	if (_epoll_fd < 0)
+	{
+		CAT_FATAL("IOThreads") << "epoll_create error " << errno;
+		return false;
+	}
 
-void UDPThreads::Shutdown()
-{
-}
+	// Create the wake event, which stays signaled once set so every thread sees it
+	_wake_fd = eventfd(0, 0);
+	if (_wake_fd < 0)
+	{
+		CAT_FATAL("IOThreads") << "eventfd error " << errno;
+		return false;
+	}
 
+	epoll_event ev;
+	CAT_OBJCLR(ev);
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
 
-//// IOThreads
+	if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _wake_fd, &ev))
+	{
+		CAT_FATAL("IOThreads") << "Unable to watch wake event: epoll_ctl error " << errno;
+		return false;
+	}
 
-IOThreads::IOThreads()
-{
-	_recv_allocator = 0;
-}
+	// Initialize the worker count to the number of processors
+	u32 worker_count = m_system_info->GetProcessorCount();
+	if (worker_count < 1) worker_count = 1;
 
-IOThreads::~IOThreads()
-{
-	Shutdown();
-}
+	// If worker count override is set,
+	u32 worker_count_override = m_settings->getInt("IO.IOThreads.WorkerCount", 0);
+	if (worker_count_override != 0)
+	{
+		// Use it instead of the number of processors
+		worker_count = worker_count_override;
+	}
 
-bool IOThreads::Startup()
-{
-	// If startup was previously attempted,
-	if (_recv_allocator)
+	_workers = new (std::nothrow) IOThread[worker_count];
+	if (!_workers)
 	{
-		// Clean up and try again
-		Shutdown();
+		CAT_FATAL("IOThreads") << "Out of memory while allocating " << worker_count << " worker thread objects";
+		return false;
 	}
 
-	_recv_allocator = new BufferAllocator(sizeof(RecvBuffer) + IOTHREADS_BUFFER_READ_BYTES, IOTHREADS_BUFFER_COUNT);
+	_worker_count = worker_count;
 
-	if (!_recv_allocator || !_recv_allocator->Valid())
+	// For each worker,
+	for (u32 ii = 0; ii < worker_count; ++ii)
 	{
-		FATAL("IOThreads") << "Out of memory while allocating " << IOTHREADS_BUFFER_COUNT << " buffers for a shared pool";
-		return false;
+		// Start its thread
+		if (!_workers[ii].StartThread(this))
+		{
+			CAT_FATAL("IOThreads") << "StartThread error " << errno;
+			return false;
+		}
+
+		// Try to tie each thread to an ideal processor core to help with scheduling
+		if (worker_count > 2) _workers[ii].SetIdealCore(ii);
 	}
 
+	CAT_INFO("IOThreads") << "Started " << worker_count << " epoll threads";
+
 	return true;
 }
 
-bool IOThreads::Shutdown()
+void IOThreads::Shutdown()
 {
-	u32 count = _udp_workers.size();
-	
-	for (u32 ii = 0; ii < count; ++ii)
+	// If wake event was created,
+	if (_wake_fd >= 0)
 	{
-		UDPThread *worker = _udp_workers[ii];
-		worker->Shutdown();
-	}
+		CAT_INFO("IOThreads") << "Shutting down thread pool...";
 
-	u32 worker_count = _worker_count;
-
-	// If port was created,
-	if (_io_port)
-	{
-		// For each worker,
-		for (u32 ii = 0; ii < worker_count; ++ii)
+		// Signal the wake event, which kills the worker threads
+		u64 value = 1;
+		if (write(_wake_fd, &value, sizeof(value)) != sizeof(value))
 		{
-			// Post a completion event that kills the worker threads
-			if (!PostQueuedCompletionStatus(_io_port, 0, 0, 0))
-			{
-				FATAL("IOThreads") << "PostQueuedCompletionStatus error " << GetLastError();
-			}
+			CAT_FATAL("IOThreads") << "Unable to signal wake event: write error " << errno;
 		}
 	}
 
 	const int SHUTDOWN_WAIT_TIMEOUT = 15000; // 15 seconds
 
 	// For each worker thread,
-	for (u32 ii = 0; ii < worker_count; ++ii)
+	for (u32 ii = 0; ii < _worker_count; ++ii)
 	{
 		if (!_workers[ii].WaitForThread(SHUTDOWN_WAIT_TIMEOUT))
 		{
-			FATAL("IOThreads") << "Thread " << ii << "/" << worker_count << " refused to die!  Attempting lethal force...";
+			CAT_FATAL("IOThreads") << "Thread " << ii << "/" << _worker_count << " refused to die!  Attempting lethal force...";
 			_workers[ii].AbortThread();
 		}
 	}
@@ -296,36 +222,66 @@ bool IOThreads::Shutdown()
 
 	_worker_count = 0;
 
-	// If port was created,
-	if (_io_port)
+	if (_wake_fd >= 0)
+	{
+		close(_wake_fd);
+		_wake_fd = -1;
+	}
+
+	if (_epoll_fd >= 0)
+	{
+		close(_epoll_fd);
+		_epoll_fd = -1;
+	}
+}
+
+bool IOThreads::Associate(IOThreadsAssociator *associator, u32 events)
+{
+	if (_epoll_fd < 0)
 	{
-		CloseHandle(_io_port);
-		_io_port = 0;
+		CAT_FATAL("IOThreads") << "Unable to associate handle since epoll set was never created";
+		return false;
 	}
 
-	// If allocator was created,
-	if (_recv_allocator)
+	epoll_event ev;
+	CAT_OBJCLR(ev);
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = associator;
+
+	if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, associator->GetHandle(), &ev))
 	{
-		delete _recv_allocator;
-		_recv_allocator = 0;
+		CAT_FATAL("IOThreads") << "Associating handle error " << errno;
+		return false;
 	}
 
 	return true;
 }
 
-bool IOThreads::Associate(UDPEndpoint *udp_endpoint)
+bool IOThreads::Rearm(IOThreadsAssociator *associator, u32 events)
 {
-	if (!_io_port)
+	epoll_event ev;
+	CAT_OBJCLR(ev);
+	ev.events = events | EPOLLONESHOT;
+	ev.data.ptr = associator;
+
+	if (epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, associator->GetHandle(), &ev))
 	{
-		FATAL("IOThreads") << "Unable to associate handle since completion port was never created";
+		CAT_WARN("IOThreads") << "Re-arming handle error " << errno;
 		return false;
 	}
 
-	HANDLE result = CreateIoCompletionPort((HANDLE)udp_endpoint->GetSocket(), _io_port, (ULONG_PTR)udp_endpoint, 0);
+	return true;
+}
+
+bool IOThreads::Dissociate(IOThreadsAssociator *associator)
+{
+	epoll_event ev;
+	CAT_OBJCLR(ev);
 
-	if (result != _io_port)
+	// Non-null event pointer for pre-2.6.9 kernels
+	if (epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, associator->GetHandle(), &ev))
 	{
-		FATAL("IOThreads") << "Associating UDPEndpoint error " << GetLastError();
+		CAT_WARN("IOThreads") << "Dissociating handle error " << errno;
 		return false;
 	}
 
@@ -0,0 +1,594 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/net/NetworkSimulator.hpp>
+#include <cat/net/UDPEndpoint.hpp>
+#include <cat/net/UDPRecvAllocator.hpp>
+#include <cat/net/UDPSendAllocator.hpp>
+#include <cat/io/Buffers.hpp>
+#include <cat/io/Settings.hpp>
+#include <cat/io/Log.hpp>
+#include <cat/time/Clock.hpp>
+using namespace cat;
+
+static UDPRecvAllocator *m_recv_allocator = 0;
+static UDPSendAllocator *m_udp_send_allocator = 0;
+static Settings *m_settings = 0;
+static Clock *m_clock = 0;
+
+static const u32 PPM = 1000000;
+
+
+//// NetworkSimulator
+
+CAT_REF_SINGLETON(NetworkSimulator);
+
+bool NetworkSimulator::OnInitialize()
+{
+	Use(m_recv_allocator, m_udp_send_allocator, m_settings, m_clock);
+
+	_endpoint_count = 0;
+	_link_count = 0;
+	_queue = 0;
+	_queue_size = 0;
+	_next_seq = 0;
+	_unlinked_drops = 0;
+	_die = false;
+	_virtual = false;
+
+	_enabled = m_settings->getInt("IO.Simulator.Enable", 0) != 0;
+	if (!_enabled) return true;
+
+	_virtual = m_settings->getInt("IO.Simulator.VirtualClock", 0) != 0;
+
+	_seed = (u32)m_settings->getInt("IO.Simulator.Seed", 0);
+	_queue_limit = m_settings->getInt("IO.Simulator.MaxQueued", DEFAULT_MAX_QUEUED, 1024, 1000000);
+
+	_default_params.latency_usec = m_settings->getInt("IO.Simulator.LatencyUsec", 50000, 0, 10000000);
+	_default_params.jitter_usec = m_settings->getInt("IO.Simulator.JitterUsec", 0, 0, 10000000);
+	_default_params.loss_ppm = m_settings->getInt("IO.Simulator.LossPPM", 0, 0, PPM);
+	_default_params.burst_enter_ppm = m_settings->getInt("IO.Simulator.BurstEnterPPM", 0, 0, PPM);
+	_default_params.burst_exit_ppm = m_settings->getInt("IO.Simulator.BurstExitPPM", PPM, 0, PPM);
+	_default_params.burst_loss_ppm = m_settings->getInt("IO.Simulator.BurstLossPPM", PPM, 0, PPM);
+	_default_params.duplicate_ppm = m_settings->getInt("IO.Simulator.DuplicatePPM", 0, 0, PPM);
+	_default_params.rate_bytes = m_settings->getInt("IO.Simulator.RateBytesPerSec", 0, 0, 0x7fffffff);
+	_default_params.queue_bytes = m_settings->getInt("IO.Simulator.QueueBytes", 256000, 1500, 0x7fffffff);
+
+	_queue = new (std::nothrow) Pending[_queue_limit];
+	if (!_queue)
+	{
+		CAT_FATAL("NetworkSimulator") << "Out of memory";
+		return false;
+	}
+
+	CAT_WARN("NetworkSimulator") << "Simulating UDP traffic between local endpoints with seed " << _seed
+		<< ": latency " << _default_params.latency_usec << " us, loss " << _default_params.loss_ppm << " ppm"
+		<< (_virtual ? ", virtual clock" : "");
+
+	// If the harness drives time,
+	if (_virtual)
+	{
+		// Start from the current time so timestamps look ordinary
+		m_clock->SetVirtualTime(m_clock->usec());
+		return true;
+	}
+
+	return StartThread();
+}
+
+void NetworkSimulator::OnFinalize()
+{
+	if (!_queue) return;
+
+	if (!_virtual)
+	{
+		_die = true;
+		_wakeup.Set();
+
+		WaitForThread();
+	}
+
+	// Release datagrams still in flight
+	BatchSet garbage;
+	garbage.Clear();
+
+	for (u32 ii = 0; ii < _queue_size; ++ii)
+		garbage.PushBack(_queue[ii].buffer);
+
+	if (garbage.head)
+		m_recv_allocator->ReleaseBatch(garbage);
+
+	delete []_queue;
+	_queue = 0;
+}
+
+bool NetworkSimulator::Register(UDPEndpoint *endpoint)
+{
+	Port port = endpoint->GetPort();
+
+	AutoMutex lock(_endpoint_lock);
+
+	// If the table is full or the port is already taken by another simulated endpoint,
+	if (_endpoint_count >= MAX_ENDPOINTS)
+		return false;
+
+	for (u32 ii = 0; ii < _endpoint_count; ++ii)
+		if (_endpoints[ii]->GetPort() == port)
+			return false;
+
+	_endpoints[_endpoint_count++] = endpoint;
+
+	CAT_INANE("NetworkSimulator") << "Registered endpoint on port " << port;
+
+	return true;
+}
+
+void NetworkSimulator::Unregister(UDPEndpoint *endpoint)
+{
+	AutoMutex lock(_endpoint_lock);
+
+	for (u32 ii = 0; ii < _endpoint_count; ++ii)
+	{
+		if (_endpoints[ii] == endpoint)
+		{
+			_endpoints[ii] = _endpoints[--_endpoint_count];
+			break;
+		}
+	}
+}
+
+bool NetworkSimulator::IsRegistered(Port port)
+{
+	AutoMutex lock(_endpoint_lock);
+
+	for (u32 ii = 0; ii < _endpoint_count; ++ii)
+		if (_endpoints[ii]->GetPort() == port)
+			return true;
+
+	return false;
+}
+
+UDPEndpoint *NetworkSimulator::AcquireEndpoint(Port port)
+{
+	AutoMutex lock(_endpoint_lock);
+
+	for (u32 ii = 0; ii < _endpoint_count; ++ii)
+	{
+		UDPEndpoint *endpoint = _endpoints[ii];
+
+		// Unregister happens under this lock before the last reference can go away
+		if (endpoint->GetPort() == port)
+		{
+			endpoint->AddRef(CAT_REFOBJECT_TRACE);
+			return endpoint;
+		}
+	}
+
+	return 0;
+}
+
+void NetworkSimulator::SetDefaultLink(const SimulatedLinkParams &params)
+{
+	AutoMutex lock(_queue_lock);
+
+	_default_params = params;
+}
+
+bool NetworkSimulator::SetLink(Port src, Port dst, const SimulatedLinkParams &params)
+{
+	AutoMutex lock(_queue_lock);
+
+	Link *link = FindLink(src, dst, true);
+	if (!link) return false;
+
+	// Start the direction over so a repeated run sees the same link
+	link->params = params;
+	CAT_OBJCLR(link->stats);
+	link->prng.Initialize(_seed, ((u32)src << 16) | dst);
+	link->bursty = false;
+	link->idle_usec = 0;
+
+	return true;
+}
+
+bool NetworkSimulator::GetLinkStats(Port src, Port dst, SimulatedLinkStats &stats)
+{
+	AutoMutex lock(_queue_lock);
+
+	Link *link = FindLink(src, dst, false);
+	if (!link) return false;
+
+	stats = link->stats;
+	return true;
+}
+
+u64 NetworkSimulator::GetUnlinkedDrops()
+{
+	AutoMutex lock(_queue_lock);
+
+	return _unlinked_drops;
+}
+
+NetworkSimulator::Link *NetworkSimulator::FindLink(Port src, Port dst, bool create)
+{
+	for (u32 ii = 0; ii < _link_count; ++ii)
+	{
+		Link *link = &_links[ii];
+
+		if (link->src == src && link->dst == dst)
+			return link;
+	}
+
+	if (!create || _link_count >= MAX_LINKS)
+		return 0;
+
+	Link *link = &_links[_link_count++];
+
+	link->src = src;
+	link->dst = dst;
+	link->params = _default_params;
+	CAT_OBJCLR(link->stats);
+	link->prng.Initialize(_seed, ((u32)src << 16) | dst);
+	link->bursty = false;
+	link->idle_usec = 0;
+
+	return link;
+}
+
+bool NetworkSimulator::DecideLoss(Link *link)
+{
+	const SimulatedLinkParams &params = link->params;
+
+	// Gilbert-Elliott state transition
+	if (link->bursty)
+	{
+		if (link->prng.Next() % PPM < params.burst_exit_ppm)
+			link->bursty = false;
+	}
+	else
+	{
+		if (link->prng.Next() % PPM < params.burst_enter_ppm)
+			link->bursty = true;
+	}
+
+	u32 loss_ppm = link->bursty ? params.burst_loss_ppm : params.loss_ppm;
+
+	return link->prng.Next() % PPM < loss_ppm;
+}
+
+bool NetworkSimulator::Enqueue(const Pending &pending)
+{
+	if (_queue_size >= _queue_limit)
+		return false;
+
+	// Sift up
+	u32 ii = _queue_size++;
+	while (ii > 0)
+	{
+		u32 parent = (ii - 1) / 2;
+		Pending &p = _queue[parent];
+
+		if (p.deliver_usec < pending.deliver_usec ||
+			(p.deliver_usec == pending.deliver_usec && (s32)(p.seq - pending.seq) < 0))
+			break;
+
+		_queue[ii] = p;
+		ii = parent;
+	}
+
+	_queue[ii] = pending;
+
+	// If this is the new earliest delivery, the thread may be sleeping too long
+	if (ii == 0)
+		_wakeup.Set();
+
+	return true;
+}
+
+void NetworkSimulator::PopQueue()
+{
+	Pending last = _queue[--_queue_size];
+
+	// Sift down
+	u32 ii = 0;
+	CAT_FOREVER
+	{
+		u32 child = ii * 2 + 1;
+		if (child >= _queue_size) break;
+
+		Pending *c = &_queue[child];
+
+		if (child + 1 < _queue_size)
+		{
+			Pending *r = c + 1;
+
+			if (r->deliver_usec < c->deliver_usec ||
+				(r->deliver_usec == c->deliver_usec && (s32)(r->seq - c->seq) < 0))
+			{
+				c = r;
+				++child;
+			}
+		}
+
+		if (last.deliver_usec < c->deliver_usec ||
+			(last.deliver_usec == c->deliver_usec && (s32)(last.seq - c->seq) < 0))
+			break;
+
+		_queue[ii] = *c;
+		ii = child;
+	}
+
+	_queue[ii] = last;
+}
+
+bool NetworkSimulator::Send(UDPEndpoint *sender, const BatchSet &buffers, const NetAddr &addr)
+{
+	Port dst = addr.GetPort();
+
+	// If the destination is not simulated,
+	if (!IsRegistered(dst))
+		return false;
+
+	// Receiver sees the datagram coming from the same IP it was sent to
+	NetAddr src_addr = addr;
+	src_addr.SetPort(sender->GetPort());
+
+	NetAddr::SockAddr out_addr;
+	int addr_len;
+	if (!src_addr.Unwrap(out_addr, addr_len))
+	{
+		m_udp_send_allocator->ReleaseBatch(buffers);
+		return true;
+	}
+
+	double now_usec = m_clock->usec();
+	u32 now_msec = m_clock->msec();
+	BatchSet garbage;
+	garbage.Clear();
+
+	_queue_lock.Enter();
+
+	Link *link = FindLink(sender->GetPort(), dst, true);
+
+	// If the link table is full,
+	if (!link)
+	{
+		// Count the datagrams as dropped rather than losing them silently
+		u32 count = 0;
+		for (BatchHead *node = buffers.head; node; node = node->batch_next)
+			++count;
+
+		if (_unlinked_drops == 0)
+		{
+			CAT_WARN("NetworkSimulator") << "Link table is full: Dropping datagrams from port " << sender->GetPort() << " to port " << dst;
+		}
+
+		_unlinked_drops += count;
+
+		_queue_lock.Leave();
+
+		m_udp_send_allocator->ReleaseBatch(buffers);
+		return true;
+	}
+
+	// For each datagram,
+	for (BatchHead *node = buffers.head; node; node = node->batch_next)
+	{
+		SendBuffer *buffer = static_cast<SendBuffer*>( node );
+		u32 bytes = buffer->data_bytes;
+
+		++link->stats.sent;
+
+		// Oversized datagrams never make it through a real network either
+		if (bytes > IOTHREADS_BUFFER_READ_BYTES || DecideLoss(link))
+		{
+			++link->stats.lost;
+			continue;
+		}
+
+		const SimulatedLinkParams &params = link->params;
+
+		// Serialize onto the bottleneck
+		double start_usec = link->idle_usec > now_usec ? link->idle_usec : now_usec;
+		double finish_usec = start_usec;
+		if (params.rate_bytes)
+		{
+			// If the bottleneck queue is full, tail drop
+			if ((start_usec - now_usec) * params.rate_bytes > params.queue_bytes * 1000000.)
+			{
+				++link->stats.overflowed;
+				continue;
+			}
+
+			finish_usec += bytes * 1000000. / params.rate_bytes;
+			link->idle_usec = finish_usec;
+		}
+
+		u32 copies = 1;
+		if (params.duplicate_ppm && link->prng.Next() % PPM < params.duplicate_ppm)
+		{
+			++link->stats.duplicated;
+			copies = 2;
+		}
+
+		// Copies are independently delayed, so jitter also reorders
+		for (u32 jj = 0; jj < copies; ++jj)
+		{
+			BatchSet recv;
+			if (m_recv_allocator->AcquireBatch(recv, 1) != 1)
+			{
+				++link->stats.overflowed;
+				break;
+			}
+
+			RecvBuffer *copy = static_cast<RecvBuffer*>( recv.head );
+			memcpy(GetTrailingBytes(copy), GetTrailingBytes(buffer), bytes);
+			copy->data_bytes = bytes;
+			copy->event_msec = now_msec;
+			copy->iointernal.addr = out_addr;
+			copy->iointernal.addr_len = addr_len;
+
+			Pending pending;
+			pending.deliver_usec = finish_usec + params.latency_usec;
+			if (params.jitter_usec)
+				pending.deliver_usec += link->prng.Next() % (params.jitter_usec + 1);
+			pending.seq = _next_seq++;
+			pending.src = link->src;
+			pending.dst = dst;
+			pending.buffer = copy;
+
+			if (!Enqueue(pending))
+			{
+				++link->stats.overflowed;
+				garbage.PushBack(copy);
+			}
+		}
+	}
+
+	_queue_lock.Leave();
+
+	if (garbage.head)
+		m_recv_allocator->ReleaseBatch(garbage);
+
+	m_udp_send_allocator->ReleaseBatch(buffers);
+
+	return true;
+}
+
+void NetworkSimulator::Deliver(const BatchSet &buffers, Port dst)
+{
+	UDPEndpoint *endpoint = AcquireEndpoint(dst);
+
+	// If the receiver went away while the datagrams were in flight,
+	if (!endpoint)
+	{
+		m_recv_allocator->ReleaseBatch(buffers);
+		return;
+	}
+
+	if (endpoint->IsShutdown())
+		m_recv_allocator->ReleaseBatch(buffers);
+	else
+		endpoint->OnRecvRouting(buffers);
+
+	endpoint->ReleaseRef(CAT_REFOBJECT_TRACE);
+}
+
+int NetworkSimulator::DeliverDue(double now_usec, u32 now_msec)
+{
+	int wait_msec = -1;
+
+	BatchSet delivery;
+	delivery.Clear();
+	Port delivery_port = 0;
+
+	_queue_lock.Enter();
+
+	// Pull everything that is due, handing off runs bound for the same endpoint
+	while (_queue_size > 0)
+	{
+		Pending &top = _queue[0];
+
+		if (top.deliver_usec > now_usec)
+		{
+			wait_msec = (int)((top.deliver_usec - now_usec) / 1000.);
+			break;
+		}
+
+		RecvBuffer *buffer = top.buffer;
+		Port dst = top.dst;
+
+		Link *link = FindLink(top.src, dst, false);
+		if (link)
+		{
+			++link->stats.delivered;
+			link->stats.bytes_delivered += buffer->data_bytes;
+		}
+
+		PopQueue();
+
+		// Receive time is the moment the datagram leaves the link
+		buffer->event_msec = now_msec;
+
+		if (delivery.head && dst != delivery_port)
+		{
+			_queue_lock.Leave();
+			Deliver(delivery, delivery_port);
+			delivery.Clear();
+			_queue_lock.Enter();
+		}
+
+		delivery.PushBack(buffer);
+		delivery_port = dst;
+	}
+
+	_queue_lock.Leave();
+
+	if (delivery.head)
+		Deliver(delivery, delivery_port);
+
+	return wait_msec;
+}
+
+bool NetworkSimulator::Entrypoint(void *param)
+{
+	while (!_die)
+	{
+		int wait_msec = DeliverDue(m_clock->usec(), m_clock->msec());
+
+		_wakeup.Wait(wait_msec);
+	}
+
+	return true;
+}
+
+void NetworkSimulator::Advance(u32 usec)
+{
+	if (!_virtual) return;
+
+	double target_usec = m_clock->usec() + usec;
+
+	CAT_FOREVER
+	{
+		_queue_lock.Enter();
+		bool due = _queue_size > 0 && _queue[0].deliver_usec <= target_usec;
+		double next_usec = due ? _queue[0].deliver_usec : 0;
+		_queue_lock.Leave();
+
+		if (!due) break;
+
+		// Step to the next delivery so the receiver sees the exact arrival time
+		if (next_usec > m_clock->usec())
+			m_clock->SetVirtualTime(next_usec);
+
+		// Datagrams sent by the receivers in response are scheduled from here
+		DeliverDue(m_clock->usec(), m_clock->msec());
+	}
+
+	m_clock->SetVirtualTime(target_usec);
+}
@@ -39,8 +39,12 @@ using namespace cat;
 #if !defined(IPV6_V6ONLY)
 #define IPV6_V6ONLY 27
 #endif
-#if !defined(SIO_UDP_CONNRESET)
-#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
+#if defined(CAT_OS_WINDOWS)
+# if !defined(SIO_UDP_CONNRESET)
+#  define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
+# endif
+#else
+# include <netinet/in.h>
 #endif
 
 
@@ -107,6 +111,23 @@ bool Socket::SetRecvBufferSize(int bytes)
 	return true;
 }
 
+bool Socket::SetReusePort(bool reuse)
+{
+#if defined(SO_REUSEPORT)
+	int behavior = reuse ? 1 : 0;
+	if (setsockopt(_s, SOL_SOCKET, SO_REUSEPORT, (char*)&behavior, sizeof(behavior)))
+	{
+		CAT_WARN("Socket") << "Unable to setsockopt SO_REUSEPORT: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	return true;
+#else
+	CAT_WARN("Socket") << "Unable to setsockopt SO_REUSEPORT: Not supported on this platform";
+	return !reuse;
+#endif
+}
+
 bool Socket::Bind(Port port)
 {
 	// Bind the socket to a given port
@@ -138,6 +159,8 @@ bool UDPSocket::IgnoreUnreachable(bool ignore)
 	// ICMP Port Unreachable or other failures until you get the first packet.
 	// After that call IgnoreUnreachable() to avoid spoofed ICMP exploits.
 
+#if defined(CAT_OS_WINDOWS)
+
 	DWORD behavior = ignore ? FALSE : TRUE;
 	if (ioctlsocket(GetSocket(), SIO_UDP_CONNRESET, &behavior) == SOCKET_ERROR)
 	{
@@ -146,10 +169,52 @@ bool UDPSocket::IgnoreUnreachable(bool ignore)
 	}
 
 	return true;
+
+#elif defined(CAT_OS_LINUX)
+
+	// Unconnected UDP sockets only see ICMP errors through the error queue
+	return ReportErrors(!ignore);
+
+#else
+
+	// Unconnected UDP sockets do not report ICMP errors on BSD
+	return true;
+
+#endif
+}
+
+bool UDPSocket::ReportErrors(bool report)
+{
+#if defined(CAT_OS_LINUX)
+
+	int behavior = report ? 1 : 0;
+
+	// If an IPv6 socket, errors for IPv4-mapped peers are reported through IP_RECVERR
+	if (SupportsIPv6() && setsockopt(GetSocket(), IPPROTO_IPV6, IPV6_RECVERR, (const char*)&behavior, sizeof(behavior)))
+	{
+		CAT_WARN("UDPSocket") << "Unable to setsockopt IPV6_RECVERR: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	if (setsockopt(GetSocket(), IPPROTO_IP, IP_RECVERR, (const char*)&behavior, sizeof(behavior)) && !SupportsIPv6())
+	{
+		CAT_WARN("UDPSocket") << "Unable to setsockopt IP_RECVERR: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	return true;
+
+#else
+
+	return !report;
+
+#endif
 }
 
 bool UDPSocket::DontFragment(bool df)
 {
+#if defined(CAT_OS_WINDOWS)
+
 	DWORD behavior = df ? TRUE : FALSE;
 	if (setsockopt(GetSocket(), IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&behavior, sizeof(behavior)))
 	{
@@ -158,6 +223,47 @@ bool UDPSocket::DontFragment(bool df)
 	}
 
 	return true;
+
+#elif defined(CAT_OS_LINUX)
+
+	// PROBE sets DF but ignores the cached path MTU, so oversized probes
+	// reach the bottleneck router instead of failing locally.  Errors are
+	// needed to learn the path MTU from ICMP "fragmentation needed".
+	int behavior = df ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+
+	// If an IPv6 socket,
+	if (SupportsIPv6())
+	{
+		int behavior6 = df ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_DONT;
+		if (setsockopt(GetSocket(), IPPROTO_IPV6, IPV6_MTU_DISCOVER, (const char*)&behavior6, sizeof(behavior6)))
+		{
+			CAT_WARN("UDPSocket") << "Unable to setsockopt IPV6_MTU_DISCOVER: " << Sockets::GetLastErrorString();
+			return false;
+		}
+	}
+
+	// Also applies to IPv4-mapped peers on an IPv6 socket, so only an error for pure IPv4
+	if (setsockopt(GetSocket(), IPPROTO_IP, IP_MTU_DISCOVER, (const char*)&behavior, sizeof(behavior)) && !SupportsIPv6())
+	{
+		CAT_WARN("UDPSocket") << "Unable to setsockopt IP_MTU_DISCOVER: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	return !df || ReportErrors(true);
+
+#else
+
+	// IP_DONTFRAG on BSD
+	int behavior = df ? 1 : 0;
+	if (setsockopt(GetSocket(), IPPROTO_IP, IP_DONTFRAG, (const char*)&behavior, sizeof(behavior)))
+	{
+		CAT_WARN("UDPSocket") << "Unable to change don't fragment bit: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	return true;
+
+#endif
 }
 
 
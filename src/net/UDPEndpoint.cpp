@@ -26,188 +26,274 @@
 	POSSIBILITY OF SUCH DAMAGE.
 */
 
-#include <cat/iocp/UDPEndpoint.hpp>
-#include <cat/io/Logging.hpp>
+#include <cat/net/UDPEndpoint.hpp>
+#include <cat/io/Log.hpp>
 #include <cat/io/Settings.hpp>
-#include <cat/io/IOLayer.hpp>
-#include <cat/net/Buffers.hpp>
+#include <cat/io/Buffers.hpp>
+#include <cat/net/UDPRecvAllocator.hpp>
+#include <sys/epoll.h>
+#include <netinet/udp.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 using namespace std;
 using namespace cat;
 
-#if defined(CAT_OS_WINDOWS)
-
-#include <MSWSock.h>
-
-// Add missing definition for MinGW
-#if !defined(SIO_UDP_CONNRESET)
-#define SIO_UDP_CONNRESET _WSAIOW(IOC_VENDOR,12)
+#if defined(CAT_OS_LINUX)
+# define CAT_UDP_MMSG /* recvmmsg() and sendmmsg() are available */
+# define CAT_UDP_GSO /* UDP_SEGMENT and UDP_GRO may be available, checked at runtime */
+# if !defined(UDP_SEGMENT)
+#  define UDP_SEGMENT 103
+# endif
+# if !defined(UDP_GRO)
+#  define UDP_GRO 104
+# endif
+# define CAT_UDP_RECVERR /* Socket error queue is available */
+# include <linux/errqueue.h>
 #endif
 
+#if defined(SO_TIMESTAMPNS) && defined(CAT_UDP_MMSG)
+# define CAT_UDP_TIMESTAMPS /* Kernel receive timestamps are available */
 #endif
 
+static UDPRecvAllocator *m_recv_allocator = 0;
+static UDPSendAllocator *m_udp_send_allocator = 0;
+static IOThreads *m_io_threads = 0;
+static Settings *m_settings = 0;
+static NetworkSimulator *m_network_simulator = 0;
 
-//// UDPEndpoint
+#if defined(CAT_UDP_TIMESTAMPS)
 
-void UDPEndpoint::OnShutdownRequest()
-{
-	if (_socket != SOCKET_ERROR)
-	{
-		CloseSocket(_socket);
-		_socket = SOCKET_ERROR;
-	}
-}
+// Kernel stamps further than this from the IO thread clock are ignored (clock steps)
+static const s32 MAX_TIMESTAMP_SKEW = 10000; // milliseconds
 
-bool UDPEndpoint::OnZeroReferences()
+// Returns true if the control message holds a usable kernel receive timestamp
+static bool ReadKernelTimestamp(cmsghdr *cmsg, u32 event_msec, u32 &msec)
 {
+	if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+		return false;
+
+	timespec ts;
+	memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+
+	// Truncate to 32 bits the same way Clock::msec() does
+	u64 ns = (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	u32 kernel_msec = (u32)(ns / 1000000);
+
+	s32 skew = (s32)(event_msec - kernel_msec);
+	if (skew > MAX_TIMESTAMP_SKEW || skew < -MAX_TIMESTAMP_SKEW)
+		return false;
+
+	msec = kernel_msec;
 	return true;
 }
 
-UDPEndpoint::UDPEndpoint()
-{
-    _port = 0;
-    _socket = SOCKET_ERROR;
-}
+#endif // CAT_UDP_TIMESTAMPS
 
-UDPEndpoint::~UDPEndpoint()
+
+//// UDPEndpoint
+
+bool UDPEndpoint::OnInitialize()
 {
-    if (_socket != SOCKET_ERROR)
-        CloseSocket(_socket);
+	Use(m_io_threads, m_udp_send_allocator, m_recv_allocator);
+	Use(m_settings, m_network_simulator);
+
+	return true;
 }
 
-Port UDPEndpoint::GetPort()
+void UDPEndpoint::OnDestroy()
 {
-	// Get bound port if it was random
-	if (_port == 0)
-	{
-		_port = GetBoundPort(_socket);
-
-		if (!_port)
-		{
-			WARN("UDPEndpoint") << "Unable to get own address: " << SocketGetLastErrorString();
-			return 0;
-		}
-	}
+	// Stop receiving simulated datagrams
+	if (_simulated)
+		m_network_simulator->Unregister(this);
 
-	return _port;
+	// Make the socket readable so the IO thread holding the readiness event notices the shutdown
+	if (Valid())
+		shutdown(GetSocket(), SHUT_RDWR);
 }
 
-bool UDPEndpoint::IgnoreUnreachable()
+bool UDPEndpoint::OnFinalize()
 {
-    // FALSE = Disable behavior where, after receiving an ICMP Unreachable message,
-    // WSARecvFrom() will fail.  Disables ICMP completely; normally this is good.
-    // But when you're writing a client endpoint, you probably want to listen to
-    // ICMP Port Unreachable or other failures until you get the first packet.
-    // After that call IgnoreUnreachable() to avoid spoofed ICMP exploits.
-
-	if (_socket == SOCKET_ERROR)
-		return false;
+	Close();
 
-#if defined(CAT_OS_WINDOWS)
+	// Return unused read buffers
+	if (_spare_buffers.head)
+	{
+		m_recv_allocator->ReleaseBatch(_spare_buffers);
+		_spare_buffers.Clear();
+		_spare_count = 0;
+	}
 
-	DWORD dwBytesReturned = 0;
-    BOOL bNewBehavior = FALSE;
-    if (WSAIoctl(_socket, SIO_UDP_CONNRESET, &bNewBehavior,
-				 sizeof(bNewBehavior), 0, 0, &dwBytesReturned, 0, 0) == SOCKET_ERROR)
+	// Release any writes that were never flushed
+	if (_write_buffers.head)
 	{
-		WARN("UDPEndpoint") << "Unable to ignore ICMP Unreachable: " << SocketGetLastErrorString();
-		return false;
+		m_udp_send_allocator->ReleaseBatch(_write_buffers);
+		_write_buffers.Clear();
 	}
-	
-#else
 
-#error "TODO"
+	if (_gro_reads)
+	{
+		delete []_gro_reads;
+		_gro_reads = 0;
+	}
 
-#endif
+	// No watcher event is outstanding once the last reference is gone
+	if (_write_watcher.fd >= 0)
+	{
+		close(_write_watcher.fd);
+		_write_watcher.fd = -1;
+	}
 
 	return true;
 }
 
-bool UDPEndpoint::DontFragment(bool df)
+UDPEndpoint::UDPEndpoint()
+{
+	_batch_depth = UDP_DEFAULT_BATCH_DEPTH;
+
+	_spare_buffers.Clear();
+	_spare_count = 0;
+	_write_buffers.Clear();
+	_write_flushing = false;
+	_write_watched = false;
+	_write_watcher.endpoint = this;
+	_write_watcher.fd = -1;
+
+	_gro_reads = 0;
+	_gso_enabled = false;
+	_kernel_timestamps = false;
+	_simulated = false;
+
+	_recv_syscalls = 0;
+	_recv_datagrams = 0;
+	_send_syscalls = 0;
+	_send_datagrams = 0;
+}
+
+UDPEndpoint::~UDPEndpoint()
+{
+}
+
+bool UDPEndpoint::Initialize(Port port, bool ignoreUnreachable, bool RequestIPv6, bool RequireIPv4, int kernelReceiveBufferBytes, bool reusePort)
 {
-	if (_socket == SOCKET_ERROR)
+	// If not able to create a socket,
+	if (!Create(RequestIPv6, RequireIPv4))
 		return false;
 
-	DWORD bNewBehavior = df ? TRUE : FALSE;
-	if (setsockopt(_socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&bNewBehavior, sizeof(bNewBehavior)))
+	// Set SO_RCVBUF as requested (often defaults are far too low for UDP servers or UDP file transfer clients)
+	if (kernelReceiveBufferBytes < 64000) kernelReceiveBufferBytes = 64000;
+	SetRecvBufferSize(kernelReceiveBufferBytes);
+
+	// If ignoring ICMP unreachable,
+	if (ignoreUnreachable)
+		IgnoreUnreachable(true);
+
+	// If sharing the port with other sockets was requested but is not possible,
+	if (reusePort && !SetReusePort(true))
 	{
-		WARN("UDPEndpoint") << "Unable to change don't fragment bit: " << SocketGetLastErrorString();
+		Close();
 		return false;
 	}
 
-	return true;
-}
-
-bool UDPEndpoint::Bind(IOLayer *iolayer, bool onlySupportIPv4, Port port, bool ignoreUnreachable, int rcv_buffsize)
-{
-	// Create an unbound, overlapped UDP socket for the endpoint
-    Socket s;
-	if (!CreateSocket(SOCK_DGRAM, IPPROTO_UDP, true, s, onlySupportIPv4))
-	{
-		FATAL("UDPEndpoint") << "Unable to create a UDP socket: " << SocketGetLastErrorString();
+	// If not able to bind,
+	if (!Bind(port))
 		return false;
-    }
-	_ipv6 = !onlySupportIPv4;
 
-	// Set SO_SNDBUF to zero for a zero-copy network stack (we maintain the buffers)
-	int snd_buffsize = 0;
-	if (setsockopt(s, SOL_SOCKET, SO_SNDBUF, (char*)&snd_buffsize, sizeof(snd_buffsize)))
+	// Reads and writes never block an IO thread or a worker
+	int flags = fcntl(GetSocket(), F_GETFL, 0);
+	if (flags == -1 || fcntl(GetSocket(), F_SETFL, flags | O_NONBLOCK) == -1)
 	{
-		WARN("UDPEndpoint") << "Unable to zero the send buffer: " << SocketGetLastErrorString();
-		CloseSocket(s);
+		CAT_FATAL("UDPEndpoint") << "Unable to make socket non-blocking: " << Sockets::GetLastErrorString();
+		Close();
 		return false;
 	}
 
-	// Set SO_RCVBUF as requested (often defaults are far too low for UDP servers or UDP file transfer clients)
-	if (rcv_buffsize < 64000) rcv_buffsize = 64000;
-	if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, (char*)&rcv_buffsize, sizeof(rcv_buffsize)))
+	// Duplicate the socket so EPOLLOUT can be watched apart from the read event
+	_write_watcher.fd = dup(GetSocket());
+	if (_write_watcher.fd < 0)
 	{
-		WARN("UDPEndpoint") << "Unable to setsockopt SO_RCVBUF " << rcv_buffsize << ": " << SocketGetLastErrorString();
-		CloseSocket(s);
+		CAT_FATAL("UDPEndpoint") << "Unable to duplicate socket: " << Sockets::GetLastErrorString();
+		Close();
 		return false;
 	}
 
-	_socket = s;
+	_batch_depth = m_settings->getInt("IO.UDPEndpoint.BatchDepth", UDP_DEFAULT_BATCH_DEPTH, 1, UDP_MAX_BATCH_DEPTH);
 
-	// Ignore ICMP Unreachable
-    if (ignoreUnreachable) IgnoreUnreachable();
+	EnableOffload();
+
+#if defined(CAT_UDP_TIMESTAMPS)
+	// If kernel receive timestamps are requested,
+	if (m_settings->getInt("IO.UDPEndpoint.KernelTimestamps", 1))
+	{
+		int enable = 1;
+		_kernel_timestamps = 0 == setsockopt(GetSocket(), SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+	}
+#endif
 
-    // Bind the socket to a given port
-    if (!NetBind(s, port, onlySupportIPv4))
-    {
-        FATAL("UDPEndpoint") << "Unable to bind to port: " << SocketGetLastErrorString();
-        CloseSocket(s);
-        _socket = SOCKET_ERROR;
-        return false;
-    }
+	// Reference held by the write watcher until it fires, which is right away
+	_write_watched = true;
+	AddRef(CAT_REFOBJECT_TRACE);
 
-	_port = port;
-	_iolayer = iolayer;
+	// Associate the write watcher with IOThreads
+	if (!m_io_threads->Associate(&_write_watcher, EPOLLOUT))
+	{
+		CAT_FATAL("UDPEndpoint") << "Unable to associate write watcher with IOThreads";
+		Close();
+		ReleaseRef(CAT_REFOBJECT_TRACE);
+		return false;
+	}
 
-	// Add reference to keep object alive until function returns
-	AddRef();
-	_buffers_posted = SIMULTANEOUS_READS;
+	// Reference held by the readiness event until shutdown is noticed
+	AddRef(CAT_REFOBJECT_TRACE);
 
 	// Associate with IOThreads
-	if (!iolayer->GetIOThreads()->Associate(this))
+	if (!m_io_threads->Associate(this, EPOLLIN))
 	{
-		FATAL("UDPEndpoint") << "Unable to associate with IOThreads";
-		CloseSocket(s);
-		_socket = SOCKET_ERROR;
-		ReleaseRef(); // Release temporary references keeping the object alive until function returns
+		CAT_FATAL("UDPEndpoint") << "Unable to associate with IOThreads";
+		Close();
+		ReleaseRef(CAT_REFOBJECT_TRACE);
 		return false;
 	}
 
-	// Now that we're in the IO layer, start watching the object for shutdown
-	iolayer->Watch(this);
+	// If traffic between local endpoints is being simulated,
+	if (m_network_simulator->IsEnabled())
+		_simulated = m_network_simulator->Register(this);
 
-    INFO("UDPEndpoint") << "Open on port " << GetPort();
+	CAT_INFO("UDPEndpoint") << "Open on port " << GetPort() << " with batch depth " << _batch_depth
+		<< (_gso_enabled ? ", GSO" : "") << (_gro_reads ? ", GRO" : "") << (_simulated ? ", simulated" : "");
 
-	ReleaseRef(); // Release temporary reference keeping the object alive until function returns
-    return true;
+	return true;
 }
 
+void UDPEndpoint::EnableOffload()
+{
+#if defined(CAT_UDP_GSO)
+	// Setting a zero segment size only succeeds on kernels that support UDP_SEGMENT
+	if (m_settings->getInt("IO.UDPEndpoint.GSO", 1))
+	{
+		int segment_bytes = 0;
+		_gso_enabled = 0 == setsockopt(GetSocket(), SOL_UDP, UDP_SEGMENT, &segment_bytes, sizeof(segment_bytes));
+	}
+
+	// If coalesced reads are requested,
+	if (m_settings->getInt("IO.UDPEndpoint.GRO", 0))
+	{
+		_gro_reads = new (std::nothrow) CoalescedRead[UDP_GRO_BATCH_DEPTH];
+
+		int enable = 1;
+		if (_gro_reads && setsockopt(GetSocket(), SOL_UDP, UDP_GRO, &enable, sizeof(enable)))
+		{
+			CAT_INFO("UDPEndpoint") << "UDP_GRO unavailable: " << Sockets::GetLastErrorString();
+			delete []_gro_reads;
+			_gro_reads = 0;
+		}
+	}
+#endif // CAT_UDP_GSO
+}
 
-//// Begin Event
+
+//// Begin Events
 
 bool UDPEndpoint::Write(const BatchSet &buffers, u32 count, const NetAddr &addr)
 {
@@ -217,14 +303,18 @@ bool UDPEndpoint::Write(const BatchSet &buffers, u32 count, const NetAddr &addr)
 	// If in the process of shutdown or input invalid,
 	if (IsShutdown() || !addr.Unwrap(out_addr, addr_len))
 	{
-		StdAllocator::ii->ReleaseBatch(buffers);
+		m_udp_send_allocator->ReleaseBatch(buffers);
 		return false;
 	}
 
+	// If the destination is another endpoint on the simulated network,
+	if (_simulated && m_network_simulator->Send(this, buffers, addr))
+		return true;
+
 	// For each buffer,
 	for (BatchHead *node = buffers.head; node; node = node->batch_next)
 	{
-		SendBuffer *buffer = reinterpret_cast<SendBuffer*>( node );
+		SendBuffer *buffer = static_cast<SendBuffer*>( node );
 
 		// Fill in the address
 		buffer->iointernal.addr = out_addr;
@@ -235,100 +325,653 @@ bool UDPEndpoint::Write(const BatchSet &buffers, u32 count, const NetAddr &addr)
 	_write_buffers.PushBack(buffers);
 	_write_lock.Leave();
 
+	FlushWrites();
+
 	return true;
 }
 
-CAT_INLINE bool UDPEndpoint::Write(u8 *data, u32 data_bytes, const NetAddr &addr)
+bool UDPEndpoint::Write(u8 *data, u32 data_bytes, const NetAddr &addr)
 {
 	SendBuffer *buffer = SendBuffer::Promote(data);
-	buffer->SetBytes(data_bytes);
+	buffer->data_bytes = data_bytes;
 	return Write(buffer, 1, addr);
 }
 
-CAT_INLINE void UDPEndpoint::SetRemoteAddress(RecvBuffer *buffer)
+void UDPEndpoint::SetRemoteAddress(RecvBuffer *buffer)
 {
 	buffer->addr.Wrap(buffer->iointernal.addr);
 }
 
+void UDPEndpoint::GetStats(UDPEndpointStats &stats)
+{
+	stats.recv_syscalls = _recv_syscalls;
+	stats.recv_datagrams = _recv_datagrams;
+	stats.send_syscalls = _send_syscalls;
+	stats.send_datagrams = _send_datagrams;
+}
+
 
 //// Event Completion
 
 void UDPEndpoint::ReleaseRecvBuffers(BatchSet buffers, u32 count)
 {
-	if (!buffers.head) return;
+	if (buffers.head)
+		m_recv_allocator->ReleaseBatch(buffers);
+}
+
+void UDPEndpoint::OnReadiness(u32 events, u32 event_msec)
+{
+	if (!IsShutdown())
+	{
+		// If errors are queued,
+		if (events & EPOLLERR)
+			ProcessErrors();
+
+		// If socket is readable,
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			ProcessReads(event_msec);
+	}
+
+	// If shutting down,
+	if (IsShutdown())
+	{
+		// Stop watching and release the reference held by the readiness event
+		m_io_threads->Dissociate(this);
+		ReleaseRef(CAT_REFOBJECT_TRACE);
+		return;
+	}
+
+	m_io_threads->Rearm(this, EPOLLIN);
+}
+
+void UDPEndpoint::WriteWatcher::OnReadiness(u32 events, u32 event_msec)
+{
+	endpoint->OnWritable();
+}
+
+void UDPEndpoint::OnWritable()
+{
+	_write_lock.Enter();
+	_write_watched = false;
+	_write_lock.Leave();
+
+	// Drain whatever the kernel refused earlier
+	if (!IsShutdown())
+		FlushWrites();
+
+	// Release the reference held by the armed watcher
+	ReleaseRef(CAT_REFOBJECT_TRACE);
+}
+
+u32 UDPEndpoint::RecvBatch(BatchSet &buffers, u32 count, u32 event_msec)
+{
+#if defined(CAT_UDP_MMSG)
+
+	mmsghdr msgs[UDP_MAX_BATCH_DEPTH];
+	iovec iovs[UDP_MAX_BATCH_DEPTH];
+#if defined(CAT_UDP_TIMESTAMPS)
+	u64 controls[UDP_MAX_BATCH_DEPTH][CAT_CEIL_UNIT(CMSG_SPACE(sizeof(timespec)), sizeof(u64))];
+#endif
+
+	// For each buffer,
+	u32 ii = 0;
+	for (BatchHead *node = buffers.head; node && ii < count; node = node->batch_next, ++ii)
+	{
+		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
+
+		iovs[ii].iov_base = GetTrailingBytes(buffer);
+		iovs[ii].iov_len = IOTHREADS_BUFFER_READ_BYTES;
+
+		CAT_OBJCLR(msgs[ii]);
+		msgs[ii].msg_hdr.msg_name = &buffer->iointernal.addr;
+		msgs[ii].msg_hdr.msg_namelen = sizeof(buffer->iointernal.addr);
+		msgs[ii].msg_hdr.msg_iov = &iovs[ii];
+		msgs[ii].msg_hdr.msg_iovlen = 1;
+
+#if defined(CAT_UDP_TIMESTAMPS)
+		if (_kernel_timestamps)
+		{
+			msgs[ii].msg_hdr.msg_control = controls[ii];
+			msgs[ii].msg_hdr.msg_controllen = sizeof(controls[ii]);
+		}
+#endif
+	}
+
+	int result = recvmmsg(GetSocket(), msgs, ii, MSG_DONTWAIT, 0);
+	if (result <= 0)
+		return 0;
+
+	++_recv_syscalls;
+	_recv_datagrams += result;
+
+	// For each completed buffer,
+	BatchHead *node = buffers.head;
+	for (int jj = 0; jj < result; ++jj, node = node->batch_next)
+	{
+		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
+
+		buffer->data_bytes = msgs[jj].msg_len;
+		buffer->event_msec = event_msec;
+		buffer->iointernal.addr_len = msgs[jj].msg_hdr.msg_namelen;
+
+#if defined(CAT_UDP_TIMESTAMPS)
+		// If the kernel stamped the datagram, use that instead
+		if (msgs[jj].msg_hdr.msg_controllen > 0)
+		{
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[jj].msg_hdr);
+			if (cmsg) ReadKernelTimestamp(cmsg, event_msec, buffer->event_msec);
+		}
+#endif
+	}
+
+	return (u32)result;
+
+#else // CAT_UDP_MMSG
+
+	RecvBuffer *buffer = static_cast<RecvBuffer*>( buffers.head );
+	socklen_t addr_len = sizeof(buffer->iointernal.addr);
+
+	int bytes = recvfrom(GetSocket(), GetTrailingBytes(buffer), IOTHREADS_BUFFER_READ_BYTES, MSG_DONTWAIT,
+		reinterpret_cast<sockaddr*>( &buffer->iointernal.addr ), &addr_len);
+	if (bytes < 0)
+		return 0;
+
+	++_recv_syscalls;
+	++_recv_datagrams;
+
+	buffer->data_bytes = bytes;
+	buffer->event_msec = event_msec;
+	buffer->iointernal.addr_len = addr_len;
+
+	return 1;
+
+#endif // CAT_UDP_MMSG
+}
+
+u32 UDPEndpoint::RecvCoalesced(BatchSet &delivery, u32 event_msec)
+{
+#if defined(CAT_UDP_GSO)
+
+	mmsghdr msgs[UDP_GRO_BATCH_DEPTH];
+	iovec iovs[UDP_GRO_BATCH_DEPTH];
 
-	_iolayer->GetIOThreads()->GetRecvAllocator()->ReleaseBatch(buffers);
+	// For each scratch area,
+	for (u32 ii = 0; ii < UDP_GRO_BATCH_DEPTH; ++ii)
+	{
+		CoalescedRead *read = &_gro_reads[ii];
+
+		iovs[ii].iov_base = read->data;
+		iovs[ii].iov_len = UDP_GRO_READ_BYTES;
+
+		CAT_OBJCLR(msgs[ii]);
+		msgs[ii].msg_hdr.msg_name = &read->addr;
+		msgs[ii].msg_hdr.msg_namelen = sizeof(read->addr);
+		msgs[ii].msg_hdr.msg_iov = &iovs[ii];
+		msgs[ii].msg_hdr.msg_iovlen = 1;
+		msgs[ii].msg_hdr.msg_control = read->control;
+		msgs[ii].msg_hdr.msg_controllen = sizeof(read->control);
+	}
+
+	int result = recvmmsg(GetSocket(), msgs, UDP_GRO_BATCH_DEPTH, MSG_DONTWAIT, 0);
+	if (result <= 0)
+		return 0;
+
+	++_recv_syscalls;
+
+	// For each coalesced read,
+	for (int jj = 0; jj < result; ++jj)
+	{
+		CoalescedRead *read = &_gro_reads[jj];
+		u32 bytes = msgs[jj].msg_len;
+		u32 segment_bytes = bytes;
+		u32 recv_msec = event_msec;
+
+		// If the kernel merged several datagrams, find the size they were sent with
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[jj].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&msgs[jj].msg_hdr, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+			{
+				int gso_size;
+				memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+				if (gso_size > 0) segment_bytes = gso_size;
+			}
+#if defined(CAT_UDP_TIMESTAMPS)
+			else ReadKernelTimestamp(cmsg, event_msec, recv_msec);
+#endif
+		}
+
+		// If datagrams do not fit in a read buffer, drop them like a lossy link would
+		if (segment_bytes > IOTHREADS_BUFFER_READ_BYTES)
+			continue;
+
+		// Split the read into one buffer per datagram
+		u32 offset = 0;
+		do
+		{
+			// If out of spare buffers,
+			if (!_spare_buffers.head)
+			{
+				AcquireSpareBuffers();
+
+				if (!_spare_buffers.head)
+				{
+					CAT_WARN("UDPEndpoint") << "Out of memory splitting coalesced read";
+					return (u32)result;
+				}
+			}
+
+			RecvBuffer *buffer = static_cast<RecvBuffer*>( _spare_buffers.head );
+			_spare_buffers.head = buffer->batch_next;
+			if (!_spare_buffers.head) _spare_buffers.tail = 0;
+			--_spare_count;
+
+			u32 copy_bytes = bytes - offset;
+			if (copy_bytes > segment_bytes) copy_bytes = segment_bytes;
+
+			memcpy(GetTrailingBytes(buffer), read->data + offset, copy_bytes);
+			buffer->data_bytes = copy_bytes;
+			buffer->event_msec = recv_msec;
+			buffer->iointernal.addr = read->addr;
+			buffer->iointernal.addr_len = msgs[jj].msg_hdr.msg_namelen;
+
+			delivery.PushBack(buffer);
+			++_recv_datagrams;
+
+			offset += copy_bytes;
+		} while (offset < bytes);
+	}
+
+	return (u32)result;
+
+#else // CAT_UDP_GSO
+
+	return 0;
+
+#endif // CAT_UDP_GSO
 }
 
-void UDPEndpoint::ProcessReads()
+void UDPEndpoint::ProcessErrors()
 {
-	BufferAllocator *allocator = _iolayer->GetRecvAllocator();
+#if defined(CAT_UDP_RECVERR)
 
-	const u32 READ_BATCH_SIZE = 32;
+	// Until the error queue is drained,
+	CAT_FOREVER
+	{
+		NetAddr::SockAddr addr;
+		u64 control[16];
+		u8 payload[16];
+		iovec iov;
+		msghdr msg;
+
+		iov.iov_base = payload;
+		iov.iov_len = sizeof(payload);
+
+		CAT_OBJCLR(msg);
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(GetSocket(), &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+
+		for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (!(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) &&
+				!(cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+
+			// If the error reports a path MTU, the original destination is in the message name
+			if (err.ee_errno == EMSGSIZE && msg.msg_namelen > 0)
+			{
+				OnPathMTU(NetAddr(reinterpret_cast<const sockaddr*>( &addr )), err.ee_info);
+			}
+			else
+			{
+				CAT_INANE("UDPEndpoint") << "Ignored queued socket error: " << Sockets::GetErrorString(err.ee_errno);
+			}
+		}
+	}
+
+#endif // CAT_UDP_RECVERR
+}
 
-	for (;;)
+void UDPEndpoint::AcquireSpareBuffers()
+{
+	// Top up the spare buffers to a full batch
+	if (_spare_count < _batch_depth)
 	{
-		BatchSet set;
-		u32 acquired = allocator->AcquireBatch(set, READ_BATCH_SIZE);
+		BatchSet allocated;
+		u32 acquired = m_recv_allocator->AcquireBatch(allocated, _batch_depth - _spare_count);
 
-		if (acquired == 0)
+		if (acquired > 0)
 		{
-			WARN("UDPEndpoint") << "Out of memory acquiring read buffers";
-			
-			//
+			_spare_buffers.PushBack(allocated);
+			_spare_count += acquired;
 		}
+	}
+}
+
+void UDPEndpoint::ProcessReads(u32 event_msec)
+{
+	// For each batch up to the per-event limit,
+	for (u32 reads = 0; reads < MAX_READS_PER_EVENT && !IsShutdown(); ++reads)
+	{
+		AcquireSpareBuffers();
 
-		// For each buffer,
-		for (BatchHead *node = set.head; node; node = node->batch_next)
+		// If no buffers are available,
+		if (_spare_count == 0)
 		{
+			CAT_WARN("UDPEndpoint") << "Out of memory acquiring read buffers";
+			return;
 		}
 
-		RecvBuffer *buffer = reinterpret_cast<RecvBuffer*>( set.head );
-		u8 *data = GetTrailingBytes(buffer);
+		BatchSet delivery;
+		delivery.Clear();
+		u32 requested, received;
 
-		buffer->iointernal.addr_len = sizeof(buffer->iointernal.addr);
+		// If the kernel is coalescing datagrams,
+		if (_gro_reads)
+		{
+			requested = UDP_GRO_BATCH_DEPTH;
+			received = RecvCoalesced(delivery, event_msec);
+		}
+		else
+		{
+			requested = _spare_count;
+			received = RecvBatch(_spare_buffers, requested, event_msec);
+
+			if (received > 0)
+			{
+				// Split the completed buffers off the front of the spare set
+				delivery.head = _spare_buffers.head;
+
+				BatchHead *tail = _spare_buffers.head;
+				for (u32 ii = 1; ii < received; ++ii)
+					tail = tail->batch_next;
+
+				delivery.tail = tail;
+				_spare_buffers.head = tail->batch_next;
+				tail->batch_next = 0;
+				if (!_spare_buffers.head) _spare_buffers.tail = 0;
+				_spare_count -= received;
+			}
+		}
 
-		if (recvfrom(_socket, data, IOTHREADS_BUFFER_READ_BYTES,
-					 &buffer->iointernal.addr, &buffer->iointernal.addr_len) == SOCKET_ERROR)
+		// If nothing was received,
+		if (received == 0)
 		{
-			INFO("UDPEndpoint") << "Read processing halted: recvfrom() failure " << SocketGetLastErrorString();
+			int err = errno;
+
+			if (err != EAGAIN && err != EWOULDBLOCK && err != EINTR && err != ECONNREFUSED && !IsShutdown())
+			{
+				CAT_WARN("UDPEndpoint") << "recvmmsg() failure " << Sockets::GetLastErrorString();
+			}
 			return;
 		}
 
 		// Notify derived class about new buffers
-		OnReadRouting(buffers);
+		if (delivery.head)
+			OnRecvRouting(delivery);
+
+		// If the kernel queue was drained,
+		if (received < requested)
+			return;
 	}
 }
 
-void UDPEndpoint::ProcessWrites()
+u32 UDPEndpoint::SendBatch(BatchHead *node, u32 count, bool &would_block)
 {
-	for (;;)
+#if defined(CAT_UDP_MMSG)
+
+	mmsghdr msgs[UDP_MAX_BATCH_DEPTH];
+	iovec iovs[UDP_MAX_BATCH_DEPTH];
+	u32 segments[UDP_MAX_BATCH_DEPTH];
+#if defined(CAT_UDP_GSO)
+	u64 controls[UDP_MAX_BATCH_DEPTH][CAT_CEIL_UNIT(CMSG_SPACE(sizeof(u16)), sizeof(u64))];
+#endif
+
+	// For each message,
+	u32 ii = 0, msg_count = 0;
+	while (node && ii < count)
 	{
-		_write_flag.Wait();
+		SendBuffer *buffer = static_cast<SendBuffer*>( node );
+		u32 segment_bytes = buffer->data_bytes, run_bytes = 0;
+
+		mmsghdr *msg = &msgs[msg_count];
+		CAT_OBJCLR(*msg);
+		msg->msg_hdr.msg_name = &buffer->iointernal.addr;
+		msg->msg_hdr.msg_namelen = buffer->iointernal.addr_len;
+		msg->msg_hdr.msg_iov = &iovs[ii];
+
+		// Gather a run of datagrams that the kernel can segment back apart:
+		// Same address, same size, except the last one may be shorter
+		u32 run = 0;
+		CAT_FOREVER
+		{
+			iovs[ii].iov_base = GetTrailingBytes(buffer);
+			iovs[ii].iov_len = buffer->data_bytes;
+			run_bytes += buffer->data_bytes;
+			++run;
+			++ii;
+			node = node->batch_next;
+
+			if (!_gso_enabled || !node || ii >= count || buffer->data_bytes < segment_bytes || segment_bytes == 0)
+				break;
+
+			SendBuffer *next_buffer = static_cast<SendBuffer*>( node );
+
+			if (next_buffer->data_bytes > segment_bytes ||
+				run_bytes + next_buffer->data_bytes > UDP_GSO_MAX_BYTES ||
+				next_buffer->iointernal.addr_len != buffer->iointernal.addr_len ||
+				memcmp(&next_buffer->iointernal.addr, &buffer->iointernal.addr, buffer->iointernal.addr_len) != 0)
+				break;
+
+			buffer = next_buffer;
+		}
+
+		msg->msg_hdr.msg_iovlen = run;
+		segments[msg_count] = run;
 
-		if (IsShutdown())
+#if defined(CAT_UDP_GSO)
+		// If the run needs to be segmented,
+		if (run > 1)
 		{
-			INFO("UDPEndpoint") << "Write processing halted: Flagged for shutdown";
-			return;
+			msg->msg_hdr.msg_control = controls[msg_count];
+			msg->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(u16));
+
+			cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(u16));
+
+			u16 gso_size = (u16)segment_bytes;
+			memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
 		}
+#endif
 
-		// Steal the write buffers
-		_write_lock.Enter();
-		BatchSet write_buffers = _write_buffers;
+		++msg_count;
+	}
+
+	// While messages remain in this batch,
+	u32 sent = 0, sent_msgs = 0;
+	while (sent_msgs < msg_count)
+	{
+		int result = sendmmsg(GetSocket(), msgs + sent_msgs, msg_count - sent_msgs, MSG_DONTWAIT);
+
+		++_send_syscalls;
+
+		if (result < 0)
+		{
+			int err = errno;
+
+			if (err == EINTR)
+				continue;
+
+			// If the kernel send buffer is full, leave the rest queued
+			if (err == EAGAIN || err == EWOULDBLOCK)
+			{
+				would_block = true;
+				break;
+			}
+
+#if defined(CAT_UDP_GSO)
+			// If the kernel or device cannot segment, stop trying and resend these one by one
+			if (segments[sent_msgs] > 1 && (err == EIO || err == EINVAL || err == ENOPROTOOPT || err == EOPNOTSUPP))
+			{
+				CAT_WARN("UDPEndpoint") << "Disabling UDP GSO after send failure: " << Sockets::GetErrorString(err);
+				_gso_enabled = false;
+				break;
+			}
+#endif
+
+			// Drop the datagrams that failed, like a lossy link would
+			sent += segments[sent_msgs++];
+			continue;
+		}
+
+		// For each message sent,
+		for (int jj = 0; jj < result; ++jj)
+		{
+			u32 run = segments[sent_msgs++];
+			_send_datagrams += run;
+			sent += run;
+		}
+	}
+
+	return sent;
+
+#else // CAT_UDP_MMSG
+
+	SendBuffer *buffer = static_cast<SendBuffer*>( node );
+
+	int result;
+	do
+	{
+		result = sendto(GetSocket(), GetTrailingBytes(buffer), buffer->data_bytes, MSG_DONTWAIT,
+			reinterpret_cast<const sockaddr*>( &buffer->iointernal.addr ), buffer->iointernal.addr_len);
+
+		++_send_syscalls;
+	} while (result < 0 && errno == EINTR);
+
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		would_block = true;
+		return 0;
+	}
+
+	// Drop a datagram that failed, like a lossy link would
+	if (result >= 0)
+		++_send_datagrams;
+
+	return 1;
+
+#endif // CAT_UDP_MMSG
+}
+
+void UDPEndpoint::FlushWrites()
+{
+	_write_lock.Enter();
+
+	// If another thread is flushing, it will pick up the new writes
+	if (_write_flushing)
+	{
+		_write_lock.Leave();
+		return;
+	}
+
+	_write_flushing = true;
+
+	BatchSet done;
+	done.Clear();
+
+	// While writes are queued,
+	while (_write_buffers.head)
+	{
+		// Take the whole queue and send it without holding the lock
+		BatchSet queued = _write_buffers;
 		_write_buffers.Clear();
+
 		_write_lock.Leave();
+		BatchHead *rest = SendQueued(queued, done);
+		_write_lock.Enter();
 
-		// For each buffer,
-		for (BatchHead *node = write_buffers.head; node; node = node->next)
+		// If the kernel refused some, put them back in front of any newer writes
+		if (rest)
 		{
-			SendBuffer *buffer = reinterpret_cast<SendBuffer*>( node );
-			u8 *data = GetTrailingBytes(buffer);
-			u32 bytes = buffer->GetBytes();
+			queued.tail->batch_next = _write_buffers.head;
+			if (!_write_buffers.head) _write_buffers.tail = queued.tail;
+			_write_buffers.head = rest;
+			break;
+		}
+	}
+
+	_write_flushing = false;
+
+	// If writes are left waiting on the kernel and nothing is watching for EPOLLOUT,
+	bool watch = _write_buffers.head && !_write_watched;
+	if (watch) _write_watched = true;
+
+	_write_lock.Leave();
+
+	if (watch)
+		WatchWrites();
+
+	if (done.head)
+		m_udp_send_allocator->ReleaseBatch(done);
+}
+
+BatchHead *UDPEndpoint::SendQueued(const BatchSet &queued, BatchSet &done)
+{
+	BatchHead *node = queued.head;
+	BatchHead *last = 0;
+
+	// While writes remain,
+	while (node)
+	{
+		bool would_block = false;
+		u32 sent = SendBatch(node, _batch_depth, would_block);
 
-			// Transmit it without checking return value
-			sendto(_socket, &buffer->iointernal.addr, &buffer->iointernal.addr_len);
+		while (sent--)
+		{
+			last = node;
+			node = node->batch_next;
 		}
 
-		StdAllocator::ii->ReleaseBatch(write_buffers);
+		if (would_block)
+			break;
+	}
+
+	// If any were consumed, split them off for release
+	if (last)
+	{
+		last->batch_next = 0;
+
+		BatchSet sent_set;
+		sent_set.head = queued.head;
+		sent_set.tail = last;
+		done.PushBack(sent_set);
+	}
+
+	return node;
+}
+
+void UDPEndpoint::WatchWrites()
+{
+	// Reference held by the armed watcher until it fires
+	AddRef(CAT_REFOBJECT_TRACE);
+
+	if (!m_io_threads->Rearm(&_write_watcher, EPOLLOUT))
+	{
+		_write_lock.Enter();
+		_write_watched = false;
+		_write_lock.Leave();
+
+		ReleaseRef(CAT_REFOBJECT_TRACE);
 	}
 }
@@ -179,3 +179,22 @@ void UDPSendAllocator::ReleaseBatch(const BatchSet &set)
 	// If previous bin is non-zero,
 	if (prev_bin > 0) _allocators[prev_bin - 1]->ReleaseBatch(kills);
 }
+
+void UDPSendAllocator::GetStats(MagazineCacheStats &stats)
+{
+	CAT_OBJCLR(stats);
+
+	// For each bin,
+	for (int ii = 0, count = _num_allocators; ii < count; ++ii)
+	{
+		MagazineCacheStats bin;
+		_allocators[ii]->GetStats(bin);
+
+		stats.slot_collisions += bin.slot_collisions;
+		stats.depot_retries += bin.depot_retries;
+		stats.depot_pushes += bin.depot_pushes;
+		stats.depot_pops += bin.depot_pops;
+		stats.depot_misses += bin.depot_misses;
+		stats.steals += bin.steals;
+	}
+}
@@ -184,29 +184,17 @@ void Client::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 					_key_agreement_initiator.KeyEncryption(&key_hash, &_auth_enc, _session_key) &&
 					InitializeTransportSecurity(true, _auth_enc))
 				{
-					_last_recv_tsc = _next_sync_time = _mtu_discovery_time = _clock->msec();
-					_mtu_discovery_attempts = 2;
+					_last_recv_tsc = _next_sync_time = _clock->msec();
 					_sync_attempts = 0;
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 					// Set ID
-					u16 *id = reinterpret_cast<u16*>( data + 1 + ANSWER_BYTES );
-					_my_id = getLE(*id);
+					_my_id = ReadRoamingID(data + 1 + ANSWER_BYTES);
 #endif
 
 					WriteTimePing();
 
-					if (!DontFragment())
-					{
-						CAT_WARN("Client") << "Unable to detect MTU: Unable to set DF bit";
-
-						_mtu_discovery_attempts = 0;
-					}
-					else if (!PostMTUProbe(MAXIMUM_MTU) ||
-							 !PostMTUProbe(MEDIUM_MTU))
-					{
-						CAT_WARN("Client") << "Unable to detect MTU: First probe post failure";
-					}
+					StartMTUSearch(_last_recv_tsc);
 
 					_connected = true;
 					OnConnect();
@@ -254,8 +242,13 @@ void Client::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 				// If needs to be decompressed,
 				if (data[data_bytes])
 				{
+					int compress_size = 0;
+
 					// Decompress the buffer
-					int compress_size = LZ4_uncompress_unknownOutputSize((const char*)data, (char*)compress_buffer, data_bytes, sizeof(compress_buffer));
+					if (data[data_bytes] != DGRAM_LZ4_DICT)
+						compress_size = LZ4_uncompress_unknownOutputSize((const char*)data, (char*)compress_buffer, data_bytes, sizeof(compress_buffer));
+					else
+						compress_size = DecompressDictionary(data, data_bytes, compress_buffer, sizeof(compress_buffer));
 
 					if (compress_size <= 0)
 					{
@@ -339,40 +332,9 @@ void Client::OnTick(ThreadLocalStorage &tls, u32 now)
 				}
 			}
 
-			// If MTU discovery attempts continue,
-			if (_mtu_discovery_attempts > 0)
-			{
-				// If it is time to re-probe the MTU,
-				if ((s32)(now - _mtu_discovery_time) >= MTU_PROBE_INTERVAL)
-				{
-					// If payload bytes already maxed out,
-					if (_max_payload_bytes >= MAXIMUM_MTU - _udpip_bytes - SPHYNX_C2S_OVERHEAD ||
-						_mtu_discovery_attempts <= 0)
-					{
-						// Stop posting probes
-						_mtu_discovery_attempts = 0;
-
-						// On final attempt set DF=0
-						DontFragment(false);
-					}
-					else
-					{
-						if (!PostMTUProbe(MAXIMUM_MTU))
-						{
-							CAT_WARN("Client") << "Unable to detect MTU: Probe post failure";
-						}
-
-						if (_max_payload_bytes < MEDIUM_MTU - _udpip_bytes - SPHYNX_C2S_OVERHEAD &&
-							!PostMTUProbe(MEDIUM_MTU))
-						{
-							CAT_WARN("Client") << "Unable to detect MTU: Probe post failure";
-						}
-
-						_mtu_discovery_time = now;
-						--_mtu_discovery_attempts;
-					}
-				}
-			}
+			// If MTU discovery continues,
+			if (_mtu_probe)
+				UpdateMTUSearch(now);
 
 			// Do derived class tick event so any messages posted do not need to wait for the next tick
 			OnCycle(now);
@@ -404,6 +366,20 @@ Client::Client()
 	_ts_sample_count = 0;
 
 	_worker_id = INVALID_WORKER_ID;
+
+	// Path MTU search
+	_mtu_probe = 0;
+	_mtu_reported = 0;
+
+	// Compression dictionary
+	_dict_buffer = 0;
+	_dict_received = 0;
+}
+
+Client::~Client()
+{
+	if (_dict_buffer)
+		delete []_dict_buffer;
 }
 
 bool Client::InitialConnect(TunnelTLS *tls, TunnelPublicKey &public_key, const char *session_key)
@@ -439,6 +415,7 @@ bool Client::InitialConnect(TunnelTLS *tls, TunnelPublicKey &public_key, const c
 	bool require_ip4 = m_settings->getInt("Sphynx.Client.RequireIPv4", 1) != 0;
 	int kernelReceiveBufferBytes = m_settings->getInt("Sphynx.Client.KernelReceiveBuffer",
 		DEFAULT_KERNEL_RECV_BUFFER, MIN_KERNEL_RECV_BUFFER, MAX_KERNEL_RECV_BUFFER);
+	FlowControlMode flow_control_mode = FlowControl::GetModeFromName(m_settings->getStr("Sphynx.Client.FlowControl", "Tampon").c_str());
 
 	// Attempt to bind to any port and accept ICMP errors initially
 	if (!Initialize(0, true, request_ip6, require_ip4, kernelReceiveBufferBytes))
@@ -450,6 +427,15 @@ bool Client::InitialConnect(TunnelTLS *tls, TunnelPublicKey &public_key, const c
 	// Initialize max payload bytes
 	InitializePayloadBytes(SupportsIPv6());
 
+	if (!InitializeFlowControl(flow_control_mode))
+	{
+		CAT_WARN("Client") << "Failed to connect: Out of memory initializing flow control";
+		return false;
+	}
+
+	SetACKFrequency(m_settings->getInt("Sphynx.Client.AckEvery", DEFAULT_ACK_EVERY),
+		m_settings->getInt("Sphynx.Client.AckMaxDelay", DEFAULT_ACK_MAX_DELAY));
+
 	return true;
 }
 
@@ -637,6 +623,127 @@ bool Client::WriteTimePing()
 	return WriteOOB(IOP_C2S_TIME_PING, &timestamp, 4, SOP_INTERNAL);
 }
 
+void Client::StartMTUSearch(u32 now)
+{
+	// Everything up to the current payload size is known to work
+	_mtu_low = _max_payload_bytes + _udpip_bytes + SPHYNX_C2S_OVERHEAD;
+
+	// Never probe past what a receive buffer can hold
+	_mtu_high = IOTHREADS_BUFFER_READ_BYTES + _udpip_bytes;
+	if (_mtu_high > MAXIMUM_MTU) _mtu_high = MAXIMUM_MTU;
+
+	_mtu_probe = 0;
+	_mtu_reported = 0;
+
+	if (!DontFragment())
+	{
+		CAT_WARN("Client") << "Unable to detect MTU: Unable to set DF bit";
+		return;
+	}
+
+	// Most paths carry full size frames, so try the top of the range first
+	PostMTUSearchProbe(now, _mtu_high);
+}
+
+void Client::PostMTUSearchProbe(u32 now, u32 mtu)
+{
+	_mtu_probe = mtu;
+	_mtu_discovery_time = now;
+	_mtu_discovery_attempts = MTU_PROBE_RETRIES;
+
+	if (!PostMTUProbe(mtu))
+	{
+		CAT_WARN("Client") << "Unable to detect MTU: Probe post failure";
+	}
+}
+
+void Client::NextMTUSearchStep(u32 now)
+{
+	// If the search range is narrow enough,
+	if (_mtu_high < _mtu_low + MTU_SEARCH_PRECISION)
+	{
+		CAT_INFO("Client") << "Path MTU discovery complete.  MTU = " << _mtu_low;
+
+		_mtu_probe = 0;
+
+		// Let the kernel fragment from now on in case the path shrinks
+		DontFragment(false);
+		return;
+	}
+
+	// Bisect the remaining range
+	PostMTUSearchProbe(now, (_mtu_low + _mtu_high + 1) / 2);
+}
+
+void Client::UpdateMTUSearch(u32 now)
+{
+	u32 reported = _mtu_reported;
+
+	// If the kernel reported the path MTU,
+	if (reported)
+	{
+		_mtu_reported = 0;
+
+		if (reported >= MINIMUM_MTU && reported < _mtu_high)
+		{
+			_mtu_high = reported;
+			if (_mtu_high < _mtu_low) _mtu_low = _mtu_high;
+
+			// If the outstanding probe cannot fit, try the reported size exactly
+			if (_mtu_probe > _mtu_high)
+			{
+				if (_mtu_high > _mtu_low)
+					PostMTUSearchProbe(now, _mtu_high);
+				else
+					NextMTUSearchStep(now);
+				return;
+			}
+		}
+	}
+
+	// If the probe has not been acknowledged in time,
+	if ((s32)(now - _mtu_discovery_time) >= (s32)MTU_PROBE_TIMEOUT)
+	{
+		// If retries remain, it may have just been lost
+		if (--_mtu_discovery_attempts > 0)
+		{
+			_mtu_discovery_time = now;
+
+			if (!PostMTUProbe(_mtu_probe))
+			{
+				CAT_WARN("Client") << "Unable to detect MTU: Probe post failure";
+			}
+		}
+		else
+		{
+			// Too large for this path
+			_mtu_high = _mtu_probe - 1;
+
+			NextMTUSearchStep(now);
+		}
+	}
+}
+
+void Client::OnPathMTU(const NetAddr &dest, u32 mtu)
+{
+	// The server is the only destination, so picked up on the next tick
+	_mtu_reported = mtu;
+}
+
+void Client::OnPaceTimer(ThreadLocalStorage &tls, u32 now)
+{
+	OnPacingWakeup();
+}
+
+bool Client::SchedulePacingWakeup(u32 when)
+{
+	// If not assigned to a worker yet,
+	if (_worker_id == INVALID_WORKER_ID)
+		return false;
+
+	return m_worker_threads->ScheduleWakeup(_worker_id, this, WorkerTimerDelegate::FromMember<Client, &Client::OnPaceTimer>(this), when);
+}
+
 s32 Client::WriteDatagrams(const BatchSet &buffers, u32 count)
 {
 	u64 iv = _auth_enc.GrabIVRange(count);
@@ -645,7 +752,7 @@ s32 Client::WriteDatagrams(const BatchSet &buffers, u32 count)
 	/*
 		The format of each buffer:
 
-		[TRANSPORT(X)] [ENCRYPTION(11)] [USERID(2)] <- user id only in roaming ip mode
+		[TRANSPORT(X)] [ENCRYPTION(11)] [USERID(3)] <- user id only in roaming ip mode
 
 		The encryption overhead is not filled in yet.
 		Each buffer's data_bytes is the transport layer data length.
@@ -653,7 +760,7 @@ s32 Client::WriteDatagrams(const BatchSet &buffers, u32 count)
 	*/
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	u16 my_id = getLE((u16)_my_id);
+	u32 my_id = _my_id;
 #endif
 
 	// For each datagram to send,
@@ -669,11 +776,10 @@ s32 Client::WriteDatagrams(const BatchSet &buffers, u32 count)
 		_auth_enc.Encrypt(iv, msg_data, msg_bytes);
 #else
 		// Encrypt the message
-		_auth_enc.Encrypt(iv, msg_data, msg_bytes - 2);
+		_auth_enc.Encrypt(iv, msg_data, msg_bytes - ROAMING_ID_BYTES);
 
 		// Write ID to the end of packets
-		u16 *msg_id = reinterpret_cast<u16*>( msg_data + msg_bytes - 2 );
-		*msg_id = my_id;
+		WriteRoamingID(msg_data + msg_bytes - ROAMING_ID_BYTES, my_id);
 #endif // CAT_SPHYNX_ROAMING_IP
 
 		//INFO("Client") << "Transmitting datagram with " << msg_bytes << " data bytes";
@@ -690,18 +796,98 @@ s32 Client::WriteDatagrams(const BatchSet &buffers, u32 count)
 	return write_count;
 }
 
+void Client::OnDictionaryPiece(BufferStream data, u32 bytes)
+{
+	u32 dict_id = getLE(*reinterpret_cast<u32*>( data + 1 ));
+	u32 dict_bytes = getLE(*reinterpret_cast<u16*>( data + 5 ));
+	u32 offset = getLE(*reinterpret_cast<u16*>( data + 7 ));
+	u32 piece_bytes = bytes - (IOP_S2C_DICTIONARY_MINLEN - 1);
+
+	// If dictionary was already installed,
+	if (_recv_dictionary)
+		return;
+
+	// If this is the first piece,
+	if (!_dict_buffer)
+	{
+		if (dict_bytes > CompressionDictionary::MAX_BYTES)
+		{
+			CAT_WARN("Client") << "Ignored oversized compression dictionary of " << dict_bytes << " bytes";
+			return;
+		}
+
+		_dict_buffer = new (std::nothrow) u8[dict_bytes];
+		if (!_dict_buffer) return;
+
+		_dict_id = dict_id;
+		_dict_bytes = dict_bytes;
+		_dict_received = 0;
+	}
+
+	// If piece does not fit the dictionary being received,
+	if (dict_id != _dict_id || dict_bytes != _dict_bytes || offset + piece_bytes > dict_bytes)
+	{
+		CAT_WARN("Client") << "Ignored invalid compression dictionary piece";
+		return;
+	}
+
+	memcpy(_dict_buffer + offset, data + 8, piece_bytes);
+	_dict_received += piece_bytes;
+
+	// If dictionary is not complete yet,
+	if (_dict_received < _dict_bytes)
+		return;
+
+	CompressionDictionary *dict = CompressionDictionary::Create(_dict_buffer, _dict_bytes);
+
+	delete []_dict_buffer;
+	_dict_buffer = 0;
+
+	if (!dict) return;
+
+	// If dictionary arrived intact,
+	if (dict->GetID() == _dict_id)
+	{
+		// Server compresses against it after this acknowledgment, and it already holds it
+		SetRecvDictionary(dict);
+		SetSendDictionary(dict);
+
+		u32 id = getLE(_dict_id);
+		WriteReliable(STREAM_UNORDERED, IOP_C2S_DICTIONARY_ACK, &id, sizeof(id), SOP_INTERNAL);
+
+		CAT_INFO("Client") << "Installed " << _dict_bytes << " byte compression dictionary";
+	}
+	else
+	{
+		CAT_WARN("Client") << "Compression dictionary failed verification";
+	}
+
+	dict->ReleaseRef();
+}
+
 void Client::OnInternal(u32 recv_time, BufferStream data, u32 bytes)
 {
 	switch (data[0] & 3)
 	{
 	case IOP_S2C_MTU_SET:
-		if (bytes == IOP_S2C_MTU_SET_LEN)
+		// If server is sending a piece of its compression dictionary,
+		if (data[0] == IOP_S2C_DICTIONARY)
+		{
+			if (bytes >= IOP_S2C_DICTIONARY_MINLEN)
+				OnDictionaryPiece(data, bytes);
+		}
+		else if (data[0] == IOP_ACK_FREQUENCY)
+		{
+			if (bytes == IOP_ACK_FREQUENCY_LEN)
+				SetACKFrequency(data[1], getLE(*reinterpret_cast<u16*>( data + 2 )));
+		}
+		else if (bytes == IOP_S2C_MTU_SET_LEN)
 		{
 			u16 max_payload_bytes = getLE(*reinterpret_cast<u16*>( data + 1 ));
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
-			// Subtract 2 off for the extra c2s overhead
-			max_payload_bytes -= 2;
+			// Subtract off the extra c2s overhead
+			max_payload_bytes -= ROAMING_ID_BYTES;
 #endif
 
 			// If new maximum payload is greater than the previous one,
@@ -712,6 +898,17 @@ void Client::OnInternal(u32 recv_time, BufferStream data, u32 bytes)
 			}
 
 			CAT_WARN("Client") << "Got IOP_S2C_MTU_SET.  Max payload bytes = " << max_payload_bytes;
+
+			// If MTU discovery continues,
+			if (_mtu_probe)
+			{
+				u32 confirmed = _max_payload_bytes + _udpip_bytes + SPHYNX_C2S_OVERHEAD;
+				if (confirmed > _mtu_low) _mtu_low = confirmed;
+
+				// If the outstanding probe made it through, narrow the search right away
+				if (_mtu_low >= _mtu_probe)
+					NextMTUSearchStep(recv_time);
+			}
 		}
 		break;
 
@@ -0,0 +1,429 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/sphynx/CompressionDictionary.hpp>
+#include <cat/threads/Atomic.hpp>
+#include <cat/hash/Murmur.hpp>
+#include <cat/io/Log.hpp>
+#include <fstream>
+using namespace std;
+using namespace cat;
+using namespace sphynx;
+
+
+//// Dictionary LZ4
+
+/*
+	These write and read the ordinary LZ4 block format.  The only difference
+	from the bundled codec is that the data is preceded by the dictionary in
+	the same buffer, and matches may reach back into it.  Datagrams are at
+	most MAXIMUM_MTU bytes, so every offset fits in 16 bits.
+*/
+
+static const u32 DICT_MIN_MATCH = 4;
+static const u32 DICT_LAST_LITERALS = 5; // The last bytes are always literals
+static const u32 DICT_MATCH_FINISH = 12; // No match starts this close to the end
+static const u32 DICT_ML_BITS = 4;
+static const u32 DICT_ML_MASK = (1 << DICT_ML_BITS) - 1;
+static const u32 DICT_RUN_MASK = (1 << (8 - DICT_ML_BITS)) - 1;
+
+static CAT_INLINE u32 ReadU32(const u8 *p)
+{
+	u32 x;
+	memcpy(&x, p, sizeof(x));
+	return x;
+}
+
+static CAT_INLINE u32 HashPosition(const u8 *p)
+{
+	return (ReadU32(p) * 2654435761U) >> (32 - CompressionDictionary::HASH_BITS);
+}
+
+static CAT_INLINE u8 *WriteLength(u8 *op, u32 length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+
+	*op++ = (u8)length;
+	return op;
+}
+
+static u8 *WriteSequence(u8 *op, const u8 *literals, u32 literal_bytes, u32 offset, u32 match_extra)
+{
+	u8 *token = op++;
+
+	if (literal_bytes >= DICT_RUN_MASK)
+	{
+		*token = (u8)(DICT_RUN_MASK << DICT_ML_BITS);
+		op = WriteLength(op, literal_bytes - DICT_RUN_MASK);
+	}
+	else *token = (u8)(literal_bytes << DICT_ML_BITS);
+
+	memcpy(op, literals, literal_bytes);
+	op += literal_bytes;
+
+	// Final run of literals has no match
+	if (!offset) return op;
+
+	op[0] = (u8)offset;
+	op[1] = (u8)(offset >> 8);
+	op += 2;
+
+	if (match_extra >= DICT_ML_MASK)
+	{
+		*token |= DICT_ML_MASK;
+		op = WriteLength(op, match_extra - DICT_ML_MASK);
+	}
+	else *token |= (u8)match_extra;
+
+	return op;
+}
+
+// Index every position of the dictionary, later positions winning
+static void PrimeTable(u16 *table, const u8 *dict, u32 dict_bytes)
+{
+	memset(table, 0, CompressionDictionary::HASH_SIZE * sizeof(u16));
+
+	for (u32 ii = 0; ii + DICT_MIN_MATCH <= dict_bytes; ++ii)
+		table[HashPosition(dict + ii)] = (u16)ii;
+}
+
+// Data starts at base + (src - base) and the dictionary fills the bytes before it
+static u32 CompressPrefixed(u16 *table, const u8 *base, const u8 *src, u32 bytes, u8 *out)
+{
+	const u8 *ip = src, *anchor = src, *end = src + bytes;
+	u8 *op = out;
+
+	if (bytes > DICT_MATCH_FINISH)
+	{
+		const u8 *finish = end - DICT_MATCH_FINISH;
+		const u8 *match_limit = end - DICT_LAST_LITERALS;
+
+		while (ip <= finish)
+		{
+			u32 h = HashPosition(ip);
+			const u8 *ref = base + table[h];
+			table[h] = (u16)(ip - base);
+
+			if (ReadU32(ref) != ReadU32(ip))
+			{
+				++ip;
+				continue;
+			}
+
+			// Extend the match backwards over pending literals
+			while (ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				--ip;
+				--ref;
+			}
+
+			const u8 *mp = ip + DICT_MIN_MATCH, *mr = ref + DICT_MIN_MATCH;
+			while (mp < match_limit && *mp == *mr)
+			{
+				++mp;
+				++mr;
+			}
+
+			op = WriteSequence(op, anchor, (u32)(ip - anchor), (u32)(ip - ref), (u32)(mp - ip) - DICT_MIN_MATCH);
+
+			// Index near the end of the match so a following repeat is found
+			table[HashPosition(mp - 2)] = (u16)(mp - 2 - base);
+
+			ip = anchor = mp;
+		}
+	}
+
+	op = WriteSequence(op, anchor, (u32)(end - anchor), 0, 0);
+
+	return (u32)(op - out);
+}
+
+// Put back the hash slots that compressing the data may have overwritten
+static void RestoreTable(u16 *table, const u16 *primed, const u8 *src, u32 bytes)
+{
+	if (bytes <= DICT_MATCH_FINISH)
+		return;
+
+	for (const u8 *p = src, *last = src + bytes - DICT_MIN_MATCH; p <= last; ++p)
+	{
+		u32 h = HashPosition(p);
+		table[h] = primed[h];
+	}
+}
+
+// The low bytes before dest hold the dictionary
+static s32 DecompressPrefixed(const u8 *src, u32 bytes, u8 *dest, u32 limit, const u8 *low)
+{
+	const u8 *ip = src, *end = src + bytes;
+	u8 *op = dest, *oend = dest + limit;
+
+	CAT_FOREVER
+	{
+		if (ip >= end) return -1;
+
+		u32 token = *ip++;
+
+		// Literals
+		u32 length = token >> DICT_ML_BITS;
+		if (length == DICT_RUN_MASK)
+		{
+			u32 s;
+			do
+			{
+				if (ip >= end) return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+
+		if (length > (u32)(end - ip) || length > (u32)(oend - op))
+			return -1;
+
+		memcpy(op, ip, length);
+		op += length;
+		ip += length;
+
+		// The final sequence has only literals
+		if (ip == end) break;
+
+		// Match
+		if (end - ip < 2) return -1;
+
+		u32 offset = ip[0] | ((u32)ip[1] << 8);
+		ip += 2;
+
+		if (!offset || offset > (u32)(op - low))
+			return -1;
+
+		length = token & DICT_ML_MASK;
+		if (length == DICT_ML_MASK)
+		{
+			u32 s;
+			do
+			{
+				if (ip >= end) return -1;
+				s = *ip++;
+				length += s;
+			} while (s == 255);
+		}
+		length += DICT_MIN_MATCH;
+
+		if (length > (u32)(oend - op))
+			return -1;
+
+		// Byte at a time, since the match may overlap the bytes it produces
+		const u8 *ref = op - offset;
+		while (length--)
+			*op++ = *ref++;
+	}
+
+	return (s32)(op - dest);
+}
+
+
+//// DictionaryWorkspace
+
+void DictionaryWorkspace::FreeMemory()
+{
+	if (dict) dict->ReleaseRef();
+	if (buffer) delete []buffer;
+	if (table) delete []table;
+
+	Clear();
+}
+
+
+//// CompressionDictionary
+
+CompressionDictionary::CompressionDictionary()
+{
+	_references = 1;
+	_data = 0;
+	_bytes = 0;
+	_id = 0;
+	_table = 0;
+}
+
+CompressionDictionary::~CompressionDictionary()
+{
+	if (_data) delete []_data;
+	if (_table) delete []_table;
+}
+
+u32 CompressionDictionary::CalculateID(const void *data, u32 bytes)
+{
+	MurmurHash hash(data, bytes);
+
+	return hash.Get32();
+}
+
+CompressionDictionary *CompressionDictionary::Create(const void *data, u32 bytes)
+{
+	// If the dictionary is empty or too large,
+	if (bytes < DICT_MIN_MATCH || bytes > MAX_BYTES)
+	{
+		CAT_WARN("CompressionDictionary") << "Rejected dictionary of " << bytes << " bytes";
+		return 0;
+	}
+
+	CompressionDictionary *dict = new (std::nothrow) CompressionDictionary;
+	if (!dict) return 0;
+
+	dict->_data = new (std::nothrow) u8[bytes];
+	dict->_table = new (std::nothrow) u16[HASH_SIZE];
+
+	if (!dict->_data || !dict->_table)
+	{
+		delete dict;
+		return 0;
+	}
+
+	memcpy(dict->_data, data, bytes);
+	dict->_bytes = bytes;
+	dict->_id = CalculateID(data, bytes);
+
+	// Positions are relative to the start of the dictionary, where the workspace buffer begins
+	PrimeTable(dict->_table, dict->_data, bytes);
+
+	return dict;
+}
+
+CompressionDictionary *CompressionDictionary::Load(const char *path)
+{
+	ifstream file(path, ios::in | ios::binary);
+
+	if (!file)
+	{
+		CAT_WARN("CompressionDictionary") << "Unable to open dictionary file " << path;
+		return 0;
+	}
+
+	u8 data[MAX_BYTES + 1];
+	file.read((char*)data, sizeof(data));
+	u32 bytes = (u32)file.gcount();
+
+	// If the file was too large to be a dictionary,
+	if (bytes > MAX_BYTES)
+	{
+		CAT_WARN("CompressionDictionary") << "Dictionary file " << path << " exceeds " << MAX_BYTES << " bytes";
+		return 0;
+	}
+
+	CompressionDictionary *dict = Create(data, bytes);
+
+	if (dict)
+	{
+		CAT_INFO("CompressionDictionary") << "Loaded " << bytes << " byte dictionary " << HexDumpString(&dict->_id, 4) << " from " << path;
+	}
+
+	return dict;
+}
+
+void CompressionDictionary::AddRef()
+{
+	Atomic::Add(&_references, 1);
+}
+
+void CompressionDictionary::ReleaseRef()
+{
+	// If this was the last reference,
+	if (Atomic::Add(&_references, -1) == 1)
+		delete this;
+}
+
+bool CompressionDictionary::Install(DictionaryWorkspace &ws)
+{
+	// If the workspace already holds this dictionary,
+	if (ws.dict == this)
+		return true;
+
+	if (!ws.buffer)
+	{
+		ws.buffer = new (std::nothrow) u8[MAX_BYTES + MAXIMUM_MTU];
+		if (!ws.buffer) return false;
+	}
+
+	if (ws.dict) ws.dict->ReleaseRef();
+
+	AddRef();
+	ws.dict = this;
+
+	memcpy(ws.buffer, _data, _bytes);
+
+	// The table is copied again on next compression
+	if (ws.table)
+	{
+		delete []ws.table;
+		ws.table = 0;
+	}
+
+	return true;
+}
+
+u32 CompressionDictionary::Compress(DictionaryWorkspace &ws, const u8 *data, u32 bytes, u8 *out)
+{
+	if (bytes > MAXIMUM_MTU || !Install(ws))
+		return 0;
+
+	if (!ws.table)
+	{
+		ws.table = new (std::nothrow) u16[HASH_SIZE];
+		if (!ws.table) return 0;
+
+		memcpy(ws.table, _table, HASH_SIZE * sizeof(u16));
+	}
+
+	u8 *src = ws.buffer + _bytes;
+	memcpy(src, data, bytes);
+
+	u32 compress_bytes = CompressPrefixed(ws.table, ws.buffer, src, bytes, out);
+
+	RestoreTable(ws.table, _table, src, bytes);
+
+	return compress_bytes < bytes ? compress_bytes : 0;
+}
+
+s32 CompressionDictionary::Decompress(DictionaryWorkspace &ws, const u8 *data, u32 bytes, u8 *out, u32 out_limit)
+{
+	if (!Install(ws))
+		return -1;
+
+	if (out_limit > MAXIMUM_MTU)
+		out_limit = MAXIMUM_MTU;
+
+	// Decompress right after the dictionary so matches can refer back into it
+	u8 *dest = ws.buffer + _bytes;
+
+	s32 decompress_bytes = DecompressPrefixed(data, bytes, dest, out_limit, ws.buffer);
+
+	if (decompress_bytes > 0)
+		memcpy(out, dest, decompress_bytes);
+
+	return decompress_bytes;
+}
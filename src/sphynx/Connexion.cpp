@@ -35,7 +35,9 @@ using namespace cat;
 using namespace sphynx;
 
 static Clock *m_clock = 0;
+static WorkerThreads *m_worker_threads = 0;
 static TLSInstance<TunnelTLS> m_tunnel_tls;
+static TLSInstance<TransportTLS> m_transport_tls;
 
 
 //// Connexion
@@ -47,7 +49,7 @@ u32 Connexion::getLocalTime()
 
 bool Connexion::OnInitialize()
 {
-	Use(m_clock);
+	Use(m_clock, m_worker_threads);
 
 	return true;
 }
@@ -55,6 +57,11 @@ bool Connexion::OnInitialize()
 void Connexion::OnDestroy()
 {
 	if (_parent) _parent->_conn_map.Remove(this);
+
+	// If the source is holding the migration marker, it will not tick again to
+	// send it on, so send it now and let it finish the move and drop its reference
+	if (Atomic::Set(&_migrate_waiting, 0))
+		PostMigrateMarker(_migrate_from);
 }
 
 bool Connexion::OnFinalize()
@@ -78,13 +85,13 @@ void Connexion::RetransmitAnswer(RecvBuffer *buffer)
 	u8 *data = GetTrailingBytes(buffer);
 	u32 bytes = buffer->data_bytes;
 
-	if (bytes == C2S_CHALLENGE_LEN && data[0] == C2S_CHALLENGE)
+	if (_handshake && bytes == C2S_CHALLENGE_LEN && data[0] == C2S_CHALLENGE)
 	{
 		u8 *challenge = data + sizeof(PROTOCOL_MAGIC) + 1 + 4;
 
 		// Only need to check that the challenge is the same, since we
 		// have already validated the cookie and protocol magic to get here
-		if (_first_challenge_hash == MurmurHash(challenge, CHALLENGE_BYTES).Get64())
+		if (_handshake->first_challenge_hash == MurmurHash(challenge, CHALLENGE_BYTES).Get64())
 		{
 			CAT_WARN("Connexion") << "Ignoring challenge: Replay challenge in bad state";
 			return;
@@ -100,7 +107,7 @@ void Connexion::RetransmitAnswer(RecvBuffer *buffer)
 		// Construct packet
 		pkt[0] = S2C_ANSWER;
 
-		memcpy(pkt + 1, _cached_answer, ANSWER_BYTES);
+		memcpy(pkt + 1, _handshake->answer, ANSWER_BYTES);
 
 		_parent->Write(pkt, S2C_ANSWER_LEN, buffer->GetAddr());
 
@@ -111,6 +118,23 @@ void Connexion::RetransmitAnswer(RecvBuffer *buffer)
 #endif // CAT_SPHYNX_ROAMING_IP
 
 void Connexion::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
+{
+	// If not changing workers, this is the owning worker
+	if (_migrate_state == MIGRATE_IDLE)
+	{
+		double start_usec = m_clock->usec();
+
+		ProcessDatagrams(buffers);
+
+		_cost_usec += (u32)(m_clock->usec() - start_usec);
+	}
+	else
+	{
+		OnMigrateRecv(tls, buffers);
+	}
+}
+
+void Connexion::ProcessDatagrams(const BatchSet &buffers)
 {
 	u8 compress_buffer[IOTHREADS_BUFFER_READ_BYTES];
 	u32 buffer_count = 0;
@@ -133,7 +157,7 @@ void Connexion::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 		// If the data could be decrypted,
 		if (data_bytes > SPHYNX_C2S_OVERHEAD &&
 #if defined(CAT_SPHYNX_ROAMING_IP)
-			_auth_enc.Decrypt(data, data_bytes - 2))
+			_auth_enc.Decrypt(data, data_bytes - ROAMING_ID_BYTES))
 #else
 			_auth_enc.Decrypt(data, data_bytes))
 #endif
@@ -143,8 +167,13 @@ void Connexion::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 			// If needs to be decompressed,
 			if (data[data_bytes])
 			{
+				int compress_size = 0;
+
 				// Decompress the buffer
-				int compress_size = LZ4_uncompress_unknownOutputSize((const char*)data, (char*)compress_buffer, data_bytes, sizeof(compress_buffer));
+				if (data[data_bytes] != DGRAM_LZ4_DICT)
+					compress_size = LZ4_uncompress_unknownOutputSize((const char*)data, (char*)compress_buffer, data_bytes, sizeof(compress_buffer));
+				else
+					compress_size = DecompressDictionary(data, data_bytes, compress_buffer, sizeof(compress_buffer));
 
 				if (compress_size <= 0)
 				{
@@ -188,9 +217,20 @@ void Connexion::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 		}
 		*/
 		OnTransportDatagrams(delivery);
-		_seen_encrypted = true;
 		_last_recv_tsc = Clock::msec_fast();
 
+		// If this is the first time the client is heard from over the tunnel,
+		if (!_seen_encrypted)
+		{
+			_seen_encrypted = true;
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+			// The answer made it, so it will not need to be replayed
+			delete _handshake;
+			_handshake = 0;
+#endif
+		}
+
 #if defined(CAT_SPHYNX_ROAMING_IP)
 		// If client address needs to be updated,
 		RecvBuffer *tail = static_cast<RecvBuffer*>( delivery.tail );
@@ -206,6 +246,22 @@ void Connexion::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 
 void Connexion::OnTick(ThreadLocalStorage &tls, u32 now)
 {
+	// If this worker does not own the Connexion while it changes workers,
+	if (!IsRunnableOn(tls))
+		return;
+
+	// If the source is holding the marker until routers with the old worker id are gone,
+	if (_migrate_waiting && _parent->_conn_map.PassedGrace(_migrate_epoch))
+	{
+		_migrate_grace = true;
+
+		// Go around once more to drain what they delivered, unless OnDestroy() sent it already
+		if (Atomic::Set(&_migrate_waiting, 0))
+			PostMigrateMarker(_migrate_from);
+	}
+
+	double start_usec = m_clock->usec();
+
 	// If in graceful disconnect,
 	if (IsDisconnected())
 	{
@@ -224,6 +280,192 @@ void Connexion::OnTick(ThreadLocalStorage &tls, u32 now)
 		{
 			Disconnect(DISCO_TIMEOUT);
 		}
+		// If the load balancer asked for a move,
+		else if (_migrate_to != INVALID_WORKER_ID && _migrate_state == MIGRATE_IDLE)
+		{
+			BeginMigration();
+		}
+	}
+
+	_cost_usec += (u32)(m_clock->usec() - start_usec);
+}
+
+bool Connexion::IsRunnableOn(ThreadLocalStorage &tls)
+{
+	switch (_migrate_state)
+	{
+	case MIGRATE_IDLE:
+		return &tls == &m_worker_threads->GetTLS(_worker_id);
+	case MIGRATE_PARKING:
+		// The source keeps running until the marker leaves it
+		return &tls == &m_worker_threads->GetTLS(_migrate_from);
+	default:
+		return false;
+	}
+}
+
+u32 Connexion::TakeCostSample()
+{
+	u32 cost = _cost_usec;
+	u32 delta = cost - _balance_cost_last;
+
+	_balance_cost_last = cost;
+
+	return delta;
+}
+
+bool Connexion::RequestMigration(u32 worker_id)
+{
+	// If the worker is invalid or already the owner,
+	if (worker_id >= m_worker_threads->GetWorkerCount() || worker_id == _worker_id)
+		return false;
+
+	// If a move is already under way,
+	if (IsMigrating())
+		return false;
+
+	_migrate_to = worker_id;
+
+	return true;
+}
+
+void Connexion::BeginMigration()
+{
+	u32 source = _worker_id, dest = _migrate_to;
+
+	_migrate_to = INVALID_WORKER_ID;
+
+	// Tick on the destination too; it skips ticks until the marker arrives
+	if (!m_worker_threads->AssignTimer(dest, this, WorkerTimerDelegate::FromMember<Connexion, &Connexion::OnTick>(this)))
+	{
+		CAT_WARN("Connexion") << "Unable to assign timer on worker " << dest << ": Staying on worker " << source;
+		return;
+	}
+
+	_migrate_from = source;
+	_migrate_grace = false;
+	_migrate_waiting = 0;
+	_parked.Clear();
+
+	// Park datagrams on the destination before routing can send any there
+	Atomic::Set(&_migrate_state, MIGRATE_PARKING);
+	Atomic::Set(&_worker_id, dest);
+
+	// Routers that entered by this epoch may still deliver to the source
+	_migrate_epoch = _parent->_conn_map.GetEpoch();
+
+	// Marker holds a reference until it reaches the destination
+	AddRef(CAT_REFOBJECT_TRACE);
+	_migrate_marker.callback.SetMember<Connexion, &Connexion::OnRecv>(this);
+
+	PostMigrateMarker(source);
+}
+
+void Connexion::PostMigrateMarker(u32 worker_id)
+{
+	// Same callback as the datagrams, so it keeps its place in the work queue
+	m_worker_threads->DeliverBuffers(WQPRIO_HI, worker_id, BatchSet(&_migrate_marker));
+}
+
+void Connexion::OnMigrateRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
+{
+	BatchSet run;
+	run.Clear();
+
+	// For each buffer, stopping at the marker,
+	for (BatchHead *next, *node = buffers.head; node; node = next)
+	{
+		next = node->batch_next;
+
+		// If this is a datagram,
+		if (node != &_migrate_marker)
+		{
+			run.PushBack(node);
+
+			// If more datagrams follow before the marker,
+			if (next && next != &_migrate_marker)
+				continue;
+		}
+
+		// If there are datagrams waiting,
+		if (run.head)
+		{
+			// If this worker still owns the Connexion,
+			if (IsRunnableOn(tls))
+			{
+				ProcessDatagrams(run);
+			}
+			else if (&tls == &m_worker_threads->GetTLS(_worker_id))
+			{
+				// Hold them on the destination until the marker arrives
+				_parked.PushBack(run);
+			}
+			else
+			{
+				// Late arrival on the source after the handoff
+				m_worker_threads->DeliverBuffers(WQPRIO_HI, _worker_id, run);
+			}
+
+			run.Clear();
+		}
+
+		if (node == &_migrate_marker)
+			OnMigrateMarker(tls);
+	}
+}
+
+void Connexion::OnMigrateMarker(ThreadLocalStorage &tls)
+{
+	// If the marker is still circling the source queue,
+	if (_migrate_state == MIGRATE_PARKING)
+	{
+		// If routers that saw the old worker id may still be delivering,
+		if (!_migrate_grace)
+		{
+			// If they are gone or no more ticks are coming, go around once more to drain what they delivered
+			if (IsShutdown() || _parent->_conn_map.PassedGrace(_migrate_epoch))
+			{
+				_migrate_grace = true;
+
+				PostMigrateMarker(_migrate_from);
+			}
+			else
+			{
+				// Hold the marker and check again on the next tick instead of spinning
+				Atomic::Set(&_migrate_waiting, 1);
+
+				// If shutdown started meanwhile and OnDestroy() did not see the flag, send it on here
+				if (IsShutdown() && Atomic::Set(&_migrate_waiting, 0))
+					PostMigrateMarker(_migrate_from);
+			}
+
+			return;
+		}
+
+		// Nothing more will arrive here: Hand off to the destination
+		Atomic::Set(&_migrate_state, MIGRATE_HANDOFF);
+
+		TransportTLS *remote_tls = m_transport_tls.Peek(m_worker_threads->GetTLS(_worker_id));
+		if (remote_tls) MigrateTLS(remote_tls);
+
+		m_worker_threads->RemoveTimer(_migrate_from, this);
+
+		PostMigrateMarker(_worker_id);
+	}
+	else
+	{
+		// Parked datagrams arrived before anything still queued behind the marker
+		BatchSet parked = _parked;
+		_parked.Clear();
+
+		Atomic::Set(&_migrate_state, MIGRATE_IDLE);
+
+		if (parked.head)
+			ProcessDatagrams(parked);
+
+		CAT_INFO("Connexion") << "Moved " << this << " from worker " << _migrate_from << " to worker " << _worker_id;
+
+		ReleaseRef(CAT_REFOBJECT_TRACE);
 	}
 }
 
@@ -232,7 +474,65 @@ Connexion::Connexion()
 	_my_id = ConnexionMap::INVALID_KEY;
 	_seen_encrypted = false;
 
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	_handshake = 0;
+#endif
+
 	_worker_id = INVALID_WORKER_ID;
+
+	_migrate_state = MIGRATE_IDLE;
+	_migrate_to = INVALID_WORKER_ID;
+	_migrate_from = INVALID_WORKER_ID;
+	_migrate_epoch = 0;
+	_migrate_grace = false;
+	_migrate_waiting = 0;
+	_parked.Clear();
+	_cost_usec = 0;
+	_balance_cost_last = 0;
+}
+
+Connexion::~Connexion()
+{
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	if (_handshake)
+		delete _handshake;
+#endif
+}
+
+void Connexion::GetFootprint(ConnexionFootprint &footprint)
+{
+	Transport::GetFootprint(footprint);
+
+	footprint.connexion_bytes = sizeof(Connexion);
+	footprint.encryption_bytes = sizeof(AuthenticatedEncryption);
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	footprint.handshake_bytes = sizeof(HandshakeCache);
+#else
+	footprint.handshake_bytes = 0;
+#endif
+}
+
+void Connexion::OnPaceTimer(ThreadLocalStorage &tls, u32 now)
+{
+	// If the wakeup landed on a worker that is not running the Connexion,
+	if (!IsRunnableOn(tls))
+	{
+		// While parking the source still runs it, so fire there right away.
+		// During the handoff, give the marker a moment to reach the destination
+		u32 when = _migrate_state == MIGRATE_PARKING ? now : now + 1;
+
+		m_worker_threads->ScheduleWakeup(GetRunningWorkerID(), this, WorkerTimerDelegate::FromMember<Connexion, &Connexion::OnPaceTimer>(this), when);
+		return;
+	}
+
+	OnPacingWakeup();
+}
+
+bool Connexion::SchedulePacingWakeup(u32 when)
+{
+	// While parking, routing already points at the destination but the source sends
+	return m_worker_threads->ScheduleWakeup(GetRunningWorkerID(), this, WorkerTimerDelegate::FromMember<Connexion, &Connexion::OnPaceTimer>(this), when);
 }
 
 s32 Connexion::WriteDatagrams(const BatchSet &buffers, u32 count)
@@ -260,7 +560,7 @@ s32 Connexion::WriteDatagrams(const BatchSet &buffers, u32 count)
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 		// Remove extra overhead bytes for s2c stuff
-		msg_bytes -= 2;
+		msg_bytes -= ROAMING_ID_BYTES;
 		buffer->data_bytes = msg_bytes;
 #endif
 
@@ -274,16 +574,63 @@ s32 Connexion::WriteDatagrams(const BatchSet &buffers, u32 count)
 	return _parent->Write(buffers, count, _client_addr) ? write_count : 0;
 }
 
+bool Connexion::PostDictionary(CompressionDictionary *dict)
+{
+	if (!SetRecvDictionary(dict))
+		return false;
+
+	const u8 *dict_data = dict->GetData();
+	u32 dict_bytes = dict->GetBytes();
+
+	u8 piece[IOP_S2C_DICTIONARY_MINLEN - 1 + IOP_S2C_DICTIONARY_PIECE_BYTES];
+	*reinterpret_cast<u32*>( piece ) = getLE(dict->GetID());
+	*reinterpret_cast<u16*>( piece + 4 ) = getLE((u16)dict_bytes);
+
+	// For each piece of the dictionary,
+	for (u32 offset = 0; offset < dict_bytes; offset += IOP_S2C_DICTIONARY_PIECE_BYTES)
+	{
+		u32 piece_bytes = dict_bytes - offset;
+		if (piece_bytes > IOP_S2C_DICTIONARY_PIECE_BYTES)
+			piece_bytes = IOP_S2C_DICTIONARY_PIECE_BYTES;
+
+		*reinterpret_cast<u16*>( piece + 6 ) = getLE((u16)offset);
+		memcpy(piece + 8, dict_data + offset, piece_bytes);
+
+		// Bulk stream so the dictionary does not hold up early game messages
+		if (!WriteReliable(STREAM_BULK, IOP_S2C_DICTIONARY, piece, 8 + piece_bytes, SOP_INTERNAL))
+			return false;
+	}
+
+	return true;
+}
+
 void Connexion::OnInternal(u32 recv_time, BufferStream data, u32 bytes)
 {
 	switch (data[0] & 3)
 	{
 	case IOP_C2S_MTU_PROBE:
-		if (bytes >= IOP_C2S_MTU_TEST_MINLEN)
+		// If client installed the compression dictionary,
+		if (data[0] == IOP_C2S_DICTIONARY_ACK)
+		{
+			if (bytes == IOP_C2S_DICTIONARY_ACK_LEN && _recv_dictionary &&
+				getLE(*reinterpret_cast<u32*>( data + 1 )) == _recv_dictionary->GetID())
+			{
+				// Start compressing outgoing datagrams against it
+				SetSendDictionary(_recv_dictionary);
+
+				CAT_INFO("Connexion") << "Got IOP_C2S_DICTIONARY_ACK.  Dictionary compression enabled";
+			}
+		}
+		else if (data[0] == IOP_ACK_FREQUENCY)
+		{
+			if (bytes == IOP_ACK_FREQUENCY_LEN)
+				SetACKFrequency(data[1], getLE(*reinterpret_cast<u16*>( data + 2 )));
+		}
+		else if (bytes >= IOP_C2S_MTU_TEST_MINLEN)
 		{
 #if defined(CAT_SPHYNX_ROAMING_IP)
-			// The byte count does not include the 2 byte header and 2 byte user id
-			bytes += 2 + 2;
+			// The byte count does not include the 2 byte header and the user id
+			bytes += 2 + ROAMING_ID_BYTES;
 #else
 			// The byte count does not include the 2 byte header
 			bytes += 2;
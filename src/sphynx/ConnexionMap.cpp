@@ -28,6 +28,8 @@
 
 #include <cat/sphynx/ConnexionMap.hpp>
 #include <cat/hash/Murmur.hpp>
+#include <cat/threads/Atomic.hpp>
+#include <cat/math/BitMath.hpp>
 #include <cat/io/Log.hpp>
 using namespace cat;
 using namespace sphynx;
@@ -101,47 +103,193 @@ static CAT_INLINE u32 map_hash_addr(const NetAddr &addr, u32 ip_salt, u32 port_s
 ConnexionMap::ConnexionMap()
 {
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	_conn_table = 0;
-	_free_table = 0;
+	CAT_OBJCLR(_chunks);
 	_first_free = ConnexionMap::INVALID_KEY;
 	_map_alloc = 0;
 #else
-	CAT_OBJCLR(_map_table);
+	_map_table = 0;
+	_map_mask = 0;
 #endif
-	CAT_OBJCLR(_flood_table);
+	_flood_table = 0;
+	_flood_mask = 0;
+	_max_population = 0;
 	_is_shutdown = false;
 	_count = 0;
 }
 
 ConnexionMap::~ConnexionMap()
 {
+	// No readers remain, so everything retired can go now
+	for (int ii = 0; ii < 2; ++ii)
+		ReleaseRetired(_retired[ii]);
+
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	if (_conn_table)
+	for (u32 ii = 0; ii < MAX_CHUNKS && _chunks[ii]; ++ii)
 	{
-		delete []_conn_table;
-		_conn_table = 0;
+		delete []_chunks[ii];
+		_chunks[ii] = 0;
 	}
-
-	if (_free_table)
+#else
+	if (_map_table)
 	{
-		delete []_free_table;
-		_free_table = 0;
+		delete []_map_table;
+		_map_table = 0;
 	}
 #endif
+
+	if (_flood_table)
+	{
+		delete []_flood_table;
+		_flood_table = 0;
+	}
 }
 
-void ConnexionMap::Initialize(FortunaOutput *csprng)
+bool ConnexionMap::Initialize(FortunaOutput *csprng, u32 max_population)
 {
 #if !defined(CAT_SPHYNX_ROAMING_IP)
 	_ip_salt = csprng->Generate();
 	_port_salt = csprng->Generate();
 #endif
 	_flood_salt = csprng->Generate();
+
+	if (max_population < 1) max_population = 1;
+	else if (max_population > MAX_POPULATION_LIMIT) max_population = MAX_POPULATION_LIMIT;
+	_max_population = max_population;
+
+	// Round up to a power of two
+	u32 flood_size = max_population > 1 ? NextHighestPow2(max_population - 1) : 1;
+	if (flood_size < MIN_FLOOD_TABLE_SIZE) flood_size = MIN_FLOOD_TABLE_SIZE;
+
+	_flood_table = new (std::nothrow) u8[flood_size];
+	if (!_flood_table) return false;
+	memset(_flood_table, 0, flood_size);
+	_flood_mask = flood_size - 1;
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	// Keep the open-addressed table at most half full
+	u32 map_size = flood_size * 2;
+
+	_map_table = new (std::nothrow) Slot[map_size];
+	if (!_map_table) return false;
+	memset(_map_table, 0, sizeof(Slot) * map_size);
+	_map_mask = map_size - 1;
+#endif
+
+	CAT_INFO("ConnexionMap") << "Sized for " << max_population << " connexions";
+
+	return true;
+}
+
+void ConnexionMap::CollectRetired(std::vector<Connexion*> &released)
+{
+	// For each of the two advances that put the current epoch out of reach,
+	for (int ii = 0; ii < 2; ++ii)
+	{
+		// If nothing is waiting to be reclaimed,
+		if (_retired[0].empty() && _retired[1].empty())
+			return;
+
+		// If a reader is still inside the previous epoch,
+		if (!_epoch.TryAdvance())
+			return;
+
+		// Everything retired two epochs ago is now unreachable
+		std::vector<Connexion*> &retired = _retired[_epoch.GetEpoch() & 1];
+		released.insert(released.end(), retired.begin(), retired.end());
+		retired.clear();
+	}
+}
+
+bool ConnexionMap::PassedGrace(u32 epoch)
+{
+	// If the epoch has already moved on, there is no need for the lock
+	if ((u32)(_epoch.GetEpoch() - epoch) >= 2)
+		return true;
+
+	AutoMutex lock(_table_lock);
+
+	std::vector<Connexion*> released;
+
+	// Readers that entered by the given epoch are gone once it has advanced twice
+	while ((u32)(_epoch.GetEpoch() - epoch) < 2)
+	{
+		// If a reader is still inside the previous epoch,
+		if (!_epoch.TryAdvance())
+			break;
+
+		// Everything retired two epochs ago is now unreachable
+		std::vector<Connexion*> &retired = _retired[_epoch.GetEpoch() & 1];
+		released.insert(released.end(), retired.begin(), retired.end());
+		retired.clear();
+	}
+
+	bool passed = (u32)(_epoch.GetEpoch() - epoch) >= 2;
+
+	lock.Release();
+
+	ReleaseRetired(released);
+
+	return passed;
+}
+
+void ConnexionMap::ReclaimRetired()
+{
+	std::vector<Connexion*> released;
+
+	AutoMutex lock(_table_lock);
+
+	CollectRetired(released);
+
+	lock.Release();
+
+	ReleaseRetired(released);
+}
+
+void ConnexionMap::ReleaseRetired(std::vector<Connexion*> &released)
+{
+	for (u32 ii = 0, size = (u32)released.size(); ii < size; ++ii)
+		released[ii]->ReleaseRef(CAT_REFOBJECT_TRACE);
+
+	released.clear();
 }
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 
-bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr, u16 id)
+bool ConnexionMap::Grow()
+{
+	u32 old_alloc = _map_alloc;
+	u32 chunk_index = old_alloc >> CHUNK_BITS;
+
+	// If the directory is full,
+	if (chunk_index >= MAX_CHUNKS)
+		return false;
+
+	Slot *chunk = new (std::nothrow) Slot[CHUNK_SIZE];
+	if (!chunk)
+	{
+		CAT_WARN("ConnexionMap") << "Out of memory growing connexion map";
+		return false;
+	}
+
+	// Chain new slots together, keeping any free slots owned by other shards
+	for (u32 ii = 0; ii < CHUNK_SIZE; ++ii)
+	{
+		chunk[ii].conn = 0;
+		chunk[ii].next_free = old_alloc + ii + 1;
+	}
+	chunk[CHUNK_SIZE - 1].next_free = _first_free;
+
+	// Publish the chunk before the larger slot count that covers it
+	_chunks[chunk_index] = chunk;
+	Atomic::StoreMemoryBarrier();
+	_map_alloc = old_alloc + CHUNK_SIZE;
+
+	_first_free = old_alloc;
+
+	return true;
+}
+
+bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr, u32 id)
 {
 	connexion = Lookup(id);
 
@@ -149,7 +297,7 @@ bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr,
 	if (!connexion)
 	{
 		// Do flood key computation only if address is not in the address map table
-		u32 flood_key = flood_hash_addr(addr, _flood_salt) & HASH_TABLE_MASK;
+		u32 flood_key = flood_hash_addr(addr, _flood_salt) & _flood_mask;
 
 		// If flood threshold breached,
 		return (_flood_table[flood_key] >= CONNECTION_FLOOD_THRESHOLD);
@@ -163,9 +311,9 @@ bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr,
 bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr)
 {
 	// Hash IP:port:salt to get the hash table key
-	u32 key = map_hash_addr(addr, _ip_salt, _port_salt) & HASH_TABLE_MASK;
+	u32 key = map_hash_addr(addr, _ip_salt, _port_salt) & _map_mask;
 
-	AutoReadLock lock(_table_lock);
+	AutoEpoch epoch(_epoch);
 
 	if (IsShutdown())
 	{
@@ -194,7 +342,7 @@ bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr)
 			if (slot->collision)
 			{
 				// Calculate next collision key
-				key = (key * COLLISION_MULTIPLIER + COLLISION_INCREMENTER) & HASH_TABLE_MASK;
+				key = (key * COLLISION_MULTIPLIER + COLLISION_INCREMENTER) & _map_mask;
 
 				// Loop around and process the next slot in the collision list
 			}
@@ -207,7 +355,7 @@ bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr)
 	}
 
 	// Do flood key computation only if address is not in the address map table
-	u32 flood_key = flood_hash_addr(addr, _flood_salt) & HASH_TABLE_MASK;
+	u32 flood_key = flood_hash_addr(addr, _flood_salt) & _flood_mask;
 
 	connexion = 0;
 	return (_flood_table[flood_key] >= CONNECTION_FLOOD_THRESHOLD);
@@ -217,19 +365,21 @@ bool ConnexionMap::LookupCheckFlood(Connexion * &connexion, const NetAddr &addr)
 
 Connexion *ConnexionMap::Lookup(u32 key)
 {
-#if defined(CAT_SPHYNX_ROAMING_IP)
-	if (key >= _map_alloc) return 0;
-#else
-	if (key >= HASH_TABLE_SIZE) return 0;
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+	if (key > _map_mask) return 0;
 #endif
 
-	AutoReadLock lock(_table_lock);
+	AutoEpoch epoch(_epoch);
 
 	if (IsShutdown())
 		return 0;
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	Connexion *conn = _conn_table[key];
+	// Chunks are published before the slot count that covers them
+	if (key >= _map_alloc) return 0;
+	Atomic::LoadMemoryBarrier();
+
+	Connexion *conn = GetSlot(key)->conn;
 #else
 	Connexion *conn = _map_table[key].conn;
 #endif
@@ -243,13 +393,13 @@ Connexion *ConnexionMap::Lookup(u32 key)
 	return 0;
 }
 
-SphynxError ConnexionMap::Insert(Connexion *conn)
+SphynxError ConnexionMap::Insert(Connexion *conn, u32 shard_count, u32 shard)
 {
 #if !defined(CAT_SPHYNX_ROAMING_IP)
 
 	// Hash IP:port:salt to get the hash table key
-	u32 key = map_hash_addr(conn->_client_addr, _ip_salt, _port_salt) & HASH_TABLE_MASK;
-	u32 flood_key = flood_hash_addr(conn->_client_addr, _flood_salt) & HASH_TABLE_MASK;
+	u32 key = map_hash_addr(conn->_client_addr, _ip_salt, _port_salt) & _map_mask;
+	u32 flood_key = flood_hash_addr(conn->_client_addr, _flood_salt) & _flood_mask;
 
 	// Grab the slot
 	Slot *slot = &_map_table[key];
@@ -257,7 +407,7 @@ SphynxError ConnexionMap::Insert(Connexion *conn)
 	// Add a reference to the Connexion
 	conn->AddRef(CAT_REFOBJECT_TRACE);
 
-	AutoWriteLock lock(_table_lock);
+	AutoMutex lock(_table_lock);
 
 	if (IsShutdown())
 	{
@@ -266,6 +416,15 @@ SphynxError ConnexionMap::Insert(Connexion *conn)
 		return ERR_SHUTDOWN;
 	}
 
+	// If out of room,
+	if (IsFull())
+	{
+		lock.Release();
+		CAT_INFO("ConnexionMap") << "Cannot accept new connexion from " << conn->GetAddress().IPToString() << " : " << conn->GetAddress().GetPort();
+		conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+		return ERR_SERVER_FULL;
+	}
+
 	// While collision keys are marked used,
 	while (slot->conn)
 	{
@@ -281,32 +440,42 @@ SphynxError ConnexionMap::Insert(Connexion *conn)
 		slot->collision = true;
 
 		// Iterate to next collision key
-		key = (key * COLLISION_MULTIPLIER + COLLISION_INCREMENTER) & HASH_TABLE_MASK;
+		key = (key * COLLISION_MULTIPLIER + COLLISION_INCREMENTER) & _map_mask;
 		slot = &_map_table[key];
 
-		// NOTE: This will loop forever if every table key is marked used
+		// NOTE: The table is kept at most half full so this always finds a free key
 	}
 
 	_count++;
 
 	_flood_table[flood_key]++;
 
-	// Mark used
-	slot->conn = conn;
 	conn->_my_id = key;
 	conn->_flood_key = flood_key;
 
+	// Publish the Connexion to readers only after it is filled in
+	Atomic::StoreMemoryBarrier();
+
+	// Mark used
+	slot->conn = conn;
+
+	// Pick up any references left behind by a Remove() that raced a reader
+	std::vector<Connexion*> released;
+	CollectRetired(released);
+
 	lock.Release();
 
+	ReleaseRetired(released);
+
 #else // Roaming IP version:
 
 	// Hash IP:port:salt to get the hash table key
-	u32 flood_key = flood_hash_addr(conn->_client_addr, _flood_salt) & HASH_TABLE_MASK;
+	u32 flood_key = flood_hash_addr(conn->_client_addr, _flood_salt) & _flood_mask;
 
 	// Add a reference to the Connexion
 	conn->AddRef(CAT_REFOBJECT_TRACE);
 
-	AutoWriteLock lock(_table_lock);
+	AutoMutex lock(_table_lock);
 
 	if (IsShutdown())
 	{
@@ -324,65 +493,49 @@ SphynxError ConnexionMap::Insert(Connexion *conn)
 		return ERR_FLOOD;
 	}
 
-	// If no free slots,
-	u16 slot_id = _first_free;
-	if (slot_id == ConnexionMap::INVALID_KEY)
+	// If out of room,
+	if (IsFull())
 	{
-		// If out of room,
-		if (_map_alloc >= MAX_POPULATION)
+		lock.Release();
+		CAT_INFO("ConnexionMap") << "Cannot accept new connexion from " << conn->GetAddress().IPToString() << " : " << conn->GetAddress().GetPort();
+		conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+		return ERR_SERVER_FULL;
+	}
+
+	u32 prev_id, slot_id;
+
+	CAT_FOREVER
+	{
+		// Find the first free slot that belongs to the requested shard
+		prev_id = ConnexionMap::INVALID_KEY;
+		slot_id = _first_free;
+		while (slot_id != ConnexionMap::INVALID_KEY && slot_id % shard_count != shard)
+		{
+			prev_id = slot_id;
+			slot_id = GetSlot(slot_id)->next_free;
+		}
+
+		// If a slot was found,
+		if (slot_id != ConnexionMap::INVALID_KEY)
+			break;
+
+		// If unable to grow,
+		if (!Grow())
 		{
 			lock.Release();
 			CAT_INFO("ConnexionMap") << "Cannot accept new connexion from " << conn->GetAddress().IPToString() << " : " << conn->GetAddress().GetPort();
 			conn->ReleaseRef(CAT_REFOBJECT_TRACE);
 			return ERR_SERVER_FULL;
 		}
-
-		// Expand!
-
-		u32 old_alloc = _map_alloc;
-		u32 new_alloc = old_alloc * 2;
-		if (new_alloc > MAX_POPULATION) new_alloc = MAX_POPULATION;
-		else if (new_alloc < MAP_PREALLOC) new_alloc = MAP_PREALLOC;
-
-		// Allocate tables
-		Connexion **conn_table;
-		do conn_table = new (std::nothrow) Connexion*[new_alloc];
-		while (!conn_table);
-
-		u16 *free_table;
-		do free_table = new (std::nothrow) u16[new_alloc];
-		while (!free_table);
-
-		// Copy old data over
-		if (_conn_table) memcpy(conn_table, _conn_table, sizeof(Connexion*) * old_alloc);
-
-		// Clear the new connexion pointers
-		memset(conn_table + old_alloc, 0, sizeof(Connexion*) * (new_alloc - old_alloc));
-
-		// Release old tables
-		delete []_conn_table;
-		delete []_free_table;
-
-		// Replace old table
-		_map_alloc = new_alloc;
-		_conn_table = conn_table;
-		_free_table = free_table;
-
-		// Initialize free list
-		_first_free = old_alloc;
-		for (u32 ii = old_alloc; ii < new_alloc - 1; ++ii)
-			_free_table[ii] = (u16)(ii + 1);
-		_free_table[new_alloc - 1] = ConnexionMap::INVALID_KEY;
-
-		// Use the first free slot for the new slot
-		slot_id = old_alloc;
 	}
 
-	// Set connexion pointer for the slot
-	_conn_table[slot_id] = conn;
+	Slot *slot = GetSlot(slot_id);
 
-	// Advance first free index
-	_first_free = _free_table[slot_id];
+	// Unlink slot from the free list
+	if (prev_id == ConnexionMap::INVALID_KEY)
+		_first_free = slot->next_free;
+	else
+		GetSlot(prev_id)->next_free = slot->next_free;
 
 	// Increment population count
 	_count++;
@@ -394,8 +547,20 @@ SphynxError ConnexionMap::Insert(Connexion *conn)
 	conn->_my_id = slot_id;
 	conn->_flood_key = flood_key;
 
+	// Publish the Connexion to readers only after it is filled in
+	Atomic::StoreMemoryBarrier();
+
+	// Set connexion pointer for the slot
+	slot->conn = conn;
+
+	// Pick up any references left behind by a Remove() that raced a reader
+	std::vector<Connexion*> released;
+	CollectRetired(released);
+
 	lock.Release();
 
+	ReleaseRetired(released);
+
 #endif // CAT_SPHYNX_ROAMING_IP
 
 	CAT_INFO("ConnexionMap") << "Inserted connexion from " << conn->GetAddress().IPToString() << " : " << conn->GetAddress().GetPort() << " id=" << conn->GetMyID();
@@ -411,13 +576,17 @@ void ConnexionMap::Remove(Connexion *conn)
 	u32 key = conn->GetMyID();
 
 	// If key is invalid,
-	if (key >= HASH_TABLE_SIZE) return;
+#if defined(CAT_SPHYNX_ROAMING_IP)
+	if (key >= _map_alloc) return;
+#else
+	if (key > _map_mask) return;
+#endif
 
 	CAT_INFO("ConnexionMap") << "Removing connexion from " << conn->GetAddress().IPToString() << " : " << conn->GetAddress().GetPort() << " id=" << conn->GetMyID();
 
 	u32 flood_key = conn->_flood_key;
 
-	AutoWriteLock lock(_table_lock);
+	AutoMutex lock(_table_lock);
 
 #if !defined(CAT_SPHYNX_ROAMING_IP)
 
@@ -431,7 +600,7 @@ void ConnexionMap::Remove(Connexion *conn)
 		do 
 		{
 			// Roll backwards
-			key = ((key + COLLISION_INCRINVERSE) * COLLISION_MULTINVERSE) & HASH_TABLE_MASK;
+			key = ((key + COLLISION_INCRINVERSE) * COLLISION_MULTINVERSE) & _map_mask;
 
 			// If collision list is done,
 			if (!_map_table[key].collision)
@@ -445,8 +614,9 @@ void ConnexionMap::Remove(Connexion *conn)
 
 #else
 
-	_conn_table[key] = 0;
-	_free_table[key] = _first_free;
+	Slot *slot = GetSlot(key);
+	slot->conn = 0;
+	slot->next_free = _first_free;
 	_first_free = key;
 
 #endif // CAT_SPHYNX_ROAMING_IP
@@ -454,10 +624,61 @@ void ConnexionMap::Remove(Connexion *conn)
 	_count--;
 	_flood_table[flood_key]--;
 
+	// Readers may still hold the pointer, so the table reference is released
+	// once every reader that could have seen it has left
+	_retired[_epoch.GetEpoch() & 1].push_back(conn);
+
+	std::vector<Connexion*> released;
+	CollectRetired(released);
+
 	lock.Release();
 
-	// Finally release reference so that it can die
-	conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+	// Finally release references so that they can die
+	ReleaseRetired(released);
+}
+
+void ConnexionMap::AcquireAll(std::vector<Connexion*> &connexions)
+{
+	AutoEpoch epoch(_epoch);
+
+	if (IsShutdown())
+		return;
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+
+	// For each hash table bin,
+	for (u32 key = 0; key <= _map_mask; ++key)
+	{
+		Connexion *conn = _map_table[key].conn;
+
+		// If table entry is populated,
+		if (conn)
+		{
+			conn->AddRef(CAT_REFOBJECT_TRACE);
+			connexions.push_back(conn);
+		}
+	}
+
+#else
+
+	// Chunks are published before the slot count that covers them
+	u32 map_alloc = _map_alloc;
+	Atomic::LoadMemoryBarrier();
+
+	// For each bin,
+	for (u32 key = 0; key < map_alloc; ++key)
+	{
+		Connexion *conn = GetSlot(key)->conn;
+
+		// If table entry is populated,
+		if (conn)
+		{
+			conn->AddRef(CAT_REFOBJECT_TRACE);
+			connexions.push_back(conn);
+		}
+	}
+
+#endif // CAT_SPHYNX_ROAMING_IP
 }
 
 void ConnexionMap::ShutdownAll()
@@ -466,14 +687,14 @@ void ConnexionMap::ShutdownAll()
 
 	std::vector<Connexion*> connexions;
 
-	AutoWriteLock lock(_table_lock);
+	AutoMutex lock(_table_lock);
 
 	_is_shutdown = true;
 
 #if !defined(CAT_SPHYNX_ROAMING_IP)
 
 	// For each hash table bin,
-	for (int key = 0; key < HASH_TABLE_SIZE; ++key)
+	for (u32 key = 0; key <= _map_mask; ++key)
 	{
 		Connexion *conn = _map_table[key].conn;
 
@@ -494,7 +715,8 @@ void ConnexionMap::ShutdownAll()
 	// For each bin,
 	for (u32 key = 0; key < _map_alloc; ++key)
 	{
-		Connexion *conn = _conn_table[key];
+		Slot *slot = GetSlot(key);
+		Connexion *conn = slot->conn;
 
 		// If table entry is populated,
 		if (conn)
@@ -502,7 +724,7 @@ void ConnexionMap::ShutdownAll()
 			conn->AddRef(CAT_REFOBJECT_TRACE);
 			connexions.push_back(conn);
 
-			_conn_table[key] = 0;
+			slot->conn = 0;
 		}
 	}
 
@@ -510,8 +732,13 @@ void ConnexionMap::ShutdownAll()
 
 	_count = 0;
 
+	std::vector<Connexion*> released;
+	CollectRetired(released);
+
 	lock.Release();
 
+	ReleaseRetired(released);
+
 	// For each Connexion object to release,
 	for (u32 ii = 0, size = (u32)connexions.size(); ii < size; ++ii)
 	{
@@ -29,6 +29,7 @@
 #include <cat/sphynx/FlowControl.hpp>
 #include <cat/time/Clock.hpp>
 #include <cat/io/Log.hpp>
+#include <cat/lang/Strings.hpp>
 #include <cat/sphynx/Transport.hpp>
 using namespace cat;
 using namespace sphynx;
@@ -40,9 +41,38 @@ FlowControl::FlowControl()
 {
 	_bandwidth_low_limit = 3000;
 	_bandwidth_high_limit = 100000000;
-	_bps = _bandwidth_low_limit;
 
-	_rtt = 3000;
+	_rtt = INITIAL_RTT;
+}
+
+FlowControl *FlowControl::Create(FlowControlMode mode)
+{
+	switch (mode)
+	{
+	case FLOW_CONTROL_BOTTLENECK:	return new (std::nothrow) BottleneckFlowControl;
+	default:						return new (std::nothrow) TamponFlowControl;
+	}
+}
+
+FlowControlMode FlowControl::GetModeFromName(const char *name)
+{
+	if (iStrEqual(name, "Bottleneck"))
+		return FLOW_CONTROL_BOTTLENECK;
+
+	if (*name && !iStrEqual(name, "Tampon"))
+	{
+		CAT_WARN("FlowControl") << "Unrecognized flow control \"" << name << "\": Using Tampon";
+	}
+
+	return FLOW_CONTROL_TAMPON;
+}
+
+
+//// TamponFlowControl
+
+TamponFlowControl::TamponFlowControl()
+{
+	_bps = _bandwidth_low_limit;
 
 	_last_bw_update = 0;
 	_available_bw = 0;
@@ -55,7 +85,7 @@ FlowControl::FlowControl()
 	_stats_goodput = 0;
 }
 
-s32 FlowControl::GetRemainingBytes(u32 now)
+s32 TamponFlowControl::GetRemainingBytes(u32 now)
 {
 	_lock.Enter();
 
@@ -80,7 +110,7 @@ s32 FlowControl::GetRemainingBytes(u32 now)
 	return available;
 }
 
-void FlowControl::OnPacketSend(u32 bytes_with_overhead)
+void TamponFlowControl::OnPacketSend(u32 bytes_with_overhead)
 {
 	_lock.Enter();
 
@@ -89,7 +119,12 @@ void FlowControl::OnPacketSend(u32 bytes_with_overhead)
 	_lock.Leave();
 }
 
-void FlowControl::OnTick(u32 now, u32 timeout_loss_count)
+u32 TamponFlowControl::GetPacingRate()
+{
+	return _bps;
+}
+
+void TamponFlowControl::OnTick(u32 now, u32 timeout_loss_count)
 {
 	_lock.Enter();
 
@@ -159,7 +194,7 @@ void FlowControl::OnTick(u32 now, u32 timeout_loss_count)
 	_lock.Leave();
 }
 
-void FlowControl::OnACK(u32 recv_time, OutgoingMessage *node)
+void TamponFlowControl::OnACK(u32 recv_time, OutgoingMessage *node)
 {
 	// If no retransmission,
 	if (node->ts_firstsend == node->ts_lastsend)
@@ -173,13 +208,13 @@ void FlowControl::OnACK(u32 recv_time, OutgoingMessage *node)
 		_stats_rtt_count++;
 
 		// Update estimate of RTT
-		_rtt = (_rtt * 9 + rtt) / 10;
+		UpdateRTT(rtt);
 
 		_lock.Leave();
 	}
 }
 
-void FlowControl::OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes)
+void TamponFlowControl::OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes)
 {
 	_lock.Enter();
 
@@ -188,3 +223,270 @@ void FlowControl::OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes)
 
 	_lock.Leave();
 }
+
+
+//// BottleneckFlowControl
+
+// Probe Bandwidth pacing gain cycle
+static const u32 PROBE_BW_GAINS[8] = {
+	320, 192, 256, 256, 256, 256, 256, 256
+};
+
+BottleneckFlowControl::BottleneckFlowControl()
+{
+	_mode = MODE_STARTUP;
+	_pacing_gain = HIGH_GAIN;
+
+	_btl_bw = _bandwidth_low_limit;
+	CAT_OBJCLR(_bw_samples);
+	_round_count = 0;
+
+	_min_rtt = 0;
+	_min_rtt_stamp = 0;
+
+	_round_start = 0;
+	_round_delivered = 0;
+	_round_sent = 0;
+	_round_started = false;
+
+	_full_bw = 0;
+	_full_bw_count = 0;
+	_filled_pipe = false;
+
+	_cycle_index = 0;
+	_probe_rtt_done = 0;
+
+	_available_bw = 0;
+	_last_bw_update = 0;
+}
+
+CAT_INLINE u32 BottleneckFlowControl::CalculatePacingRate()
+{
+	u32 rate = (u32)(((u64)_btl_bw * _pacing_gain) / GAIN_UNIT);
+
+	if (rate < (u32)_bandwidth_low_limit)
+		rate = _bandwidth_low_limit;
+	else if (rate > (u32)_bandwidth_high_limit)
+		rate = _bandwidth_high_limit;
+
+	return rate;
+}
+
+void BottleneckFlowControl::EnterProbeBandwidth()
+{
+	_mode = MODE_PROBE_BW;
+
+	// Start anywhere in the cycle except the drain phase
+	_cycle_index = _round_count % (CYCLE_LENGTH - 1);
+	if (_cycle_index >= 1) ++_cycle_index;
+
+	_pacing_gain = PROBE_BW_GAINS[_cycle_index];
+}
+
+void BottleneckFlowControl::EndRound(u32 now)
+{
+	u32 elapsed = now - _round_start;
+
+	u32 rate = (u32)(((u64)_round_delivered * 1000) / elapsed);
+
+	// If the sender left most of its pacing budget unused, the round was application-limited
+	u64 budget = ((u64)CalculatePacingRate() * elapsed) / 1000;
+	bool app_limited = (u64)_round_sent * 4 < budget * 3 || _mode == MODE_PROBE_RTT;
+
+	// Application-limited rounds may raise the estimate but never lower it
+	u32 sample = rate;
+	if (app_limited && sample < _btl_bw)
+		sample = _btl_bw;
+
+	_bw_samples[_round_count % BW_WINDOW_ROUNDS] = sample;
+	++_round_count;
+
+	// Bottleneck bandwidth is the windowed maximum delivery rate
+	u32 btl_bw = 0;
+	for (u32 ii = 0; ii < BW_WINDOW_ROUNDS; ++ii)
+		if (btl_bw < _bw_samples[ii])
+			btl_bw = _bw_samples[ii];
+
+	if (btl_bw < (u32)_bandwidth_low_limit)
+		btl_bw = _bandwidth_low_limit;
+
+	_btl_bw = btl_bw;
+
+	// If pipe is still filling and the round was not application-limited,
+	if (!_filled_pipe && !app_limited)
+	{
+		// If bandwidth grew by at least 25%,
+		if ((u64)btl_bw * 4 >= (u64)_full_bw * 5)
+		{
+			_full_bw = btl_bw;
+			_full_bw_count = 0;
+		}
+		else if (++_full_bw_count >= FULL_BW_ROUNDS)
+		{
+			_filled_pipe = true;
+		}
+	}
+
+	switch (_mode)
+	{
+	case MODE_STARTUP:
+		if (_filled_pipe)
+		{
+			_mode = MODE_DRAIN;
+			_pacing_gain = DRAIN_GAIN;
+		}
+		break;
+
+	case MODE_DRAIN:
+		EnterProbeBandwidth();
+		break;
+
+	case MODE_PROBE_BW:
+		_cycle_index = (_cycle_index + 1) % CYCLE_LENGTH;
+		_pacing_gain = PROBE_BW_GAINS[_cycle_index];
+		break;
+
+	case MODE_PROBE_RTT:
+		// If probe has lasted long enough,
+		if ((s32)(now - _probe_rtt_done) >= 0)
+		{
+			_min_rtt_stamp = now;
+
+			if (_filled_pipe)
+				EnterProbeBandwidth();
+			else
+			{
+				_mode = MODE_STARTUP;
+				_pacing_gain = HIGH_GAIN;
+			}
+		}
+		break;
+	}
+
+	CAT_INANE("FlowControl") << "Bottleneck round: rate=" << rate << (app_limited ? " (app-limited)" : "") << " BtlBw=" << _btl_bw << " MinRTT=" << _min_rtt << " mode=" << (u32)_mode << " gain=" << _pacing_gain;
+
+	_round_start = now;
+	_round_delivered = 0;
+	_round_sent = 0;
+}
+
+s32 BottleneckFlowControl::GetRemainingBytes(u32 now)
+{
+	_lock.Enter();
+
+	u32 rate = CalculatePacingRate();
+
+	u32 elapsed = now - _last_bw_update;
+	_last_bw_update = now;
+
+	// Allow bursts of up to one worker tick or one datagram, whichever is larger
+	s32 burst_max = rate / 100;
+	if (burst_max < (s32)MAXIMUM_MTU)
+		burst_max = MAXIMUM_MTU;
+
+	// Need to use 64-bit here because this number can exceed 4 MB
+	u64 bytes = ((u64)elapsed * rate) / 1000;
+	if (bytes > (u64)burst_max)
+		bytes = burst_max;
+
+	s32 available = _available_bw + (s32)bytes;
+	if (available > burst_max)
+		available = burst_max;
+
+	_available_bw = available;
+
+	_lock.Leave();
+
+	return available;
+}
+
+void BottleneckFlowControl::OnPacketSend(u32 bytes_with_overhead)
+{
+	_lock.Enter();
+
+	_available_bw -= bytes_with_overhead;
+	_round_sent += bytes_with_overhead;
+
+	_lock.Leave();
+}
+
+u32 BottleneckFlowControl::GetPacingRate()
+{
+	_lock.Enter();
+
+	u32 rate = CalculatePacingRate();
+
+	_lock.Leave();
+
+	return rate;
+}
+
+void BottleneckFlowControl::OnTick(u32 now, u32 timeout_loss_count)
+{
+	_lock.Enter();
+
+	// If no round is in progress yet,
+	if (!_round_started)
+	{
+		_round_start = now;
+		_min_rtt_stamp = now;
+		_round_started = true;
+	}
+	else
+	{
+		// Rounds last one minimum RTT, or one smoothed RTT until the first sample
+		u32 round_msec = _min_rtt ? _min_rtt : _rtt;
+		if (round_msec < MIN_ROUND_MSEC)
+			round_msec = MIN_ROUND_MSEC;
+
+		if ((s32)(now - _round_start) >= (s32)round_msec)
+			EndRound(now);
+	}
+
+	_lock.Leave();
+}
+
+void BottleneckFlowControl::OnACK(u32 recv_time, OutgoingMessage *node)
+{
+	// If no retransmission,
+	if (node->ts_firstsend == node->ts_lastsend)
+	{
+		u32 rtt = recv_time - node->ts_firstsend;
+		if (rtt < 1) rtt = 1;
+
+		_lock.Enter();
+
+		UpdateRTT(rtt);
+
+		bool expired = (s32)(recv_time - _min_rtt_stamp) >= (s32)MIN_RTT_WINDOW_MSEC;
+
+		// If minimum RTT has not been refreshed for a while,
+		if (expired && _min_rtt && _mode != MODE_PROBE_RTT)
+		{
+			// Drain the queue so the propagation delay can be measured again
+			_mode = MODE_PROBE_RTT;
+			_pacing_gain = PROBE_RTT_GAIN;
+
+			u32 probe_msec = _min_rtt > PROBE_RTT_MSEC ? _min_rtt : PROBE_RTT_MSEC;
+			_probe_rtt_done = recv_time + probe_msec;
+		}
+
+		if (!_min_rtt || rtt <= _min_rtt || expired)
+		{
+			_min_rtt = rtt;
+			_min_rtt_stamp = recv_time;
+		}
+
+		_lock.Leave();
+	}
+}
+
+void BottleneckFlowControl::OnACKDone(u32 recv_time, u32 nack_loss_count, u32 data_bytes)
+{
+	_lock.Enter();
+
+	// Loss does not drive the model, only delivery does
+	_round_delivered += data_bytes;
+
+	_lock.Leave();
+}
@@ -0,0 +1,280 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/sphynx/HandshakePipeline.hpp>
+#include <cat/sphynx/Server.hpp>
+#include <cat/threads/Atomic.hpp>
+#include <cat/io/Log.hpp>
+using namespace cat;
+using namespace sphynx;
+
+
+//// HandshakeThread
+
+HandshakeThread::HandshakeThread()
+{
+	_pipeline = 0;
+}
+
+bool HandshakeThread::Entrypoint(void *param)
+{
+	HandshakePipeline *pipeline = _pipeline;
+	HandshakeJob *jobs[HandshakePipeline::MAX_BATCH];
+
+	while (!pipeline->_kill_flag)
+	{
+		bool more;
+		u32 count = pipeline->Dequeue(jobs, HandshakePipeline::MAX_BATCH, more);
+
+		// If the queue is empty, sleep until a challenge arrives
+		if (!count)
+		{
+			_wake_flag.Wait(IDLE_WAIT_MSEC);
+			continue;
+		}
+
+		// If challenges are left over, get another thread started on them
+		if (more) pipeline->WakeOne();
+
+		u32 answered = pipeline->_server->OnChallenges(_tls, jobs, count);
+
+		pipeline->Complete(jobs, count, answered);
+	}
+
+	return true;
+}
+
+
+//// HandshakePipeline
+
+HandshakePipeline::HandshakePipeline()
+{
+	_server = 0;
+	_clock = 0;
+	_thread_count = 0;
+	_next_wake = 0;
+	_kill_flag = false;
+	_jobs = 0;
+	_free_head = 0;
+	_queue_head = _queue_tail = 0;
+	_queue_depth = 0;
+	_sample.Clear();
+}
+
+HandshakePipeline::~HandshakePipeline()
+{
+	Stop();
+}
+
+bool HandshakePipeline::Start(Server *server, Clock *clock, u32 thread_count, u32 queue_depth)
+{
+	if (thread_count > MAX_THREADS) thread_count = MAX_THREADS;
+	if (queue_depth < MIN_QUEUE_DEPTH) queue_depth = MIN_QUEUE_DEPTH;
+	if (queue_depth > MAX_QUEUE_DEPTH) queue_depth = MAX_QUEUE_DEPTH;
+
+	// If challenges are answered inline, there is nothing to start
+	if (!thread_count) return true;
+
+	_jobs = new (std::nothrow) HandshakeJob[queue_depth];
+	if (!_jobs)
+	{
+		CAT_WARN("HandshakePipeline") << "Out of memory: Unable to allocate " << queue_depth << " handshake jobs";
+		return false;
+	}
+
+	// Thread the jobs onto the free list
+	for (u32 ii = 0; ii < queue_depth; ++ii)
+		_jobs[ii].next = (ii + 1 < queue_depth) ? &_jobs[ii + 1] : 0;
+
+	_free_head = _jobs;
+	_queue_head = _queue_tail = 0;
+	_queue_depth = 0;
+	_server = server;
+	_clock = clock;
+	_kill_flag = false;
+
+	for (u32 ii = 0; ii < thread_count; ++ii)
+	{
+		HandshakeThread *thread = &_threads[ii];
+
+		thread->_pipeline = this;
+
+		if (!thread->StartThread())
+		{
+			CAT_WARN("HandshakePipeline") << "Unable to start handshake thread " << ii;
+			Stop();
+			return false;
+		}
+
+		_thread_count = ii + 1;
+	}
+
+	CAT_INFO("HandshakePipeline") << "Answering challenges on " << thread_count
+		<< " handshake threads with a queue depth of " << queue_depth;
+
+	return true;
+}
+
+void HandshakePipeline::Stop()
+{
+	_kill_flag = true;
+
+	for (u32 ii = 0; ii < _thread_count; ++ii)
+	{
+		_threads[ii]._wake_flag.Set();
+		_threads[ii].WaitForThread();
+	}
+
+	_thread_count = 0;
+
+	FreeJobs();
+}
+
+void HandshakePipeline::FreeJobs()
+{
+	AutoMutex lock(_lock);
+
+	// Challenges still in the queue are dropped; the clients will retry
+	_free_head = 0;
+	_queue_head = _queue_tail = 0;
+	_queue_depth = 0;
+
+	if (_jobs)
+	{
+		delete []_jobs;
+		_jobs = 0;
+	}
+}
+
+void HandshakePipeline::WakeOne()
+{
+	u32 thread_count = _thread_count;
+
+	if (thread_count)
+		_threads[Atomic::Add(&_next_wake, 1) % thread_count]._wake_flag.Set();
+}
+
+bool HandshakePipeline::Enqueue(const NetAddr &addr, const u8 *challenge, u32 recv_msec)
+{
+	double now = _clock->usec();
+
+	_lock.Enter();
+
+	HandshakeJob *job = _free_head;
+
+	// If the queue is full or stopped,
+	if (!job || _kill_flag)
+	{
+		++_sample.shed;
+		_lock.Leave();
+		return false;
+	}
+
+	_free_head = job->next;
+
+	job->next = 0;
+	job->addr = addr;
+	job->recv_msec = recv_msec;
+	job->queue_usec = now;
+	memcpy(job->challenge, challenge, CHALLENGE_BYTES);
+
+	if (_queue_tail) _queue_tail->next = job;
+	else _queue_head = job;
+	_queue_tail = job;
+	++_queue_depth;
+
+	_lock.Leave();
+
+	WakeOne();
+
+	return true;
+}
+
+u32 HandshakePipeline::Dequeue(HandshakeJob **jobs, u32 max_count, bool &more)
+{
+	double now = _clock->usec();
+	u32 count = 0;
+
+	AutoMutex lock(_lock);
+
+	HandshakeJob *job = _queue_head;
+
+	while (job && count < max_count)
+	{
+		double waited = now - job->queue_usec;
+		_sample.queue_usec.Add(waited > 0 ? (u32)waited : 0);
+
+		jobs[count++] = job;
+		job = job->next;
+	}
+
+	_queue_head = job;
+	if (!job) _queue_tail = 0;
+	_queue_depth -= count;
+
+	if (count) ++_sample.batches;
+
+	more = (job != 0);
+
+	return count;
+}
+
+void HandshakePipeline::Complete(HandshakeJob **jobs, u32 count, u32 answered)
+{
+	AutoMutex lock(_lock);
+
+	for (u32 ii = 0; ii < count; ++ii)
+	{
+		HandshakeJob *job = jobs[ii];
+
+		job->next = _free_head;
+		_free_head = job;
+	}
+
+	_sample.answered += answered;
+	_sample.rejected += count - answered;
+}
+
+void HandshakePipeline::Record(u32 answered, u32 rejected)
+{
+	AutoMutex lock(_lock);
+
+	++_sample.batches;
+	_sample.answered += answered;
+	_sample.rejected += rejected;
+}
+
+void HandshakePipeline::TakeSample(HandshakeSample &sample)
+{
+	AutoMutex lock(_lock);
+
+	sample = _sample;
+	sample.queue_depth = _queue_depth;
+
+	_sample.Clear();
+}
@@ -33,6 +33,14 @@
 #include <cat/crypt/SecureEqual.hpp>
 #include <cat/crypt/tunnel/Keys.hpp>
 #include <cat/crypt/tunnel/TunnelTLS.hpp>
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+# include <linux/filter.h>
+# if !defined(SO_ATTACH_REUSEPORT_CBPF)
+#  define SO_ATTACH_REUSEPORT_CBPF 51
+# endif
+#endif
+
 using namespace std;
 using namespace cat;
 using namespace sphynx;
@@ -40,6 +48,7 @@ using namespace sphynx;
 static WorkerThreads *m_worker_threads = 0;
 static Settings *m_settings = 0;
 static UDPSendAllocator *m_udp_send_allocator = 0;
+static Clock *m_clock = 0;
 static TLSInstance<TunnelTLS> m_tunnel_tls;
 static TLSInstance<TransportTLS> m_transport_tls;
 
@@ -48,13 +57,27 @@ static TLSInstance<TransportTLS> m_transport_tls;
 
 bool Server::OnInitialize()
 {
-	Use(m_worker_threads, m_settings, m_udp_send_allocator);
+	Use(m_worker_threads, m_settings, m_udp_send_allocator, m_clock);
 
 	return m_worker_threads->InitializeTLS<TransportTLS>() && UDPEndpoint::OnInitialize();
 }
 
 void Server::OnDestroy()
 {
+	// Stop answering challenges before the connexions are shut down
+	_handshakes.Stop();
+
+	// Finish appending statistics
+	if (_stats_writing)
+	{
+		_stats_writer.Stop();
+		_stats_writing = false;
+	}
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+	StopShards();
+#endif
+
 	_conn_map.ShutdownAll();
 
 	UDPEndpoint::OnDestroy();
@@ -62,6 +85,9 @@ void Server::OnDestroy()
 
 void Server::OnRecvRouting(const BatchSet &buffers)
 {
+	// Stay in the routing gate until delivery so a Connexion changing workers can wait us out
+	AutoEpoch routing(_conn_map.GetRoutingGate());
+
 	u32 connect_worker = _connect_worker;
 	u32 worker_count = m_worker_threads->GetWorkerCount();
 
@@ -76,7 +102,7 @@ void Server::OnRecvRouting(const BatchSet &buffers)
 
 	RecvBuffer *prev_buffer = 0;
 #if defined(CAT_SPHYNX_ROAMING_IP)
-	u16 prev_buffer_id = ConnexionMap::INVALID_KEY;
+	u32 prev_buffer_id = ConnexionMap::INVALID_KEY;
 #endif
 
 	Connexion *conn;
@@ -90,7 +116,11 @@ void Server::OnRecvRouting(const BatchSet &buffers)
 		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
 
 		// If buffer is too short to contain Roaming IP source id field,
+#if defined(CAT_SPHYNX_ROAMING_IP)
+		if (buffer->data_bytes < ROAMING_ID_BYTES)
+#else
 		if (buffer->data_bytes < 2)
+#endif
 		{
 			// If close signal is received,
 			if (buffer->data_bytes == 0)
@@ -104,8 +134,7 @@ void Server::OnRecvRouting(const BatchSet &buffers)
 
 #if defined(CAT_SPHYNX_ROAMING_IP)
 		// Get source id
-		u16 *pid = reinterpret_cast<u16*>( GetTrailingBytes(buffer) + buffer->data_bytes - 2 );
-		u16 id = getLE(*pid);
+		u32 id = ReadRoamingID(GetTrailingBytes(buffer) + buffer->data_bytes - ROAMING_ID_BYTES);
 #endif
 
 		SetRemoteAddress(buffer);
@@ -291,185 +320,445 @@ void Server::OnRecv(ThreadLocalStorage &tls, const BatchSet &buffers)
 			}
 
 			// If server is overpopulated,
-			if (_conn_map.GetCount() >= ConnexionMap::MAX_POPULATION)
+			if (_conn_map.IsFull())
 			{
 				CAT_WARN("Server") << "Ignoring challenge: Server is full";
 				PostConnectionError(buffer->GetAddr(), ERR_SERVER_FULL);
 				continue;
 			}
 
-			TunnelTLS *tunnel_tls = m_tunnel_tls.Ref(tls);
-			if (!tunnel_tls)
-			{
-				CAT_FATAL("Server") << "Ignoring challenge: Unable to get TLS object";
-				PostConnectionError(buffer->GetAddr(), ERR_SERVER_ERROR);
-				continue;
-			}
-
-			u8 *pkt = m_udp_send_allocator->Acquire(S2C_ANSWER_LEN);
 			u8 *challenge = data + 1 + 4;
 
-			Skein key_hash;
-			AutoDestroy<Connexion> conn;
-
-			// Verify that post buffer could be allocated
-			if (!pkt)
+			// If challenges are answered by the handshake threads,
+			if (_handshakes.IsRunning())
 			{
-				CAT_WARN("Server") << "Ignoring challenge: Unable to allocate post buffer";
+				// If the queue is full, shed the challenge now rather than let it age
+				if (!_handshakes.Enqueue(buffer->GetAddr(), challenge, buffer->event_msec))
+				{
+					CAT_WARN("Server") << "Ignoring challenge: Handshake queue is full";
+					PostConnectionError(buffer->GetAddr(), ERR_SERVER_FULL);
+				}
 			}
-			// If challenge is invalid,
-			else if (!_key_agreement_responder.ProcessChallenge(tunnel_tls, challenge, CHALLENGE_BYTES,
-																pkt + 1, ANSWER_BYTES, &key_hash))
+			else
 			{
-				CAT_WARN("Server") << "Ignoring challenge: Invalid";
+				// Answer it inline on this worker
+				HandshakeJob job;
+				job.addr = buffer->GetAddr();
+				job.recv_msec = buffer->event_msec;
+				memcpy(job.challenge, challenge, CHALLENGE_BYTES);
 
-				pkt[0] = S2C_ERROR;
-				pkt[1] = (u8)(ERR_TAMPERING);
-				Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
-			}
-			// If out of memory for Connexion objects,
-			else if (!(conn = NewConnexion()))
-			{
-				CAT_WARN("Server") << "Out of memory: Unable to allocate new Connexion";
+				HandshakeJob *jobs[1] = { &job };
+				u32 answered = OnChallenges(tls, jobs, 1);
 
-				pkt[0] = S2C_ERROR;
-				pkt[1] = (u8)(ERR_SERVER_ERROR);
-				Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
+				_handshakes.Record(answered, 1 - answered);
 			}
-			// If unable to key encryption from session key,
-			else if (!_key_agreement_responder.KeyEncryption(&key_hash, &conn->_auth_enc, _session_key))
-			{
-				CAT_WARN("Server") << "Ignoring challenge: Unable to key encryption";
+		}
+		else
+		{
+			CAT_WARN("Server") << "Ignoring handshake packet: Unrecognized type";
+		}
+	}
 
-				pkt[0] = S2C_ERROR;
-				pkt[1] = (u8)(ERR_SERVER_ERROR);
-				Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
-			}
-			else if (!conn->InitializeTransportSecurity(false, conn->_auth_enc))
+	ReleaseRecvBuffers(buffers, buffer_count);
+}
+
+u32 Server::OnChallenges(ThreadLocalStorage &tls, HandshakeJob **jobs, u32 count)
+{
+	TunnelTLS *tunnel_tls = m_tunnel_tls.Ref(tls);
+	if (!tunnel_tls)
+	{
+		CAT_FATAL("Server") << "Ignoring challenges: Unable to get TLS object";
+
+		for (u32 ii = 0; ii < count; ++ii)
+			PostConnectionError(jobs[ii]->addr, ERR_SERVER_ERROR);
+
+		return 0;
+	}
+
+	static const u32 MAX_BATCH = KeyAgreementResponder::MAX_CHALLENGE_BATCH;
+
+	const u8 *challenges[MAX_BATCH];
+	u8 *answers[MAX_BATCH];
+	u8 *pkts[MAX_BATCH];
+	HandshakeJob *batch[MAX_BATCH];
+	Skein key_hashes[MAX_BATCH];
+	bool results[MAX_BATCH];
+	u32 batch_count = 0;
+
+	// HandshakePipeline never dequeues more than one batch at a time
+	CAT_DEBUG_ENFORCE(count <= MAX_BATCH);
+
+	// For each challenge,
+	for (u32 ii = 0; ii < count; ++ii)
+	{
+		u8 *pkt = m_udp_send_allocator->Acquire(S2C_ANSWER_LEN);
+
+		// Verify that post buffer could be allocated
+		if (!pkt)
+		{
+			CAT_WARN("Server") << "Ignoring challenge: Unable to allocate post buffer";
+			continue;
+		}
+
+		challenges[batch_count] = jobs[ii]->challenge;
+		answers[batch_count] = pkt + 1;
+		pkts[batch_count] = pkt;
+		batch[batch_count] = jobs[ii];
+		++batch_count;
+	}
+
+	// Run key agreement for the whole batch at once
+	_key_agreement_responder.ProcessChallengeBatch(tunnel_tls, batch_count, challenges, CHALLENGE_BYTES,
+												   answers, ANSWER_BYTES, key_hashes, results);
+
+	u32 answered = 0;
+
+	for (u32 ii = 0; ii < batch_count; ++ii)
+	{
+		u8 *pkt = pkts[ii];
+
+		// If challenge is invalid,
+		if (!results[ii])
+		{
+			CAT_WARN("Server") << "Ignoring challenge: Invalid";
+
+			pkt[0] = S2C_ERROR;
+			pkt[1] = (u8)(ERR_TAMPERING);
+			Write(pkt, S2C_ERROR_LEN, batch[ii]->addr);
+		}
+		else if (AcceptChallenge(batch[ii], pkt, &key_hashes[ii]))
+		{
+			++answered;
+		}
+	}
+
+	return answered;
+}
+
+bool Server::AcceptChallenge(HandshakeJob *job, u8 *pkt, Skein *key_hash)
+{
+	AutoDestroy<Connexion> conn;
+
+	// If out of memory for Connexion objects,
+	if (!(conn = NewConnexion()))
+	{
+		CAT_WARN("Server") << "Out of memory: Unable to allocate new Connexion";
+
+		pkt[0] = S2C_ERROR;
+		pkt[1] = (u8)(ERR_SERVER_ERROR);
+		Write(pkt, S2C_ERROR_LEN, job->addr);
+	}
+	// If unable to key encryption from session key,
+	else if (!_key_agreement_responder.KeyEncryption(key_hash, &conn->_auth_enc, _session_key))
+	{
+		CAT_WARN("Server") << "Ignoring challenge: Unable to key encryption";
+
+		pkt[0] = S2C_ERROR;
+		pkt[1] = (u8)(ERR_SERVER_ERROR);
+		Write(pkt, S2C_ERROR_LEN, job->addr);
+	}
+	else if (!conn->InitializeTransportSecurity(false, conn->_auth_enc))
+	{
+		CAT_WARN("Server") << "Ignoring challenge: Unable to initialize transport security";
+
+		pkt[0] = S2C_ERROR;
+		pkt[1] = (u8)(ERR_SERVER_ERROR);
+		Write(pkt, S2C_ERROR_LEN, job->addr);
+	}
+	else if (!conn->InitializeFlowControl(_flow_control_mode))
+	{
+		CAT_WARN("Server") << "Out of memory: Unable to initialize flow control";
+
+		pkt[0] = S2C_ERROR;
+		pkt[1] = (u8)(ERR_SERVER_ERROR);
+		Write(pkt, S2C_ERROR_LEN, job->addr);
+	}
+	else // Good so far:
+	{
+		conn->SetACKFrequency(_ack_every, _ack_max_delay);
+
+		// Finish constructing the answer packet
+		pkt[0] = S2C_ANSWER;
+
+#if !defined(CAT_SPHYNX_ROAMING_IP)
+		// Cache the answer in case it is lost; without memory, a lost answer just times out
+		conn->_handshake = new (std::nothrow) Connexion::HandshakeCache;
+		if (conn->_handshake)
+		{
+			conn->_handshake->first_challenge_hash = MurmurHash(job->challenge, CHALLENGE_BYTES).Get64();
+			memcpy(conn->_handshake->answer, pkt + 1, ANSWER_BYTES);
+		}
+#endif
+		conn->_client_addr = job->addr;
+		conn->_last_recv_tsc = job->recv_msec;
+		conn->_parent = this;
+		conn->InitializePayloadBytes(SupportsIPv6());
+
+		// If we have come this far, then there is now a reference to this Server object
+		// in the Connexion.  So we need to add to our reference count at this point to
+		// avoid a race condition.
+
+		// Add a reference to the server on behalf of the Connexion
+		// When the Connexion dies, it will release this reference
+		AddRef(CAT_REFOBJECT_TRACE);
+
+		// Find least populated worker id
+		u32 worker_id = m_worker_threads->FindLeastPopulatedWorker();
+
+		// Set Transport TLS from worker id
+		TransportTLS *remote_tls = m_transport_tls.Peek(m_worker_threads->GetTLS(worker_id));
+		if (!remote_tls)
+		{
+			CAT_WARN("Server") << "Ignoring challenge: Unable to get TLS";
+
+			pkt[0] = S2C_ERROR;
+			pkt[1] = (u8)ERR_SERVER_ERROR;
+			Write(pkt, S2C_ERROR_LEN, job->addr);
+		}
+		else
+		{
+			conn->InitializeTLS(remote_tls);
+
+			// Set before the timer can tick, since ticks check which worker owns the Connexion
+			conn->_worker_id = worker_id;
+
+			// Assign to a worker
+			if (!m_worker_threads->AssignTimer(worker_id, conn, WorkerTimerDelegate::FromMember<Connexion, &Connexion::OnTick>(conn)))
 			{
-				CAT_WARN("Server") << "Ignoring challenge: Unable to initialize transport security";
+				CAT_WARN("Server") << "Ignoring challenge: Unable to assign timer";
 
 				pkt[0] = S2C_ERROR;
-				pkt[1] = (u8)(ERR_SERVER_ERROR);
-				Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
+				pkt[1] = (u8)ERR_SERVER_ERROR;
+				Write(pkt, S2C_ERROR_LEN, job->addr);
 			}
-			else // Good so far:
+			else
 			{
-				// Finish constructing the answer packet
-				pkt[0] = S2C_ANSWER;
-
-#if !defined(CAT_SPHYNX_ROAMING_IP)
-				// Initialize Connexion object
-				conn->_first_challenge_hash = MurmurHash(challenge, CHALLENGE_BYTES).Get64();
-				memcpy(conn->_cached_answer, pkt + 1, ANSWER_BYTES);
+				// Attempt to insert connexion into the map
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+				// Pick an id that steers the client's datagrams to the socket of this worker
+				SphynxError err = _shard_count ? _conn_map.Insert(conn, _shard_count, worker_id) : _conn_map.Insert(conn);
+#else
+				SphynxError err = _conn_map.Insert(conn);
 #endif
-				conn->_client_addr = buffer->GetAddr();
-				conn->_last_recv_tsc = buffer->event_msec;
-				conn->_parent = this;
-				conn->InitializePayloadBytes(SupportsIPv6());
-
-				// If we have come this far, then there is now a reference to this Server object
-				// in the Connexion.  So we need to add to our reference count at this point to
-				// avoid a race condition.
-
-				// Add a reference to the server on behalf of the Connexion
-				// When the Connexion dies, it will release this reference
-				AddRef(CAT_REFOBJECT_TRACE);
-
-				// Find least populated worker id
-				u32 worker_id = m_worker_threads->FindLeastPopulatedWorker();
-
-				// Set Transport TLS from worker id
-				TransportTLS *remote_tls = m_transport_tls.Peek(m_worker_threads->GetTLS(worker_id));
-				TransportTLS *local_tls = m_transport_tls.Peek(tls);
-				if (!remote_tls || !local_tls)
+
+				// If hash key could not be inserted,
+				if (err != ERR_NO_PROBLEMO)
 				{
-					CAT_WARN("Server") << "Ignoring challenge: Unable to get TLS";
+					CAT_WARN("Server") << "Ignoring challenge: Connexion map rejected the new connexion";
 
 					pkt[0] = S2C_ERROR;
-					pkt[1] = (u8)ERR_SERVER_ERROR;
-					Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
+					pkt[1] = (u8)err;
+					Write(pkt, S2C_ERROR_LEN, job->addr);
 				}
 				else
 				{
-					//u32 lock_rv = local_tls->rand_pad.Next();
-					conn->InitializeTLS(remote_tls);
+#if defined(CAT_SPHYNX_ROAMING_IP)
+					WriteRoamingID(pkt + 1 + ANSWER_BYTES, conn->GetMyID());
+#endif
 
-					// Assign to a worker
-					if (!m_worker_threads->AssignTimer(worker_id, conn, WorkerTimerDelegate::FromMember<Connexion, &Connexion::OnTick>(conn)))
+					// If unable to post packet,
+					if (!Write(pkt, S2C_ANSWER_LEN, job->addr))
 					{
-						CAT_WARN("Server") << "Ignoring challenge: Unable to assign timer";
-
-						pkt[0] = S2C_ERROR;
-						pkt[1] = (u8)ERR_SERVER_ERROR;
-						Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
+						CAT_WARN("Server") << "Ignoring challenge: Unable to post packet";
 					}
-					else
+					// If server is still not shutting down,
+					else if (!IsShutdown())
 					{
-						conn->_worker_id = worker_id;
+						CAT_WARN("Server") << "Accepted challenge and posted answer.  Client connected";
 
-						// Attempt to insert connexion into the map
-						SphynxError err = _conn_map.Insert(conn);
+						conn->OnConnect();
 
-						// If hash key could not be inserted,
-						if (err != ERR_NO_PROBLEMO)
+						// If a compression dictionary is configured, ship it to the client
+						if (_dictionary && !conn->PostDictionary(_dictionary))
 						{
-							CAT_WARN("Server") << "Ignoring challenge: Connexion map rejected the new connexion";
-
-							pkt[0] = S2C_ERROR;
-							pkt[1] = (u8)err;
-							Write(pkt, S2C_ERROR_LEN, buffer->GetAddr());
+							CAT_WARN("Server") << "Unable to post compression dictionary to client";
 						}
-						else
-						{
-#if defined(CAT_SPHYNX_ROAMING_IP)
-							u16 *user_id = reinterpret_cast<u16*>( pkt + 1 + ANSWER_BYTES );
-							*user_id = getLE((u16)conn->GetMyID());
-#endif
 
-							// If unable to post packet,
-							if (!Write(pkt, S2C_ANSWER_LEN, buffer->GetAddr()))
-							{
-								CAT_WARN("Server") << "Ignoring challenge: Unable to post packet";
-							}
-							// If server is still not shutting down,
-							else if (!IsShutdown())
-							{
-								CAT_WARN("Server") << "Accepted challenge and posted answer.  Client connected";
-
-								conn->OnConnect();
-
-								// Do not shutdown the object
-								conn.Forget();
-							}
-						}
+						// Do not shutdown the object
+						conn.Forget();
+						return true;
 					}
 				}
 			}
+		}
+	}
+
+	// If execution gets here, the Connexion object will be shutdown
+	return false;
+}
+
+void Server::OnTick(ThreadLocalStorage &tls, u32 now)
+{
+	// Not synchronous with OnRecv() callback because offline events are distributed between threads
+
+	// Drop table references to removed connexions once the routers are done with them
+	_conn_map.ReclaimRetired();
+
+	// If it is time for another statistics snapshot,
+	if (_stats_interval && (s32)(now - _stats_last) >= (s32)_stats_interval)
+		TakeStatsSnapshot(now);
+
+	// If it is time to compare worker loads,
+	if (_balance_interval && (s32)(now - _balance_last) >= (s32)_balance_interval)
+		Rebalance(now);
+}
+
+void Server::Rebalance(u32 now)
+{
+	u32 interval = now - _balance_last;
+	_balance_last = now;
+
+	u32 worker_count = m_worker_threads->GetWorkerCount();
+	u32 busiest = 0, idlest = 0;
+	u32 busiest_delta = 0, idlest_delta = 0;
+
+	// For each worker,
+	for (u32 worker_id = 0; worker_id < worker_count; ++worker_id)
+	{
+		u32 busy = m_worker_threads->GetBusyTime(worker_id);
+		u32 delta = busy - _balance_busy[worker_id];
+		_balance_busy[worker_id] = busy;
 
-			// If execution gets here, the Connexion object will be shutdown
+		if (worker_id == 0 || delta > busiest_delta)
+		{
+			busiest = worker_id;
+			busiest_delta = delta;
 		}
-		else
+
+		if (worker_id == 0 || delta < idlest_delta)
 		{
-			CAT_WARN("Server") << "Ignoring handshake packet: Unrecognized type";
+			idlest = worker_id;
+			idlest_delta = delta;
 		}
 	}
 
-	ReleaseRecvBuffers(buffers, buffer_count);
+	// Gap between the workers, in microseconds
+	u32 gap = busiest_delta - idlest_delta;
+	u32 min_gap = (u32)((u64)interval * 1000 * _balance_threshold / 100);
+
+	std::vector<Connexion*> connexions;
+	_conn_map.AcquireAll(connexions);
+
+	Connexion *best = 0;
+	u32 best_cost = 0;
+
+	// For each connexion,
+	for (u32 ii = 0, size = (u32)connexions.size(); ii < size; ++ii)
+	{
+		Connexion *conn = connexions[ii];
+
+		// Sample every Connexion so the next pass sees only its own interval
+		u32 cost = conn->TakeCostSample();
+
+		// Moving the costliest one that leaves the two workers no further apart
+		if (gap >= min_gap && conn->GetWorkerID() == busiest && !conn->IsMigrating() &&
+			cost > best_cost && cost <= gap / 2)
+		{
+			best = conn;
+			best_cost = cost;
+		}
+	}
+
+	// If a Connexion was picked,
+	if (best && best->RequestMigration(idlest))
+	{
+		CAT_INFO("Server") << "Balancing: Moving " << best << " costing " << best_cost << " usec from worker "
+			<< busiest << " (" << busiest_delta << " usec busy) to worker " << idlest << " (" << idlest_delta << " usec busy)";
+	}
+
+	// For each connexion,
+	for (u32 ii = 0, size = (u32)connexions.size(); ii < size; ++ii)
+		connexions[ii]->ReleaseRef(CAT_REFOBJECT_TRACE);
 }
 
-void Server::OnTick(ThreadLocalStorage &tls, u32 now)
+void Server::TakeStatsSnapshot(u32 now)
 {
-	// Not synchronous with OnRecv() callback because offline events are distributed between threads
+	std::vector<Connexion*> connexions;
+	_conn_map.AcquireAll(connexions);
+
+	StatsSnapshot snapshot;
+	snapshot.Clear();
+	snapshot.time = now;
+	snapshot.interval = now - _stats_last;
+	Connexion::GetFootprint(snapshot.footprint);
+
+	// For each connexion,
+	for (u32 ii = 0, size = (u32)connexions.size(); ii < size; ++ii)
+	{
+		Connexion *conn = connexions[ii];
+		TransportStats &stats = conn->GetStats();
+
+		ConnexionSample sample;
+		sample.id = conn->GetMyID();
+		sample.addr = conn->GetAddress();
+		sample.worker_id = conn->GetWorkerID();
+		sample.rtt = stats.rtt;
+		sample.pacing_rate = stats.pacing_rate;
+		sample.send_queue = stats.GetSendQueueDepth();
+		sample.out_of_order = stats.out_of_order;
+		sample.in_flight_bytes = stats.in_flight_bytes;
+		sample.heap_bytes = stats.heap_bytes;
+		stats.TakeSample(sample.delta);
+
+		snapshot.Add(sample);
+
+		conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+	}
+
+	_handshakes.TakeSample(snapshot.handshakes);
+
+	_stats_last = now;
+
+	_stats_lock.Enter();
+	_stats_snapshot = snapshot;
+	_stats_valid = true;
+	_stats_lock.Leave();
+
+	// If snapshots are also written to a file, hand it to the writer thread
+	if (_stats_writing)
+		_stats_writer.Post(snapshot);
+}
+
+bool Server::GetStatsSnapshot(StatsSnapshot &snapshot)
+{
+	AutoMutex lock(_stats_lock);
+
+	if (!_stats_valid)
+		return false;
+
+	snapshot = _stats_snapshot;
+
+	return true;
 }
 
 Server::Server()
 {
 	_connect_worker = 0;
+	_flow_control_mode = FLOW_CONTROL_TAMPON;
+	_ack_every = Transport::DEFAULT_ACK_EVERY;
+	_ack_max_delay = Transport::DEFAULT_ACK_MAX_DELAY;
+	_dictionary = 0;
+
+	_stats_interval = 0;
+	_stats_last = 0;
+	_stats_valid = false;
+	_stats_writing = false;
+
+	_balance_interval = 0;
+	_balance_last = 0;
+	_balance_threshold = DEFAULT_BALANCE_THRESHOLD;
+	CAT_OBJCLR(_balance_busy);
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+	CAT_OBJCLR(_shards);
+	_shard_count = 0;
+#endif
 }
 
 Server::~Server()
 {
+	if (_dictionary)
+		_dictionary->ReleaseRef();
 }
 
 bool Server::StartServer(Port port, TunnelKeyPair &key_pair, const char *session_key, ThreadLocalStorage *tls)
@@ -481,7 +770,14 @@ bool Server::StartServer(Port port, TunnelKeyPair &key_pair, const char *session
 
 	// Seed components
 	_cookie_jar.Initialize(tunnel_tls->CSPRNG());
-	_conn_map.Initialize(tunnel_tls->CSPRNG());
+
+	// Size the connexion map
+	u32 max_connexions = m_settings->getInt("Sphynx.Server.MaxConnexions", ConnexionMap::DEFAULT_MAX_POPULATION);
+	if (!_conn_map.Initialize(tunnel_tls->CSPRNG(), max_connexions))
+	{
+		CAT_WARN("Server") << "Failed to initialize: Out of memory allocating connexion map";
+		return false;
+	}
 
 	// Initialize key agreement responder
 	if (!_key_agreement_responder.Initialize(tunnel_tls, key_pair))
@@ -501,18 +797,201 @@ bool Server::StartServer(Port port, TunnelKeyPair &key_pair, const char *session
 	bool require_ip4 = m_settings->getInt("Sphynx.Server.RequireIPv4", 1) != 0;
 	int kernelReceiveBufferBytes = m_settings->getInt("Sphynx.Server.KernelReceiveBuffer",
 		DEFAULT_KERNEL_RECV_BUFFER, MIN_KERNEL_RECV_BUFFER, MAX_KERNEL_RECV_BUFFER);
+	_flow_control_mode = FlowControl::GetModeFromName(m_settings->getStr("Sphynx.Server.FlowControl", "Tampon").c_str());
+	_ack_every = m_settings->getInt("Sphynx.Server.AckEvery", Transport::DEFAULT_ACK_EVERY);
+	_ack_max_delay = m_settings->getInt("Sphynx.Server.AckMaxDelay", Transport::DEFAULT_ACK_MAX_DELAY);
+	std::string dictionary_path = m_settings->getStr("Sphynx.Server.Dictionary", "");
+	_stats_interval = m_settings->getInt("Sphynx.Server.StatsInterval", 0);
+	_stats_path = m_settings->getStr("Sphynx.Server.StatsFile", "");
+	_balance_interval = m_settings->getInt("Sphynx.Server.BalanceInterval", DEFAULT_BALANCE_INTERVAL);
+	_balance_threshold = m_settings->getInt("Sphynx.Server.BalanceThreshold", DEFAULT_BALANCE_THRESHOLD);
+	u32 handshake_threads = m_settings->getInt("Sphynx.Server.HandshakeThreads", HandshakePipeline::DEFAULT_THREADS);
+	u32 handshake_depth = m_settings->getInt("Sphynx.Server.HandshakeQueueDepth", HandshakePipeline::DEFAULT_QUEUE_DEPTH);
+
+	// If a compression dictionary is configured,
+	if (!dictionary_path.empty() && !_dictionary)
+	{
+		_dictionary = CompressionDictionary::Load(dictionary_path.c_str());
+
+		if (!_dictionary)
+		{
+			CAT_WARN("Server") << "Continuing without compression dictionary " << dictionary_path;
+		}
+	}
+
+	ConnexionFootprint footprint;
+	Connexion::GetFootprint(footprint);
+
+	CAT_INFO("Server") << "Connexion footprint: " << footprint.connexion_bytes << " bytes (transport "
+		<< footprint.transport_bytes << ", encryption " << footprint.encryption_bytes << "), plus "
+		<< footprint.stream_bytes << " per stream used, " << footprint.workspace_bytes << " while sending and "
+		<< footprint.handshake_bytes << " until connected";
+
+	// Start the handshake threads before any challenges can arrive
+	if (!_handshakes.Start(this, m_clock, handshake_threads, handshake_depth))
+	{
+		CAT_WARN("Server") << "Handshake threads unavailable: Answering challenges on the workers";
+	}
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+	bool sharded = m_settings->getInt("Sphynx.Server.ShardedSockets", 0) != 0;
+#else
+	bool sharded = false;
+#endif
 
 	// Attempt to bind to the server port
-	if (!Initialize(port, true, request_ip6, require_ip4, kernelReceiveBufferBytes))
+	if (!Initialize(port, true, request_ip6, require_ip4, kernelReceiveBufferBytes, sharded))
 	{
 		CAT_WARN("Server") << "Failed to initialize: Unable to bind handshake port "
 			<< port << ". " << Sockets::GetLastErrorString();
 		return false;
 	}
 
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+	// If unable to bind a socket per worker, the handshake socket still handles everything
+	if (sharded && !StartShards(GetPort(), request_ip6, require_ip4, kernelReceiveBufferBytes))
+	{
+		CAT_WARN("Server") << "Sharded sockets unavailable: Continuing with a single socket";
+	}
+#endif
+
+	// Nothing to balance with a single worker
+	if (m_worker_threads->GetWorkerCount() < 2)
+		_balance_interval = 0;
+
+	// If snapshots are also written to a file,
+	if (_stats_interval && !_stats_path.empty() && !_stats_writing)
+	{
+		_stats_writing = _stats_writer.Start(_stats_path.c_str());
+
+		if (!_stats_writing)
+		{
+			CAT_WARN("Server") << "Unable to start the statistics writer: Snapshots will not be written to " << _stats_path;
+		}
+	}
+
+	_stats_last = _balance_last = m_clock->msec();
+
+	for (u32 worker_id = 0, count = m_worker_threads->GetWorkerCount(); worker_id < count; ++worker_id)
+		_balance_busy[worker_id] = m_worker_threads->GetBusyTime(worker_id);
+
+	// Table reclamation, snapshots and balancing are done from the timer of one worker.
+	// The timer is assigned even when snapshots and balancing are off, since
+	// removed connexions are otherwise only released when the map changes again
+	u32 worker_id = m_worker_threads->FindLeastPopulatedWorker();
+
+	if (!m_worker_threads->AssignTimer(worker_id, this, WorkerTimerDelegate::FromMember<Server, &Server::OnTick>(this)))
+	{
+		CAT_WARN("Server") << "Unable to assign timer: Removed connexions will linger in the map, and statistics snapshots and load balancing are disabled";
+	}
+
+	return true;
+}
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+
+bool Server::StartShards(Port port, bool request_ip6, bool require_ip4, int kernelReceiveBufferBytes)
+{
+	u32 worker_count = m_worker_threads->GetWorkerCount();
+
+	// Shard sockets join the port group after the handshake socket, in worker order
+	for (u32 worker_id = 0; worker_id < worker_count; ++worker_id)
+	{
+		ServerShard *shard;
+		if (!RefObjects::Create(CAT_REFOBJECT_TRACE, shard))
+		{
+			CAT_WARN("Server") << "Unable to create shard for worker " << worker_id;
+			StopShards();
+			return false;
+		}
+
+		// Add a reference to the server on behalf of the shard
+		// When the shard dies, it will release this reference
+		AddRef(CAT_REFOBJECT_TRACE);
+		shard->_server = this;
+		shard->_worker_id = worker_id;
+		_shards[worker_id] = shard;
+
+		if (!shard->Initialize(port, true, request_ip6, require_ip4, kernelReceiveBufferBytes, true))
+		{
+			CAT_WARN("Server") << "Unable to bind shard for worker " << worker_id << " to port " << port;
+			StopShards();
+			return false;
+		}
+	}
+
+	if (!AttachShardSteering(worker_count))
+	{
+		StopShards();
+		return false;
+	}
+
+	_shard_count = worker_count;
+
+	CAT_INFO("Server") << "Sharded port " << port << " across " << worker_count << " worker sockets";
+
 	return true;
 }
 
+bool Server::AttachShardSteering(u32 shard_count)
+{
+	// Return the index of the socket in the port group for each datagram:
+	// 0 = handshake socket, 1 + (id % shard_count) = shard for the worker
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),					// A = datagram length
+		BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ROAMING_ID_BYTES, 0, 18),	// If A < 3, goto handshake
+		BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, ROAMING_ID_BYTES),	// A -= 3
+		BPF_STMT(BPF_ST, 1),									// M[1] = offset of id
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),						// X = offset of id
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 2),					// A = id high byte
+		BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),					// A <<= 8
+		BPF_STMT(BPF_ST, 0),									// M[0] = A
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 1),					// A = id middle byte
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),							// X = M[0]
+		BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),					// A |= X
+		BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),					// A <<= 8
+		BPF_STMT(BPF_ST, 0),									// M[0] = A
+		BPF_STMT(BPF_LDX | BPF_MEM, 1),							// X = offset of id
+		BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),					// A = id low byte
+		BPF_STMT(BPF_LDX | BPF_MEM, 0),							// X = M[0]
+		BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),					// A = id
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shard_count),		// A = worker id
+		BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, 1),					// A = shard socket index
+		BPF_STMT(BPF_RET | BPF_A, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0),							// Handshake socket
+	};
+
+	struct sock_fprog prog;
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+
+	if (setsockopt(GetSocket(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+	{
+		CAT_WARN("Server") << "Unable to attach shard steering program: " << Sockets::GetLastErrorString();
+		return false;
+	}
+
+	return true;
+}
+
+void Server::StopShards()
+{
+	_shard_count = 0;
+
+	for (u32 ii = 0; ii < MAX_WORKER_THREADS; ++ii)
+	{
+		ServerShard *shard = _shards[ii];
+
+		if (shard)
+		{
+			_shards[ii] = 0;
+			shard->Destroy(CAT_REFOBJECT_TRACE);
+		}
+	}
+}
+
+#endif // CAT_SPHYNX_SHARDED_SERVER
+
 bool Server::PostConnectionCookie(const NetAddr &dest)
 {
 	u8 *pkt = m_udp_send_allocator->Acquire(S2C_COOKIE_LEN);
@@ -584,3 +1063,116 @@ bool Server::InitializeKey(TunnelKeyPair &key_pair, const char *pair_path, const
 
 	return true;
 }
+
+
+#if defined(CAT_SPHYNX_SHARDED_SERVER)
+
+//// ServerShard
+
+ServerShard::ServerShard()
+{
+	_server = 0;
+	_worker_id = 0;
+}
+
+ServerShard::~ServerShard()
+{
+}
+
+bool ServerShard::OnFinalize()
+{
+	Server *server = _server;
+
+	bool delete_now = UDPEndpoint::OnFinalize();
+
+	// Release the reference held on the server since StartShards()
+	if (server) server->ReleaseRef(CAT_REFOBJECT_TRACE);
+
+	return delete_now;
+}
+
+void ServerShard::OnRecvRouting(const BatchSet &buffers)
+{
+	// Stay in the routing gate until delivery so a Connexion changing workers can wait us out
+	AutoEpoch routing(_server->_conn_map.GetRoutingGate());
+
+	BatchSet delivery, fallback, garbage;
+	delivery.Clear();
+	fallback.Clear();
+	garbage.Clear();
+	u32 garbage_count = 0;
+
+	Connexion *conn = 0;
+	u32 prev_id = ConnexionMap::INVALID_KEY;
+	int add_ref_count = 0;
+
+	// For each buffer in the batch,
+	for (BatchHead *next, *node = buffers.head; node; node = next)
+	{
+		next = node->batch_next;
+		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
+
+		// If buffer is too short to contain Roaming IP source id field,
+		if (buffer->data_bytes < ROAMING_ID_BYTES)
+		{
+			// Trash it
+			garbage.PushBack(buffer);
+			++garbage_count;
+			continue;
+		}
+
+		// Get source id
+		u32 id = ReadRoamingID(GetTrailingBytes(buffer) + buffer->data_bytes - ROAMING_ID_BYTES);
+
+		// If source id has changed,
+		if (!conn || id != prev_id)
+		{
+			// If reference counts need to be added,
+			if (add_ref_count) conn->AddRef(CAT_REFOBJECT_TRACE, add_ref_count);
+			add_ref_count = 0;
+
+			conn = _server->_conn_map.Lookup(id);
+			prev_id = id;
+
+			// If the connexion belongs to another worker,
+			if (conn && conn->GetWorkerID() != _worker_id)
+			{
+				conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+				conn = 0;
+			}
+
+			// If not steered correctly, let the server route it
+			if (!conn)
+			{
+				fallback.PushBack(buffer);
+				continue;
+			}
+		}
+		else
+		{
+			// Another packet from the same connexion
+			++add_ref_count;
+		}
+
+		SetRemoteAddress(buffer);
+		buffer->callback.SetMember<Connexion, &Connexion::OnRecv>(conn);
+		delivery.PushBack(buffer);
+	}
+
+	// If reference counts need to be added,
+	if (add_ref_count) conn->AddRef(CAT_REFOBJECT_TRACE, add_ref_count);
+
+	// Deliver all buffers for this worker at once
+	if (delivery.head)
+		m_worker_threads->DeliverBuffers(WQPRIO_HI, _worker_id, delivery);
+
+	// Handshakes and misrouted datagrams take the slow path
+	if (fallback.head)
+		_server->OnRecvRouting(fallback);
+
+	// If garbage needs to be taken out,
+	if (garbage_count > 0)
+		ReleaseRecvBuffers(garbage, garbage_count);
+}
+
+#endif // CAT_SPHYNX_SHARDED_SERVER
@@ -39,7 +39,6 @@ static StdAllocator *m_std_allocator = 0;
 static Clock *m_clock = 0;
 static WorkerThreads *m_worker_threads = 0;
 static UDPSendAllocator *m_udp_send_allocator = 0;
-static TLSInstance<TransportTLS> m_transport_tls;
 
 
 //// Transport TLS
@@ -66,11 +65,19 @@ bool TransportTLS::OnInitialize()
 */
 	rand_pad.Initialize(Clock::cycles());
 
+	frag_pool.Clear();
+	send_dict_workspace.Clear();
+	recv_dict_workspace.Clear();
+
 	return true;
 }
 
 void TransportTLS::OnFinalize()
 {
+	frag_pool.FreeMemory();
+	send_dict_workspace.FreeMemory();
+	recv_dict_workspace.FreeMemory();
+
 /*	if (locks)
 	{
 		delete []locks;
@@ -78,6 +85,38 @@ void TransportTLS::OnFinalize()
 	}*/
 }
 
+Mutex *Transport::LockSendCluster()
+{
+	CAT_FOREVER
+	{
+		Mutex *lock = _send_cluster_lock;
+
+		lock->Enter();
+
+		// If the lock was not swapped by MigrateTLS() while waiting for it,
+		if (lock == _send_cluster_lock)
+			return lock;
+
+		lock->Leave();
+	}
+}
+
+void Transport::MigrateTLS(TransportTLS *tls)
+{
+	Mutex *old_lock = LockSendCluster();
+
+	_ttls = tls;
+
+	// Threads waiting on the old lock will notice the swap and retry
+	Atomic::StoreMemoryBarrier();
+	_send_cluster_lock = &tls->locks.send_cluster_lock;
+
+	old_lock->Leave();
+
+	// The send inbox locks (CAT_NO_ATOMIC_CAS2) stay with the original worker,
+	// since any shared mutex works for them and they are never held for long
+}
+
 void Transport::InitializeTLS(TransportTLS *tls)
 {
 	_ttls = tls;
@@ -89,7 +128,12 @@ void Transport::InitializeTLS(TransportTLS *tls)
 	*/
 
 	_send_cluster_lock = &tls->locks.send_cluster_lock;
-	_send_queue_lock = &tls->locks.send_queue_lock;
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+	for (int stream = 0; stream < NUM_STREAMS; ++stream)
+		_send_inbox[stream].lock = &tls->locks.send_inbox_lock;
+	_unreliable_inbox.lock = &tls->locks.send_inbox_lock;
+#endif
 }
 
 
@@ -163,21 +207,31 @@ void Transport::QueueWriteDatagram(SendCluster &cluster)
 	do pkt = m_udp_send_allocator->Acquire(pkt_bytes);
 	while (!pkt);
 
+	CompressionDictionary *dict = _send_dictionary;
+	u8 flag = dict ? DGRAM_LZ4_DICT : DGRAM_LZ4;
+
 	// Attempt packet compression
-	int compress_bytes = LZ4_compress((const char*)workspace, (char*)pkt, bytes);
+	int compress_bytes;
+	if (dict)
+		compress_bytes = dict->Compress(_ttls->send_dict_workspace, workspace, bytes, pkt);
+	else
+		compress_bytes = LZ4_compress((const char*)workspace, (char*)pkt, bytes);
 
 	// If compression fails,
 	if (compress_bytes <= 0)
 	{
 		memcpy(pkt, workspace, bytes);
-		pkt[bytes] = 0;	// Mark uncompressed
+		pkt[bytes] = DGRAM_RAW;	// Mark uncompressed
 		compress_bytes = bytes;
 	}
 	else
 	{
-		pkt[compress_bytes] = 1; // Mark compressed
+		pkt[compress_bytes] = flag; // Mark compressed
 	}
 
+	Atomic::Add(&_stats.compress_in, bytes);
+	Atomic::Add(&_stats.compress_out, compress_bytes);
+
 	SendBuffer *buffer = SendBuffer::Promote(pkt);
 	buffer->data_bytes = compress_bytes + SPHYNX_OVERHEAD;
 
@@ -186,6 +240,40 @@ void Transport::QueueWriteDatagram(SendCluster &cluster)
 }
 
 
+//// OutgoingMessage
+
+// Returns the data for a node that is not a fragment
+static CAT_INLINE u8 *GetMessageData(OutgoingMessage *node)
+{
+	// If data is trailing,
+	if (!node->shared) return GetTrailingBytes(node);
+
+	SharedMessage *payload = static_cast<SendShared*>( node )->payload;
+	u8 *data = GetTrailingBytes(payload);
+
+	// If the descriptor has switched over to the compressed bytes,
+	if (node->GetBytes() != payload->bytes)
+		data += payload->bytes;
+
+	return data;
+}
+
+static void FreeMessage(OutgoingMessage *node)
+{
+	// If node holds a reference to a shared payload,
+	if (node->shared)
+	{
+		SharedMessage *payload = static_cast<SendShared*>( node )->payload;
+
+		// If this was the last reference,
+		if (Atomic::Add(&payload->references, -1) == 1)
+			m_std_allocator->Release(payload);
+	}
+
+	m_std_allocator->Release(node);
+}
+
+
 //// SendQueue
 
 CAT_INLINE void SendQueue::FreeMemory()
@@ -193,7 +281,7 @@ CAT_INLINE void SendQueue::FreeMemory()
 	for (OutgoingMessage *node = head, *next; node; node = next)
 	{
 		next = node->next;
-		m_std_allocator->Release(node);
+		FreeMessage(node);
 	}
 }
 
@@ -278,10 +366,163 @@ CAT_INLINE void SentList::RemoveBetween(OutgoingMessage *prev, OutgoingMessage *
 
 CAT_INLINE void OutOfOrderQueue::FreeMemory()
 {
-	for (RecvQueue *node = head, *next; node; node = next)
+	if (!capacity) return;
+
+	for (u32 ii = 0; ii < capacity; ++ii)
+		if (arrived[ii >> 5] & ((u32)1 << (ii & 31)))
+			m_std_allocator->Release(slots[ii]);
+
+	m_std_allocator->Release(slots);
+}
+
+bool OutOfOrderQueue::Grow(u32 expected_id, u32 span)
+{
+	u32 new_capacity = capacity ? capacity : MIN_CAPACITY;
+	while (new_capacity < span)
+		new_capacity <<= 1;
+
+	// Slots and bitmap share one allocation
+	u32 bitmap_words = new_capacity / 32;
+	u8 *memory = (u8*)m_std_allocator->Acquire(new_capacity * sizeof(RecvQueue*) + bitmap_words * sizeof(u32));
+	if (!memory) return false;
+
+	RecvQueue **new_slots = reinterpret_cast<RecvQueue**>( memory );
+	u32 *new_arrived = reinterpret_cast<u32*>( new_slots + new_capacity );
+	memset(new_arrived, 0, bitmap_words * sizeof(u32));
+
+	// Stored ids all lie in [expected_id, expected_id + capacity) so rehashing cannot collide
+	u32 new_mask = new_capacity - 1;
+	for (u32 ii = 0, id = expected_id; ii < capacity; ++ii, ++id)
 	{
-		next = node->next;
-		m_std_allocator->Release(node);
+		if (Contains(id))
+		{
+			u32 bit = id & new_mask;
+			new_slots[bit] = slots[id & (capacity - 1)];
+			new_arrived[bit >> 5] |= (u32)1 << (bit & 31);
+		}
+	}
+
+	if (capacity) m_std_allocator->Release(slots);
+
+	slots = new_slots;
+	arrived = new_arrived;
+	capacity = new_capacity;
+	return true;
+}
+
+CAT_INLINE void OutOfOrderQueue::Insert(RecvQueue *node)
+{
+	u32 bit = node->id & (capacity - 1);
+
+	slots[bit] = node;
+	arrived[bit >> 5] |= (u32)1 << (bit & 31);
+	++size;
+}
+
+CAT_INLINE RecvQueue *OutOfOrderQueue::Remove(u32 id)
+{
+	u32 bit = id & (capacity - 1);
+
+	arrived[bit >> 5] &= ~((u32)1 << (bit & 31));
+	--size;
+	return slots[bit];
+}
+
+u32 OutOfOrderQueue::Scan(u32 id, u32 end, bool arrival)
+{
+	u32 mask = capacity - 1;
+
+	while ((s32)(end - id) > 0)
+	{
+		u32 bit = id & mask;
+		u32 word = arrived[bit >> 5];
+		if (!arrival) word = ~word;
+
+		// Discard bits for ids before this one
+		word >>= bit & 31;
+
+		if (word)
+		{
+			u32 found = id + BSF32(word);
+			return (s32)(end - found) > 0 ? found : end;
+		}
+
+		// Continue from the next word, wrapping around the ring
+		id += 32 - (bit & 31);
+	}
+
+	return end;
+}
+
+
+//// SendCluster
+
+void SendCluster::AcquireWorkspace()
+{
+	// Wait for memory like the datagram allocation in QueueWriteDatagram()
+	do workspace = (u8*)m_std_allocator->Acquire(WORKSPACE_BYTES);
+	while (!workspace);
+}
+
+void SendCluster::ReleaseWorkspace()
+{
+	if (workspace)
+	{
+		m_std_allocator->Release(workspace);
+		workspace = 0;
+	}
+}
+
+
+//// ReassemblyPool
+
+void ReassemblyPool::FreeMemory()
+{
+	for (u32 ii = 0; ii < CLASS_COUNT; ++ii)
+	{
+		for (u32 jj = 0, count = free_count[ii]; jj < count; ++jj)
+			delete []free_buffers[ii][jj];
+	}
+
+	Clear();
+}
+
+u8 *ReassemblyPool::Acquire(u32 bytes)
+{
+	u32 size_class = GetClass(bytes);
+	u32 class_bytes = GetClassBytes(size_class);
+
+	// If a buffer of this size class is sitting in the free list,
+	u32 count = free_count[size_class];
+	if (count > 0)
+	{
+		free_count[size_class] = --count;
+		pooled_bytes -= class_bytes;
+		return free_buffers[size_class][count];
+	}
+
+	return new (std::nothrow) u8[class_bytes];
+}
+
+void ReassemblyPool::Release(u8 *buffer, u32 bytes)
+{
+	if (!buffer) return;
+
+	u32 size_class = GetClass(bytes);
+	u32 class_bytes = GetClassBytes(size_class);
+
+	// If there is room to keep it around for the next message,
+	u32 count = free_count[size_class];
+	if (count < MAX_FREE_PER_CLASS &&
+		pooled_bytes + class_bytes <= MAX_POOLED_BYTES)
+	{
+		free_buffers[size_class][count] = buffer;
+		free_count[size_class] = count + 1;
+		pooled_bytes += class_bytes;
+	}
+	else
+	{
+		delete []buffer;
 	}
 }
 
@@ -309,6 +550,153 @@ const char *cat::sphynx::GetSphynxErrorString(SphynxError err)
 	}
 }
 
+//// RetransmitWheel
+
+void RetransmitWheel::Place(OutgoingMessage *node, u32 t)
+{
+	u32 delta = t - current;
+
+	// If beyond the horizon, park it at the far edge
+	if (delta >= HORIZON)
+	{
+		t = current + HORIZON - 1;
+		delta = HORIZON - 1;
+	}
+
+	// Pick the lowest level that can resolve the deadline
+	OutgoingMessage **slot;
+	if (delta < SLOTS)
+		slot = &slots[0][t & SLOT_MASK];
+	else if (delta < SLOTS * SLOTS)
+		slot = &slots[1][(t >> SLOT_BITS) & SLOT_MASK];
+	else
+		slot = &slots[2][(t >> (SLOT_BITS * 2)) & SLOT_MASK];
+
+	// Link to head of slot
+	OutgoingMessage *head = *slot;
+	node->wheel_next = head;
+	node->wheel_pprev = slot;
+	if (head) head->wheel_pprev = &node->wheel_next;
+	*slot = node;
+}
+
+void RetransmitWheel::Schedule(OutgoingMessage *node, u32 now, u32 expire)
+{
+	// If wheel is empty, skip ahead to now
+	if (!count) current = now >> RESOLUTION_SHIFT;
+
+	node->ts_expire = expire;
+
+	// Round up so it never fires early, and never file it into a slot already processed
+	u32 t = (expire + (1 << RESOLUTION_SHIFT) - 1) >> RESOLUTION_SHIFT;
+	if ((s32)(t - current) <= 0) t = current + 1;
+
+	Place(node, t);
+	++count;
+}
+
+OutgoingMessage *RetransmitWheel::Advance(u32 now)
+{
+	u32 target = now >> RESOLUTION_SHIFT;
+	OutgoingMessage *expired = 0;
+
+	// For each level 0 slot time up to now,
+	while (count && (s32)(target - current) > 0)
+	{
+		u32 t = ++current;
+
+		// If a level 0 revolution just completed, cascade the next level 1 slot down
+		if ((t & SLOT_MASK) == 0)
+		{
+			u32 level1 = (t >> SLOT_BITS) & SLOT_MASK;
+
+			// If a level 1 revolution just completed, cascade the next level 2 slot down
+			if (level1 == 0)
+			{
+				u32 level2 = (t >> (SLOT_BITS * 2)) & SLOT_MASK;
+
+				OutgoingMessage *node = slots[2][level2];
+				slots[2][level2] = 0;
+
+				for (OutgoingMessage *next; node; node = next)
+				{
+					next = node->wheel_next;
+
+					u32 node_t = (node->ts_expire + (1 << RESOLUTION_SHIFT) - 1) >> RESOLUTION_SHIFT;
+					if ((s32)(node_t - t) < 0) node_t = t;
+
+					Place(node, node_t);
+				}
+			}
+
+			OutgoingMessage *node = slots[1][level1];
+			slots[1][level1] = 0;
+
+			for (OutgoingMessage *next; node; node = next)
+			{
+				next = node->wheel_next;
+
+				u32 node_t = (node->ts_expire + (1 << RESOLUTION_SHIFT) - 1) >> RESOLUTION_SHIFT;
+				if ((s32)(node_t - t) < 0) node_t = t;
+
+				Place(node, node_t);
+			}
+		}
+
+		// Unlink everything in the slot that came due
+		OutgoingMessage *node = slots[0][t & SLOT_MASK];
+		slots[0][t & SLOT_MASK] = 0;
+
+		for (OutgoingMessage *next; node; node = next)
+		{
+			next = node->wheel_next;
+
+			node->wheel_pprev = 0;
+			node->wheel_next = expired;
+			expired = node;
+			--count;
+		}
+	}
+
+	// If wheel emptied, skip ahead to now
+	if (!count) current = target;
+
+	return expired;
+}
+
+
+//// Transport
+
+StreamState Transport::_idle_stream;
+
+StreamState *Transport::GetStream(u32 stream)
+{
+	StreamState *state = _streams[stream];
+
+	// If the stream has not stored anything yet,
+	if (!state)
+	{
+		state = new (std::nothrow) StreamState;
+		if (!state) return 0;
+
+		state->Clear();
+
+		_streams[stream] = state;
+	}
+
+	return state;
+}
+
+CAT_INLINE u32 Transport::GetRetransmitTime(u32 stream, OutgoingMessage *node)
+{
+	u32 timeout = _send_flow->GetHeadTimeout(stream);
+
+	u32 backoff = node->ts_lastsend - node->ts_firstsend;
+	if (backoff > 4 * timeout) backoff = 4 * timeout;
+
+	return node->ts_lastsend + timeout + backoff;
+}
+
 void Transport::FreeSentNode(OutgoingMessage *node)
 {
 	// If node is a fragment,
@@ -323,22 +711,33 @@ void Transport::FreeSentNode(OutgoingMessage *node)
 			// If message has completed sending,
 			if (full_data_node->sent_bytes >= full_data_node->GetBytes())
 			{
-				m_std_allocator->Release(full_data_node);
+				FreeMessage(full_data_node);
 			}
 		}
 	}
 
-	m_std_allocator->Release(node);
+	FreeMessage(node);
 }
 
-CAT_INLINE void Transport::QueueFragFree(u8 *data)
+CAT_INLINE void Transport::QueueFragFree(u8 *data, u32 bytes)
 {
 	// Add to the free frag list
 	u32 count = _ttls->free_list_count;
-	_ttls->free_list[count] = data;
+	_ttls->free_list[count].buffer = data;
+	_ttls->free_list[count].bytes = bytes;
 	_ttls->free_list_count = ++count;
 }
 
+CAT_INLINE void Transport::ReleaseQueuedFrags()
+{
+	ReassemblyPool &pool = _ttls->frag_pool;
+
+	for (u32 ii = 0, count = _ttls->free_list_count; ii < count; ++ii)
+		pool.Release(_ttls->free_list[ii].buffer, _ttls->free_list[ii].bytes);
+
+	_ttls->free_list_count = 0;
+}
+
 void Transport::QueueDelivery(u32 stream, u8 *data, u32 data_bytes)
 {
 	u32 depth = _ttls->delivery_queue_depth;
@@ -356,9 +755,7 @@ void Transport::QueueDelivery(u32 stream, u8 *data, u32 data_bytes)
 		_ttls->delivery_queue_depth = 0;
 
 		// Free memory for fragments
-		for (u32 ii = 0, count = _ttls->free_list_count; ii < count; ++ii)
-			delete []_ttls->free_list[ii];
-		_ttls->free_list_count = 0;
+		ReleaseQueuedFrags();
 	}
 }
 
@@ -371,9 +768,7 @@ void Transport::DeliverQueued()
 		_ttls->delivery_queue_depth = 0;
 
 		// Free memory for fragments
-		for (u32 ii = 0, count = _ttls->free_list_count; ii < count; ++ii)
-			delete []_ttls->free_list[ii];
-		_ttls->free_list_count = 0;
+		ReleaseQueuedFrags();
 	}
 }
 
@@ -382,20 +777,31 @@ void Transport::DeliverQueued()
 
 Transport::Transport()
 {
+	// Per-stream state is allocated on first use
+	CAT_OBJCLR(_streams);
+
 	// Receive state
 	CAT_OBJCLR(_got_reliable);
 
-	CAT_OBJCLR(_fragments);
+	_frag_bytes = 0;
+
+	CAT_OBJCLR(_latest_recv_seq);
 
-	CAT_OBJCLR(_recv_wait);
+	_ack_every = DEFAULT_ACK_EVERY;
+	_ack_max_delay = DEFAULT_ACK_MAX_DELAY;
+	_ack_pending = 0;
+	_ack_due = 0;
+	_ack_immediate = false;
 
 	// Send state
+	_send_cluster.workspace = 0;
 	_send_cluster.Clear();
 	_send_flush_after_processing = false;
 
-	CAT_OBJCLR(_send_queue);
-	CAT_OBJCLR(_sending_queue);
-	CAT_OBJCLR(_sent_list);
+	CAT_OBJCLR(_send_inbox);
+	CAT_OBJCLR(_unreliable_inbox);
+	CAT_OBJCLR(_latest_send_seq);
+	_retransmit_wheel.Clear();
 
 	// Just clear these for now.  When security is initialized these will be filled in
 	CAT_OBJCLR(_next_send_id);
@@ -408,11 +814,31 @@ Transport::Transport()
 	_outgoing_datagrams.Clear();
 	_outgoing_datagrams_count = 0;
 
+	_paced_datagrams.Clear();
+	_pace_next_usec = 0;
+	_pace_wakeup_pending = 0;
+
 	_huge_endpoint = 0;
+
+	_send_flow = 0;
+
+	_recv_dictionary = 0;
+	_send_dictionary = 0;
+
+	_stats.Clear();
 }
 
 Transport::~Transport()
 {
+	if (_send_flow)
+		delete _send_flow;
+
+	if (_recv_dictionary)
+		_recv_dictionary->ReleaseRef();
+
+	if (_send_dictionary)
+		_send_dictionary->ReleaseRef();
+
 	// Release memory for outgoing datagrams
 	for (BatchHead *next, *node = _outgoing_datagrams.head; node; node = next)
 	{
@@ -420,18 +846,76 @@ Transport::~Transport()
 		m_std_allocator->Release(node);
 	}
 
+	// Release datagrams that were still waiting to be paced
+	if (_paced_datagrams.head)
+		m_udp_send_allocator->ReleaseBatch(_paced_datagrams);
+
+	SendQueue inbox;
+
 	// For each stream,
 	for (int stream = 0; stream < NUM_STREAMS; ++stream)
 	{
-		// Release memory for fragment buffer
-		if (_fragments[stream].buffer)
-			delete []_fragments[stream].buffer;
+		StreamState *state = _streams[stream];
+
+		// If the stream was ever used,
+		if (state)
+		{
+			// Release memory for fragment buffer
+			if (state->fragment.buffer)
+				delete []state->fragment.buffer;
 
-		_recv_wait[stream].FreeMemory();
-		_sent_list[stream].FreeMemory();
-		_send_queue[stream].FreeMemory();
-		_sending_queue[stream].FreeMemory();
+			state->recv_wait.FreeMemory();
+			state->sent_list.FreeMemory();
+			state->sending_queue.FreeMemory();
+
+			delete state;
+		}
+
+		inbox.head = _send_inbox[stream].PopAll(inbox.tail);
+		inbox.FreeMemory();
 	}
+
+	inbox.head = _unreliable_inbox.PopAll(inbox.tail);
+	inbox.FreeMemory();
+
+	_send_cluster.ReleaseWorkspace();
+}
+
+void Transport::GetFootprint(ConnexionFootprint &footprint)
+{
+	footprint.transport_bytes = sizeof(Transport);
+	footprint.stream_bytes = sizeof(StreamState);
+	footprint.workspace_bytes = SendCluster::WORKSPACE_BYTES;
+}
+
+bool Transport::SetRecvDictionary(CompressionDictionary *dict)
+{
+	if (!dict || _recv_dictionary)
+		return false;
+
+	dict->AddRef();
+	_recv_dictionary = dict;
+
+	return true;
+}
+
+bool Transport::SetSendDictionary(CompressionDictionary *dict)
+{
+	if (!dict || _send_dictionary)
+		return false;
+
+	dict->AddRef();
+	_send_dictionary = dict;
+
+	return true;
+}
+
+s32 Transport::DecompressDictionary(const u8 *data, u32 bytes, u8 *out, u32 out_limit)
+{
+	CompressionDictionary *dict = _recv_dictionary;
+	if (!dict) return 0;
+
+	return dict->Decompress(_ttls->recv_dict_workspace, data, bytes, out, out_limit);
 }
 
 void Transport::Disconnect(u8 reason)
@@ -456,6 +940,13 @@ void Transport::InitializePayloadBytes(bool ip6)
 	_max_payload_bytes = MINIMUM_MTU - _udpip_bytes - SPHYNX_OVERHEAD;
 }
 
+bool Transport::InitializeFlowControl(FlowControlMode mode)
+{
+	_send_flow = FlowControl::Create(mode);
+
+	return _send_flow != 0;
+}
+
 bool Transport::InitializeTransportSecurity(bool is_initiator, AuthenticatedEncryption &auth_enc)
 {
 	/*
@@ -501,29 +992,40 @@ void Transport::TickTransport(u32 now)
 		return;
 	}
 
-	// Acknowledge recent reliable messages
-	for (int stream = 0; stream < NUM_STREAMS; ++stream)
-	{
-		if (_got_reliable[stream])
-		{
-			WriteACK();
-			break;
-		}
-	}
+	// If acknowledgments have been held back long enough,
+	if ((s32)(now - _ack_due) >= 0)
+		SendACK(now);
 
 	u32 loss_count = 0;
 
-	// Retransmit lost messages
+	// If any messages are waiting for acknowledgment, retransmit the ones that timed out
+	if (_retransmit_wheel.count)
+		loss_count = RetransmitLost(now);
+
+	_send_flow->OnTick(now, loss_count);
+
+	// Sample statistics gauges
+	u32 out_of_order = 0, heap_bytes = _frag_bytes;
 	for (int stream = 0; stream < NUM_STREAMS; ++stream)
 	{
-		if (_sent_list[stream].head)
+		StreamState *state = _streams[stream];
+
+		if (state)
 		{
-			loss_count = RetransmitLost(now);
-			break;
+			out_of_order += state->recv_wait.size;
+			heap_bytes += sizeof(StreamState) + state->recv_wait.GetBytes();
 		}
 	}
 
-	_send_flow.OnTick(now, loss_count);
+	// Reading the workspace pointer without the lock is fine for a gauge
+	if (_send_cluster.workspace)
+		heap_bytes += SendCluster::WORKSPACE_BYTES;
+
+	Atomic::Add(&_stats.losses, loss_count);
+	_stats.out_of_order = out_of_order;
+	_stats.heap_bytes = heap_bytes;
+	_stats.rtt = _send_flow->GetRTT();
+	_stats.pacing_rate = _send_flow->GetPacingRate();
 
 	FlushWrites();
 }
@@ -546,8 +1048,12 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 		s32 bytes = buffer->data_bytes;
 		u32 recv_time = buffer->event_msec;
 
+		++_stats.datagrams_recv;
+		_stats.bytes_recv += bytes;
+
 		// Start peeling out messages from the warm gooey center of the packet
 		u32 ack_id = 0, stream = 0;
+		bool reliable_arrived = false;
 
 		CAT_INANE("Transport") << "Datagram dump " << bytes << ":" << HexDumpString(data, bytes);
 
@@ -646,6 +1152,8 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 			{
 				CAT_INANE("Transport") << "Got # " << stream << ":" << ack_id;
 
+				reliable_arrived = true;
+
 				s32 diff = (s32)(ack_id - _next_recv_expected_id[stream]);
 
 				// If message is next expected,
@@ -680,7 +1188,9 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 
 					CAT_INANE("Transport") << "Rel dump " << bytes << ":" << HexDumpString(data, bytes);
 
+					// Our acknowledgment was probably lost, so repeat it right away
 					_got_reliable[stream] = true;
+					_ack_immediate = true;
 				}
 			}
 			else if (data_bytes > 0) // Unreliable message:
@@ -693,6 +1203,8 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 					OnACK(recv_time, data, data_bytes);
 				else if (super_opcode == SOP_INTERNAL)
 					OnInternal(recv_time, data, data_bytes);
+				else if (super_opcode == SOP_LATEST)
+					OnLatest(data, data_bytes);
 
 				CAT_DEBUG_CHECK_MEMORY();
 			}
@@ -706,6 +1218,16 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 			bytes -= data_bytes;
 			data += data_bytes;
 		} // while bytes >= 1
+
+		// If the datagram carried reliable messages,
+		if (reliable_arrived)
+		{
+			++_stats.reliable_recv;
+
+			// If this is the first one waiting for acknowledgment, start the delay
+			if (_ack_pending++ == 0)
+				_ack_due = recv_time + _ack_max_delay;
+		}
 	} // end for each buffer
 
 	CAT_DEBUG_CHECK_MEMORY();
@@ -713,6 +1235,14 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 	// Deliver any messages that are queued up
 	DeliverQueued();
 
+	// If acknowledgment should not wait for the next tick,
+	if (_ack_immediate || _ack_pending >= _ack_every)
+	{
+		SendACK(m_clock->msec());
+
+		_send_flush_after_processing = true;
+	}
+
 	// If flush was requested,
 	if (_send_flush_after_processing)
 	{
@@ -723,10 +1253,10 @@ void Transport::OnTransportDatagrams(const BatchSet &delivery)
 
 void Transport::RunReliableReceiveQueue(u32 recv_time, u32 ack_id, u32 stream)
 {
-	RecvQueue *node = _recv_wait[stream].head;
+	OutOfOrderQueue &wait = PeekStream(stream)->recv_wait;
 
 	// If no queue to run or queue is not ready yet,
-	if (!node || node->id != ack_id)
+	if (!wait.size || !wait.Contains(ack_id))
 	{
 		// Just update next expected id and set flag to send acks on next tick
 		_next_recv_expected_id[stream] = ack_id;
@@ -734,11 +1264,15 @@ void Transport::RunReliableReceiveQueue(u32 recv_time, u32 ack_id, u32 stream)
 		return;
 	}
 
+	// A hole just closed, so let the sender know right away
+	_ack_immediate = true;
+
 	// For each queued message that is now ready to go,
 	u32 next_ack_id = ack_id;
 	do
 	{
 		// Grab the queued message
+		RecvQueue *node = wait.Remove(next_ack_id);
 		u32 super_opcode = node->sop;
 		u8 *old_data = GetTrailingBytes(node);
 		u32 old_data_bytes = node->bytes;
@@ -766,63 +1300,46 @@ void Transport::RunReliableReceiveQueue(u32 recv_time, u32 ack_id, u32 stream)
 		// And proceed on to next message
 		++next_ack_id;
 
-		RecvQueue *next = node->next;
 		m_std_allocator->Release(node);
-		node = next;
-	} while (node && node->id == next_ack_id);
+	} while (wait.size && wait.Contains(next_ack_id));
 
-	// Reduce the size of the wait queue
-	_recv_wait[stream].size -= next_ack_id - ack_id;
-	_recv_wait[stream].head = node;
 	_next_recv_expected_id[stream] = next_ack_id;
 	_got_reliable[stream] = true;
 }
 
 void Transport::StoreReliableOutOfOrder(u32 recv_time, u8 *data, u32 data_bytes, u32 ack_id, u32 stream, u32 super_opcode)
 {
-	// If too many out of order arrivals already,
-	u32 count = _recv_wait[stream].size;
-	if (count >= OUT_OF_ORDER_LIMIT)
+	u32 expected_id = _next_recv_expected_id[stream];
+	u32 span = ack_id - expected_id + 1;
+
+	// If too far ahead of the next expected message,
+	if (span > OUT_OF_ORDER_LIMIT)
 	{
 		CAT_WARN("Transport") << "Out of room for out-of-order arrivals";
 		return;
 	}
 
-	// Walk forwards because the skip list makes this straight-forward (pun intended)
-	RecvQueue *next = _recv_wait[stream].head;
-	RecvQueue *prev = 0, *prev_seq = 0;
-
-	// Search for queue insertion point
-	u32 ii = 0;
-	while (next)
+	StreamState *state = GetStream(stream);
+	if (!state)
 	{
-		// If insertion point is found,
-		if (ack_id < next->id)
-			break;
-
-		// Node is either in this sequence or after it
+		CAT_WARN("Transport") << "Out of memory for incoming packet queue";
+		return;
+	}
 
-		// Investigate the end of sequence
-		RecvQueue *eos = next->eos;
+	OutOfOrderQueue &wait = state->recv_wait;
 
-		// If ack_id is contained within the sequence,
-		if (ack_id <= eos->id)
-		{
-			CAT_WARN("Transport") << "Ignored duplicate queued reliable message";
-			return;
-		}
-
-		// Set up for the next loop
-		prev_seq = next;
-		prev = eos;
-		next = eos->next;
+	// If the window does not reach this far yet,
+	if (span > wait.capacity && !wait.Grow(expected_id, span))
+	{
+		CAT_WARN("Transport") << "Out of memory for incoming packet queue";
+		return;
+	}
 
-		// If too many attempts to find insertion point already,
-		if (++ii >= OUT_OF_ORDER_LOOPS)
-		{
-			CAT_WARN("Transport") << "Dropped message due to swiss cheese";
-			return;
-		}
+	// If already received,
+	if (wait.Contains(ack_id))
+	{
+		CAT_WARN("Transport") << "Ignored duplicate queued reliable message";
+		return;
 	}
 
 	CAT_WARN("Transport") << "Queuing out-of-order message # " << stream << ":" << ack_id;
@@ -871,140 +1388,181 @@ void Transport::StoreReliableOutOfOrder(u32 recv_time, u8 *data, u32 data_bytes,
 	new_node->id = ack_id;
 	memcpy(GetTrailingBytes(new_node), data, stored_bytes);
 
-	// Link into list
-	new_node->next = next;
-	if (prev) prev->next = new_node;
-	else _recv_wait[stream].head = new_node;
-
-	// Link into sequence (skip list),
-	if (prev && prev->id + 1 == ack_id)
-		prev_seq->eos = (next && ack_id + 1 == next->id) ? next->eos : new_node;
-	else if (next && ack_id + 1 == next->id)
-		new_node->eos = next->eos;
-	else
-		new_node->eos = new_node;
+	wait.Insert(new_node);
 
+	// A hole is open, so let the sender know right away
 	_got_reliable[stream] = true;
-	_recv_wait[stream].size = count + 1;
+	_ack_immediate = true;
+}
+
+void Transport::OnLatest(u8 *data, u32 bytes)
+{
+	if (bytes <= LATEST_HEADER_BYTES)
+	{
+		CAT_WARN("Transport") << "Truncated latest-only message ignored";
+		return;
+	}
+
+	u32 channel = data[0];
+	if (channel >= MAX_LATEST_CHANNELS)
+	{
+		CAT_WARN("Transport") << "Latest-only message on invalid channel " << channel << " ignored";
+		return;
+	}
+
+	u16 seq = getLE(*(u16*)(data + 1));
+
+	// If not newer than the last message delivered on the channel,
+	if ((s16)(seq - _latest_recv_seq[channel]) <= 0)
+	{
+		CAT_INANE("Transport") << "Stale latest-only message " << channel << ":" << seq << " dropped";
+		return;
+	}
+
+	_latest_recv_seq[channel] = seq;
+
+	QueueDelivery(STREAM_UNORDERED, data + LATEST_HEADER_BYTES, bytes - LATEST_HEADER_BYTES);
 }
 
 void Transport::OnFragment(u32 recv_time, u8 *data, u32 bytes, u32 stream)
 {
 	//INFO("Transport") << "OnFragment " << bytes << ":" << HexDumpString(data, bytes);
 
-	u16 frag_length = _fragments[stream].length;
-	u16 frag_offset = _fragments[stream].offset;
+	StreamState *state = GetStream(stream);
+	if (!state)
+	{
+		CAT_WARN("Transport") << "Out of memory: Fragment ignored in stream " << stream;
+		return;
+	}
+
+	RecvFrag &frag = state->fragment;
 
 	// If fragment is starting,
-	if (!frag_offset)
+	if (!frag.length)
 	{
 		if (bytes < FRAG_HEADER_BYTES + 1)
 		{
 			CAT_WARN("Transport") << "Truncated message fragment head ignored";
 			return;
 		}
-		else
+
+		u16 frag_length = getLE(*(u16*)(data)) + 1;
+		u16 decomp_length = getLE(*(u16*)(data + 2));
+		data += FRAG_HEADER_BYTES;
+		bytes -= FRAG_HEADER_BYTES;
+
+		// If decompressed length is under fragment length,
+		if (decomp_length < frag_length)
 		{
-			frag_length = getLE(*(u16*)(data)) + 1;
-			u16 decomp_length = getLE(*(u16*)(data + 2));
-			data += FRAG_HEADER_BYTES;
-			bytes -= FRAG_HEADER_BYTES;
+			CAT_WARN("Transport") << "Fragment head decompressed length under fragment sum length";
+		}
 
-			// If decompressed length is under fragment length,
-			if (decomp_length < frag_length)
-			{
-				CAT_WARN("Transport") << "Fragment head decompressed length under fragment sum length";
-			}
+		frag.length = frag_length;
+		frag.decomp_length = decomp_length;
+		frag.offset = 0;
 
+		// If this connexion already holds too much partially reassembled data,
+		if (_frag_bytes + frag_length > MAX_REASSEMBLY_BYTES)
+		{
+			CAT_WARN("Transport") << "Reassembly limit reached: Discarding fragmented message in stream " << stream;
+			frag.buffer = 0;
+		}
+		else
+		{
 			// Allocate fragment buffer
-			_fragments[stream].buffer = new (std::nothrow) u8[frag_length];
-			if (!_fragments[stream].buffer)
+			frag.buffer = _ttls->frag_pool.Acquire(frag_length);
+			if (!frag.buffer)
 			{
-				CAT_WARN("Transport") << "Out of memory: Unable to allocate fragment buffer";
-				return;
+				CAT_WARN("Transport") << "Out of memory: Discarding fragmented message in stream " << stream;
 			}
 			else
 			{
-				_fragments[stream].length = frag_length;
-				_fragments[stream].decomp_length = decomp_length;
-				_fragments[stream].offset = 0;
+				_frag_bytes += frag_length;
 			}
 		}
 
 		// Fall-thru to processing data part of fragment message:
 	}
 
+	u8 *buffer = frag.buffer;
+	u32 fragment_length = frag.length;
+
 	// If there are no data bytes in this fragment,
 	if (bytes == 0)
 	{
 		// This is a request to abort the fragment
-		if (_fragments[stream].buffer)
-			delete []_fragments[stream].buffer;
+		if (buffer)
+		{
+			_ttls->frag_pool.Release(buffer, fragment_length);
+			_frag_bytes -= fragment_length;
+			frag.buffer = 0;
+		}
 
-		_fragments[stream].length = 0;
+		frag.length = 0;
 		CAT_WARN("Transport") << "Aborted fragment transfer in stream " << stream;
 		return;
 	}
 
-	u32 fragment_length = _fragments[stream].length;
-	u32 fragment_remaining = fragment_length - _fragments[stream].offset;
+	u32 fragment_remaining = fragment_length - frag.offset;
 
-	// If the fragment is now complete,
-	if (bytes >= fragment_remaining)
+	// If the fragment is not complete yet,
+	if (bytes < fragment_remaining)
 	{
-		// Reset length flag
-		_fragments[stream].length = 0;
+		// Copy it into place unless the message is being discarded
+		if (buffer) memcpy(buffer + frag.offset, data, bytes);
+		frag.offset += bytes;
+		return;
+	}
 
-		if (bytes > fragment_remaining)
-		{
-			CAT_WARN("Transport") << "Message fragment overflow truncated";
-		}
+	if (bytes > fragment_remaining)
+	{
+		CAT_WARN("Transport") << "Message fragment overflow truncated";
+	}
 
-		// Copy final fragment
-		u8 *buffer = _fragments[stream].buffer;
-		memcpy(buffer + _fragments[stream].offset, data, fragment_remaining);
+	// Reset length flag and zero buffer pointer so that it won't be reclaimed on dtor
+	frag.length = 0;
+	frag.buffer = 0;
 
-		// Queue up this buffer for deletion after we are done
-		QueueFragFree(buffer);
+	// If the message was discarded,
+	if (!buffer) return;
 
-		// If compression was used,
-		u32 fragment_decomp_length = _fragments[stream].decomp_length;
-		if (fragment_decomp_length > fragment_length)
-		{
-			u8 *dest = new (std::nothrow) u8[fragment_decomp_length];
-			if (!dest)
-			{
-				CAT_WARN("Transport") << "Out of memory allocating " << fragment_decomp_length;
-				return;
-			}
+	_frag_bytes -= fragment_length;
 
-			// Queue up this buffer for deletion after we are done
-			QueueFragFree(dest);
+	// Copy final fragment
+	memcpy(buffer + frag.offset, data, fragment_remaining);
 
-			// If decompression succeeds,
-			int r = LZ4_uncompress((const char*)buffer, (char*)dest, fragment_decomp_length);
-			if (r <= 0)
-			{
-				CAT_WARN("Transport") << "Decompression of fragmented message failed";
-				return;
-			}
+	// Queue up this buffer for release after we are done
+	QueueFragFree(buffer, fragment_length);
 
-			buffer = dest;
-			fragment_length = fragment_decomp_length;
+	// If compression was used,
+	u32 fragment_decomp_length = frag.decomp_length;
+	if (fragment_decomp_length > fragment_length)
+	{
+		u8 *dest = _ttls->frag_pool.Acquire(fragment_decomp_length);
+		if (!dest)
+		{
+			CAT_WARN("Transport") << "Out of memory allocating " << fragment_decomp_length;
+			return;
 		}
 
-		// Zero buffer pointer so that it won't be reclaimed on dtor
-		_fragments[stream].buffer = 0;
+		// Queue up this buffer for release after we are done
+		QueueFragFree(dest, fragment_decomp_length);
 
-		// Deliver this buffer
-		QueueDelivery(stream, buffer, fragment_length);
-	}
-	else
-	{
-		memcpy(_fragments[stream].buffer + _fragments[stream].offset, data, bytes);
-		_fragments[stream].offset += bytes;
+		// If decompression succeeds,
+		int r = LZ4_uncompress((const char*)buffer, (char*)dest, fragment_decomp_length);
+		if (r <= 0)
+		{
+			CAT_WARN("Transport") << "Decompression of fragmented message failed";
+			return;
+		}
+
+		buffer = dest;
+		fragment_length = fragment_decomp_length;
 	}
 
+	// Deliver this buffer
+	QueueDelivery(stream, buffer, fragment_length);
+
 	CAT_DEBUG_CHECK_MEMORY();
 }
 
@@ -1039,54 +1597,106 @@ bool Transport::WriteOOB(u8 msg_opcode, const void *msg_data, u32 msg_bytes, Sup
 
 	// NOTE: Does not reflect writing datagram in bandwidth usage.
 	// This was the only place that was doing it outside of the assigned worker thread.
-	return WriteDatagrams(buffer, 1) > 0;
+	s32 write_count = WriteDatagrams(buffer, 1);
+	if (write_count > 0)
+	{
+		Atomic::Add(&_stats.datagrams_sent, 1);
+		Atomic::Add(&_stats.bytes_sent, write_count);
+		return true;
+	}
+
+	return false;
 }
 
-bool Transport::WriteUnreliable(u8 msg_opcode, const void *vmsg_data, u32 msg_bytes, SuperOpcode super_opcode)
+bool Transport::WriteUnreliable(u8 msg_opcode, const void *msg_data, u32 msg_bytes, SuperOpcode super_opcode)
 {
-	const u8 *msg_data = reinterpret_cast<const u8*>( vmsg_data );
+	// Fail on invalid input: SOP_LATEST (== SOP_FRAG) is reserved for WriteLatest()
+	if (super_opcode == SOP_LATEST)
+	{
+		CAT_WARN("Transport") << "Invalid input: Use WriteLatest() for latest-only messages";
+		return false;
+	}
 
-	u32 max_payload_bytes = _max_payload_bytes;
-	u32 data_bytes = msg_bytes + 1;
-	u32 header_bytes = data_bytes > BLO_MASK ? 2 : 1;
-	u32 needed = header_bytes + data_bytes;
+	u32 data_bytes = 1 + msg_bytes;
+	u8 *msg = OutgoingMessage::Acquire(data_bytes);
+	if (!msg) return false;
+
+	msg[0] = msg_opcode;
+	memcpy(msg + 1, msg_data, msg_bytes);
+
+	return WriteUnreliableZeroCopy(msg, data_bytes, super_opcode);
+}
+
+bool Transport::WriteUnreliableZeroCopy(u8 *msg, u32 msg_bytes, SuperOpcode super_opcode)
+{
+	u32 header_bytes = msg_bytes > BLO_MASK ? 2 : 1;
+
+	// Fail on invalid input: SOP_LATEST (== SOP_FRAG) is reserved for WriteLatest()
+	if (super_opcode == SOP_LATEST)
+	{
+		CAT_WARN("Transport") << "Invalid input: Use WriteLatest() for latest-only messages";
+		OutgoingMessage::Release(msg);
+		return false;
+	}
 
 	// Fail on invalid input
-	if (needed > max_payload_bytes)
+	if (header_bytes + msg_bytes > _max_payload_bytes)
 	{
 		CAT_WARN("Transport") << "Invalid input: Unreliable buffer size request too large";
+		OutgoingMessage::Release(msg);
 		return false;
 	}
 
-	_send_cluster_lock->Enter();
+	OutgoingMessage *node = OutgoingMessage::Promote(msg);
+	node->SetBytes(msg_bytes);
+	node->sop = super_opcode;
+	node->shared = 0;
+
+	// Leave it for the worker thread to write into the send cluster
+	_unreliable_inbox.Push(node);
 
-	// If growing the send buffer cannot contain the new message,
-	if (_send_cluster.bytes + needed > max_payload_bytes)
+	CAT_INFO("Transport") << "Queued unreliable message with " << msg_bytes << " bytes";
+
+	return true;
+}
+
+bool Transport::WriteLatest(u32 channel, u8 msg_opcode, const void *vmsg_data, u32 msg_bytes)
+{
+	const u8 *msg_data = reinterpret_cast<const u8*>( vmsg_data );
+
+	if (channel >= MAX_LATEST_CHANNELS)
 	{
-		QueueWriteDatagram(_send_cluster);
-		_send_cluster.Clear();
+		CAT_WARN("Transport") << "Invalid input: Latest-only channel " << channel << " out of range";
+		return false;
 	}
 
-	// Create or grow buffer and write into it
-	u8 *pkt = _send_cluster.Next(needed);
+	u32 data_bytes = LATEST_HEADER_BYTES + 1 + msg_bytes;
+	u32 header_bytes = data_bytes > BLO_MASK ? 2 : 1;
 
-	// Write header
-	if (data_bytes <= BLO_MASK)
-		pkt[0] = (u8)data_bytes | (super_opcode << SOP_SHIFT);
-	else
+	// Fail on invalid input
+	if (header_bytes + data_bytes > _max_payload_bytes)
 	{
-		pkt[0] = (u8)(data_bytes & BLO_MASK) | (super_opcode << SOP_SHIFT) | C_MASK;
-		pkt[1] = (u8)(data_bytes >> BHI_SHIFT);
+		CAT_WARN("Transport") << "Invalid input: Latest-only buffer size request too large";
+		return false;
 	}
-	pkt += header_bytes;
 
-	// Write data
-	pkt[0] = msg_opcode;
-	memcpy(pkt + 1, msg_data, msg_bytes);
+	u8 *msg = OutgoingMessage::Acquire(data_bytes);
+	if (!msg) return false;
 
-	_send_cluster_lock->Leave();
+	// Write data; the sequence number is filled in by the worker thread
+	msg[0] = (u8)channel;
+	msg[LATEST_HEADER_BYTES] = msg_opcode;
+	memcpy(msg + LATEST_HEADER_BYTES + 1, msg_data, msg_bytes);
 
-	CAT_INFO("Transport") << "Wrote unreliable message with " << data_bytes << " bytes";
+	OutgoingMessage *node = OutgoingMessage::Promote(msg);
+	node->SetBytes(data_bytes);
+	node->sop = SOP_LATEST;
+	node->shared = 0;
+
+	// Leave it for the worker thread to write into the send cluster
+	_unreliable_inbox.Push(node);
+
+	CAT_INFO("Transport") << "Queued latest-only message with " << data_bytes << " bytes on channel " << channel;
 
 	return true;
 }
@@ -1111,60 +1721,71 @@ bool Transport::BroadcastReliable(BinnedConnexionSubset &subset, StreamMode stre
 		return false;
 	}
 
-	// For each worker,
+	// Count recipients
 	u32 acquire_sum = 0;
 	for (int worker_id = 0, worker_count = subset.WorkerCount(); worker_id < worker_count; ++worker_id)
 	{
-		// Skip empty bins
-		ConnexionSubset &subsubset = subset[worker_id];
-		const int subset_count = subsubset.Count();
-		if (subset_count <= 0) continue;
+		const int subset_count = subset[worker_id].Count();
+		if (subset_count > 0) acquire_sum += subset_count;
+	}
 
-		// Prepare one message for each subset connexion
-		OutgoingMessage *head = 0;
-		for (int msg_id = 0; msg_id < subset_count; ++msg_id)
-		{
-			// Acquire buffer
-			u8 *msg;
-			do msg = OutgoingMessage::Acquire(1 + msg_bytes);
-			while (!msg);
+	// If no recipients,
+	if (!acquire_sum) return true;
 
-			// Initialize outgoing message object
-			OutgoingMessage *node = OutgoingMessage::Promote(msg);
-			node->SetBytes(1 + msg_bytes);
-			node->frag_count = 0;
-			node->sop = super_opcode;
-			node->send_bytes = 0;
-			node->sent_bytes = 0;
+	u32 data_bytes = 1 + msg_bytes;
 
-			// Link to head of list
-			node->next = head;
-			head = node;
+	// If the message is too long to ever go out without fragmentation, compress it once here
+	// Inlined from LZ4 code - Remember to update this if it changes!
+	u32 comp_bound = (data_bytes > SHARED_COMPRESS_THRESHOLD) ? (data_bytes + (data_bytes/255) + 16) : 0;
 
-			// Fill data
-			msg[0] = msg_opcode;
-			memcpy(msg + 1, msg_data, msg_bytes);
-		}
+	// Build the shared payload
+	SharedMessage *payload;
+	do payload = m_std_allocator->AcquireTrailing<SharedMessage>(data_bytes + comp_bound);
+	while (!payload);
+
+	u8 *data = GetTrailingBytes(payload);
+	data[0] = msg_opcode;
+	memcpy(data + 1, msg_data, msg_bytes);
 
-		// Lookup send queue lock for this worker id
-		TransportTLS *tls = m_transport_tls.Peek(m_worker_threads->GetTLS(worker_id));
-		Mutex *send_queue_lock = &tls->locks.send_queue_lock;
+	payload->bytes = data_bytes;
+	payload->comp_bytes = 0;
+	payload->references = acquire_sum;
 
-		send_queue_lock->Enter();
+	if (comp_bound)
+	{
+		int compress_bytes = LZ4_compress((const char*)data, (char*)data + data_bytes, data_bytes);
+
+		// If compression helped,
+		if (compress_bytes > 0 && (u32)compress_bytes < data_bytes)
+			payload->comp_bytes = compress_bytes;
+	}
+
+	// For each worker,
+	for (int worker_id = 0, worker_count = subset.WorkerCount(); worker_id < worker_count; ++worker_id)
+	{
+		ConnexionSubset &subsubset = subset[worker_id];
+		const int subset_count = subsubset.Count();
 
 		// For each client,
 		for (int ii = 0; ii < subset_count; ++ii)
 		{
-			OutgoingMessage *next = head->next;
+			// Acquire descriptor
+			SendShared *node;
+			do node = m_std_allocator->AcquireObject<SendShared>();
+			while (!node);
 
-			subsubset[ii]->_send_queue[stream].Append(head);
+			// Initialize outgoing message object
+			node->SetBytes(data_bytes);
+			node->frag_count = 0;
+			node->sop = super_opcode;
+			node->shared = 1;
+			node->send_bytes = 0;
+			node->sent_bytes = 0;
+			node->payload = payload;
 
-			head = next;
+			subsubset[ii]->_send_inbox[stream].Push(node);
+			Atomic::Add(&subsubset[ii]->_stats.reliable_posted, 1);
 		}
-
-		send_queue_lock->Leave();
-
-		acquire_sum += subset_count;
 	}
 
 	CAT_INFO("Transport") << "Appended reliable message with " << msg_bytes << " bytes to stream " << stream << " for " << acquire_sum << " connexions";
@@ -1186,13 +1807,13 @@ bool Transport::WriteReliableZeroCopy(StreamMode stream, u8 *msg, u32 msg_bytes,
 	node->SetBytes(msg_bytes);
 	node->frag_count = 0;
 	node->sop = super_opcode;
+	node->shared = 0;
 	node->send_bytes = 0;
 	node->sent_bytes = 0;
 
-	// Add to back of send queue
-	_send_queue_lock->Enter();
-	_send_queue[stream].Append(node);
-	_send_queue_lock->Leave();
+	// Add to send inbox
+	_send_inbox[stream].Push(node);
+	Atomic::Add(&_stats.reliable_posted, 1);
 
 	CAT_INFO("Transport") << "Appended reliable message with " << msg_bytes << " bytes to stream " << stream;
 
@@ -1224,14 +1845,14 @@ void Transport::Retransmit(u32 stream, OutgoingMessage *node, u32 now)
 		OutgoingMessage *full_node = frag->full_data;
 		frag_total_bytes = full_node->GetBytes();
 		frag_comp_bytes = full_node->orig_bytes;
-		data = GetTrailingBytes(full_node) + frag->offset;
+		data = GetMessageData(full_node) + frag->offset;
 
 		// If this is the first fragment of the message,
 		if (frag->offset == 0) frag_overhead = FRAG_HEADER_BYTES;
 	}
 	else
 	{
-		data = GetTrailingBytes(node);
+		data = GetMessageData(node);
 	}
 
 	// Calculate message length
@@ -1240,7 +1861,7 @@ void Transport::Retransmit(u32 stream, OutgoingMessage *node, u32 now)
 	u32 hdr_bytes = (data_bytes <= BLO_MASK) ? 1 : 2;
 	u32 ack_id = node->id;
 
-	_send_cluster_lock->Enter();
+	LockSendCluster();
 	SendCluster cluster = _send_cluster;
 
 	// Calculate ack_id_overhead
@@ -1268,51 +1889,176 @@ void Transport::Retransmit(u32 stream, OutgoingMessage *node, u32 now)
 	_send_cluster_lock->Leave();
 
 	node->ts_lastsend = now;
+	Atomic::Add(&_stats.retransmits, 1);
+
+	// Reschedule retransmission with the longer backoff
+	_retransmit_wheel.Remove(node);
+	_retransmit_wheel.Schedule(node, now, GetRetransmitTime(stream, node));
 
 	CAT_INFO("Transport") << "Retransmitted stream " << stream << " # " << ack_id;
 }
 
 void Transport::FlushWrites()
 {
+	WriteQueuedUnreliable();
+
 	bool locked = WriteQueuedReliable();
 
 	// If no data to flush (common),
 	if (_send_cluster.bytes == 0 && _outgoing_datagrams.head == 0)
 	{
 		if (locked) _send_cluster_lock->Leave();
+
+		// If paced datagrams are waiting and no wakeup will release them,
+		if (_paced_datagrams.head && !_pace_wakeup_pending)
+			ReleasePacedDatagrams();
+
 		return;
 	}
 
-	if (!locked) _send_cluster_lock->Enter();
-
-	u32 count = _outgoing_datagrams_count;
+	if (!locked) LockSendCluster();
 
 	if (_send_cluster.bytes)
 	{
 		QueueWriteDatagram(_send_cluster);
 		_send_cluster.Clear();
-		++count;
 	}
 
-	BatchSet outgoing_datagrams = _outgoing_datagrams;
+	// Give the workspace back until the next write
+	_send_cluster.ReleaseWorkspace();
+
+	// Queue behind any datagrams still waiting for their departure time
+	_paced_datagrams.PushBack(_outgoing_datagrams);
 	_outgoing_datagrams.Clear();
 
 	_outgoing_datagrams_count = 0;
 
 	_send_cluster_lock->Leave();
 
+	ReleasePacedDatagrams();
+
+	CAT_DEBUG_CHECK_MEMORY();
+}
+
+void Transport::ReleasePacedDatagrams()
+{
+	u64 now_usec = (u64)m_clock->usec();
+
+	u32 rate = _send_flow->GetPacingRate();
+	rate += rate >> PACING_HEADROOM_SHIFT;
+	if (rate == 0) rate = 1;
+
+	LockSendCluster();
+
+	// If the pacer was idle, do not let it bank credit for a burst
+	u64 next_usec = _pace_next_usec;
+	if (next_usec < now_usec) next_usec = now_usec;
+
+	BatchHead *node = _paced_datagrams.head, *last = 0;
+	u32 count = 0;
+
+	// While the next datagram is due within the pacing quantum,
+	while (node && next_usec <= now_usec + PACING_QUANTUM_USEC)
+	{
+		SendBuffer *buffer = static_cast<SendBuffer*>( node );
+
+		next_usec += ((u64)(buffer->data_bytes + _udpip_bytes) * 1000000) / rate;
+
+		last = node;
+		node = node->batch_next;
+		++count;
+	}
+
+	BatchSet due(_paced_datagrams.head, last);
+
+	// Split the due datagrams off the front of the queue
+	if (last)
+	{
+		last->batch_next = 0;
+
+		_paced_datagrams.head = node;
+		if (!node) _paced_datagrams.tail = 0;
+	}
+
+	_pace_next_usec = next_usec;
+
+	_send_cluster_lock->Leave();
+
 	// If any datagrams to write,
-	if (outgoing_datagrams.head)
+	if (count > 0)
 	{
 		// If write succeeds,
-		s32 write_count = WriteDatagrams(outgoing_datagrams, count);
+		s32 write_count = WriteDatagrams(due, count);
 		if (write_count > 0)
 		{
-			_send_flow.OnPacketSend(write_count);
+			_send_flow->OnPacketSend(write_count);
+
+			Atomic::Add(&_stats.datagrams_sent, count);
+			Atomic::Add(&_stats.bytes_sent, write_count);
 		}
 	}
 
-	CAT_DEBUG_CHECK_MEMORY();
+	// If datagrams remain and no wakeup is scheduled yet,
+	if (node && Atomic::Set(&_pace_wakeup_pending, 1) == 0)
+	{
+		u32 delay = (u32)((next_usec - now_usec - PACING_QUANTUM_USEC) / 1000);
+
+		// If the wakeup cannot be scheduled, the next tick will flush instead
+		if (!SchedulePacingWakeup(m_clock->msec() + delay))
+			_pace_wakeup_pending = 0;
+	}
+}
+
+void Transport::OnPacingWakeup()
+{
+	_pace_wakeup_pending = 0;
+
+	ReleasePacedDatagrams();
+}
+
+void Transport::SendACK(u32 now)
+{
+	// For each stream,
+	for (int stream = 0; stream < NUM_STREAMS; ++stream)
+	{
+		// If reliable messages need acknowledging,
+		if (_got_reliable[stream])
+		{
+			WriteACK();
+
+			++_stats.acks_sent;
+			break;
+		}
+	}
+
+	_ack_pending = 0;
+	_ack_immediate = false;
+	_ack_due = now + _ack_max_delay;
+}
+
+void Transport::SetACKFrequency(u32 ack_every, u32 max_delay)
+{
+	if (ack_every < 1) ack_every = 1;
+	else if (ack_every > MAX_ACK_EVERY) ack_every = MAX_ACK_EVERY;
+
+	if (max_delay > MAX_ACK_MAX_DELAY) max_delay = MAX_ACK_MAX_DELAY;
+
+	_ack_every = ack_every;
+	_ack_max_delay = max_delay;
+
+	CAT_INFO("Transport") << "ACK frequency set to every " << ack_every << " datagrams or " << max_delay << " ms";
+}
+
+bool Transport::RequestACKFrequency(u32 ack_every, u32 max_delay)
+{
+	if (ack_every > MAX_ACK_EVERY) ack_every = MAX_ACK_EVERY;
+	if (max_delay > MAX_ACK_MAX_DELAY) max_delay = MAX_ACK_MAX_DELAY;
+
+	u8 msg[IOP_ACK_FREQUENCY_LEN - 1];
+	msg[0] = (u8)ack_every;
+	*(u16*)(msg + 1) = getLE16((u16)max_delay);
+
+	return WriteReliable(STREAM_UNORDERED, IOP_ACK_FREQUENCY, msg, sizeof(msg), SOP_INTERNAL);
 }
 
 void Transport::WriteACK()
@@ -1347,13 +2093,19 @@ void Transport::WriteACK()
 
 			CAT_INFO("Transport") << "Acknowledging rollup # " << stream << ":" << rollup_ack_id;
 
-			RecvQueue *eos, *node = _recv_wait[stream].head;
+			OutOfOrderQueue &wait = PeekStream(stream)->recv_wait;
 			u32 last_id = rollup_ack_id;
+			u32 scan_id = rollup_ack_id, scan_end = rollup_ack_id + wait.capacity;
 
-			for (u32 ii = 0; node && ii < OUT_OF_ORDER_LOOPS; ++ii, node = eos->next)
+			// For each run of arrivals in the window,
+			while (wait.size)
 			{
-				// Get end of sequence pointer (eos)
-				eos = node->eos;
+				u32 start_id = wait.Scan(scan_id, scan_end, true);
+				if (start_id == scan_end)
+				{
+					scan_id = scan_end;
+					break;
+				}
 
 				// Encode RANGE: START(3) || END(3)
 				if (remaining < 6)
@@ -1362,7 +2114,8 @@ void Transport::WriteACK()
 					break;
 				}
 
-				u32 start_id = node->id, end_id = eos->id;
+				scan_id = wait.Scan(start_id, scan_end, false);
+				u32 end_id = scan_id - 1;
 
 				// ACK messages transmits ids relative to the previous one in the datagram
 				u32 start_offset = start_id - last_id;
@@ -1427,7 +2180,7 @@ void Transport::WriteACK()
 			} // for each range in the waiting list
 
 			// If we exhausted all in the list, unset flag
-			if (!node) _got_reliable[stream] = false;
+			if (!wait.size || scan_id == scan_end) _got_reliable[stream] = false;
 		}
 	}
 
@@ -1451,7 +2204,7 @@ void Transport::WriteACK()
 
 	// Now that the packet is constructed, write it into the send cluster
 
-	_send_cluster_lock->Enter();
+	LockSendCluster();
 
 	// If the growing send buffer cannot contain the new message,
 	if (_send_cluster.bytes + msg_bytes > max_payload_bytes)
@@ -1474,38 +2227,25 @@ u32 Transport::RetransmitLost(u32 now)
 {
 	u32 loss_count = 0;
 
-	// Retransmit lost packets
-	for (int stream = 0; stream < NUM_STREAMS; ++stream)
+	// For each node whose deadline has come due,
+	for (OutgoingMessage *next, *node = _retransmit_wheel.Advance(now); node; node = next)
 	{
-		OutgoingMessage *node = _sent_list[stream].head;
-		if (!node) continue;
+		next = node->wheel_next;
 
-		u32 timeout = _send_flow.GetHeadTimeout(stream);
+		u32 stream = node->stream;
+		u32 expire = GetRetransmitTime(stream, node);
 
-		// For each node that might be ready for a retransmission,
-		do
+		// If the timeout grew since it was scheduled,
+		if ((s32)(now - expire) < 0)
 		{
-			s32 mia_time = now - node->ts_lastsend;
-
-			u32 backoff = node->ts_lastsend - node->ts_firstsend;
-			if (backoff > 4 * timeout) backoff = 4 * timeout;
-
-			if (mia_time >= (s32)(timeout + backoff))
-			{
-				Retransmit(stream, node, now);
+			_retransmit_wheel.Schedule(node, now, expire);
+			continue;
+		}
 
-				// Record a loss if the node is representative of loss
-				loss_count += node->loss_on;
-			}
-			else if ((s32)(now - node->ts_firstsend) < (s32)timeout)
-			{
-				// Nodes are added to the end of the sent list, so as soon as it
-				// finds one that cannot possibly be retransmitted it is done
-				break;
-			}
+		Retransmit(stream, node, now);
 
-			node = node->next;
-		} while (node);
+		// Record a loss if the node is representative of loss
+		loss_count += node->loss_on;
 	}
 
 	return loss_count;
@@ -1542,7 +2282,10 @@ bool Transport::PostHugeZeroCopy(const BatchSet &buffers, u32 count)
 	s32 write_count = WriteDatagrams(buffers, count);
 	if (write_count > 0)
 	{
-		_send_flow.OnPacketSend(_udpip_bytes * count + write_count);
+		_send_flow->OnPacketSend(_udpip_bytes * count + write_count);
+
+		Atomic::Add(&_stats.datagrams_sent, count);
+		Atomic::Add(&_stats.bytes_sent, write_count);
 		return true;
 	}
 
@@ -1605,7 +2348,10 @@ bool Transport::PostMTUProbe(u32 mtu)
 	s32 write_count = WriteDatagrams(buffer, 1);
 	if (write_count > 0)
 	{
-		_send_flow.OnPacketSend(_udpip_bytes + write_count);
+		_send_flow->OnPacketSend(_udpip_bytes + write_count);
+
+		Atomic::Add(&_stats.datagrams_sent, 1);
+		Atomic::Add(&_stats.bytes_sent, write_count);
 		return true;
 	}
 
@@ -1619,11 +2365,11 @@ CAT_INLINE void Transport::RetransmitNegative(u32 recv_time, u32 stream, u32 las
 	// last_ack_id that still remains in the sent list
 	// is probably lost.
 
-	OutgoingMessage *rnode = _sent_list[stream].head;
+	OutgoingMessage *rnode = PeekStream(stream)->sent_list.head;
 
 	if (rnode)
 	{
-		u32 timeout = _send_flow.GetNACKTimeout(stream);
+		u32 timeout = _send_flow->GetNACKTimeout(stream);
 
 		while ((s32)(last_ack_id - rnode->id) > 0)
 		{
@@ -1677,7 +2423,7 @@ void Transport::OnACK(u32 recv_time, u8 *data, u32 data_bytes)
 				stream = (ida >> 1) & 3;
 				u32 ack_id = ((u32)idc << 13) | ((u16)idb << 5) | (ida >> 3);
 
-				node = _sent_list[stream].head;
+				node = PeekStream(stream)->sent_list.head;
 
 				if (node)
 				{
@@ -1698,17 +2444,19 @@ void Transport::OnACK(u32 recv_time, u8 *data, u32 data_bytes)
 						{
 							if (node->loss_on)
 							{
-								_send_flow.OnACK(recv_time, node);
+								_send_flow->OnACK(recv_time, node);
 								acknowledged_data_sum += _udpip_bytes;
 							}
 							acknowledged_data_sum += 2 + node->GetBytes();
+							Atomic::Add(&_stats.in_flight_bytes, -(s32)(2 + node->GetBytes()));
 
 							OutgoingMessage *next = node->next;
+							_retransmit_wheel.Remove(node);
 							FreeSentNode(node);
 							node = next;
 						} while (node && (s32)(ack_id - node->id) > 0);
 
-						_sent_list[stream].RemoveBefore(node);
+						_streams[stream]->sent_list.RemoveBefore(node);
 					}
 				}
 			}
@@ -1834,17 +2582,19 @@ void Transport::OnACK(u32 recv_time, u8 *data, u32 data_bytes)
 					{
 						if (node->loss_on)
 						{
-							_send_flow.OnACK(recv_time, node);
+							_send_flow->OnACK(recv_time, node);
 							acknowledged_data_sum += _udpip_bytes;
 						}
 						acknowledged_data_sum += 2 + node->GetBytes();
+						Atomic::Add(&_stats.in_flight_bytes, -(s32)(2 + node->GetBytes()));
 
 						OutgoingMessage *next = node->next;
+						_retransmit_wheel.Remove(node);
 						FreeSentNode(node);
 						node = next;
 					} while (node && (s32)(end_ack_id - node->id) >= 0);
 
-					_sent_list[stream].RemoveBetween(prev, node);
+					_streams[stream]->sent_list.RemoveBetween(prev, node);
 				}
 
 				// Next range start is offset from the end of this range
@@ -1859,7 +2609,9 @@ void Transport::OnACK(u32 recv_time, u8 *data, u32 data_bytes)
 		RetransmitNegative(recv_time, stream, last_ack_id, loss_count);
 
 	// Inform the flow control algorithm
-	_send_flow.OnACKDone(recv_time, loss_count, acknowledged_data_sum);
+	_send_flow->OnACKDone(recv_time, loss_count, acknowledged_data_sum);
+
+	Atomic::Add(&_stats.losses, loss_count);
 }
 
 OutgoingMessage *Transport::DequeueBandwidth(OutgoingMessage *node, s32 available_bytes, s32 &bandwidth)
@@ -2063,23 +2815,34 @@ bool Transport::WriteSendQueueNode(OutgoingMessage *node, u32 now, u32 stream, s
 			// If node is just now fragmenting for the first time,
 			if (!node->frag_count++)
 			{
-				// Calculate compression output buffer size
 				u32 src_bytes = node->GetBytes();
+				int compress_bytes;
 
-				// Inlined from LZ4 code - Remember to update this if it changes!
-				u32 dest_bytes = (src_bytes + (src_bytes/255) + 16);
-
-				// Acquire compression output buffer
-				u8 *dest;
-				do dest = new (std::nothrow) u8[dest_bytes];
-				while (!dest);
+				// If payload is shared, it was already compressed when it was built
+				if (node->shared)
+					compress_bytes = static_cast<SendShared*>( node )->payload->comp_bytes;
+				else
+				{
+					// Calculate compression output buffer size
+					// Inlined from LZ4 code - Remember to update this if it changes!
+					u32 dest_bytes = (src_bytes + (src_bytes/255) + 16);
+
+					// Acquire compression output buffer
+					u8 *dest;
+					do dest = new (std::nothrow) u8[dest_bytes];
+					while (!dest);
+
+					// Attempt compression
+					u8 *src_data = GetTrailingBytes(node);
+					compress_bytes = LZ4_compress((const char*)src_data, (char*)dest, src_bytes);
+					if (compress_bytes > 0)
+						memcpy(src_data, dest, compress_bytes);
+
+					delete []dest;
+				}
 
-				// Attempt compression
-				u8 *src_data = GetTrailingBytes(node);
-				int compress_bytes = LZ4_compress((const char*)src_data, (char*)dest, src_bytes);
 				if (compress_bytes > 0)
 				{
-					memcpy(src_data, dest, compress_bytes);
 					node->SetBytes(compress_bytes);
 
 					// Recalculate copy bytes
@@ -2095,8 +2858,6 @@ bool Transport::WriteSendQueueNode(OutgoingMessage *node, u32 now, u32 stream, s
 				}
 
 				node->orig_bytes = (u16)src_bytes;
-
-				delete []dest;
 			}
 
 			// Fill fragment object
@@ -2104,6 +2865,7 @@ bool Transport::WriteSendQueueNode(OutgoingMessage *node, u32 now, u32 stream, s
 			frag->offset = sent_bytes;
 			frag->full_data = node;
 			frag->sop = SOP_FRAG;
+			frag->shared = 0;
 
 			add_node = static_cast<OutgoingMessage*>( frag );
 		}
@@ -2123,14 +2885,22 @@ bool Transport::WriteSendQueueNode(OutgoingMessage *node, u32 now, u32 stream, s
 		}
 
 		// Link to the end of the sent list
-		_sent_list[stream].Append(add_node);
+		_streams[stream]->sent_list.Append(add_node);
+
+		Atomic::Add(&_stats.reliable_sent, 1);
+		Atomic::Add(&_stats.in_flight_bytes, 2 + add_node->GetBytes());
+
+		// Schedule retransmission
+		add_node->stream = (u8)stream;
+		add_node->wheel_pprev = 0;
+		_retransmit_wheel.Schedule(add_node, now, GetRetransmitTime(stream, add_node));
 
 		// Grow the cluster
 		u8 *msg = _send_cluster.Next(write_bytes);
 
 		// Append to cluster
 		ClusterReliableAppend(stream, ack_id, msg, ack_id_overhead, frag_overhead,
-			_send_cluster, add_node->sop, GetTrailingBytes(node) + sent_bytes,
+			_send_cluster, add_node->sop, GetMessageData(node) + sent_bytes,
 			data_bytes_to_copy, node->GetBytes(), node->orig_bytes);
 
 		send_limit -= data_bytes_to_copy;
@@ -2156,12 +2926,102 @@ bool Transport::WriteSendQueueNode(OutgoingMessage *node, u32 now, u32 stream, s
 	}
 }
 
+void Transport::WriteQueuedUnreliable()
+{
+	// Avoid locking if no unreliable messages were posted
+	if (!_unreliable_inbox.head) return;
+
+	OutgoingMessage *tail;
+	OutgoingMessage *node = _unreliable_inbox.PopAll(tail);
+	if (!node) return;
+
+	// Find the newest message waiting on each latest-only channel
+	OutgoingMessage *latest[MAX_LATEST_CHANNELS];
+	u32 latest_mask = 0;
+
+	for (OutgoingMessage *scan = node; scan; scan = scan->next)
+	{
+		if (scan->sop == SOP_LATEST)
+		{
+			u32 channel = GetTrailingBytes(scan)[0];
+
+			// Skip channels that WriteLatest() would have rejected
+			if (channel >= MAX_LATEST_CHANNELS)
+				continue;
+
+			latest[channel] = scan;
+			latest_mask |= (u32)1 << channel;
+		}
+	}
+
+	u32 max_payload_bytes = _max_payload_bytes;
+
+	LockSendCluster();
+
+	// For each unreliable message,
+	for (OutgoingMessage *next; node; node = next)
+	{
+		next = node->next;
+
+		u32 data_bytes = node->GetBytes();
+		u32 header_bytes = data_bytes > BLO_MASK ? 2 : 1;
+		u32 needed = header_bytes + data_bytes;
+		u8 super_opcode = node->sop;
+
+		// If latest-only message,
+		if (latest_mask && super_opcode == SOP_LATEST)
+		{
+			u8 *msg = GetTrailingBytes(node);
+			u32 channel = msg[0];
+
+			// If the channel is invalid or a newer message is waiting on it, drop this one
+			if (channel >= MAX_LATEST_CHANNELS || latest[channel] != node)
+			{
+				OutgoingMessage::Release(node);
+				continue;
+			}
+
+			// Assign the next sequence number for the channel
+			u16 seq = ++_latest_send_seq[channel];
+			*(u16*)(msg + 1) = getLE16(seq);
+		}
+
+		// If growing the send buffer cannot contain the new message,
+		if (_send_cluster.bytes + needed > max_payload_bytes)
+		{
+			QueueWriteDatagram(_send_cluster);
+			_send_cluster.Clear();
+		}
+
+		// Create or grow buffer and write into it
+		u8 *pkt = _send_cluster.Next(needed);
+
+		// Write header
+		if (data_bytes <= BLO_MASK)
+			pkt[0] = (u8)data_bytes | (super_opcode << SOP_SHIFT);
+		else
+		{
+			pkt[0] = (u8)(data_bytes & BLO_MASK) | (super_opcode << SOP_SHIFT) | C_MASK;
+			pkt[1] = (u8)(data_bytes >> BHI_SHIFT);
+		}
+
+		// Write data
+		memcpy(pkt + header_bytes, GetTrailingBytes(node), data_bytes);
+
+		OutgoingMessage::Release(node);
+	}
+
+	_send_cluster_lock->Leave();
+
+	CAT_DEBUG_CHECK_MEMORY();
+}
+
 bool Transport::WriteQueuedReliable()
 {
 	// Avoid locking to transmit queued if no queued exist
 	int stream;
 	for (stream = 0; stream < NUM_STREAMS; ++stream)
-		if (_send_queue[stream].head || _sending_queue[stream].head)
+		if (_send_inbox[stream].head || PeekStream(stream)->sending_queue.head)
 			break;
 
 	// If no reliable data to send,
@@ -2178,16 +3038,28 @@ bool Transport::WriteQueuedReliable()
 	u32 now = m_clock->msec();
 
 	// Calculate bandwidth available for this transmission
-	s32 bandwidth = _send_flow.GetRemainingBytes(now);
+	s32 bandwidth = _send_flow->GetRemainingBytes(now);
 
 	// If there is no more room in the channel,
 	if (bandwidth < 0) return false;
 
-	// Steal all work from each stream's send queue
-	_send_queue_lock->Enter();
+	// Steal all work from each stream's send inbox
 	for (u32 stream = 0; stream < NUM_STREAMS; ++stream)
-		_sending_queue[stream].Steal(_send_queue[stream]);
-	_send_queue_lock->Leave();
+	{
+		// If nothing was posted to this stream,
+		if (!_send_inbox[stream].head)
+			continue;
+
+		// If out of memory, leave the messages in the inbox for the next flush
+		StreamState *state = GetStream(stream);
+		if (!state)
+			continue;
+
+		SendQueue inbox;
+		inbox.head = _send_inbox[stream].PopAll(inbox.tail);
+
+		state->sending_queue.Steal(inbox);
+	}
 
 	// Generate a list of messages to transmit based on the bandwidth available
 	OutgoingMessage *out_head[NUM_STREAMS], *out_tail[NUM_STREAMS];
@@ -2196,7 +3068,7 @@ bool Transport::WriteQueuedReliable()
 	// Split bandwidth evenly between normal streams
 	for (u32 stream = 0; stream < NUM_STREAMS - 1; ++stream)
 	{
-		OutgoingMessage *node = remaining > 0 ? _sending_queue[stream].head : 0;
+		OutgoingMessage *node = remaining > 0 ? PeekStream(stream)->sending_queue.head : 0;
 		out_head[stream] = node;
 
 		if (!node)
@@ -2220,7 +3092,7 @@ bool Transport::WriteQueuedReliable()
 	}
 
 	// If any bandwidth remains, give it to the bulk stream
-	OutgoingMessage *node = remaining > 0 ? _sending_queue[STREAM_BULK].head : 0;
+	OutgoingMessage *node = remaining > 0 ? PeekStream(STREAM_BULK)->sending_queue.head : 0;
 	out_head[STREAM_BULK] = node;
 	if (!node)
 		out_tail[STREAM_BULK] = 0;
@@ -2241,7 +3113,7 @@ bool Transport::WriteQueuedReliable()
 	remaining = bandwidth;
 
 	// Write dequeued messages to the send cluster
-	_send_cluster_lock->Enter();
+	LockSendCluster();
 
 	// For each stream,
 	for (u32 stream = 0; stream < NUM_STREAMS; ++stream)
@@ -2263,8 +3135,11 @@ bool Transport::WriteQueuedReliable()
 				break;
 			else
 			{
-				_sending_queue[stream].head = next;
-				if (!next) _sending_queue[stream].tail = 0;
+				SendQueue &queue = _streams[stream]->sending_queue;
+				queue.head = next;
+				if (!next) queue.tail = 0;
+
+				Atomic::Add(&_stats.reliable_dequeued, 1);
 			}
 
 		} while (node != out_tail[stream] && (node = next));
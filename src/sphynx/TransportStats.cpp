@@ -0,0 +1,376 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/sphynx/TransportStats.hpp>
+#include <cat/math/BitMath.hpp>
+#include <fstream>
+using namespace std;
+using namespace cat;
+using namespace sphynx;
+
+
+//// TransportStats
+
+void TransportStats::TakeSample(TransportCounters &delta)
+{
+	TransportCounters now;
+	now.datagrams_sent = datagrams_sent;
+	now.bytes_sent = bytes_sent;
+	now.datagrams_recv = datagrams_recv;
+	now.bytes_recv = bytes_recv;
+	now.reliable_sent = reliable_sent;
+	now.retransmits = retransmits;
+	now.losses = losses;
+	now.reliable_recv = reliable_recv;
+	now.acks_sent = acks_sent;
+	now.compress_in = compress_in;
+	now.compress_out = compress_out;
+
+	// Differences are correct across counter wrap-around
+	delta.datagrams_sent = now.datagrams_sent - last_sample.datagrams_sent;
+	delta.bytes_sent = now.bytes_sent - last_sample.bytes_sent;
+	delta.datagrams_recv = now.datagrams_recv - last_sample.datagrams_recv;
+	delta.bytes_recv = now.bytes_recv - last_sample.bytes_recv;
+	delta.reliable_sent = now.reliable_sent - last_sample.reliable_sent;
+	delta.retransmits = now.retransmits - last_sample.retransmits;
+	delta.losses = now.losses - last_sample.losses;
+	delta.reliable_recv = now.reliable_recv - last_sample.reliable_recv;
+	delta.acks_sent = now.acks_sent - last_sample.acks_sent;
+	delta.compress_in = now.compress_in - last_sample.compress_in;
+	delta.compress_out = now.compress_out - last_sample.compress_out;
+
+	last_sample = now;
+}
+
+
+//// StatsHistogram
+
+void StatsHistogram::Add(u32 value)
+{
+	u32 bucket = value ? BSR32(value) + 1 : 0;
+
+	++counts[bucket];
+	++total;
+}
+
+u32 StatsHistogram::GetPercentile(u32 percent) const
+{
+	if (!total) return 0;
+
+	// Number of samples at or under the percentile, rounded up
+	u64 rank = ((u64)total * percent + 99) / 100;
+	if (rank < 1) rank = 1;
+
+	u64 seen = 0;
+	for (u32 bucket = 0; bucket < BUCKETS; ++bucket)
+	{
+		seen += counts[bucket];
+
+		if (seen >= rank)
+			return bucket ? (u32)(((u64)1 << bucket) - 1) : 0;
+	}
+
+	return ~(u32)0;
+}
+
+void StatsHistogram::Write(ostream &out, const char *name) const
+{
+	out << name << ".p50 " << GetPercentile(50) << "\n";
+	out << name << ".p90 " << GetPercentile(90) << "\n";
+	out << name << ".p99 " << GetPercentile(99) << "\n";
+
+	// Only write populated buckets, labeled by their upper bound
+	for (u32 bucket = 0; bucket < BUCKETS; ++bucket)
+	{
+		if (counts[bucket])
+		{
+			u32 bound = bucket ? (u32)(((u64)1 << bucket) - 1) : 0;
+
+			out << name << ".le." << bound << " " << counts[bucket] << "\n";
+		}
+	}
+}
+
+
+//// ConnexionFootprint
+
+void ConnexionFootprint::Write(ostream &out) const
+{
+	out << "sphynx.footprint.connexion_bytes " << connexion_bytes << "\n";
+	out << "sphynx.footprint.transport_bytes " << transport_bytes << "\n";
+	out << "sphynx.footprint.encryption_bytes " << encryption_bytes << "\n";
+	out << "sphynx.footprint.stream_bytes " << stream_bytes << "\n";
+	out << "sphynx.footprint.workspace_bytes " << workspace_bytes << "\n";
+	out << "sphynx.footprint.handshake_bytes " << handshake_bytes << "\n";
+}
+
+
+//// ConnexionSample
+
+u32 ConnexionSample::GetLossPermille() const
+{
+	if (!delta.losses) return 0;
+
+	u32 sent = delta.reliable_sent;
+	if (sent < delta.losses) sent = delta.losses;
+
+	return (u32)(((u64)delta.losses * 1000) / sent);
+}
+
+
+//// StatsSnapshot
+
+static void AccumulateCounters(TransportCounters &total, const TransportCounters &delta)
+{
+	total.datagrams_sent += delta.datagrams_sent;
+	total.bytes_sent += delta.bytes_sent;
+	total.datagrams_recv += delta.datagrams_recv;
+	total.bytes_recv += delta.bytes_recv;
+	total.reliable_sent += delta.reliable_sent;
+	total.retransmits += delta.retransmits;
+	total.losses += delta.losses;
+	total.reliable_recv += delta.reliable_recv;
+	total.acks_sent += delta.acks_sent;
+	total.compress_in += delta.compress_in;
+	total.compress_out += delta.compress_out;
+}
+
+// Returns true if a is a worse connexion than b
+static bool IsWorseSample(const ConnexionSample &a, const ConnexionSample &b)
+{
+	u32 a_loss = a.GetLossPermille(), b_loss = b.GetLossPermille();
+
+	if (a_loss != b_loss) return a_loss > b_loss;
+
+	return a.rtt > b.rtt;
+}
+
+void StatsSnapshot::Clear()
+{
+	time = 0;
+	interval = 0;
+	connexions = 0;
+
+	CAT_OBJCLR(total);
+
+	rtt.Clear();
+	loss_permille.Clear();
+	retransmits.Clear();
+	send_queue.Clear();
+	out_of_order.Clear();
+	in_flight_bytes.Clear();
+	pacing_rate.Clear();
+	heap_bytes.Clear();
+
+	footprint.Clear();
+	memory_bytes = 0;
+
+	handshakes.Clear();
+
+	problem_count = 0;
+}
+
+void StatsSnapshot::Add(const ConnexionSample &sample)
+{
+	++connexions;
+
+	AccumulateCounters(total, sample.delta);
+
+	rtt.Add(sample.rtt);
+	loss_permille.Add(sample.GetLossPermille());
+	retransmits.Add(sample.delta.retransmits);
+	send_queue.Add(sample.send_queue);
+	out_of_order.Add(sample.out_of_order);
+	in_flight_bytes.Add(sample.in_flight_bytes);
+	pacing_rate.Add(sample.pacing_rate);
+	heap_bytes.Add(sample.heap_bytes);
+
+	memory_bytes += footprint.connexion_bytes + sample.heap_bytes;
+
+	// Insertion sort into the short list of worst connexions
+	u32 ii = problem_count;
+
+	if (ii < PROBLEM_CLIENTS)
+		++problem_count;
+	else if (!IsWorseSample(sample, problems[--ii]))
+		return;
+
+	while (ii > 0 && IsWorseSample(sample, problems[ii - 1]))
+	{
+		problems[ii] = problems[ii - 1];
+		--ii;
+	}
+
+	problems[ii] = sample;
+}
+
+void StatsSnapshot::Write(ostream &out) const
+{
+	out << "sphynx.time " << time << "\n";
+	out << "sphynx.interval_msec " << interval << "\n";
+	out << "sphynx.connexions " << connexions << "\n";
+
+	out << "sphynx.datagrams_sent " << total.datagrams_sent << "\n";
+	out << "sphynx.bytes_sent " << total.bytes_sent << "\n";
+	out << "sphynx.datagrams_recv " << total.datagrams_recv << "\n";
+	out << "sphynx.bytes_recv " << total.bytes_recv << "\n";
+	out << "sphynx.reliable_sent " << total.reliable_sent << "\n";
+	out << "sphynx.retransmits " << total.retransmits << "\n";
+	out << "sphynx.losses " << total.losses << "\n";
+	out << "sphynx.reliable_recv " << total.reliable_recv << "\n";
+	out << "sphynx.acks_sent " << total.acks_sent << "\n";
+
+	// Acknowledgments per hundred datagrams carrying reliable data
+	u32 ack_ratio = total.reliable_recv ? (u32)(((u64)total.acks_sent * 100) / total.reliable_recv) : 0;
+	out << "sphynx.ack_percent " << ack_ratio << "\n";
+
+	// Compressed size as a percentage of the original
+	u32 ratio = total.compress_in ? (u32)(((u64)total.compress_out * 100) / total.compress_in) : 100;
+	out << "sphynx.compress_percent " << ratio << "\n";
+
+	rtt.Write(out, "sphynx.rtt_msec");
+	loss_permille.Write(out, "sphynx.loss_permille");
+	retransmits.Write(out, "sphynx.retransmits_per_conn");
+	send_queue.Write(out, "sphynx.send_queue");
+	out_of_order.Write(out, "sphynx.out_of_order");
+	in_flight_bytes.Write(out, "sphynx.in_flight_bytes");
+	pacing_rate.Write(out, "sphynx.pacing_rate");
+	heap_bytes.Write(out, "sphynx.heap_bytes");
+
+	footprint.Write(out);
+	out << "sphynx.memory_kb " << (u32)(memory_bytes / 1024) << "\n";
+
+	// New connexions per second over the interval
+	u32 handshake_rate = interval ? (u32)(((u64)handshakes.answered * 1000) / interval) : 0;
+	out << "sphynx.handshakes_answered " << handshakes.answered << "\n";
+	out << "sphynx.handshakes_per_sec " << handshake_rate << "\n";
+	out << "sphynx.handshakes_rejected " << handshakes.rejected << "\n";
+	out << "sphynx.handshakes_shed " << handshakes.shed << "\n";
+	out << "sphynx.handshake_batches " << handshakes.batches << "\n";
+	out << "sphynx.handshake_queue_depth " << handshakes.queue_depth << "\n";
+	handshakes.queue_usec.Write(out, "sphynx.handshake_queue_usec");
+
+	for (u32 ii = 0; ii < problem_count; ++ii)
+	{
+		const ConnexionSample &sample = problems[ii];
+
+		out << "sphynx.problem." << ii << " id=" << sample.id
+			<< " addr=" << sample.addr.IPToString() << ":" << sample.addr.GetPort()
+			<< " worker=" << sample.worker_id
+			<< " loss_permille=" << sample.GetLossPermille()
+			<< " rtt=" << sample.rtt
+			<< " retransmits=" << sample.delta.retransmits
+			<< " send_queue=" << sample.send_queue
+			<< " out_of_order=" << sample.out_of_order
+			<< " in_flight=" << sample.in_flight_bytes
+			<< " pacing_rate=" << sample.pacing_rate << "\n";
+	}
+}
+
+
+//// StatsWriter
+
+StatsWriter::StatsWriter()
+{
+	_kill_flag = false;
+	_has_pending = false;
+	_replaced = 0;
+}
+
+bool StatsWriter::Start(const char *path)
+{
+	_path = path;
+	_kill_flag = false;
+
+	return StartThread();
+}
+
+void StatsWriter::Stop()
+{
+	_kill_flag = true;
+	_wake_flag.Set();
+
+	WaitForThread();
+}
+
+void StatsWriter::Post(const StatsSnapshot &snapshot)
+{
+	_lock.Enter();
+	if (_has_pending) ++_replaced;
+	_pending = snapshot;
+	_has_pending = true;
+	_lock.Leave();
+
+	_wake_flag.Set();
+}
+
+bool StatsWriter::Entrypoint(void *param)
+{
+	StatsSnapshot snapshot;
+
+	CAT_FOREVER
+	{
+		bool kill = _kill_flag;
+
+		_lock.Enter();
+		bool has_pending = _has_pending;
+		if (has_pending) snapshot = _pending;
+		_has_pending = false;
+		u32 replaced = _replaced;
+		_replaced = 0;
+		_lock.Leave();
+
+		if (replaced)
+		{
+			CAT_WARN("StatsWriter") << "Writing fell behind: Skipped " << replaced << " snapshots";
+		}
+
+		// If there is a snapshot to append,
+		if (has_pending)
+		{
+			ofstream file(_path.c_str(), ios_base::out | ios_base::app);
+
+			if (!file)
+			{
+				CAT_WARN("StatsWriter") << "Unable to append statistics to " << _path;
+			}
+			else
+			{
+				snapshot.Write(file);
+				file << "\n";
+			}
+		}
+
+		// The kill flag was read before the last check, so nothing posted before Stop() is lost
+		if (kill) break;
+
+		_wake_flag.Wait();
+	}
+
+	return true;
+}
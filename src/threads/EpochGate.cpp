@@ -0,0 +1,100 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/threads/EpochGate.hpp>
+#include <cat/threads/Atomic.hpp>
+using namespace cat;
+
+// One plus the slot index assigned to this thread, or zero before first use
+static CAT_TLS u32 m_thread_slot = 0;
+static volatile u32 m_next_slot = 0;
+
+
+//// EpochGate
+
+EpochGate::EpochGate()
+{
+	_epoch = 0;
+
+	CAT_OBJCLR(_slots);
+}
+
+u32 EpochGate::Enter()
+{
+	u32 index = m_thread_slot;
+
+	// If this thread has not been assigned a slot yet,
+	if (!index)
+	{
+		index = Atomic::Add(&m_next_slot, 1) % MAX_SLOTS + 1;
+		m_thread_slot = index;
+	}
+
+	--index;
+	Slot *slot = &_slots[index];
+
+	CAT_FOREVER
+	{
+		u32 epoch = _epoch;
+		u32 parity = epoch & 1;
+
+		// Atomic add is also a full memory barrier
+		Atomic::Add(&slot->readers[parity], 1);
+
+		// If the epoch did not move before this reader was counted,
+		if (_epoch == epoch)
+			return (index << 1) | parity;
+
+		// A writer may have already checked this count, so try again
+		Atomic::Add(&slot->readers[parity], -1);
+	}
+}
+
+void EpochGate::Leave(u32 ticket)
+{
+	Atomic::Add(&_slots[ticket >> 1].readers[ticket & 1], -1);
+}
+
+bool EpochGate::TryAdvance()
+{
+	u32 epoch = _epoch;
+
+	// Readers of the previous epoch share a count with the next epoch
+	u32 parity = (epoch + 1) & 1;
+
+	for (u32 ii = 0; ii < MAX_SLOTS; ++ii)
+	{
+		// If a reader from the previous epoch is still inside,
+		if (_slots[ii].readers[parity])
+			return false;
+	}
+
+	Atomic::Set(&_epoch, epoch + 1);
+
+	return true;
+}
@@ -33,6 +33,8 @@
 using namespace cat;
 
 static const u32 INITIAL_TIMERS_ALLOCATED = 16;
+static const u32 INITIAL_WAKEUPS_ALLOCATED = 16;
+static const u32 MAX_WAKEUP_DELAY = 0x40000000; // Placeholder when no wakeups remain
 
 static Clock *m_clock = 0;
 static SystemInfo *m_system_info = 0;
@@ -43,6 +45,7 @@ static SystemInfo *m_system_info = 0;
 WorkerThread::WorkerThread()
 {
 	_kill_flag = false;
+	_busy_usec = 0;
 
 	_timers = new (std::nothrow) WorkerTimer[INITIAL_TIMERS_ALLOCATED];
 	_timers_count = 0;
@@ -52,12 +55,29 @@ WorkerThread::WorkerThread()
 	_new_timers_count = 0;
 	_new_timers_allocated = INITIAL_TIMERS_ALLOCATED;
 
+	// If either allocation fails, the array is grown on first use instead
+	_wakeups = new (std::nothrow) WorkerWakeup[INITIAL_WAKEUPS_ALLOCATED];
+	_wakeups_count = 0;
+	_wakeups_allocated = _wakeups ? INITIAL_WAKEUPS_ALLOCATED : 0;
+	_next_wakeup = 0;
+
+	_firing = new (std::nothrow) WorkerWakeup[INITIAL_WAKEUPS_ALLOCATED];
+	_firing_allocated = _firing ? INITIAL_WAKEUPS_ALLOCATED : 0;
+
 	for (u32 ii = 0; ii < WQPRIO_COUNT; ++ii)
 	{
 		_workqueues[ii].queued.Clear();
 	}
 }
 
+WorkerThread::~WorkerThread()
+{
+	delete []_timers;
+	delete []_new_timers;
+	delete []_wakeups;
+	delete []_firing;
+}
+
 bool WorkerThread::Associate(RefObject *object, WorkerTimerDelegate callback)
 {
 	if (!object || !callback)
@@ -92,6 +112,146 @@ bool WorkerThread::Associate(RefObject *object, WorkerTimerDelegate callback)
 	return true;
 }
 
+bool WorkerThread::Dissociate(RefObject *object)
+{
+	// Running timers are only touched by this thread
+	for (u32 ii = 0, timers_count = _timers_count; ii < timers_count; ++ii)
+	{
+		if (_timers[ii].object == object)
+		{
+			_timers[ii] = _timers[--timers_count];
+			_timers_count = timers_count;
+
+			object->ReleaseRef(CAT_REFOBJECT_TRACE);
+			return true;
+		}
+	}
+
+	AutoMutex lock(_new_timers_lock);
+
+	// If it has not been merged into the running array yet,
+	for (u32 ii = 0, new_timers_count = _new_timers_count; ii < new_timers_count; ++ii)
+	{
+		if (_new_timers[ii].object == object)
+		{
+			_new_timers[ii] = _new_timers[--new_timers_count];
+			_new_timers_count = new_timers_count;
+
+			lock.Release();
+
+			object->ReleaseRef(CAT_REFOBJECT_TRACE);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool WorkerThread::ScheduleWakeup(RefObject *object, WorkerTimerDelegate callback, u32 when)
+{
+	if (!object || !callback)
+		return false;
+
+	AutoMutex lock(_wakeups_lock);
+
+	u32 wakeups_count = _wakeups_count + 1;
+	if (wakeups_count > _wakeups_allocated)
+	{
+		u32 new_allocated = wakeups_count * 2;
+
+		WorkerWakeup *wakeups = new (std::nothrow) WorkerWakeup[new_allocated];
+		if (!wakeups) return false;
+
+		memcpy(wakeups, _wakeups, _wakeups_count * sizeof(WorkerWakeup));
+
+		delete []_wakeups;
+
+		_wakeups = wakeups;
+		_wakeups_allocated = new_allocated;
+	}
+
+	// Hold the reference before the worker can see the entry and release it
+	object->AddRef(CAT_REFOBJECT_TRACE);
+
+	_wakeups[_wakeups_count].object = object;
+	_wakeups[_wakeups_count].callback = callback;
+	_wakeups[_wakeups_count].when = when;
+
+	// If this is the first or the earliest wakeup,
+	if (_wakeups_count == 0 || (s32)(when - _next_wakeup) < 0)
+		_next_wakeup = when;
+
+	_wakeups_count = wakeups_count;
+
+	lock.Release();
+
+	// Interrupt the wait so the worker can shorten it
+	_event_flag.Set();
+
+	return true;
+}
+
+void WorkerThread::FireWakeups(u32 now, u32 retry_delay)
+{
+	AutoMutex lock(_wakeups_lock);
+
+	u32 wakeups_count = _wakeups_count;
+
+	// If the firing array may be too small,
+	if (wakeups_count > _firing_allocated)
+	{
+		WorkerWakeup *firing = new (std::nothrow) WorkerWakeup[_wakeups_allocated];
+
+		// If out of memory, try again later rather than spinning on the due wakeups
+		if (!firing)
+		{
+			_next_wakeup = now + retry_delay;
+			return;
+		}
+
+		delete []_firing;
+
+		_firing = firing;
+		_firing_allocated = _wakeups_allocated;
+	}
+
+	u32 firing_count = 0, kept_count = 0;
+	u32 next_wakeup = now + MAX_WAKEUP_DELAY;
+
+	// Split expired wakeups from those still pending
+	for (u32 ii = 0; ii < wakeups_count; ++ii)
+	{
+		WorkerWakeup *wakeup = &_wakeups[ii];
+
+		if ((s32)(now - wakeup->when) >= 0)
+			_firing[firing_count++] = *wakeup;
+		else
+		{
+			if ((s32)(wakeup->when - next_wakeup) < 0)
+				next_wakeup = wakeup->when;
+
+			_wakeups[kept_count++] = *wakeup;
+		}
+	}
+
+	_wakeups_count = kept_count;
+	_next_wakeup = next_wakeup;
+
+	lock.Release();
+
+	// For each expired wakeup,
+	for (u32 ii = 0; ii < firing_count; ++ii)
+	{
+		WorkerWakeup *wakeup = &_firing[ii];
+
+		// If object is not shutting down,
+		if (!wakeup->object->IsShutdown())
+			wakeup->callback(_tls, now);
+
+		wakeup->object->ReleaseRef(CAT_REFOBJECT_TRACE);
+	}
+}
+
 void WorkerThread::DeliverBuffers(u32 priority, const BatchSet &buffers)
 {
 	_workqueues[priority].lock.Enter();
@@ -309,6 +469,10 @@ bool WorkerThread::Entrypoint(void *vmaster)
 		{
 			u32 wait_time = next_tick - now;
 
+			// If a wakeup is due before the next tick,
+			if (_wakeups_count > 0 && (s32)(_next_wakeup - next_tick) < 0)
+				wait_time = _next_wakeup - now;
+
 			if ((s32)wait_time >= 0)
 			{
 				if (_event_flag.Wait(wait_time))
@@ -318,6 +482,8 @@ bool WorkerThread::Entrypoint(void *vmaster)
 			}
 		}
 
+		double busy_start = m_clock->usec();
+
 		// Grab queue if event is flagged
 		if (check_events)
 		{
@@ -335,6 +501,10 @@ bool WorkerThread::Entrypoint(void *vmaster)
 			} // next priority level
 		} // end if check_events
 
+		// If a wakeup is due,
+		if (_wakeups_count > 0 && (s32)(now - _next_wakeup) >= 0)
+			FireWakeups(now, tick_interval);
+
 		// If tick interval is up,
 		if ((s32)(now - next_tick) >= 0)
 		{
@@ -352,6 +522,8 @@ bool WorkerThread::Entrypoint(void *vmaster)
 				CAT_INANE("WorkerThread") << "Slow worker tick";
 			}
 		}
+
+		_busy_usec += (u32)(m_clock->usec() - busy_start);
 	}
 
 	u32 timers_count = _timers_count;
@@ -364,6 +536,14 @@ bool WorkerThread::Entrypoint(void *vmaster)
 		timer->object->ReleaseRef(CAT_REFOBJECT_TRACE);
 	}
 
+	// Release wakeups that never fired
+	AutoMutex lock(_wakeups_lock);
+
+	for (u32 ii = 0; ii < _wakeups_count; ++ii)
+		_wakeups[ii].object->ReleaseRef(CAT_REFOBJECT_TRACE);
+
+	_wakeups_count = 0;
+
 	return true;
 }
 
@@ -58,6 +58,9 @@ CAT_REF_SINGLETON(Clock);
 
 bool Clock::OnInitialize()
 {
+	_virtual = false;
+	_virtual_usec = 0;
+
 #if defined(CAT_OS_WINDOWS)
 
 	// Set minimum timer resolution as low as possible
@@ -118,8 +121,17 @@ u32 Clock::msec_fast()
 #endif
 }
 
+void Clock::SetVirtualTime(double usec)
+{
+	_virtual_usec = usec;
+	_virtual = true;
+}
+
 u32 Clock::msec()
 {
+	if (_virtual)
+		return static_cast<u32>(static_cast<u64>(_virtual_usec / 1000.0));
+
 #if defined(CAT_OS_WINDOWS)
 
 	return timeGetTime();
@@ -138,6 +150,9 @@ u32 Clock::msec()
 
 double Clock::usec()
 {
+	if (_virtual)
+		return _virtual_usec;
+
 #if defined(CAT_OS_WINDOWS)
 
     /* In Windows, this value can leap forward randomly:
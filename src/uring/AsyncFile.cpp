@@ -0,0 +1,207 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/uring/AsyncFile.hpp>
+#include <cat/io/Log.hpp>
+#include <cat/io/Settings.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+using namespace std;
+using namespace cat;
+
+static IOThreadPools *m_io_thread_pools = 0;
+
+bool AsyncFile::OnInitialize()
+{
+	Use(m_io_thread_pools);
+
+	return true;
+}
+
+void AsyncFile::OnDestroy()
+{
+}
+
+bool AsyncFile::OnFinalize()
+{
+	// No requests are outstanding once the last reference is gone
+	Close();
+
+	return true;
+}
+
+AsyncFile::AsyncFile()
+{
+    _file = -1;
+}
+
+AsyncFile::~AsyncFile()
+{
+    Close();
+}
+
+bool AsyncFile::Open(const char *file_path, u32 async_file_modes)
+{
+	Close();
+
+	int flags = 0;
+
+	if ((async_file_modes & ASYNCFILE_READ) && (async_file_modes & ASYNCFILE_WRITE))
+		flags = O_RDWR;
+	else if (async_file_modes & ASYNCFILE_WRITE)
+		flags = O_WRONLY;
+	else
+		flags = O_RDONLY;
+
+	if (async_file_modes & ASYNCFILE_WRITE)
+	{
+		// Open it whether it exists or not
+		flags |= O_CREAT;
+
+		// If in truncate mode,
+		if (async_file_modes & ASYNCFILE_TRUNC)
+		{
+			// Truncate existing file
+			flags |= O_TRUNC;
+		}
+	}
+
+	if (async_file_modes & ASYNCFILE_NOBUFFER)
+		flags |= O_DIRECT;
+
+	_file = open(file_path, flags, 0644);
+	if (_file == -1)
+	{
+		CAT_WARN("AsyncFile") << "open error: " << errno;
+		return false;
+	}
+
+	// Pass the access pattern on to the page cache
+	if (async_file_modes & ASYNCFILE_RANDOM)
+		posix_fadvise(_file, 0, 0, POSIX_FADV_RANDOM);
+	else if (async_file_modes & ASYNCFILE_SEQUENTIAL)
+		posix_fadvise(_file, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	return true;
+}
+
+void AsyncFile::Close()
+{
+	if (_file != -1)
+	{
+		close(_file);
+		_file = -1;
+	}
+}
+
+bool AsyncFile::SetSize(u64 bytes)
+{
+	if (ftruncate(_file, (off_t)bytes))
+	{
+		CAT_WARN("AsyncFile") << "ftruncate error: " << errno;
+		return false;
+	}
+
+	return true;
+}
+
+u64 AsyncFile::GetSize()
+{
+	struct stat st;
+
+	if (fstat(_file, &st))
+		return 0;
+
+	return st.st_size;
+}
+
+bool AsyncFile::Read(ReadBuffer *buffer, u64 offset, void *data, u32 bytes)
+{
+	buffer->data = data;
+	buffer->iointernal.io_type = IOTYPE_FILE_READ;
+	buffer->iointernal.associator = this;
+	buffer->iointernal.offset = offset;
+
+	AddRef(CAT_REFOBJECT_TRACE);
+
+	IOThreadPool *pool = m_io_thread_pools->GetSharedPool();
+
+	pool->EnterSubmit();
+
+	io_uring_sqe *sqe = pool->GetSQE();
+	if (sqe)
+	{
+		io_uring_prep_read(sqe, _file, data, bytes, offset);
+		io_uring_sqe_set_data(sqe, static_cast<UringOverlapped*>( &buffer->iointernal ));
+	}
+
+	pool->LeaveSubmit();
+
+	if (!sqe)
+	{
+		CAT_WARN("AsyncFile") << "Read error: Submission queue full";
+		ReleaseRef(CAT_REFOBJECT_TRACE);
+		return false;
+	}
+
+	return true;
+}
+
+bool AsyncFile::Write(WriteBuffer *buffer, u64 offset, void *data, u32 bytes)
+{
+	buffer->data = data;
+	buffer->iointernal.io_type = IOTYPE_FILE_WRITE;
+	buffer->iointernal.associator = this;
+	buffer->iointernal.offset = offset;
+
+	AddRef(CAT_REFOBJECT_TRACE);
+
+	IOThreadPool *pool = m_io_thread_pools->GetSharedPool();
+
+	pool->EnterSubmit();
+
+	io_uring_sqe *sqe = pool->GetSQE();
+	if (sqe)
+	{
+		io_uring_prep_write(sqe, _file, data, bytes, offset);
+		io_uring_sqe_set_data(sqe, static_cast<UringOverlapped*>( &buffer->iointernal ));
+	}
+
+	pool->LeaveSubmit();
+
+	if (!sqe)
+	{
+		CAT_WARN("AsyncFile") << "Write error: Submission queue full";
+		ReleaseRef(CAT_REFOBJECT_TRACE);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,397 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/uring/IOThreadPools.hpp>
+#include <cat/io/Buffers.hpp>
+#include <cat/time/Clock.hpp>
+#include <cat/io/Log.hpp>
+#include <cat/io/Settings.hpp>
+#include <errno.h>
+using namespace cat;
+
+static IOThreadPools *m_io_thread_pools = 0;
+static Settings *m_settings = 0;
+static UDPSendAllocator *m_udp_send_allocator = 0;
+static Clock *m_clock = 0;
+
+
+//// IOThread
+
+CAT_INLINE bool IOThread::HandleCompletion(io_uring_cqe *cqe, u32 event_msec,
+	BatchSet &sendq, UDPEndpoint *&prev_send_endpoint, u32 &send_count,
+	BatchSet &recvq, UDPEndpoint *&prev_recv_endpoint, u32 &recv_count, u32 &recv_releases)
+{
+	UringOverlapped *ov = reinterpret_cast<UringOverlapped*>( io_uring_cqe_get_data(cqe) );
+
+	// Terminate thread on zero completion
+	if (!ov)
+		return true;
+
+	s32 result = cqe->res;
+
+	// Based on type of IO,
+	switch (ov->io_type)
+	{
+	case IOTYPE_UDP_SEND:
+		{
+			UDPEndpoint *udp_endpoint = static_cast<UDPEndpoint*>( ov->associator );
+			SendBuffer *buffer = reinterpret_cast<SendBuffer*>( (u8*)ov - offsetof(SendBuffer, iointernal) );
+
+			// Link to sendq
+			sendq.PushBack(buffer);
+
+			// If a different endpoint sent the last buffer,
+			if (prev_send_endpoint != udp_endpoint)
+			{
+				if (prev_send_endpoint) prev_send_endpoint->ReleaseRef(CAT_REFOBJECT_TRACE, send_count);
+
+				prev_send_endpoint = udp_endpoint;
+				send_count = 0;
+			}
+
+			++send_count;
+		}
+		break;
+
+	case IOTYPE_UDP_RECV:
+		{
+			UDPEndpoint *udp_endpoint = static_cast<UDPEndpoint*>( ov->associator );
+
+			bool terminated;
+			RecvBuffer *buffer = udp_endpoint->OnRecvCompletion(result, cqe->flags, event_msec, terminated);
+
+			// If no buffer was filled and no reference is owed,
+			if (!buffer && !terminated)
+				break;
+
+			// If a different endpoint got the last datagram,
+			if (prev_recv_endpoint != udp_endpoint)
+			{
+				FlushRecvQueue(recvq, prev_recv_endpoint, recv_count, recv_releases);
+
+				prev_recv_endpoint = udp_endpoint;
+			}
+
+			// If a buffer was filled,
+			if (buffer)
+			{
+				// Append to recvq
+				recvq.PushBack(buffer);
+				++recv_count;
+			}
+
+			// Hold the terminated request's reference until recvq is delivered
+			if (terminated)
+				++recv_releases;
+		}
+		break;
+
+	case IOTYPE_FILE_WRITE:
+		{
+			AsyncFile *async_file = static_cast<AsyncFile*>( ov->associator );
+			WriteBuffer *buffer = reinterpret_cast<WriteBuffer*>( (u8*)ov - offsetof(WriteBuffer, iointernal) );
+
+			// Write event completion results to buffer
+			u64 offset = buffer->iointernal.offset;
+			buffer->offset = offset;
+			buffer->data_bytes = result > 0 ? result : 0;
+
+			// If callback is valid,
+			if (buffer->callback.IsValid())
+			{
+				// Invoke callback inline rather than defer to worker threads for file io
+				buffer->callback(GetTLS(), buffer);
+			}
+
+			async_file->ReleaseRef(CAT_REFOBJECT_TRACE);
+		}
+		break;
+
+	case IOTYPE_FILE_READ:
+		{
+			AsyncFile *async_file = static_cast<AsyncFile*>( ov->associator );
+			ReadBuffer *buffer = reinterpret_cast<ReadBuffer*>( (u8*)ov - offsetof(ReadBuffer, iointernal) );
+
+			// Write event completion results to buffer
+			u64 offset = buffer->iointernal.offset;
+			buffer->offset = offset;
+			buffer->data_bytes = result > 0 ? result : 0;
+
+			// If callback is valid,
+			if (buffer->callback.IsValid())
+			{
+				// Invoke callback inline rather than defer to worker threads for file io
+				buffer->callback(GetTLS(), buffer);
+			}
+
+			async_file->ReleaseRef(CAT_REFOBJECT_TRACE);
+		}
+		break;
+	}
+
+	return false;
+}
+
+CAT_INLINE void IOThread::FlushRecvQueue(BatchSet &recvq, UDPEndpoint *&prev_recv_endpoint, u32 &recv_count, u32 &recv_releases)
+{
+	// If recvq is not empty,
+	if (recvq.head)
+		prev_recv_endpoint->OnRecvBatch(recvq, recv_count);
+
+	// Release references held by terminated requests only after delivery
+	if (recv_releases)
+		prev_recv_endpoint->ReleaseRef(CAT_REFOBJECT_TRACE, recv_releases);
+
+	recvq.Clear();
+	prev_recv_endpoint = 0;
+	recv_count = 0;
+	recv_releases = 0;
+}
+
+bool IOThread::Entrypoint(void *vmaster)
+{
+	IOThreadPool *master = reinterpret_cast<IOThreadPool*>( vmaster );
+	io_uring *ring = master->GetRing();
+
+	static const u32 MAX_IO_GATHER = 128;
+
+	u32 max_io_gather = m_settings->getInt("IO.IOThreadPool.MaxIOGather", MAX_IO_GATHER, 1, MAX_IO_GATHER);
+
+	BatchSet sendq, recvq;
+	sendq.Clear();
+	recvq.Clear();
+
+	UDPEndpoint *prev_send_endpoint = 0, *prev_recv_endpoint = 0;
+	u32 send_count = 0, recv_count = 0, recv_releases = 0;
+
+	bool exit_flag = false;
+
+	while (!exit_flag)
+	{
+		io_uring_cqe *cqe;
+
+		// Wait for the first completion
+		int result = io_uring_wait_cqe(ring, &cqe);
+		if (result < 0)
+		{
+			if (result == -EINTR)
+				continue;
+
+			CAT_FATAL("IOThread") << "io_uring_wait_cqe error " << -result;
+			break;
+		}
+
+		u32 event_msec = m_clock->msec();
+
+		// Gather as many completions as are ready, up to the limit
+		unsigned head;
+		u32 count = 0;
+
+		io_uring_for_each_cqe(ring, head, cqe)
+		{
+			if (HandleCompletion(cqe, event_msec, sendq, prev_send_endpoint, send_count, recvq, prev_recv_endpoint, recv_count, recv_releases))
+				exit_flag = true;
+
+			if (++count >= max_io_gather)
+				break;
+		}
+
+		io_uring_cq_advance(ring, count);
+
+		// If datagrams or releases are pending,
+		if (prev_recv_endpoint)
+			FlushRecvQueue(recvq, prev_recv_endpoint, recv_count, recv_releases);
+
+		// If sendq is not empty,
+		if (sendq.head)
+		{
+			m_udp_send_allocator->ReleaseBatch(sendq);
+			sendq.Clear();
+
+			prev_send_endpoint->ReleaseRef(CAT_REFOBJECT_TRACE, send_count);
+			prev_send_endpoint = 0;
+			send_count = 0;
+		}
+	}
+
+	return true;
+}
+
+
+//// IOThreadPool
+
+IOThreadPool::IOThreadPool()
+{
+	_ring_valid = false;
+}
+
+bool IOThreadPool::Startup()
+{
+	// If startup was previously attempted,
+	if (_ring_valid)
+	{
+		// Clean up and try again
+		Shutdown();
+	}
+
+	u32 entries = m_settings->getInt("IO.IOThreadPool.RingEntries", DEFAULT_RING_ENTRIES, MIN_RING_ENTRIES, MAX_RING_ENTRIES);
+
+	int result = io_uring_queue_init(entries, &_ring, 0);
+	if (result < 0)
+	{
+		CAT_FATAL("IOThreadPools") << "io_uring_queue_init error " << -result;
+		return false;
+	}
+
+	_ring_valid = true;
+
+	// Start the completion thread
+	if (!_worker.StartThread(this))
+	{
+		CAT_FATAL("IOThreadPools") << "StartThread error " << errno;
+		return false;
+	}
+
+	return true;
+}
+
+bool IOThreadPool::Shutdown()
+{
+	// If ring was never created,
+	if (!_ring_valid)
+		return true;
+
+	CAT_INFO("IOThreadPool") << "Shutting down thread pool...";
+
+	// Post a zero completion that kills the worker thread
+	EnterSubmit();
+	io_uring_sqe *sqe = GetSQE();
+	if (sqe)
+	{
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, 0);
+	}
+	LeaveSubmit();
+
+	if (!sqe)
+	{
+		CAT_FATAL("IOThreadPools") << "Unable to post quit completion";
+	}
+
+	const int SHUTDOWN_WAIT_TIMEOUT = 15000; // 15 seconds
+
+	if (!_worker.WaitForThread(SHUTDOWN_WAIT_TIMEOUT))
+	{
+		CAT_FATAL("IOThreadPools") << "Thread refused to die!  Attempting lethal force...";
+		_worker.AbortThread();
+	}
+
+	io_uring_queue_exit(&_ring);
+	_ring_valid = false;
+
+	return true;
+}
+
+io_uring_sqe *IOThreadPool::GetSQE()
+{
+	io_uring_sqe *sqe = io_uring_get_sqe(&_ring);
+
+	// If submission queue is full,
+	if (!sqe)
+	{
+		// Flush it and try again
+		io_uring_submit(&_ring);
+		sqe = io_uring_get_sqe(&_ring);
+	}
+
+	return sqe;
+}
+
+
+//// IOThreadPools
+
+CAT_REF_SINGLETON(IOThreadPools);
+
+bool IOThreadPools::OnInitialize()
+{
+	m_io_thread_pools = this;
+
+	Use(m_settings, m_udp_send_allocator, m_clock);
+
+	return IsInitialized() && _shared_pool.Startup();
+}
+
+void IOThreadPools::OnFinalize()
+{
+	// For each pool,
+	for (pools_iter ii = _private_pools; ii; ++ii)
+	{
+		IOThreadPool *pool = ii;
+
+		pool->Shutdown();
+		delete pool;
+	}
+
+	_private_pools.Clear();
+
+	_shared_pool.Shutdown();
+}
+
+IOThreadPool *IOThreadPools::AssociatePrivate(IOThreadsAssociator *associator)
+{
+	AutoMutex lock(_lock);
+
+	IOThreadPool *pool = new (std::nothrow) IOThreadPool;
+	if (!pool) return 0;
+
+	if (!pool->Startup())
+	{
+		pool->Shutdown();
+		delete pool;
+		return 0;
+	}
+
+	_private_pools.PushFront(pool);
+
+	return pool;
+}
+
+bool IOThreadPools::DissociatePrivate(IOThreadPool *pool)
+{
+	if (!pool) return true;
+
+	bool success = pool->Shutdown();
+
+	AutoMutex lock(_lock);
+
+	_private_pools.Erase(pool);
+
+	delete pool;
+
+	return success;
+}
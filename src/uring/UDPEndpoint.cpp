@@ -0,0 +1,466 @@
+/*
+	Copyright (c) 2011 Christopher A. Taylor.  All rights reserved.
+
+	Redistribution and use in source and binary forms, with or without
+	modification, are permitted provided that the following conditions are met:
+
+	* Redistributions of source code must retain the above copyright notice,
+	  this list of conditions and the following disclaimer.
+	* Redistributions in binary form must reproduce the above copyright notice,
+	  this list of conditions and the following disclaimer in the documentation
+	  and/or other materials provided with the distribution.
+	* Neither the name of LibCat nor the names of its contributors may be used
+	  to endorse or promote products derived from this software without
+	  specific prior written permission.
+
+	THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+	AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+	IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+	ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+	LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+	CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+	SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+	INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+	CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+	ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+	POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <cat/uring/UDPEndpoint.hpp>
+#include <cat/io/Log.hpp>
+#include <cat/io/Settings.hpp>
+#include <cat/io/Buffers.hpp>
+#include <cat/net/UDPRecvAllocator.hpp>
+#include <errno.h>
+using namespace std;
+using namespace cat;
+
+static UDPRecvAllocator *m_recv_allocator = 0;
+static IOThreadPools *m_io_thread_pools = 0;
+static UDPSendAllocator *m_udp_send_allocator = 0;
+static Settings *m_settings = 0;
+
+// Buffer group id used for the provided receive buffers of each ring
+static const int URING_RECV_BGID = 0;
+
+// Bytes the kernel writes ahead of the payload in a multishot recvmsg() buffer
+static const u32 URING_RECV_HEADER_BYTES = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in6);
+
+
+//// UDPEndpoint
+
+bool UDPEndpoint::OnInitialize()
+{
+	Use(m_io_thread_pools, m_udp_send_allocator, m_recv_allocator);
+	Use(m_settings);
+
+	return true;
+}
+
+void UDPEndpoint::OnDestroy()
+{
+	// Terminate the multishot receive so that its reference is released
+	if (Valid())
+		shutdown(GetSocket(), SHUT_RDWR);
+}
+
+bool UDPEndpoint::OnFinalize()
+{
+	// No requests are outstanding once the last reference is gone
+	FreeBufferRing();
+
+	m_io_thread_pools->DissociatePrivate(_pool);
+	_pool = 0;
+
+	Close();
+
+	return true;
+}
+
+UDPEndpoint::UDPEndpoint()
+{
+	_pool = 0;
+	_buf_ring = 0;
+	_provided = 0;
+	_provided_count = 0;
+	_provided_missing = 0;
+	_recv_armed = false;
+
+	_recv_ov.io_type = IOTYPE_UDP_RECV;
+	_recv_ov.associator = this;
+}
+
+UDPEndpoint::~UDPEndpoint()
+{
+}
+
+bool UDPEndpoint::Initialize(Port port, bool ignoreUnreachable, bool RequestIPv6, bool RequireIPv4, int kernelReceiveBufferBytes, bool reusePort)
+{
+	// If not able to create a socket,
+	if (!Create(RequestIPv6, RequireIPv4))
+		return false;
+
+	// Set SO_RCVBUF as requested (often defaults are far too low for UDP servers or UDP file transfer clients)
+	if (kernelReceiveBufferBytes < 64000) kernelReceiveBufferBytes = 64000;
+	SetRecvBufferSize(kernelReceiveBufferBytes);
+
+	// If ignoring ICMP unreachable,
+    if (ignoreUnreachable)
+		IgnoreUnreachable(true);
+
+	// If sharing the port with other sockets was requested but is not possible,
+	if (reusePort && !SetReusePort(true))
+	{
+		Close();
+		return false;
+	}
+
+	// If not able to bind,
+	if (!Bind(port))
+		return false;
+
+	AddRef(CAT_REFOBJECT_TRACE);
+
+	// Get a private ring for this endpoint
+	_pool = m_io_thread_pools->AssociatePrivate(this);
+	if (!_pool)
+	{
+		CAT_FATAL("UDPEndpoint") << "Unable to associate with IOThreadPools";
+		Close();
+		ReleaseRef(CAT_REFOBJECT_TRACE); // Release temporary references keeping the object alive until function returns
+		return false;
+	}
+
+	// If receive buffers could not be provided,
+	if (!SetupBufferRing() || !PostMultishotRecv())
+	{
+		CAT_FATAL("UDPEndpoint") << "No reads could be launched";
+		Close();
+		ReleaseRef(CAT_REFOBJECT_TRACE); // Release temporary reference keeping the object alive until function returns
+		return false;
+	}
+
+    CAT_INFO("UDPEndpoint") << "Open on port " << GetPort() << " with " << _provided_count << " provided buffers";
+
+	ReleaseRef(CAT_REFOBJECT_TRACE); // Release temporary reference keeping the object alive until function returns
+    return true;
+}
+
+
+//// Provided Buffers
+
+bool UDPEndpoint::SetupBufferRing()
+{
+	// Verify the receive header fits ahead of the trailing bytes of a RecvBuffer
+	if (sizeof(RecvBuffer) - offsetof(RecvBuffer, iointernal) < URING_RECV_HEADER_BYTES)
+	{
+		CAT_FATAL("UDPEndpoint") << "RecvBuffer header is too small for multishot receives";
+		return false;
+	}
+
+	u32 requested = m_settings->getInt("IO.UDPEndpoint.ProvidedBuffers", UDP_PROVIDED_BUFFERS, 1, UDP_MAX_PROVIDED_BUFFERS);
+
+	// Round up to a power of two as required by the ring
+	u32 count = 1;
+	while (count < requested) count <<= 1;
+
+	int result;
+	_buf_ring = io_uring_setup_buf_ring(_pool->GetRing(), count, URING_RECV_BGID, 0, &result);
+	if (!_buf_ring)
+	{
+		CAT_FATAL("UDPEndpoint") << "io_uring_setup_buf_ring error " << -result;
+		return false;
+	}
+
+	_provided = new (std::nothrow) RecvBuffer*[count];
+	if (!_provided)
+	{
+		CAT_FATAL("UDPEndpoint") << "Out of memory allocating provided buffer table";
+		return false;
+	}
+
+	for (u32 ii = 0; ii < count; ++ii)
+		_provided[ii] = 0;
+
+	_provided_count = count;
+	_provided_missing = count;
+
+	CAT_OBJCLR(_recv_msg);
+	_recv_msg.msg_namelen = sizeof(sockaddr_in6);
+
+	ReplenishBuffers();
+
+	return _provided_missing < _provided_count;
+}
+
+void UDPEndpoint::FreeBufferRing()
+{
+	// If provided buffer table exists,
+	if (_provided)
+	{
+		BatchSet garbage;
+		garbage.Clear();
+
+		// For each slot still holding a buffer,
+		for (u32 ii = 0; ii < _provided_count; ++ii)
+			if (_provided[ii])
+				garbage.PushBack(_provided[ii]);
+
+		if (garbage.head)
+			m_recv_allocator->ReleaseBatch(garbage);
+
+		delete []_provided;
+		_provided = 0;
+	}
+
+	if (_buf_ring)
+	{
+		io_uring_free_buf_ring(_pool->GetRing(), _buf_ring, _provided_count, URING_RECV_BGID);
+		_buf_ring = 0;
+	}
+
+	_provided_count = 0;
+	_provided_missing = 0;
+}
+
+void UDPEndpoint::ReplenishBuffers()
+{
+	if (_provided_missing == 0)
+		return;
+
+	BatchSet allocated;
+	u32 acquired = m_recv_allocator->AcquireBatch(allocated, _provided_missing);
+
+	if (acquired < _provided_missing)
+	{
+		CAT_WARN("UDPEndpoint") << "Only able to acquire " << acquired << " of " << _provided_missing << " buffers";
+	}
+
+	int mask = io_uring_buf_ring_mask(_provided_count);
+	int offset = 0;
+
+	// For each empty slot while buffers remain,
+	BatchHead *node = allocated.head;
+	for (u32 bid = 0; bid < _provided_count && node && offset < (int)acquired; ++bid)
+	{
+		if (_provided[bid])
+			continue;
+
+		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
+		node = node->batch_next;
+
+		_provided[bid] = buffer;
+
+		// Region starts inside the header so the payload lands near the trailing bytes
+		io_uring_buf_ring_add(_buf_ring, &buffer->iointernal,
+			URING_RECV_HEADER_BYTES + IOTHREADS_BUFFER_READ_BYTES, bid, mask, offset++);
+	}
+
+	io_uring_buf_ring_advance(_buf_ring, offset);
+	_provided_missing -= offset;
+}
+
+bool UDPEndpoint::PostMultishotRecv()
+{
+	if (IsShutdown())
+		return false;
+
+	AddRef(CAT_REFOBJECT_TRACE);
+
+	_pool->EnterSubmit();
+
+	io_uring_sqe *sqe = _pool->GetSQE();
+	if (sqe)
+	{
+		io_uring_prep_recvmsg_multishot(sqe, GetSocket(), &_recv_msg, 0);
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_RECV_BGID;
+		io_uring_sqe_set_data(sqe, &_recv_ov);
+	}
+
+	_pool->LeaveSubmit();
+
+	if (!sqe)
+	{
+		CAT_FATAL("UDPEndpoint") << "Unable to post multishot receive: Submission queue full";
+		ReleaseRef(CAT_REFOBJECT_TRACE);
+		return false;
+	}
+
+	_recv_armed = true;
+	return true;
+}
+
+
+//// Begin Events
+
+bool UDPEndpoint::Write(const BatchSet &buffers, u32 count, const NetAddr &addr)
+{
+	NetAddr::SockAddr out_addr;
+	int addr_len;
+
+	// If in the process of shutdown or input invalid,
+	if (IsShutdown() || !addr.Unwrap(out_addr, addr_len))
+	{
+		m_udp_send_allocator->ReleaseBatch(buffers);
+		return false;
+	}
+
+	u32 write_count = 0;
+
+	AddRef(CAT_REFOBJECT_TRACE, count);
+
+	_pool->EnterSubmit();
+
+	for (BatchHead *next, *node = buffers.head; node; node = next)
+	{
+		next = node->batch_next;
+		SendBuffer *buffer = static_cast<SendBuffer*>( node );
+
+		io_uring_sqe *sqe = _pool->GetSQE();
+		if (!sqe)
+		{
+			CAT_WARN("UDPEndpoint") << "Submission queue full: Dropping datagram";
+
+			m_udp_send_allocator->ReleaseBatch(node);
+			ReleaseRef(CAT_REFOBJECT_TRACE);
+			continue;
+		}
+
+		IOLayerSendOverhead *ov = &buffer->iointernal;
+		ov->io_type = IOTYPE_UDP_SEND;
+		ov->associator = this;
+		ov->addr = out_addr;
+		ov->addr_len = addr_len;
+
+		ov->iov.iov_base = GetTrailingBytes(buffer);
+		ov->iov.iov_len = buffer->data_bytes;
+
+		CAT_OBJCLR(ov->msg);
+		ov->msg.msg_name = &ov->addr;
+		ov->msg.msg_namelen = addr_len;
+		ov->msg.msg_iov = &ov->iov;
+		ov->msg.msg_iovlen = 1;
+
+		// Fire off a sendmsg() and forget about it
+		io_uring_prep_sendmsg(sqe, GetSocket(), &ov->msg, 0);
+		io_uring_sqe_set_data(sqe, static_cast<UringOverlapped*>( ov ));
+
+		++write_count;
+	}
+
+	// Submit the whole batch with one syscall
+	_pool->LeaveSubmit();
+
+	return count == write_count;
+}
+
+bool UDPEndpoint::Write(u8 *data, u32 data_bytes, const NetAddr &addr)
+{
+	SendBuffer *buffer = SendBuffer::Promote(data);
+	buffer->data_bytes = data_bytes;
+	return Write(buffer, 1, addr);
+}
+
+void UDPEndpoint::SetRemoteAddress(RecvBuffer *buffer)
+{
+	buffer->addr.Wrap(buffer->iointernal.addr);
+}
+
+
+//// Event Completion
+
+void UDPEndpoint::ReleaseRecvBuffers(BatchSet buffers, u32 count)
+{
+	if (buffers.head)
+		m_recv_allocator->ReleaseBatch(buffers);
+}
+
+RecvBuffer *UDPEndpoint::OnRecvCompletion(s32 result, u32 flags, u32 event_msec, bool &terminated)
+{
+	RecvBuffer *filled = 0;
+	terminated = false;
+
+	// If a provided buffer was consumed,
+	if (flags & IORING_CQE_F_BUFFER)
+	{
+		u32 bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		RecvBuffer *buffer = _provided[bid];
+
+		_provided[bid] = 0;
+		++_provided_missing;
+
+		u8 *region = reinterpret_cast<u8*>( &buffer->iointernal );
+
+		io_uring_recvmsg_out *out = 0;
+		if (result >= 0)
+			out = io_uring_recvmsg_validate(region, result, &_recv_msg);
+
+		// If a whole datagram arrived,
+		if (out && !(out->flags & MSG_TRUNC))
+		{
+			// Copy the address out before it is overwritten
+			sockaddr_in6 addr;
+			u32 addr_len = out->namelen;
+			if (addr_len > sizeof(addr)) addr_len = sizeof(addr);
+			memcpy(&addr, io_uring_recvmsg_name(out), addr_len);
+
+			u32 bytes = io_uring_recvmsg_payload_length(out, result, &_recv_msg);
+			memmove(GetTrailingBytes(buffer), io_uring_recvmsg_payload(out, &_recv_msg), bytes);
+
+			// Write event completion results to buffer
+			buffer->iointernal.addr = addr;
+			buffer->iointernal.addr_len = addr_len;
+			buffer->data_bytes = bytes;
+			buffer->event_msec = event_msec;
+
+			filled = buffer;
+		}
+		else
+		{
+			m_recv_allocator->ReleaseBatch(buffer);
+		}
+	}
+
+	// If the multishot receive has terminated,
+	if (!(flags & IORING_CQE_F_MORE))
+	{
+		_recv_armed = false;
+
+		// If not shutting down (ran out of buffers or hit an error),
+		if (!IsShutdown())
+		{
+			if (result < 0 && result != -ENOBUFS)
+			{
+				CAT_WARN("UDPEndpoint") << "Multishot receive terminated with error " << -result;
+			}
+
+			ReplenishBuffers();
+			PostMultishotRecv();
+		}
+
+		// The IO thread releases the reference held by the terminated request
+		// after the filled buffer has been delivered
+		terminated = true;
+	}
+
+	return filled;
+}
+
+void UDPEndpoint::OnRecvBatch(const BatchSet &buffers, u32 count)
+{
+	// If reads completed during shutdown,
+	if (IsShutdown())
+	{
+		// Just release the read buffers
+		m_recv_allocator->ReleaseBatch(buffers);
+	}
+	else
+	{
+		// Notify derived class about new buffers
+		OnRecvRouting(buffers);
+
+		// Finalization frees the ring once shutdown is flagged, so only refill before then
+		ReplenishBuffers();
+	}
+}
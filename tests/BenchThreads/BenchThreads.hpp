@@ -0,0 +1,87 @@
+#ifndef CAT_TESTS_BENCH_THREADS_HPP
+#define CAT_TESTS_BENCH_THREADS_HPP
+
+#include <cat/threads/Thread.hpp>
+#include <cat/io/Log.hpp>
+
+/*
+	Benchmark Threads
+
+	Shared by the multithreaded benchmarks.  Each trial starts its threads
+	held at a start line and releases them together, so thread creation is
+	not timed.  RunScaling() runs the trial at 1, 2, 4 ... threads and logs
+	one row per thread count comparing a design against the one it replaced.
+*/
+
+// Thread that waits at the start line, then runs one trial body
+class BenchThread : public cat::Thread
+{
+	volatile cat::u32 *_go;
+
+	bool Entrypoint(void *param)
+	{
+		while (!*_go)
+		{
+			CAT_FENCE_COMPILER;
+		}
+
+		return Run();
+	}
+
+protected:
+	virtual bool Run() = 0;
+
+public:
+	CAT_INLINE BenchThread() { _go = 0; }
+	virtual ~BenchThread() {}
+
+	// The thread runs once *go becomes nonzero
+	CAT_INLINE bool StartAt(volatile cat::u32 *go)
+	{
+		_go = go;
+		return StartThread();
+	}
+};
+
+// Start count threads held at the start line, which is cleared first
+// If one fails to start, the others are released and waited on, and false is returned
+template<class T>
+bool StartBenchThreads(const char *bench_name, T threads[], cat::u32 count, volatile cat::u32 *go)
+{
+	*go = 0;
+
+	for (cat::u32 ii = 0; ii < count; ++ii)
+	{
+		if (!threads[ii].StartAt(go))
+		{
+			CAT_WARN(bench_name) << "Unable to start thread " << ii;
+
+			*go = 1;
+			for (cat::u32 jj = 0; jj < ii; ++jj)
+				threads[jj].WaitForThread();
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the rate per second for a trial with the given number of threads, or 0 on failure
+typedef double (*BenchTrial)(cat::u32 thread_count, bool use_new);
+
+// Log "<count> <noun>: <new_name> = <rate> <unit>, <old_name> = <rate> <unit>" for each count
+static void RunScaling(const char *bench_name, BenchTrial trial, cat::u32 max_threads, const char *noun,
+					   const char *new_name, const char *old_name, const char *unit)
+{
+	for (cat::u32 count = 1; count <= max_threads; count *= 2)
+	{
+		double old_rate = trial(count, false);
+		double new_rate = trial(count, true);
+
+		CAT_WARN(bench_name) << count << " " << noun << ": " << new_name << " = " << (cat::u32)new_rate
+			<< " " << unit << ", " << old_name << " = " << (cat::u32)old_rate << " " << unit;
+	}
+}
+
+#endif // CAT_TESTS_BENCH_THREADS_HPP
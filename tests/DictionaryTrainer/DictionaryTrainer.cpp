@@ -0,0 +1,118 @@
+#include <cat/AllSphynx.hpp>
+#include <cat/AllCodec.hpp>
+#include <ext/lz4/lz4.h>
+#include <fstream>
+using namespace std;
+using namespace cat;
+using namespace sphynx;
+
+/*
+	Trains a Sphynx compression dictionary from captured messages.
+
+	Usage: DictionaryTrainer <capture file> <dictionary file> [max bytes]
+
+	The capture file is a sequence of records, each a 16-bit little-endian
+	message length followed by the message bytes, as an application would
+	write them from OnMessages() during a representative play session.
+
+	The dictionary file is ready for the "Sphynx.Server.Dictionary" setting.
+	After training, every captured message is compressed with plain LZ4 and
+	with the dictionary to show how much it saves.
+*/
+
+static const u32 DEFAULT_MAX_BYTES = 4096;
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		CAT_WARN("DictionaryTrainer") << "Usage: DictionaryTrainer <capture file> <dictionary file> [max bytes]";
+		return 1;
+	}
+
+	u32 max_bytes = argc >= 4 ? atoi(argv[3]) : DEFAULT_MAX_BYTES;
+	if (max_bytes > CompressionDictionary::MAX_BYTES)
+		max_bytes = CompressionDictionary::MAX_BYTES;
+
+	ifstream capture(argv[1], ios::in | ios::binary);
+	if (!capture)
+	{
+		CAT_WARN("DictionaryTrainer") << "Unable to open capture file " << argv[1];
+		return 1;
+	}
+
+	DictionaryTrainer trainer;
+
+	// Read each captured message
+	u8 header[2], message[65536];
+	while (capture.read((char*)header, sizeof(header)))
+	{
+		u32 bytes = header[0] | ((u32)header[1] << 8);
+
+		if (!capture.read((char*)message, bytes))
+			break;
+
+		trainer.AddSample(message, bytes);
+	}
+
+	CAT_WARN("DictionaryTrainer") << "Read " << trainer.GetSampleCount() << " messages totalling " << trainer.GetSampleBytes() << " bytes";
+
+	vector<u8> dictionary;
+	if (!trainer.Train(max_bytes, dictionary))
+	{
+		CAT_WARN("DictionaryTrainer") << "Messages have too little in common to train a dictionary";
+		return 1;
+	}
+
+	ofstream output(argv[2], ios::out | ios::binary);
+	output.write((const char*)&dictionary[0], dictionary.size());
+	if (!output)
+	{
+		CAT_WARN("DictionaryTrainer") << "Unable to write dictionary file " << argv[2];
+		return 1;
+	}
+
+	CompressionDictionary *dict = CompressionDictionary::Create(&dictionary[0], (u32)dictionary.size());
+	if (!dict)
+	{
+		CAT_WARN("DictionaryTrainer") << "Unable to load the trained dictionary";
+		return 1;
+	}
+
+	CAT_WARN("DictionaryTrainer") << "Wrote " << (u32)dictionary.size() << " byte dictionary with id " << dict->GetID();
+
+	// Compare compressed sizes, counting messages that do not shrink at their original size
+	u64 raw_bytes = 0, plain_bytes = 0, dict_bytes = 0;
+	u8 compressed[MAXIMUM_MTU + MAXIMUM_MTU / 255 + 16];
+
+	DictionaryWorkspace workspace;
+	workspace.Clear();
+
+	for (u32 ii = 0; ii < trainer.GetSampleCount(); ++ii)
+	{
+		u32 bytes;
+		const u8 *sample = trainer.GetSample(ii, bytes);
+
+		// Only datagram-sized messages are compressed by the transport
+		if (bytes > MAXIMUM_MTU)
+			continue;
+
+		int plain = LZ4_compress((const char*)sample, (char*)compressed, bytes);
+		u32 with_dict = dict->Compress(workspace, sample, bytes, compressed);
+
+		raw_bytes += bytes;
+		plain_bytes += plain > 0 ? plain : bytes;
+		dict_bytes += with_dict > 0 ? with_dict : bytes;
+	}
+
+	if (raw_bytes > 0)
+	{
+		CAT_WARN("DictionaryTrainer") << "Plain LZ4: " << (u32)(plain_bytes * 100 / raw_bytes)
+			<< "% of original.  With dictionary: " << (u32)(dict_bytes * 100 / raw_bytes) << "% of original";
+	}
+
+	workspace.FreeMemory();
+	dict->ReleaseRef();
+
+	return 0;
+}
@@ -0,0 +1,363 @@
+#include <cat/AllSphynx.hpp>
+#include "../BenchThreads/BenchThreads.hpp"
+using namespace cat;
+using namespace sphynx;
+
+static Clock *m_clock = 0;
+
+/*
+	Measures lookups per second from 1 to 32 reader threads over a table
+	shaped like the ConnexionMap, as the IO threads route datagrams.
+
+	Each lookup reads a slot, takes a reference on the object found there
+	and drops it again, like LookupCheckFlood() followed by the datagram
+	being handled.  Readers each work on their own keys so that reference
+	counts do not bounce between them and only the table guard is shared.
+
+	The EpochGate that now guards the ConnexionMap is compared against the
+	RWLock it replaced.
+
+	A churn test then runs a real ConnexionMap: one thread keeps replacing
+	connexions with Insert() and Remove(), another calls ReclaimRetired()
+	like the server tick, and reader threads look up random keys.  Every
+	Connexion found must still be alive and hold the key it was found by,
+	and once the readers stop every Connexion must be freed.
+*/
+
+static const u32 TABLE_SIZE = 16384;
+static const u32 LOOKUPS_PER_THREAD = 1 << 21;
+static const u32 MAX_READERS = 32;
+
+struct Entry
+{
+	volatile u32 refs;
+	u8 padding[CAT_DEFAULT_CACHE_LINE_SIZE - sizeof(u32)];
+};
+
+static Entry *m_entries = 0;
+static Entry * volatile m_table[TABLE_SIZE];
+
+static RWLock m_table_lock;
+static EpochGate m_epoch;
+
+static volatile u32 m_go = 0;
+
+class Reader : public BenchThread
+{
+	u32 _first_key;
+	bool _use_epoch;
+	u32 _found;
+
+	bool Run()
+	{
+		u32 key = _first_key, found = 0;
+
+		for (u32 ii = 0; ii < LOOKUPS_PER_THREAD; ++ii)
+		{
+			Entry *entry;
+
+			if (_use_epoch)
+			{
+				AutoEpoch epoch(m_epoch);
+
+				entry = m_table[key];
+				if (entry) Atomic::Add(&entry->refs, 1);
+			}
+			else
+			{
+				AutoReadLock lock(m_table_lock);
+
+				entry = m_table[key];
+				if (entry) Atomic::Add(&entry->refs, 1);
+			}
+
+			if (entry)
+			{
+				++found;
+				Atomic::Add(&entry->refs, -1);
+			}
+
+			// Stay within this reader's own stripe of keys
+			key = (key + MAX_READERS) & (TABLE_SIZE - 1);
+		}
+
+		_found = found;
+
+		return true;
+	}
+
+public:
+	void Setup(u32 first_key, bool use_epoch)
+	{
+		_first_key = first_key;
+		_use_epoch = use_epoch;
+		_found = 0;
+	}
+
+	CAT_INLINE u32 GetFound() { return _found; }
+};
+
+static double RunTrial(u32 reader_count, bool use_epoch)
+{
+	Reader readers[MAX_READERS];
+
+	for (u32 ii = 0; ii < reader_count; ++ii)
+		readers[ii].Setup(ii, use_epoch);
+
+	if (!StartBenchThreads("EpochLookupBench", readers, reader_count, &m_go))
+		return 0;
+
+	double start = m_clock->usec();
+
+	m_go = 1;
+
+	u32 found = 0;
+	for (u32 ii = 0; ii < reader_count; ++ii)
+	{
+		readers[ii].WaitForThread();
+		found += readers[ii].GetFound();
+	}
+
+	double delta = m_clock->usec() - start;
+
+	u32 total = LOOKUPS_PER_THREAD * reader_count;
+	if (found != total)
+	{
+		CAT_WARN("EpochLookupBench") << "Lookup missed: Found " << found << " of " << total;
+	}
+
+	return total / delta * 1000000.0;
+}
+
+static const u32 CHURN_READERS = 4;
+static const u32 CHURN_LIVE = 3000; // Spans a chunk boundary with Roaming IP
+static const u32 CHURN_REPLACEMENTS = 200000;
+static const u32 CHURN_MAGIC = 0x1badc0de;
+
+static ConnexionMap m_churn_map;
+static volatile u32 m_churn_created = 0, m_churn_finalized = 0;
+static volatile u32 m_churn_stop = 0;
+
+class ChurnConnexion : public Connexion
+{
+	volatile u32 _magic;
+
+protected:
+	// Stand in for the Server parent, which is never set here
+	void OnDestroy() { m_churn_map.Remove(this); }
+	bool OnFinalize()
+	{
+		_magic = 0;
+		Atomic::Add(&m_churn_finalized, 1);
+		return true;
+	}
+
+	void OnConnect() {}
+	void OnMessages(IncomingMessage msgs[], u32 count) {}
+	void OnCycle(u32 now) {}
+	void OnDisconnectReason(u8 reason) {}
+
+public:
+	ChurnConnexion()
+	{
+		_magic = CHURN_MAGIC;
+		Atomic::Add(&m_churn_created, 1);
+	}
+
+	CAT_INLINE bool IsAlive() { return _magic == CHURN_MAGIC; }
+};
+
+class ChurnReader : public Thread
+{
+	u32 _seed;
+	u32 _found, _errors;
+
+	bool Entrypoint(void *param)
+	{
+		Abyssinian prng;
+		prng.Initialize(_seed);
+
+		while (!m_churn_stop)
+		{
+			u32 key = prng.Next() % (CHURN_LIVE * 2);
+
+			Connexion *conn = m_churn_map.Lookup(key);
+			if (!conn) continue;
+
+			++_found;
+
+			if (!static_cast<ChurnConnexion*>( conn )->IsAlive() || conn->GetMyID() != key)
+				++_errors;
+
+			conn->ReleaseRef(CAT_REFOBJECT_TRACE);
+		}
+
+		return true;
+	}
+
+public:
+	void Setup(u32 seed)
+	{
+		_seed = seed;
+		_found = 0;
+		_errors = 0;
+	}
+
+	CAT_INLINE u32 GetFound() { return _found; }
+	CAT_INLINE u32 GetErrors() { return _errors; }
+};
+
+class ChurnReclaimer : public Thread
+{
+	bool Entrypoint(void *param)
+	{
+		while (!m_churn_stop)
+		{
+			m_churn_map.ReclaimRetired();
+			Clock::sleep(1);
+		}
+
+		return true;
+	}
+};
+
+static bool InsertChurnConnexion(ChurnConnexion * &conn)
+{
+	if (!RefObjects::Create(CAT_REFOBJECT_TRACE, conn))
+		return false;
+
+	if (m_churn_map.Insert(conn) != ERR_NO_PROBLEMO)
+	{
+		conn->Destroy(CAT_REFOBJECT_TRACE);
+		return false;
+	}
+
+	return true;
+}
+
+static bool RunChurn()
+{
+	FortunaOutput *csprng = FortunaFactory::ref()->Create();
+	if (!csprng || !m_churn_map.Initialize(csprng, CHURN_LIVE * 2))
+	{
+		CAT_WARN("EpochLookupBench") << "Unable to initialize the ConnexionMap";
+		return false;
+	}
+
+	delete csprng;
+
+	ChurnConnexion **live = new (std::nothrow) ChurnConnexion*[CHURN_LIVE];
+	if (!live) return false;
+
+	for (u32 ii = 0; ii < CHURN_LIVE; ++ii)
+	{
+		if (!InsertChurnConnexion(live[ii]))
+		{
+			CAT_WARN("EpochLookupBench") << "Unable to insert connexion " << ii;
+			return false;
+		}
+	}
+
+	ChurnReader readers[CHURN_READERS];
+	ChurnReclaimer reclaimer;
+
+	m_churn_stop = 0;
+
+	for (u32 ii = 0; ii < CHURN_READERS; ++ii)
+	{
+		readers[ii].Setup(ii + 1);
+		readers[ii].StartThread();
+	}
+	reclaimer.StartThread();
+
+	double start = m_clock->usec();
+
+	Abyssinian prng;
+	prng.Initialize(0);
+
+	bool success = true;
+
+	// Replace random connexions while the readers look them up
+	for (u32 ii = 0; ii < CHURN_REPLACEMENTS; ++ii)
+	{
+		u32 index = prng.Next() % CHURN_LIVE;
+
+		live[index]->Destroy(CAT_REFOBJECT_TRACE);
+
+		if (!InsertChurnConnexion(live[index]))
+		{
+			CAT_WARN("EpochLookupBench") << "Unable to reinsert connexion " << ii;
+			live[index] = 0;
+			success = false;
+			break;
+		}
+	}
+
+	double delta = m_clock->usec() - start;
+
+	m_churn_stop = 1;
+
+	u32 found = 0, errors = 0;
+	for (u32 ii = 0; ii < CHURN_READERS; ++ii)
+	{
+		readers[ii].WaitForThread();
+		found += readers[ii].GetFound();
+		errors += readers[ii].GetErrors();
+	}
+	reclaimer.WaitForThread();
+
+	for (u32 ii = 0; ii < CHURN_LIVE; ++ii)
+		if (live[ii]) live[ii]->Destroy(CAT_REFOBJECT_TRACE);
+
+	delete []live;
+
+	// With no readers left, everything retired can be reclaimed
+	m_churn_map.ReclaimRetired();
+
+	// Objects are freed by the RefObjects thread
+	for (u32 ii = 0; ii < 100 && m_churn_finalized != m_churn_created; ++ii)
+		Clock::sleep(100);
+
+	CAT_WARN("EpochLookupBench") << "Churn: " << (u32)(CHURN_REPLACEMENTS / delta * 1000000.0) << " replacements/s against "
+		<< CHURN_READERS << " readers, " << found << " lookups found a connexion";
+
+	if (errors)
+	{
+		CAT_WARN("EpochLookupBench") << "Churn FAIL: " << errors << " lookups returned a freed or moved connexion";
+		success = false;
+	}
+
+	if (m_churn_finalized != m_churn_created)
+	{
+		CAT_WARN("EpochLookupBench") << "Churn FAIL: " << m_churn_created - m_churn_finalized << " of " << m_churn_created << " connexions were never freed";
+		success = false;
+	}
+
+	return success;
+}
+
+int main(int argc, char **argv)
+{
+	m_clock = Clock::ref();
+
+	m_entries = new (std::nothrow) Entry[TABLE_SIZE];
+	if (!m_entries)
+	{
+		CAT_WARN("EpochLookupBench") << "Out of memory allocating table entries";
+		return 1;
+	}
+
+	for (u32 ii = 0; ii < TABLE_SIZE; ++ii)
+	{
+		m_entries[ii].refs = 1;
+		m_table[ii] = &m_entries[ii];
+	}
+
+	CAT_WARN("EpochLookupBench") << "Looking up " << LOOKUPS_PER_THREAD << " keys per reader thread in a table of " << TABLE_SIZE;
+
+	RunScaling("EpochLookupBench", RunTrial, MAX_READERS, "readers", "EpochGate", "RWLock", "lookups/s");
+
+	delete []m_entries;
+
+	return RunChurn() ? 0 : 1;
+}
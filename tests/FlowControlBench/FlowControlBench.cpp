@@ -0,0 +1,97 @@
+#include "../TransportSim/SimTransport.hpp"
+using namespace cat;
+using namespace sphynx;
+
+/*
+	Compares the Sphynx congestion controllers over simulated paths.
+
+	Each run carries a bulk reliable transfer between two Transports over
+	the NetworkSimulator (see ../TransportSim), so the controllers are
+	driven by the real transport layer: its ticks, acknowledgments, loss
+	detection and pacing.  Each path is one bottleneck with a drop-tail
+	queue, fixed propagation delay and optional random loss, in both
+	directions.
+
+	The simulator runs on the virtual clock with a fixed seed, so every run
+	produces the same numbers.
+*/
+
+static const u32 SEED = 1234567;
+static const Port SENDER_PORT = 47020;
+static const Port RECEIVER_PORT = 47021;
+static const u32 SIM_MSEC = 20000;
+static const u32 MAX_QUEUED_MSGS = 256;
+
+struct PathParams
+{
+	const char *name;
+	u32 rate_bytes;		// Bottleneck rate in bytes per second
+	u32 rtt_msec;		// Round trip propagation delay
+	u32 queue_bytes;	// Bottleneck queue limit
+	u32 loss_ppm;		// Random loss in parts per million
+};
+
+static const PathParams PATHS[] = {
+	{ "LAN 100 Mbps, 2 ms", 12500000, 2, 250000, 0 },
+	{ "DSL 2 Mbps, 60 ms", 250000, 60, 64000, 0 },
+	{ "Long fat pipe 100 Mbps, 200 ms, 0.1% loss", 12500000, 200, 2500000, 1000 },
+	{ "Long fat pipe 50 Mbps, 300 ms, 1% loss", 6250000, 300, 2000000, 10000 },
+};
+
+static void Report(const char *mode_name, const PathParams &path, const SimBulkResult &result)
+{
+	const SimulatedLinkStats &link = result.data_link;
+
+	double goodput_mbps = result.recv_bytes * 8.0 / (SIM_MSEC / 1000.0) / 1000000.0;
+	double utilization = 100.0 * result.recv_bytes / ((double)path.rate_bytes * (SIM_MSEC / 1000));
+	double loss_percent = link.sent ? 100.0 * (link.lost + link.overflowed) / link.sent : 0;
+
+	// Message latency beyond the one-way propagation delay is mostly bottleneck queueing
+	double latency_msec = result.recv_count ? (double)result.latency_sum / result.recv_count : 0;
+	double queue_msec = latency_msec - path.rtt_msec / 2.0;
+	if (queue_msec < 0) queue_msec = 0;
+
+	CAT_WARN("FlowControlBench") << "  " << mode_name << ": goodput = " << goodput_mbps
+		<< " Mbps (" << utilization << "% of link), loss = " << loss_percent
+		<< "%, mean queue delay = " << queue_msec << " ms";
+}
+
+int main(int argc, char **argv)
+{
+	static const char *MODE_NAMES[] = { "Tampon", "Bottleneck" };
+	static const FlowControlMode MODES[] = { FLOW_CONTROL_TAMPON, FLOW_CONTROL_BOTTLENECK };
+
+	SimHarness harness;
+
+	if (!harness.Initialize(SENDER_PORT, RECEIVER_PORT, SEED))
+		return 1;
+
+	CAT_WARN("FlowControlBench") << "Simulating " << SIM_MSEC / 1000 << " seconds of bulk transfer per path, seed " << SEED;
+
+	for (u32 ii = 0; ii < sizeof(PATHS) / sizeof(PATHS[0]); ++ii)
+	{
+		const PathParams &path = PATHS[ii];
+
+		CAT_WARN("FlowControlBench") << path.name;
+
+		// One bottleneck with the same delay, loss and queue in both directions
+		SimulatedLinkParams link;
+		CAT_OBJCLR(link);
+		link.latency_usec = path.rtt_msec * 500;
+		link.loss_ppm = path.loss_ppm;
+		link.rate_bytes = path.rate_bytes;
+		link.queue_bytes = path.queue_bytes;
+
+		for (u32 jj = 0; jj < 2; ++jj)
+		{
+			SimBulkResult result;
+
+			if (!harness.RunBulk(link, MODES[jj], SIM_MSEC, MAX_QUEUED_MSGS, result))
+				return 1;
+
+			Report(MODE_NAMES[jj], path, result);
+		}
+	}
+
+	return 0;
+}
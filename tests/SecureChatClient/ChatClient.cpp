@@ -87,10 +87,10 @@ public:
 				_ft.OnControlMessage(msg, bytes);
 				break;
 			case OP_USER_JOIN:
-				CAT_WARN("Client") << "-- User joined: " << getLE(*(u16*)(msg + 1));
+				CAT_WARN("Client") << "-- User joined: " << getLE(*(u32*)(msg + 1));
 				break;
 			case OP_USER_PART:
-				CAT_WARN("Client") << "-- User quit: " << getLE(*(u16*)(msg + 1));
+				CAT_WARN("Client") << "-- User quit: " << getLE(*(u32*)(msg + 1));
 				break;
 			default:
 				CAT_WARN("Client") << "-- Got unknown message type " << (int)msg[0] << " with " << bytes << " bytes";
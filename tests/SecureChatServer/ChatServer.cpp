@@ -76,7 +76,7 @@ void GameConnexion::OnConnect()
 		test_msg[ii] = (u8)(prng.Next() % 10);
 	//WriteReliable(STREAM_2, OP_TEST_FRAGMENTS, test_msg, sizeof(test_msg));
 
-	u16 key = getLE(GetMyID());
+	u32 key = getLE(GetMyID());
 
 	Collexion<GameConnexion> *user_list = &GetServer<GameServer>()->_collexion;
 
@@ -127,7 +127,7 @@ void GameConnexion::OnDisconnectReason(u8 reason)
 {
 	CAT_WARN("Connexion") << "-- DISCONNECTED REASON " << (int)reason;
 
-	u16 key = getLE(GetMyID());
+	u32 key = getLE(GetMyID());
 
 	Collexion<GameConnexion> *user_list = &GetServer<GameServer>()->_collexion;
 
@@ -0,0 +1,163 @@
+#include <cat/AllSphynx.hpp>
+#include "../BenchThreads/BenchThreads.hpp"
+using namespace cat;
+using namespace sphynx;
+
+static Clock *m_clock = 0;
+
+/*
+	Measures how many messages per second can be posted to connexion send
+	queues from 1 to 32 producer threads while a single consumer thread
+	drains them, as the owning worker thread would.
+
+	The lock-free SendInbox is compared against the previous design, where
+	each connexion had a plain linked list and every connexion on a worker
+	shared one send queue mutex.
+*/
+
+static const u32 CONNEXION_COUNT = 64;
+static const u32 TOTAL_MESSAGES = 1 << 19;
+static const u32 MAX_PRODUCERS = 32;
+
+// Previous design: per-connexion queue behind a per-worker shared mutex
+struct LockedQueue
+{
+	OutgoingMessage *head, *tail;
+};
+
+static SendInbox m_inboxes[CONNEXION_COUNT];
+static LockedQueue m_queues[CONNEXION_COUNT];
+static Mutex m_queue_lock;
+
+static OutgoingMessage *m_messages = 0;
+
+static volatile u32 m_go = 0;
+
+class Producer : public BenchThread
+{
+	OutgoingMessage *_messages;
+	u32 _count;
+	u32 _first_connexion;
+	bool _use_inbox;
+
+	bool Run()
+	{
+		u32 connexion = _first_connexion;
+
+		for (u32 ii = 0; ii < _count; ++ii)
+		{
+			OutgoingMessage *node = _messages + ii;
+
+			if (_use_inbox)
+				m_inboxes[connexion].Push(node);
+			else
+			{
+				node->next = 0;
+
+				m_queue_lock.Enter();
+				LockedQueue &queue = m_queues[connexion];
+				if (queue.tail) queue.tail->next = node;
+				else queue.head = node;
+				queue.tail = node;
+				m_queue_lock.Leave();
+			}
+
+			if (++connexion >= CONNEXION_COUNT) connexion = 0;
+		}
+
+		return true;
+	}
+
+public:
+	void Setup(OutgoingMessage *messages, u32 count, u32 first_connexion, bool use_inbox)
+	{
+		_messages = messages;
+		_count = count;
+		_first_connexion = first_connexion;
+		_use_inbox = use_inbox;
+	}
+};
+
+static u32 DrainAll(bool use_inbox)
+{
+	u32 count = 0;
+
+	for (u32 ii = 0; ii < CONNEXION_COUNT; ++ii)
+	{
+		OutgoingMessage *node;
+
+		if (use_inbox)
+		{
+			OutgoingMessage *tail;
+			node = m_inboxes[ii].PopAll(tail);
+		}
+		else
+		{
+			m_queue_lock.Enter();
+			node = m_queues[ii].head;
+			m_queues[ii].head = m_queues[ii].tail = 0;
+			m_queue_lock.Leave();
+		}
+
+		for (; node; node = node->next)
+			++count;
+	}
+
+	return count;
+}
+
+static double RunTrial(u32 producer_count, bool use_inbox)
+{
+	Producer producers[MAX_PRODUCERS];
+	u32 per_producer = TOTAL_MESSAGES / producer_count;
+	u32 total = per_producer * producer_count;
+
+	for (u32 ii = 0; ii < producer_count; ++ii)
+		producers[ii].Setup(m_messages + ii * per_producer, per_producer, ii % CONNEXION_COUNT, use_inbox);
+
+	if (!StartBenchThreads("SendQueueBench", producers, producer_count, &m_go))
+		return 0;
+
+	double start = m_clock->usec();
+
+	m_go = 1;
+
+	for (u32 received = 0; received < total;)
+		received += DrainAll(use_inbox);
+
+	double delta = m_clock->usec() - start;
+
+	for (u32 ii = 0; ii < producer_count; ++ii)
+		producers[ii].WaitForThread();
+
+	return total / delta * 1000000.0;
+}
+
+int main(int argc, char **argv)
+{
+	m_clock = Clock::ref();
+
+	CAT_OBJCLR(m_inboxes);
+	CAT_OBJCLR(m_queues);
+
+#if defined(CAT_NO_ATOMIC_CAS2)
+	Mutex inbox_lock;
+	for (u32 ii = 0; ii < CONNEXION_COUNT; ++ii)
+		m_inboxes[ii].lock = &inbox_lock;
+#endif
+
+	m_messages = new (std::nothrow) OutgoingMessage[TOTAL_MESSAGES];
+	if (!m_messages)
+	{
+		CAT_WARN("SendQueueBench") << "Out of memory allocating messages";
+		return 1;
+	}
+
+	CAT_WARN("SendQueueBench") << "Posting " << TOTAL_MESSAGES << " messages across " << CONNEXION_COUNT << " connexions";
+
+	RunScaling("SendQueueBench", RunTrial, MAX_PRODUCERS, "producers", "SendInbox", "shared mutex", "msg/s");
+
+	delete []m_messages;
+
+	return 0;
+}
@@ -0,0 +1,315 @@
+#include "SimTransport.hpp"
+#include <ext/lz4/lz4.h>
+using namespace cat;
+using namespace sphynx;
+
+static Clock *m_clock = 0;
+
+
+//// SimEndpoint
+
+void SimEndpoint::OnRecvRouting(const BatchSet &buffers)
+{
+	if (transport)
+	{
+		transport->OnDatagrams(buffers);
+		return;
+	}
+
+	u32 count = 0;
+	for (BatchHead *node = buffers.head; node; node = node->batch_next)
+		++count;
+
+	ReleaseRecvBuffers(buffers, count);
+}
+
+
+//// SimTransport
+
+SimTransport::SimTransport()
+{
+	_endpoint = 0;
+	_wakeup_pending = false;
+
+	recv_count = 0;
+	recv_bytes = 0;
+	latency_sum = 0;
+	latency_max = 0;
+}
+
+SimTransport::~SimTransport()
+{
+	_tls.OnFinalize();
+}
+
+bool SimTransport::Initialize(SimEndpoint *endpoint, Port peer_port, FlowControlMode mode, u32 seed, u32 now)
+{
+	m_clock = Clock::ref();
+
+	if (!_tls.OnInitialize())
+		return false;
+
+	_tls.rand_pad.Initialize(seed);
+
+	InitializePayloadBytes(false);
+	InitializeTLS(&_tls);
+
+	if (!InitializeFlowControl(mode))
+		return false;
+
+	_endpoint = endpoint;
+	_peer = NetAddr("127.0.0.1", peer_port);
+	_next_tick = now + TICK_MSEC;
+
+	return true;
+}
+
+bool SimTransport::WriteTimestamped(StreamMode stream, u32 msg_bytes, u32 now)
+{
+	u8 msg[MAX_TIMESTAMPED_BYTES];
+
+	if (msg_bytes < 4 || msg_bytes > sizeof(msg))
+		return false;
+
+	// Fixed filler so the compressor sees the same data every run
+	for (u32 ii = 4; ii < msg_bytes; ++ii)
+		msg[ii] = (u8)(ii * 131 + (ii >> 3));
+
+	*reinterpret_cast<u32*>( msg ) = getLE(now);
+
+	return WriteReliable(stream, OP_TIMESTAMPED, msg, msg_bytes);
+}
+
+void SimTransport::Tick(u32 now)
+{
+	if (_wakeup_pending && (s32)(now - _wakeup_time) >= 0)
+	{
+		_wakeup_pending = false;
+		OnPacingWakeup();
+	}
+
+	if ((s32)(now - _next_tick) >= 0)
+	{
+		_next_tick += TICK_MSEC;
+		TickTransport(now);
+	}
+}
+
+void SimTransport::OnDatagrams(const BatchSet &buffers)
+{
+	u8 compress_buffer[IOTHREADS_BUFFER_READ_BYTES];
+	u32 buffer_count = 0;
+
+	BatchSet delivery, garbage;
+	delivery.Clear();
+	garbage.Clear();
+
+	for (BatchHead *next, *node = buffers.head; node; node = next)
+	{
+		next = node->batch_next;
+		RecvBuffer *buffer = static_cast<RecvBuffer*>( node );
+		++buffer_count;
+
+		u8 *data = GetTrailingBytes(buffer);
+		u32 data_bytes = buffer->data_bytes;
+
+		if (data_bytes <= SPHYNX_OVERHEAD)
+		{
+			garbage.PushBack(buffer);
+			continue;
+		}
+
+		data_bytes -= SPHYNX_OVERHEAD;
+
+		// If needs to be decompressed,
+		if (data[data_bytes])
+		{
+			int compress_size = LZ4_uncompress_unknownOutputSize((const char*)data, (char*)compress_buffer, data_bytes, sizeof(compress_buffer));
+
+			if (compress_size <= 0)
+			{
+				CAT_WARN("SimTransport") << "Ignored invalid compressed data";
+				garbage.PushBack(buffer);
+				continue;
+			}
+
+			memcpy(data, compress_buffer, compress_size);
+			data_bytes = compress_size;
+		}
+
+		buffer->data_bytes = data_bytes;
+
+		delivery.PushBack(buffer);
+	}
+
+	if (delivery.head)
+		OnTransportDatagrams(delivery);
+
+	if (garbage.head)
+		delivery.PushBack(garbage);
+
+	_endpoint->ReleaseRecvBuffers(delivery, buffer_count);
+}
+
+s32 SimTransport::WriteDatagrams(const BatchSet &buffers, u32 count)
+{
+	s32 write_count = 0;
+
+	for (BatchHead *node = buffers.head; node; node = node->batch_next)
+		write_count += static_cast<SendBuffer*>( node )->data_bytes;
+
+	return _endpoint->Write(buffers, count, _peer) ? write_count : 0;
+}
+
+bool SimTransport::SchedulePacingWakeup(u32 when)
+{
+	if (_wakeup_pending && (s32)(_wakeup_time - when) <= 0)
+		return true;
+
+	_wakeup_pending = true;
+	_wakeup_time = when;
+	return true;
+}
+
+void SimTransport::OnMessages(IncomingMessage msgs[], u32 count)
+{
+	u32 now = m_clock->msec();
+
+	for (u32 ii = 0; ii < count; ++ii)
+	{
+		BufferStream msg = msgs[ii].data;
+		u32 bytes = msgs[ii].bytes;
+
+		if (bytes < 5 || msg[0] != OP_TIMESTAMPED)
+			continue;
+
+		u32 latency = now - getLE(*reinterpret_cast<u32*>( msg + 1 ));
+
+		++recv_count;
+		recv_bytes += bytes;
+		latency_sum += latency;
+		if (latency_max < latency)
+			latency_max = latency;
+	}
+}
+
+
+//// SimHarness
+
+static const double START_USEC = 1000000.0;
+
+SimHarness::SimHarness()
+{
+	_sender_endpoint = 0;
+	_receiver_endpoint = 0;
+}
+
+SimHarness::~SimHarness()
+{
+	if (_sender_endpoint) _sender_endpoint->Destroy(CAT_REFOBJECT_TRACE);
+	if (_receiver_endpoint) _receiver_endpoint->Destroy(CAT_REFOBJECT_TRACE);
+}
+
+bool SimHarness::Initialize(Port sender_port, Port receiver_port, u32 seed)
+{
+	_sender_port = sender_port;
+	_receiver_port = receiver_port;
+	_seed = seed;
+
+	Settings *settings = Settings::ref();
+	settings->setInt("IO.Simulator.Enable", 1);
+	settings->setInt("IO.Simulator.VirtualClock", 1);
+	settings->setInt("IO.Simulator.Seed", seed);
+
+	if (!NetworkSimulator::ref()->IsVirtual())
+	{
+		CAT_FATAL("SimHarness") << "Unable to start the simulator on its virtual clock";
+		return false;
+	}
+
+	if (!RefObjects::Create(CAT_REFOBJECT_TRACE, _sender_endpoint) ||
+		!RefObjects::Create(CAT_REFOBJECT_TRACE, _receiver_endpoint))
+	{
+		CAT_FATAL("SimHarness") << "Out of memory";
+		return false;
+	}
+
+	if (!_sender_endpoint->Initialize(sender_port, true, false, true) ||
+		!_receiver_endpoint->Initialize(receiver_port, true, false, true))
+	{
+		CAT_FATAL("SimHarness") << "Unable to bind ports " << sender_port << " and " << receiver_port;
+		return false;
+	}
+
+	return true;
+}
+
+bool SimHarness::RunBulk(const SimulatedLinkParams &link, FlowControlMode mode,
+						 u32 run_msec, u32 max_queued_msgs, SimBulkResult &result)
+{
+	NetworkSimulator *sim = NetworkSimulator::ref();
+	Clock *clock = Clock::ref();
+
+	// Start every run from the same time with fresh links
+	clock->SetVirtualTime(START_USEC);
+	sim->SetLink(_sender_port, _receiver_port, link);
+	sim->SetLink(_receiver_port, _sender_port, link);
+
+	u32 now = clock->msec();
+
+	SimTransport *sender = new SimTransport;
+	SimTransport *receiver = new SimTransport;
+
+	if (!sender->Initialize(_sender_endpoint, _receiver_port, mode, _seed, now) ||
+		!receiver->Initialize(_receiver_endpoint, _sender_port, mode, _seed + 1, now))
+	{
+		CAT_FATAL("SimHarness") << "Unable to initialize the transports";
+		delete sender;
+		delete receiver;
+		return false;
+	}
+
+	_sender_endpoint->transport = sender;
+	_receiver_endpoint->transport = receiver;
+
+	for (u32 end = now + run_msec; (s32)(end - now) > 0; )
+	{
+		// Keep the send queue topped up with bulk data
+		while (sender->GetStats().GetSendQueueDepth() < max_queued_msgs)
+			sender->WriteTimestamped(STREAM_BULK, BULK_MSG_BYTES, now);
+
+		sim->Advance(1000);
+		now = clock->msec();
+
+		sender->Tick(now);
+		receiver->Tick(now);
+	}
+
+	// Clear padding too so results can be compared with memcmp
+	CAT_OBJCLR(result);
+
+	result.recv_count = receiver->recv_count;
+	result.recv_bytes = receiver->recv_bytes;
+	result.latency_sum = receiver->latency_sum;
+	result.latency_max = receiver->latency_max;
+
+	TransportStats &stats = sender->GetStats();
+	result.retransmits = stats.retransmits;
+	result.losses = stats.losses;
+	result.datagrams_sent = stats.datagrams_sent;
+	result.rtt = stats.rtt;
+
+	sim->GetLinkStats(_sender_port, _receiver_port, result.data_link);
+	sim->GetLinkStats(_receiver_port, _sender_port, result.ack_link);
+
+	// Let the datagrams still on the links arrive and be dropped
+	_sender_endpoint->transport = 0;
+	_receiver_endpoint->transport = 0;
+
+	delete sender;
+	delete receiver;
+
+	sim->Advance(DRAIN_MSEC * 1000);
+
+	return true;
+}
@@ -0,0 +1,120 @@
+#ifndef CAT_TESTS_SIM_TRANSPORT_HPP
+#define CAT_TESTS_SIM_TRANSPORT_HPP
+
+#include <cat/AllSphynx.hpp>
+
+/*
+	Simulated Transport
+
+	Runs a Sphynx Transport over a UDPEndpoint that is registered with the
+	NetworkSimulator, so two of them in one process talk over a virtual link.
+	Nothing here is thread-safe: the harness is expected to set the
+	"IO.Simulator.VirtualClock" setting and drive both sides and the
+	simulator from one thread, calling Tick() after each Advance().
+
+	Datagrams skip the encryption layer: the Transport's compression flag is
+	read back in place of the authentication tag.
+*/
+
+class SimTransport;
+
+// Endpoint that hands every datagram to one SimTransport
+class SimEndpoint : public cat::UDPEndpoint
+{
+public:
+	SimTransport *transport;
+
+	CAT_INLINE SimEndpoint() { transport = 0; }
+	CAT_INLINE const char *GetRefObjectName() { return "SimEndpoint"; }
+
+protected:
+	void OnRecvRouting(const cat::BatchSet &buffers);
+};
+
+// One side of a simulated connection
+class SimTransport : public cat::sphynx::Transport
+{
+	friend class SimEndpoint;
+
+	cat::sphynx::TransportTLS _tls;
+	SimEndpoint *_endpoint;
+	cat::NetAddr _peer;
+	cat::u32 _next_tick;
+	bool _wakeup_pending;
+	cat::u32 _wakeup_time;
+
+	void OnDatagrams(const cat::BatchSet &buffers);
+
+public:
+	static const cat::u32 TICK_MSEC = 10; // Same as the worker threads
+	static const cat::u8 OP_TIMESTAMPED = 0; // Payload starts with the send time
+	static const cat::u32 MAX_TIMESTAMPED_BYTES = 4096;
+
+	// Updated by OnMessages()
+	cat::u64 recv_count, recv_bytes;
+	cat::u64 latency_sum;
+	cat::u32 latency_max;
+
+	SimTransport();
+	virtual ~SimTransport();
+
+	// The seed replaces the clock-seeded padding generator so runs repeat
+	bool Initialize(SimEndpoint *endpoint, cat::Port peer_port, cat::sphynx::FlowControlMode mode, cat::u32 seed, cat::u32 now);
+
+	// Post a reliable message stamped with the current time
+	bool WriteTimestamped(cat::sphynx::StreamMode stream, cat::u32 msg_bytes, cat::u32 now);
+
+	// Run the transport and pacing timers that are due, once per simulated millisecond
+	void Tick(cat::u32 now);
+
+protected:
+	void OnDisconnectComplete() {}
+	cat::s32 WriteDatagrams(const cat::BatchSet &buffers, cat::u32 count);
+	bool SchedulePacingWakeup(cat::u32 when);
+	void OnMessages(cat::sphynx::IncomingMessage msgs[], cat::u32 count);
+	void OnInternal(cat::u32 recv_time, cat::BufferStream msg, cat::u32 bytes) {}
+	void OnDisconnectReason(cat::u8 reason) {}
+};
+
+// Outcome of one SimHarness::RunBulk()
+struct SimBulkResult
+{
+	cat::u64 recv_count, recv_bytes;	// Timestamped messages delivered to the receiver
+	cat::u64 latency_sum;				// Sum of message latencies in milliseconds
+	cat::u32 latency_max;
+	cat::u32 retransmits, losses, datagrams_sent, rtt; // From the sender's TransportStats
+	cat::SimulatedLinkStats data_link, ack_link;
+
+	CAT_INLINE bool operator==(const SimBulkResult &r) const { return 0 == memcmp(this, &r, sizeof(r)); }
+};
+
+/*
+	Pair of SimEndpoints on the simulator's virtual clock
+
+	Initialize() turns on the simulator with its virtual clock and binds the
+	two ports.  Each RunBulk() starts from the same virtual time with fresh
+	links in both directions and new Transports, keeps the sender's queue
+	topped up with timestamped bulk messages for run_msec, then lets the
+	links drain.  Given the same seed, arguments and order of runs, the
+	results are identical.
+*/
+class SimHarness
+{
+	SimEndpoint *_sender_endpoint, *_receiver_endpoint;
+	cat::Port _sender_port, _receiver_port;
+	cat::u32 _seed;
+
+public:
+	static const cat::u32 BULK_MSG_BYTES = 1000;
+	static const cat::u32 DRAIN_MSEC = 2000;
+
+	SimHarness();
+	~SimHarness();
+
+	bool Initialize(cat::Port sender_port, cat::Port receiver_port, cat::u32 seed);
+
+	bool RunBulk(const cat::SimulatedLinkParams &link, cat::sphynx::FlowControlMode mode,
+				 cat::u32 run_msec, cat::u32 max_queued_msgs, SimBulkResult &result);
+};
+
+#endif // CAT_TESTS_SIM_TRANSPORT_HPP
@@ -0,0 +1,86 @@
+#include "SimTransport.hpp"
+using namespace cat;
+using namespace sphynx;
+
+/*
+	Runs a bulk reliable transfer between two Transports over the
+	NetworkSimulator for a few link profiles, with each congestion
+	controller.  The simulator runs on the virtual clock and this thread
+	advances it a millisecond at a time, so nothing depends on the host:
+	every profile is run twice and the two runs must match exactly.
+*/
+
+static const u32 SEED = 1234567;
+static const Port SENDER_PORT = 47010;
+static const Port RECEIVER_PORT = 47011;
+static const u32 RUN_MSEC = 10000;
+static const u32 MAX_QUEUED_MSGS = 64;
+
+struct LinkProfile
+{
+	const char *name;
+	SimulatedLinkParams params;
+};
+
+// Link parameters: latency, jitter, loss, burst enter/exit/loss, duplication, rate, queue
+static const LinkProfile PROFILES[] = {
+	{ "Clean 20 ms", { 20000, 0, 0, 0, 0, 0, 0, 0, 0 } },
+	{ "Lossy 50 ms, 1% loss, 10 ms jitter", { 50000, 10000, 10000, 0, 0, 0, 0, 0, 0 } },
+	{ "Bursty 50 ms, 0.5% duplication", { 50000, 2000, 1000, 5000, 200000, 500000, 5000, 0, 0 } },
+	{ "Bottleneck 2 Mbps, 30 ms", { 30000, 0, 0, 0, 0, 0, 0, 250000, 64000 } },
+};
+
+static void Report(const char *mode_name, const SimBulkResult &result)
+{
+	double goodput_mbps = result.recv_bytes * 8.0 / (RUN_MSEC / 1000.0) / 1000000.0;
+	double mean_latency = result.recv_count ? (double)result.latency_sum / result.recv_count : 0;
+
+	CAT_WARN("TransportSim") << "  " << mode_name << ": goodput = " << goodput_mbps
+		<< " Mbps, latency mean = " << mean_latency << " ms max = " << result.latency_max
+		<< " ms, srtt = " << result.rtt << " ms";
+	CAT_WARN("TransportSim") << "    sent " << result.datagrams_sent << " datagrams, "
+		<< result.retransmits << " retransmits, " << result.losses << " losses; link lost "
+		<< result.data_link.lost << " overflowed " << result.data_link.overflowed
+		<< " duplicated " << result.data_link.duplicated;
+}
+
+int main(int argc, char **argv)
+{
+	static const char *MODE_NAMES[] = { "Tampon", "Bottleneck" };
+	static const FlowControlMode MODES[] = { FLOW_CONTROL_TAMPON, FLOW_CONTROL_BOTTLENECK };
+
+	SimHarness harness;
+
+	if (!harness.Initialize(SENDER_PORT, RECEIVER_PORT, SEED))
+		return 1;
+
+	CAT_WARN("TransportSim") << "Simulating " << RUN_MSEC / 1000 << " seconds of bulk transfer per profile, seed " << SEED;
+
+	int failures = 0;
+
+	for (u32 ii = 0; ii < sizeof(PROFILES) / sizeof(PROFILES[0]); ++ii)
+	{
+		const LinkProfile &profile = PROFILES[ii];
+
+		CAT_WARN("TransportSim") << profile.name;
+
+		for (u32 jj = 0; jj < 2; ++jj)
+		{
+			SimBulkResult first, second;
+
+			if (!harness.RunBulk(profile.params, MODES[jj], RUN_MSEC, MAX_QUEUED_MSGS, first) ||
+				!harness.RunBulk(profile.params, MODES[jj], RUN_MSEC, MAX_QUEUED_MSGS, second))
+				return 1;
+
+			Report(MODE_NAMES[jj], first);
+
+			if (!(first == second))
+			{
+				CAT_WARN("TransportSim") << "    FAIL: Repeated run did not match";
+				++failures;
+			}
+		}
+	}
+
+	return failures ? 1 : 0;
+}